@@ -7,11 +7,18 @@
 #define _APFS_H
 
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/kobject.h>
 #include <linux/kref.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "apfs_raw.h"
 
 #define APFS_MODULE_ID_STRING	"linux-apfs by EA Fernández"
@@ -31,11 +38,124 @@ static inline bool sb_rdonly(const struct super_block *sb) { return sb->s_flags
 #define lockdep_assert_held_write(l)	((void)(l))
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static inline void *kvmalloc(size_t size, gfp_t flags)
+{
+	gfp_t kmalloc_flags = flags;
+	void *ret;
+
+	if ((flags & GFP_KERNEL) != GFP_KERNEL)
+		return kmalloc(size, flags);
+
+	if (size > PAGE_SIZE)
+		kmalloc_flags |= __GFP_NOWARN | __GFP_NORETRY;
+
+	ret = kmalloc(size, kmalloc_flags);
+	if (ret || size < PAGE_SIZE)
+		return ret;
+
+	return vmalloc(size);
+}
+
+static inline void *kvmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	if (size != 0 && n > SIZE_MAX / size)
+		return NULL;
+	return kvmalloc(n * size, flags);
+}
+
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0) */
+
 #define APFS_IOC_SET_DFLT_PFK	_IOW('@', 0x80, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_SET_DIR_CLASS	_IOW('@', 0x81, u32)
 #define APFS_IOC_SET_PFK	_IOW('@', 0x82, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_GET_CLASS	_IOR('@', 0x83, u32)
 #define APFS_IOC_GET_PFK	_IOR('@', 0x84, struct apfs_wrapped_crypto_state)
+#define APFS_IOC_SCRUB_START	_IO('@', 0x85)
+#define APFS_IOC_SCRUB_CANCEL	_IO('@', 0x86)
+#define APFS_IOC_DEFRAG		_IOWR('@', 0x87, struct apfs_defrag_range)
+#define APFS_IOC_SNAP_CREATE	_IOW('@', 0x88, struct apfs_snap_name)
+#define APFS_IOC_SNAP_DESTROY	_IOW('@', 0x89, struct apfs_snap_name)
+#define APFS_IOC_PREFETCH	_IOWR('@', 0x8A, struct apfs_prefetch)
+#define APFS_IOC_BULKSTAT	_IOWR('@', 0x8B, struct apfs_bulkstat)
+
+/* Flags for APFS_IOC_DEFRAG */
+#define APFS_DEFRAG_DRY_RUN	0x00000001 /* Only count the extents */
+#define APFS_DEFRAG_VALID_FLAGS	APFS_DEFRAG_DRY_RUN
+
+/*
+ * Argument for APFS_IOC_DEFRAG
+ */
+struct apfs_defrag_range {
+	u64 start;	/* Byte offset for the start of the range */
+	u64 len;	/* Byte length of the range, zero for the whole file */
+	u32 flags;
+	u32 pad;
+	u64 extents;	/* On return, number of extents found in the range */
+	u64 moved;	/* On return, number of blocks moved */
+};
+
+/* Maximum length for a snapshot name, not counting the null termination */
+#define APFS_SNAP_MAX_NAMELEN	255
+
+/*
+ * Argument for APFS_IOC_SNAP_CREATE and APFS_IOC_SNAP_DESTROY
+ */
+struct apfs_snap_name {
+	char name[APFS_SNAP_MAX_NAMELEN + 1]; /* Null-terminated */
+};
+
+/* Default and maximum memory budgets for APFS_IOC_PREFETCH */
+#define APFS_PREFETCH_DFLT_BUDGET	(64ULL << 20)
+#define APFS_PREFETCH_MAX_BUDGET	(1ULL << 30)
+
+/*
+ * Argument for APFS_IOC_PREFETCH
+ */
+struct apfs_prefetch {
+	u64 budget;	/* Memory budget in bytes, zero for the default (capped) */
+	u64 inodes;	/* On return, number of inodes brought into the cache */
+	u64 reads;	/* On return, number of node reads started */
+	u64 used;	/* On return, bytes charged against the budget */
+};
+
+/* Maximum number of records returned by a single APFS_IOC_BULKSTAT */
+#define APFS_BULKSTAT_MAX	8192
+
+/*
+ * Argument for APFS_IOC_BULKSTAT
+ */
+struct apfs_bulkstat {
+	u64 ino;	/* First inode number to scan, updated for the next call */
+	u64 buf;	/* User pointer to an array of struct apfs_bstat */
+	u32 count;	/* Length of the array; on return, records filled */
+	u32 pad;
+};
+
+/*
+ * Inode record returned by APFS_IOC_BULKSTAT
+ */
+struct apfs_bstat {
+	u64 ino;
+	u64 parent_ino;		/* Primary parent */
+	u64 size;		/* Logical size of the data stream */
+	u64 alloced_size;	/* Allocated size of the data stream */
+	u64 crtime;		/* Timestamps, in nanoseconds since the epoch */
+	u64 mtime;
+	u64 ctime;
+	u64 atime;
+	u64 internal_flags;
+	u32 bsd_flags;
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u32 nlink;		/* Link count, or child count for directories */
+	u32 pad;
+};
 
 /*
  * In-memory representation of an APFS object
@@ -104,6 +224,15 @@ static inline bool apfs_node_has_fixed_kv_size(struct apfs_node *node)
 	return (node->flags & APFS_BTNODE_FIXED_KV_SIZE) != 0;
 }
 
+/**
+ * apfs_node_is_hashed - Check if a b-tree node keeps the hashes of its children
+ * @node: the node to check
+ */
+static inline bool apfs_node_is_hashed(struct apfs_node *node)
+{
+	return (node->flags & APFS_BTNODE_HASHED) != 0;
+}
+
 /*
  * Space manager data in memory.
  */
@@ -119,12 +248,16 @@ struct apfs_spaceman {
 	u32 sm_cib_count;		/* Number of chunk-info blocks */
 	u64 sm_free_count;		/* Number of free blocks */
 	u32 sm_addr_offset;		/* Offset of cib addresses in @sm_raw */
+
+	spinlock_t sm_reserve_lock;	/* Protects @sm_reserved */
+	u64 sm_reserved;		/* Free blocks set aside for writeback */
 };
 
 /* Possible states for the container transaction structure */
 #define APFS_NX_TRANS_FORCE_COMMIT	1	/* Commit guaranteed */
 #define APFS_NX_TRANS_DEFER_COMMIT	2	/* Commit banned right now */
 #define APFS_NX_TRANS_COMMITTING	4	/* Commit ongoing */
+#define APFS_NX_TRANS_FLUSH_FAILED	8	/* Nothing for the caller to abort */
 
 /*
  * Structure that keeps track of a container transaction.
@@ -137,6 +270,9 @@ struct apfs_nx_transaction {
 	struct list_head t_buffers;	/* List of buffers in the transaction */
 	size_t t_buffers_count;		/* Count of items on the list */
 	int t_starts_count;		/* Count of starts for transaction */
+
+	struct mutex t_flush_mutex;	/* Orders the checkpoint flushes */
+	int t_flush_err;		/* A checkpoint flush has failed */
 };
 
 /*
@@ -147,14 +283,38 @@ struct apfs_vol_transaction {
 
 	struct apfs_node t_old_omap_root; /* Omap root node being replaced */
 	struct apfs_node t_old_cat_root;  /* Catalog root node being replaced */
+
+	s64 t_alloc_delta;	/* Pending change to the allocated block count */
+
+	struct rb_root t_extref_delta;	/* Pending extentref drops, by block */
+	unsigned int t_extref_count;	/* Number of ranges in the delta */
 };
 
+/* Flush the extentref delta on the next transaction start if it gets this big */
+#define APFS_EXTREF_DELTA_MAX	4096
+
 /* State bits for buffer heads in a transaction */
 #define BH_TRANS	BH_PrivateStart		/* Attached to a transaction */
 #define BH_CSUM		(BH_PrivateStart + 1)	/* Requires checksum update */
 BUFFER_FNS(TRANS, trans);
 BUFFER_FNS(CSUM, csum);
 
+/* State bit for metadata buffers, valid outside transactions as well */
+#define BH_CSUM_OK	(BH_PrivateStart + 2)	/* Checksum verified since read */
+BUFFER_FNS(CSUM_OK, csum_ok);
+
+/* State bit for buffers on sealed volumes, never in a transaction */
+#define BH_SEAL_OK	(BH_PrivateStart + 3)	/* Hash verified since read */
+BUFFER_FNS(SEAL_OK, seal_ok);
+
+/* State bit for private buffers with decrypted metadata, see crypt.c */
+#define BH_DECRYPTED	(BH_PrivateStart + 4)	/* Not in the block device */
+BUFFER_FNS(DECRYPTED, decrypted);
+
+/* State bit for private buffers from the metadata cache, see metabuf.c */
+#define BH_METABUF	(BH_PrivateStart + 5)	/* Not in the block device */
+BUFFER_FNS(METABUF, metabuf);
+
 /*
  * Additional information for a buffer in a transaction.
  */
@@ -174,10 +334,86 @@ struct apfs_max_ops {
 /* Mount option flags for a container */
 #define APFS_CHECK_NODES	1
 #define APFS_READWRITE		2
+#define APFS_DATA_WRITEBACK	4	/* Don't order data before commits */
+#define APFS_FLAT_OMAP		8	/* Flat omap index on read-only mounts */
+#define APFS_NEVER_WRITABLE	16	/* Attached without write support */
 
 /*
  * Container superblock data in memory
  */
+#define APFS_METABUF_CACHE_BITS	10
+
+/*
+ * Cache of b-tree node blocks owned by the module, used instead of the page
+ * cache of the block device when the container is mounted read-only
+ */
+struct apfs_metabuf_cache {
+	spinlock_t mc_lock;		/* Protects the table and the lru list */
+	DECLARE_HASHTABLE(mc_table, APFS_METABUF_CACHE_BITS);
+	struct list_head mc_lru;	/* Cached blocks, least recent first */
+	unsigned int mc_count;		/* Number of cached blocks */
+	atomic_t mc_inflight;		/* Reads not yet completed */
+	wait_queue_head_t mc_wait;	/* Waits for the reads in flight */
+};
+
+/*
+ * Entry points that take the container locks, for the lock statistics
+ */
+enum apfs_lock_site {
+	APFS_LOCK_SITE_LOOKUP,
+	APFS_LOCK_SITE_READDIR,
+	APFS_LOCK_SITE_WRITE_BEGIN,
+	APFS_LOCK_SITE_COMMIT,
+	APFS_LOCK_SITE_STATFS,
+	APFS_LOCK_SITE_XATTR,
+	APFS_LOCK_SITE_MOUNT,
+	APFS_LOCK_SITE_UNMOUNT,
+	APFS_LOCK_SITE_OTHER,
+	APFS_LOCK_SITE_NR,
+};
+
+/* Locks covered by the statistics */
+enum apfs_lock_kind {
+	APFS_LOCK_BIG_READ,	/* nx_big_sem, shared */
+	APFS_LOCK_BIG_WRITE,	/* nx_big_sem, exclusive */
+	APFS_LOCK_NXS,		/* nxs_mutex */
+	APFS_LOCK_KIND_NR,
+};
+
+#define APFS_LOCK_HIST_BUCKETS	12
+
+/*
+ * Wait and hold times for one lock from one entry point, in nanoseconds
+ */
+struct apfs_lock_stat {
+	u64 ls_count;			/* Number of acquisitions */
+	u64 ls_wait_ns;			/* Total time spent waiting */
+	u64 ls_wait_max;		/* Longest wait */
+	u64 ls_hold_ns;			/* Total time held */
+	u64 ls_hold_max;		/* Longest hold */
+	u32 ls_wait_hist[APFS_LOCK_HIST_BUCKETS];
+	u32 ls_hold_hist[APFS_LOCK_HIST_BUCKETS];
+};
+
+/*
+ * Lock statistics collected by a single cpu
+ */
+struct apfs_lock_stats {
+	struct apfs_lock_stat ls_stats[APFS_LOCK_KIND_NR][APFS_LOCK_SITE_NR];
+};
+
+/*
+ * Lock statistics for a container, always collected, see lockstat.c
+ */
+struct apfs_lockstat {
+	struct apfs_lock_stats __percpu *ls_pcpu; /* Counters for each cpu */
+	struct apfs_lock_stats ls_base;	/* Totals at the time of the reset */
+	spinlock_t ls_base_lock;	/* Protects ls_base */
+
+	u64 ls_write_start;		/* When the big lock was taken for write */
+	enum apfs_lock_site ls_write_site; /* Current exclusive holder */
+};
+
 struct apfs_nxsb_info {
 	struct block_device *nx_bdev; /* Device for the container */
 	struct apfs_nx_superblock *nx_raw; /* On-disk main sb */
@@ -193,11 +429,22 @@ struct apfs_nxsb_info {
 	unsigned long nx_blocksize;
 	unsigned char nx_blocksize_bits;
 
+	/* Block numbers for a non-contiguous checkpoint descriptor area */
+	u64 *nx_desc_map;
+
 	struct apfs_spaceman nx_spaceman;
 	struct apfs_nx_transaction nx_transaction;
+	struct apfs_metabuf_cache nx_metabuf;
 
 	/* For now, a single semaphore for every operation */
 	struct rw_semaphore nx_big_sem;
+	struct apfs_lockstat nx_lockstat;
+
+	/* Writers wait for the fsync logs of new mounts to be replayed */
+	atomic_t nx_replay_count;	/* Mounts with a pending replay */
+	struct mutex nx_replay_mutex;	/* Serializes the replays */
+	struct task_struct *nx_replay_task; /* Task doing the replay */
+	wait_queue_head_t nx_replay_wait;
 
 	/* List of currently mounted containers */
 	struct list_head nx_list;
@@ -205,6 +452,102 @@ struct apfs_nxsb_info {
 
 extern struct mutex nxs_mutex;
 
+/**
+ * apfs_cpoint_desc_blocks - Get the block count for the descriptor area
+ * @raw: on-disk container superblock
+ */
+static inline u32 apfs_cpoint_desc_blocks(struct apfs_nx_superblock *raw)
+{
+	return le32_to_cpu(raw->nx_xp_desc_blocks) & APFS_NX_XP_BLOCKS_MASK;
+}
+
+/**
+ * __apfs_cpoint_desc_bno - Get the block number for an index in the desc area
+ * @nxi:	container information
+ * @desc_base:	first block of the area, if it's contiguous
+ * @index:	index of the block in the checkpoint descriptor area
+ *
+ * Needed while the container superblock is still being searched for.
+ */
+static inline u64 __apfs_cpoint_desc_bno(struct apfs_nxsb_info *nxi, u64 desc_base, u32 index)
+{
+	if (nxi->nx_desc_map)
+		return nxi->nx_desc_map[index];
+	return desc_base + index;
+}
+
+/**
+ * apfs_cpoint_desc_bno - Get the block number for an index in the desc area
+ * @nxi:	container information
+ * @index:	index of the block in the checkpoint descriptor area
+ */
+static inline u64 apfs_cpoint_desc_bno(struct apfs_nxsb_info *nxi, u32 index)
+{
+	return __apfs_cpoint_desc_bno(nxi, le64_to_cpu(nxi->nx_raw->nx_xp_desc_base), index);
+}
+
+/* States for the background scrub */
+#define APFS_SCRUB_IDLE		0	/* Never started */
+#define APFS_SCRUB_RUNNING	1
+#define APFS_SCRUB_DONE		2	/* Finished, check the error count */
+#define APFS_SCRUB_CANCELLED	3
+#define APFS_SCRUB_FAILED	4	/* Could not complete the walk */
+
+/* Default limit for metadata objects verified per second */
+#define APFS_SCRUB_DEFAULT_RATE	1024
+
+/*
+ * Background scrub state for a volume, reported through sysfs
+ */
+struct apfs_scrub {
+	struct task_struct *sc_task;	/* Scrub thread, if any */
+	struct mutex sc_lock;		/* Protects @sc_task */
+	unsigned int sc_state;		/* Current state of the scrub */
+	unsigned int sc_rate;		/* Objects per second, 0 for no limit */
+	u64 sc_objects;			/* Objects verified so far */
+	u64 sc_errors;			/* Corrupted objects found so far */
+	u64 sc_restarts;		/* Tree walks restarted after a commit */
+};
+
+/*
+ * Background reaper for deleted snapshots
+ */
+struct apfs_reaper {
+	struct task_struct *rp_task;	/* Reaper thread, if any */
+	struct mutex rp_lock;		/* Protects @rp_task */
+	bool rp_done;			/* Thread is done and can be reaped */
+	bool rp_kick;			/* New snapshots were deleted meanwhile */
+};
+
+/*
+ * Log of fsync() calls since the latest checkpoint, for a single volume
+ */
+struct apfs_fsync_log {
+	struct inode *fl_inode;		/* Hidden file for the log, if any */
+	bool fl_disabled;		/* The log file can't be used */
+	struct mutex fl_lock;		/* Serializes writes to the log */
+	u64 fl_map[APFS_FSYNC_LOG_BLOCKS]; /* Block numbers for the log file */
+	u64 fl_xid;			/* Transaction logged so far */
+	u32 fl_next;			/* Next free log block for @fl_xid */
+};
+
+/*
+ * Early commits requested by the memory shrinker, for a single volume
+ */
+struct apfs_shrink {
+	struct work_struct sh_work;	/* Commits the pinned buffers */
+	u64 sh_scans;			/* Times the shrinker asked for memory */
+	u64 sh_commits;			/* Early commits made for the shrinker */
+};
+
+/*
+ * Mapping of a virtual object in the flat omap index
+ */
+struct apfs_omap_map {
+	u64 oid;	/* Object id */
+	u64 bno;	/* Block number for the latest version of the object */
+};
+
 /*
  * Volume superblock data in memory
  */
@@ -215,6 +558,12 @@ struct apfs_sb_info {
 
 	struct apfs_node *s_cat_root;	/* Root of the catalog tree */
 	struct apfs_node *s_omap_root;	/* Root of the object map tree */
+	struct apfs_omap_map *s_omap_index; /* Flat omap, sorted by oid */
+	u64 s_omap_index_len;		/* Number of entries in @s_omap_index */
+
+	/* Snapshot info from the omap, set on each transaction */
+	u64 s_latest_snap;		/* Xid of latest live snapshot, or 0 */
+	u32 s_snap_count;		/* Snapshots, including those in deletion */
 
 	struct apfs_object s_vobject;	/* Volume superblock object */
 
@@ -224,10 +573,24 @@ struct apfs_sb_info {
 	kgid_t s_gid;			/* gid to override on-disk gid */
 
 	struct apfs_crypto_state_val *s_dflt_pfk; /* default per-file key */
+	struct apfs_crypt *s_crypt;	/* Software encryption, if any */
+
+	/* Sealed volumes only */
+	struct apfs_node *s_fext_root;	/* Root of the file extent tree */
+	struct crypto_shash *s_seal_tfm; /* Hash used by the seal */
+	unsigned int s_seal_hash_size;	/* Size of each hash */
 
 	struct apfs_vol_transaction s_transaction;
 
 	struct inode *s_private_dir;	/* Inode for the private directory */
+
+	struct apfs_scrub s_scrub;	/* Background metadata scrub */
+	struct apfs_reaper s_reaper;	/* Reaper for deleted snapshots */
+	struct apfs_fsync_log s_fsync_log; /* Log for fast fsync() calls */
+	struct apfs_shrink s_shrink;	/* Early commits under memory pressure */
+
+	struct kobject s_kobj;		/* Directory in /sys/fs/apfs */
+	struct completion s_kobj_unregister;
 };
 
 static inline struct apfs_sb_info *APFS_SB(struct super_block *sb)
@@ -262,6 +625,54 @@ static inline struct apfs_spaceman *APFS_SM(struct super_block *sb)
 	return &APFS_NXI(sb)->nx_spaceman;
 }
 
+/**
+ * apfs_vol_is_soft_encrypted - Check if a volume is encrypted in software
+ * @sb: superblock
+ *
+ * Metadata and file data for these volumes are encrypted with the volume key.
+ */
+static inline bool apfs_vol_is_soft_encrypted(struct super_block *sb)
+{
+	return APFS_SB(sb)->s_crypt != NULL;
+}
+
+/**
+ * apfs_metabuf_enabled - Check if nodes are read through the metadata cache
+ * @sb: superblock
+ *
+ * Blocks can't change under a read-only container, so the module can keep
+ * its own copies without worrying about coherence with the block device.  This
+ * is decided once, when the container is attached: one that was forced
+ * read-only after an error still has its nodes in the page cache.
+ */
+static inline bool apfs_metabuf_enabled(struct super_block *sb)
+{
+	return APFS_NXI(sb)->nx_flags & APFS_NEVER_WRITABLE;
+}
+
+/**
+ * apfs_vol_is_sealed - Check if a volume is sealed
+ * @sb: superblock
+ */
+static inline bool apfs_vol_is_sealed(struct super_block *sb)
+{
+	return (APFS_SB(sb)->s_vsb_raw->apfs_incompatible_features &
+	       cpu_to_le64(APFS_INCOMPAT_SEALED_VOLUME)) != 0;
+}
+
+/**
+ * apfs_cat_storage - Get the storage type for the catalog of a volume
+ * @sb: superblock
+ *
+ * The catalog is always virtual, except on sealed volumes.
+ */
+static inline u32 apfs_cat_storage(struct super_block *sb)
+{
+	u32 type = le32_to_cpu(APFS_SB(sb)->s_vsb_raw->apfs_root_tree_type);
+
+	return type & APFS_OBJ_STORAGETYPE_MASK;
+}
+
 static inline bool apfs_is_case_insensitive(struct super_block *sb)
 {
 	return (APFS_SB(sb)->s_vsb_raw->apfs_incompatible_features &
@@ -344,6 +755,45 @@ static inline void apfs_init_extent_key(u64 bno, struct apfs_key *key)
 	key->name = NULL;
 }
 
+/**
+ * apfs_init_snap_metadata_key - Initialize an in-memory key for a snapshot
+ * @xid:	transaction id for the snapshot
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_snap_metadata_key(u64 xid, struct apfs_key *key)
+{
+	key->id = xid;
+	key->type = APFS_TYPE_SNAP_METADATA;
+	key->number = 0;
+	key->name = NULL;
+}
+
+/**
+ * apfs_init_snap_name_key - Initialize an in-memory key for a snapshot name
+ * @name:	name of the snapshot
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_snap_name_key(const char *name, struct apfs_key *key)
+{
+	key->id = APFS_SNAP_NAME_OBJ_ID;
+	key->type = APFS_TYPE_SNAP_NAME;
+	key->number = 0;
+	key->name = name;
+}
+
+/**
+ * apfs_init_omap_snap_key - Initialize an in-memory key for an omap snapshot
+ * @xid:	transaction id for the snapshot
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_omap_snap_key(u64 xid, struct apfs_key *key)
+{
+	key->id = xid;
+	key->type = 0;
+	key->number = 0;
+	key->name = NULL;
+}
+
 /**
  * apfs_init_inode_key - Initialize an in-memory key for an inode query
  * @ino:	inode number
@@ -372,6 +822,35 @@ static inline void apfs_init_file_extent_key(u64 id, u64 offset,
 	key->name = NULL;
 }
 
+/**
+ * apfs_init_fext_key - Initialize an in-memory key for a sealed extent query
+ * @id:		extent id
+ * @offset:	logical address
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_fext_key(u64 id, u64 offset, struct apfs_key *key)
+{
+	key->id = id;
+	key->type = 0;
+	key->number = offset;
+	key->name = NULL;
+}
+
+/**
+ * apfs_init_data_hash_key - Initialize an in-memory key for a data hash query
+ * @id:		extent id
+ * @lba:	logical block number
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_data_hash_key(u64 id, u64 lba, struct apfs_key *key)
+{
+	key->id = id;
+	key->type = APFS_TYPE_FILE_INFO;
+	key->number = (u64)APFS_FILE_INFO_DATA_HASH << APFS_FILE_INFO_TYPE_SHIFT |
+		      (lba & APFS_FILE_INFO_LBA_MASK);
+	key->name = NULL;
+}
+
 /**
  * apfs_init_dstream_id_key - Initialize an in-memory key for a dstream query
  * @id:		data stream id
@@ -478,16 +957,21 @@ static inline u64 apfs_cat_cnid(struct apfs_key_header *key)
 }
 
 /* Flags for the query structure */
-#define APFS_QUERY_TREE_MASK	0017	/* Which b-tree we query */
-#define APFS_QUERY_OMAP		0001	/* This is a b-tree object map query */
-#define APFS_QUERY_CAT		0002	/* This is a catalog tree query */
-#define APFS_QUERY_FREE_QUEUE	0004	/* This is a free queue query */
-#define APFS_QUERY_EXTENTREF	0010	/* This is an extent reference query */
-#define APFS_QUERY_NEXT		0020	/* Find next of multiple matches */
-#define APFS_QUERY_EXACT	0040	/* Search for an exact match */
-#define APFS_QUERY_DONE		0100	/* The search at this level is over */
-#define APFS_QUERY_ANY_NAME	0200	/* Multiple search for any name */
-#define APFS_QUERY_ANY_NUMBER	0400	/* Multiple search for any number */
+#define APFS_QUERY_TREE_MASK	000177	/* Which b-tree we query */
+#define APFS_QUERY_OMAP		000001	/* This is a b-tree object map query */
+#define APFS_QUERY_CAT		000002	/* This is a catalog tree query */
+#define APFS_QUERY_FREE_QUEUE	000004	/* This is a free queue query */
+#define APFS_QUERY_EXTENTREF	000010	/* This is an extent reference query */
+#define APFS_QUERY_SNAP_META	000020	/* This is a snapshot metadata query */
+#define APFS_QUERY_OMAP_SNAP	000040	/* This is an omap snapshot query */
+#define APFS_QUERY_FEXT		000100	/* This is a sealed file extent query */
+#define APFS_QUERY_NEXT		000200	/* Find next of multiple matches */
+#define APFS_QUERY_EXACT	000400	/* Search for an exact match */
+#define APFS_QUERY_DONE		001000	/* The search at this level is over */
+#define APFS_QUERY_ANY_NAME	002000	/* Multiple search for any name */
+#define APFS_QUERY_ANY_NUMBER	004000	/* Multiple search for any number */
+#define APFS_QUERY_NOWAIT	010000	/* Fail with -EAGAIN on uncached nodes */
+#define APFS_QUERY_READAHEAD	020000	/* Read ahead the node that failed NOWAIT */
 #define APFS_QUERY_MULTIPLE	(APFS_QUERY_ANY_NAME | APFS_QUERY_ANY_NUMBER)
 
 /*
@@ -520,11 +1004,15 @@ static inline u32 apfs_query_storage(struct apfs_query *query)
 	if (query->flags & APFS_QUERY_OMAP)
 		return APFS_OBJ_PHYSICAL;
 	if (query->flags & APFS_QUERY_CAT)
-		return APFS_OBJ_VIRTUAL;
+		return apfs_cat_storage(query->node->object.sb);
 	if (query->flags & APFS_QUERY_FREE_QUEUE)
 		return APFS_OBJ_EPHEMERAL;
 	if (query->flags & APFS_QUERY_EXTENTREF)
 		return APFS_OBJ_PHYSICAL;
+	if (query->flags & (APFS_QUERY_SNAP_META | APFS_QUERY_OMAP_SNAP))
+		return APFS_OBJ_PHYSICAL;
+	if (query->flags & APFS_QUERY_FEXT)
+		return APFS_OBJ_PHYSICAL;
 	BUG();
 }
 
@@ -546,6 +1034,7 @@ struct apfs_phys_extent {
 	u64 blkcount;
 	u64 len;	/* In bytes */
 	u32 refcnt;
+	u8 kind;
 };
 
 /*
@@ -559,6 +1048,8 @@ struct apfs_dstream_info {
 	struct apfs_file_extent	ds_cached_ext;	/* Latest extent record */
 	bool			ds_ext_dirty;	/* Is ds_cached_ext dirty? */
 	spinlock_t		ds_ext_lock;	/* Protects ds_cached_ext */
+	u64			ds_seal_lba;	/* First block of verified range */
+	u32			ds_seal_len;	/* Length of verified range */
 };
 
 /**
@@ -575,6 +1066,16 @@ static inline u64 apfs_alloced_size(struct apfs_dstream_info *dstream)
 	return blks << sb->s_blocksize_bits;
 }
 
+/*
+ * Decmpfs header for a compressed inode, parsed when the inode is read
+ */
+struct apfs_compress_info {
+	u32	ci_algo;	/* Compression algorithm, zero if uncompressed */
+	bool	ci_inline;	/* Is the data inside the decmpfs xattr? */
+	u64	ci_size;	/* Uncompressed size */
+	int	ci_xattr_len;	/* Length of the decmpfs xattr, header included */
+};
+
 /*
  * APFS inode data in memory
  */
@@ -589,9 +1090,12 @@ struct apfs_inode_info {
 	u64			i_int_flags;	 /* Internal flags */
 	u32			i_bsd_flags;	 /* BSD flags */
 	struct list_head	i_list;		 /* List of inodes in transaction */
+	u64			i_nolog_xid;	 /* Last xid the fsync log can't replay */
+	atomic_t		i_delayed_blks;	 /* Blocks waiting for writeback */
 
 	bool			 i_has_dstream;	 /* Is there a dstream record? */
 	struct apfs_dstream_info i_dstream;	 /* Dstream data, if any */
+	struct apfs_compress_info i_cmpf;	 /* Decmpfs header, if compressed */
 
 	struct inode vfs_inode;
 };
@@ -678,6 +1182,38 @@ do {									\
 	ASSERT(le64_to_cpu((obj)->o_xid) == APFS_NXI(sb)->nx_xid);	\
 } while (0)
 
+/**
+ * apfs_vol_alloc_add - Account for blocks allocated or freed by a volume
+ * @sb:		superblock structure
+ * @delta:	change in the allocated block count
+ *
+ * The change is only folded into the volume superblock on commit, by
+ * apfs_vol_alloc_fold(), so that the hot paths don't have to touch it.
+ */
+static inline void apfs_vol_alloc_add(struct super_block *sb, s64 delta)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	apfs_assert_in_transaction(sb, &sbi->s_vsb_raw->apfs_o);
+	sbi->s_transaction.t_alloc_delta += delta;
+}
+
+/**
+ * apfs_vol_alloc_fold - Write the pending block count to the volume superblock
+ * @sb: superblock structure
+ */
+static inline void apfs_vol_alloc_fold(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_vol_transaction *vol_trans = &sbi->s_transaction;
+
+	if (!vol_trans->t_alloc_delta)
+		return;
+	apfs_assert_in_transaction(sb, &sbi->s_vsb_raw->apfs_o);
+	le64_add_cpu(&sbi->s_vsb_raw->apfs_fs_alloc_count, vol_trans->t_alloc_delta);
+	vol_trans->t_alloc_delta = 0;
+}
+
 /* btree.c */
 extern struct apfs_query *apfs_alloc_query(struct apfs_node *node,
 					   struct apfs_query *parent);
@@ -686,8 +1222,14 @@ extern int apfs_btree_query(struct super_block *sb, struct apfs_query **query);
 extern struct apfs_node *apfs_omap_read_node(struct super_block *sb, u64 id);
 extern int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
 				  u64 id, u64 *block, bool write);
+extern int apfs_omap_lookup_block_nowait(struct super_block *sb,
+					 struct apfs_node *tbl, u64 id,
+					 u64 *block);
+extern int apfs_omap_lookup_flags(struct super_block *sb, u64 id, u32 *flags);
+extern int apfs_omap_index_build(struct super_block *sb);
+extern void apfs_omap_index_free(struct super_block *sb);
 extern int apfs_create_omap_rec(struct super_block *sb, u64 oid, u64 bno);
-extern int apfs_delete_omap_rec(struct super_block *sb, u64 oid);
+extern int apfs_delete_omap_rec(struct super_block *sb, u64 oid, bool *shared);
 extern int apfs_query_join_transaction(struct apfs_query *query);
 extern int apfs_btree_insert(struct apfs_query *query, void *key, int key_len,
 			     void *val, int val_len);
@@ -697,11 +1239,24 @@ extern int apfs_btree_replace(struct apfs_query *query, void *key, int key_len,
 			      void *val, int val_len);
 
 /* compress.c */
-extern int apfs_compress_get_size(struct inode *inode, loff_t *size);
+extern int apfs_compress_load(struct inode *inode);
+
+/* crypt.c */
+extern int apfs_crypt_init(struct super_block *sb);
+extern void apfs_crypt_free(struct super_block *sb);
+extern struct buffer_head *apfs_crypt_read_node_block(struct super_block *sb,
+						      u64 bno, bool nowait);
+extern void apfs_crypt_put_bh(struct buffer_head *bh);
+extern int apfs_crypt_read_data(struct super_block *sb, u64 bno, u64 tweak,
+				struct page *page, unsigned int offset);
 
 /* dir.c */
 extern int apfs_inode_by_name(struct inode *dir, const struct qstr *child,
 			      u64 *ino);
+extern int apfs_prefetch_tree(struct dentry *root, struct apfs_prefetch *pf);
+extern struct inode *apfs_create_private_file(struct super_block *sb,
+					      struct qstr *qname);
+extern int APFS_CREATE_PRIVATE_FILE_MAXOPS(void);
 extern int apfs_mkany(struct inode *dir, struct dentry *dentry,
 		      umode_t mode, dev_t rdev, const char *symname);
 
@@ -738,6 +1293,8 @@ extern int apfs_extent_from_query(struct apfs_query *query,
 				  struct apfs_file_extent *extent);
 extern int __apfs_get_block(struct apfs_dstream_info *dstream, sector_t iblock,
 			    struct buffer_head *bh_result, int create);
+extern int apfs_dstream_map_tweak(struct apfs_dstream_info *dstream,
+				  sector_t dsblock, u64 *bno, u64 *tweak);
 extern int apfs_get_block(struct inode *inode, sector_t iblock,
 			  struct buffer_head *bh_result, int create);
 extern int apfs_flush_extent_cache(struct apfs_dstream_info *dstream);
@@ -745,11 +1302,31 @@ extern int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsb
 extern int apfs_get_new_block(struct inode *inode, sector_t iblock,
 			      struct buffer_head *bh_result, int create);
 extern int APFS_GET_NEW_BLOCK_MAXOPS(void);
+extern int apfs_dstream_count_extents(struct apfs_dstream_info *dstream, u64 start, u64 end, u64 *count);
+extern int apfs_dstream_defrag_flush(struct apfs_dstream_info *dstream, struct apfs_file_extent *run);
+extern int apfs_dstream_defrag_block(struct apfs_dstream_info *dstream, u64 dsblock,
+				     struct buffer_head *bh, struct apfs_file_extent *run);
+extern int APFS_DEFRAG_BLOCK_MAXOPS(void);
+extern int apfs_dstream_share_range(struct apfs_dstream_info *src, struct apfs_dstream_info *dst,
+				    u64 src_blk, u64 dst_blk, u64 blkcount, u64 *shared);
+extern int APFS_SHARE_BLOCK_MAXOPS(void);
+extern int apfs_extentref_lookup(struct apfs_node *root, u64 bno, struct apfs_phys_extent *pext,
+				 struct apfs_phys_ext_val *val);
+extern int apfs_extentref_merge_step(struct apfs_node *src_root, struct apfs_node *dst_root);
+extern int apfs_extref_delta_apply(struct super_block *sb);
+extern void apfs_extref_delta_free(struct super_block *sb);
 extern int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size);
 
 /* file.c */
 extern int apfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
+/* fsync.c */
+extern void apfs_fsync_log_mount(struct super_block *sb);
+extern void apfs_fsync_log_put(struct super_block *sb);
+extern int apfs_fsync_log_write(struct inode *inode);
+extern int apfs_fsync_log_commit(struct super_block *sb);
+extern void apfs_fsync_log_wait_replay(struct apfs_nxsb_info *nxi);
+
 /* inode.c */
 extern struct inode *apfs_iget(struct super_block *sb, u64 cnid);
 extern int apfs_update_inode(struct inode *inode, char *new_name);
@@ -758,7 +1335,8 @@ extern void apfs_evict_inode(struct inode *inode);
 extern struct inode *apfs_new_inode(struct inode *dir, umode_t mode,
 				    dev_t rdev);
 extern int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
-				 struct dentry *dentry);
+				 struct qstr *qname);
+extern int apfs_inode_create_dstream_rec(struct inode *inode);
 extern int APFS_CREATE_INODE_REC_MAXOPS(void);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
@@ -801,14 +1379,48 @@ extern int apfs_read_cat_key(void *raw, int size, struct apfs_key *key, bool has
 extern int apfs_read_free_queue_key(void *raw, int size, struct apfs_key *key);
 extern int apfs_read_omap_key(void *raw, int size, struct apfs_key *key);
 extern int apfs_read_extentref_key(void *raw, int size, struct apfs_key *key);
+extern int apfs_read_omap_snap_key(void *raw, int size, struct apfs_key *key);
+extern int apfs_read_fext_key(void *raw, int size, struct apfs_key *key);
+
+/* lockstat.c */
+extern u64 apfs_big_down_read(struct apfs_nxsb_info *nxi,
+			      enum apfs_lock_site site);
+extern void apfs_big_up_read(struct apfs_nxsb_info *nxi,
+			     enum apfs_lock_site site, u64 locked);
+extern void apfs_big_down_write(struct apfs_nxsb_info *nxi,
+				enum apfs_lock_site site);
+extern void apfs_big_write_site(struct apfs_nxsb_info *nxi,
+				enum apfs_lock_site site);
+extern void apfs_big_up_write(struct apfs_nxsb_info *nxi);
+extern void apfs_nxs_lock(struct apfs_nxsb_info *nxi, enum apfs_lock_site site);
+extern void apfs_nxs_unlock(struct apfs_nxsb_info *nxi);
+extern int apfs_lockstat_init(struct apfs_nxsb_info *nxi);
+extern void apfs_lockstat_free(struct apfs_nxsb_info *nxi);
+extern void apfs_lockstat_reset(struct apfs_nxsb_info *nxi);
+extern ssize_t apfs_lockstat_show(struct apfs_nxsb_info *nxi, char *buf);
+extern ssize_t apfs_lockstat_show_hist(struct apfs_nxsb_info *nxi, char *buf,
+				       bool hold);
 
 /* message.c */
 extern __printf(3, 4)
 void apfs_msg(struct super_block *sb, const char *prefix, const char *fmt, ...);
 
+/* metabuf.c */
+extern void apfs_metabuf_init(struct apfs_nxsb_info *nxi);
+extern void apfs_metabuf_free(struct apfs_nxsb_info *nxi);
+extern struct buffer_head *apfs_metabuf_read(struct super_block *sb, u64 bno,
+					     bool nowait);
+extern void apfs_metabuf_readahead(struct super_block *sb, u64 bno);
+extern void apfs_metabuf_put(struct buffer_head *bh);
+extern unsigned long apfs_metabuf_count(struct super_block *sb);
+extern unsigned long apfs_metabuf_shrink(struct super_block *sb, unsigned long nr);
+
 /* node.c */
 extern struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid,
 					u32 storage, bool write);
+extern struct apfs_node *apfs_read_node_nowait(struct super_block *sb, u64 oid,
+					       u32 storage);
+extern void apfs_node_readahead(struct super_block *sb, u64 oid, u32 storage);
 extern void apfs_update_node(struct apfs_node *node);
 extern int apfs_delete_node(struct apfs_query *query);
 extern int apfs_node_query(struct super_block *sb, struct apfs_query *query);
@@ -816,29 +1428,63 @@ extern void apfs_node_query_first(struct apfs_query *query);
 extern int apfs_bno_from_query(struct apfs_query *query, u64 *bno);
 extern int apfs_node_split(struct apfs_query *query);
 extern int apfs_node_locate_key(struct apfs_node *node, int index, int *off);
+extern int apfs_node_locate_data(struct apfs_node *node, int index, int *off);
 extern void apfs_node_get(struct apfs_node *node);
 extern void apfs_node_put(struct apfs_node *node);
 extern void apfs_node_free_range(struct apfs_node *node, u16 off, u16 len);
 extern int apfs_node_replace(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_create_single_rec_node(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
+extern struct apfs_node *apfs_create_root_node(struct super_block *sb, u32 tree_type,
+					       const struct apfs_btree_info_fixed *fixed);
+extern int apfs_query_next_key(struct apfs_query *query, struct apfs_key *key);
+extern int apfs_query_leaf_next(struct apfs_query *query, struct apfs_key *key);
 
 /* object.c */
 extern int apfs_obj_verify_csum(struct super_block *sb,
 				struct apfs_obj_phys *obj);
 extern void apfs_obj_set_csum(struct super_block *sb,
 			      struct apfs_obj_phys *obj);
+extern int apfs_obj_verify_bh_csum(struct super_block *sb,
+				   struct buffer_head *bh);
 extern int apfs_create_cpoint_map(struct super_block *sb, u64 oid, u64 bno);
 extern int apfs_remove_cpoint_map(struct super_block *sb, u64 bno);
 extern struct buffer_head *apfs_read_ephemeral_object(struct super_block *sb,
 						      u64 oid);
 extern struct buffer_head *apfs_read_object_block(struct super_block *sb,
 						  u64 bno, bool write);
+extern struct buffer_head *apfs_read_object_block_nowait(struct super_block *sb,
+							 u64 bno);
+extern struct buffer_head *apfs_read_snap_object_block(struct super_block *sb,
+						       u64 bno);
+
+/* scrub.c */
+extern int apfs_scrub_start(struct super_block *sb);
+extern void apfs_scrub_stop(struct super_block *sb);
+
+/* seal.c */
+extern int apfs_seal_init(struct super_block *sb);
+extern void apfs_seal_free(struct super_block *sb);
+extern int apfs_seal_verify_node(struct apfs_node *node, const u8 *hash);
+extern struct buffer_head *apfs_seal_bread(struct apfs_dstream_info *dstream,
+					   u64 dsblock, u64 bno);
+
+/* snapshot.c */
+extern int apfs_snapshot_create(struct super_block *sb, const char *name);
+extern int apfs_snapshot_destroy(struct super_block *sb, const char *name);
+extern int apfs_snap_extentref_find(struct super_block *sb, u64 bno, struct apfs_phys_extent *pext,
+				    struct apfs_phys_ext_val *val);
+extern int apfs_reaper_start(struct super_block *sb);
+extern void apfs_reaper_stop(struct super_block *sb);
 
 /* spaceman.c */
 extern int apfs_read_spaceman(struct super_block *sb);
+extern void apfs_write_spaceman(struct super_block *sb);
 extern int apfs_free_queue_insert(struct super_block *sb, u64 bno, u64 count);
 extern int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backwards);
+extern int apfs_spaceman_claim_block(struct super_block *sb, u64 bno);
+extern int apfs_reserve_blocks(struct super_block *sb, u64 count);
+extern void apfs_release_blocks(struct super_block *sb, u64 count);
 
 /* super.c */
 extern int apfs_map_volume_super(struct super_block *sb, bool write);
@@ -846,19 +1492,40 @@ extern int apfs_read_omap(struct super_block *sb, bool write);
 extern int apfs_read_catalog(struct super_block *sb, bool write);
 extern int apfs_sync_fs(struct super_block *sb, int wait);
 
+/* sysfs.c */
+extern int apfs_sysfs_register(struct super_block *sb);
+extern void apfs_sysfs_unregister(struct super_block *sb);
+extern int __init apfs_sysfs_init(void);
+extern void apfs_sysfs_exit(void);
+
 /* transaction.c */
 extern void apfs_cpoint_data_allocate(struct super_block *sb, u64 *bno);
 extern int apfs_cpoint_data_free(struct super_block *sb, u64 bno);
+extern int __apfs_transaction_start(struct super_block *sb,
+				    struct apfs_max_ops maxops,
+				    enum apfs_lock_site site);
 extern int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops);
 extern int apfs_transaction_commit(struct super_block *sb);
 extern void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode);
+extern void apfs_inode_join_transaction_data(struct super_block *sb, struct inode *inode);
 extern int apfs_transaction_join(struct super_block *sb,
 				 struct buffer_head *bh);
+extern int apfs_transaction_join_root(struct super_block *sb, bool cat);
+extern void apfs_wait_page_inflight(struct page *page);
 void apfs_transaction_abort(struct super_block *sb);
+extern void apfs_shrink_init(struct super_block *sb);
+extern void apfs_shrink_stop(struct super_block *sb);
+extern unsigned long apfs_pinned_buffers(struct super_block *sb);
+extern long apfs_nr_cached_objects(struct super_block *sb,
+				   struct shrink_control *sc);
+extern long apfs_free_cached_objects(struct super_block *sb,
+				     struct shrink_control *sc);
 
 /* xattr.c */
 extern int ____apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
 			      size_t size, bool only_whole);
+extern int apfs_xattr_get_head(struct inode *inode, const char *name,
+			       void *buffer, size_t size, int *total);
 extern int __apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
 			    size_t size);
 extern int apfs_delete_all_xattrs(struct inode *inode);
@@ -884,6 +1551,9 @@ extern const struct file_operations apfs_compress_file_operations;
 /* dir.c */
 extern const struct file_operations apfs_dir_operations;
 
+/* export.c */
+extern const struct export_operations apfs_export_ops;
+
 /* file.c */
 extern const struct file_operations apfs_file_operations;
 extern const struct inode_operations apfs_file_inode_operations;
@@ -914,10 +1584,56 @@ apfs_map_bh(struct buffer_head *bh, struct super_block *sb, sector_t block)
 	bh->b_size = sb->s_blocksize;
 }
 
+/**
+ * apfs_sb_find_get_block - Find a cached block that doesn't need to be read
+ * @sb:		superblock structure
+ * @block:	the block number
+ *
+ * Returns NULL if the block must be read from disk.  In that case a checksum or
+ * hash verified for an older read no longer counts, so the marks get cleared.
+ */
+static inline struct buffer_head *
+apfs_sb_find_get_block(struct super_block *sb, sector_t block)
+{
+	struct buffer_head *bh;
+
+	bh = __find_get_block(APFS_NXI(sb)->nx_bdev, block, sb->s_blocksize);
+	if (!bh || buffer_uptodate(bh))
+		return bh;
+	clear_buffer_csum_ok(bh);
+	clear_buffer_seal_ok(bh);
+	brelse(bh);
+	return NULL;
+}
+
 static inline struct buffer_head *
 apfs_sb_bread(struct super_block *sb, sector_t block)
 {
+	struct buffer_head *bh;
+
+	bh = apfs_sb_find_get_block(sb, block);
+	if (bh)
+		return bh;
 	return __bread_gfp(APFS_NXI(sb)->nx_bdev, block, sb->s_blocksize, __GFP_MOVABLE);
 }
 
+static inline void apfs_sb_breadahead(struct super_block *sb, sector_t block)
+{
+	struct buffer_head *bh;
+
+	bh = apfs_sb_find_get_block(sb, block);
+	if (bh) {
+		brelse(bh);
+		return;
+	}
+	__breadahead(APFS_NXI(sb)->nx_bdev, block, sb->s_blocksize);
+}
+
+/* Like apfs_sb_bread(), but returns NULL instead of reading from disk */
+static inline struct buffer_head *
+apfs_sb_bread_nowait(struct super_block *sb, sector_t block)
+{
+	return apfs_sb_find_get_block(sb, block);
+}
+
 #endif	/* _APFS_H */
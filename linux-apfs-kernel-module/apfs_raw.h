@@ -49,6 +49,8 @@
 #define APFS_OBJECT_TYPE_GBITMAP		0x00000019
 #define APFS_OBJECT_TYPE_GBITMAP_TREE		0x0000001a
 #define APFS_OBJECT_TYPE_GBITMAP_BLOCK		0x0000001b
+#define APFS_OBJECT_TYPE_INTEGRITY_META		0x0000001e
+#define APFS_OBJECT_TYPE_FEXT_TREE		0x0000001f
 #define APFS_OBJECT_TYPE_INVALID		0x00000000
 #define APFS_OBJECT_TYPE_TEST			0x000000ff
 
@@ -122,12 +124,28 @@ struct apfs_omap_val {
 	__le64 ov_paddr;
 } __packed;
 
+/* Flags for an object map snapshot */
+#define APFS_OMAP_SNAPSHOT_DELETED	0x00000001
+#define APFS_OMAP_SNAPSHOT_REVERTED	0x00000002
+#define APFS_OMAP_SNAPSHOT_FLAGS_VALID_MASK	(APFS_OMAP_SNAPSHOT_DELETED \
+						| APFS_OMAP_SNAPSHOT_REVERTED)
+
+/*
+ * Structure of a value in an object map snapshot B-tree; the key is the xid
+ */
+struct apfs_omap_snapshot {
+	__le32 oms_flags;
+	__le32 oms_pad;
+	__le64 oms_oid;
+} __packed;
+
 /* B-tree node flags */
 #define APFS_BTNODE_ROOT		0x0001
 #define APFS_BTNODE_LEAF		0x0002
 #define APFS_BTNODE_FIXED_KV_SIZE	0x0004
+#define APFS_BTNODE_HASHED		0x0008
 #define APFS_BTNODE_CHECK_KOFF_INVAL	0x8000
-#define APFS_BTNODE_MASK		0x0007	/* Valid on-disk flags */
+#define APFS_BTNODE_MASK		0x000f	/* Valid on-disk flags */
 
 /* B-tree location constants */
 #define APFS_BTOFF_INVALID		0xffff
@@ -172,6 +190,16 @@ struct apfs_btree_node_phys {
 /*38*/	__le64 btn_data[];
 } __packed;
 
+#define APFS_BTREE_NODE_HASH_SIZE_MAX	64
+
+/*
+ * Structure of a value in an index node of a hashed B-tree
+ */
+struct apfs_btn_index_node_val {
+	__le64 binv_child_oid;
+	u8 binv_child_hash[APFS_BTREE_NODE_HASH_SIZE_MAX];
+} __packed;
+
 /* B-tree info flags */
 #define APFS_BTREE_UINT64_KEYS		0x00000001
 #define APFS_BTREE_SEQUENTIAL_INSERT	0x00000002
@@ -180,13 +208,15 @@ struct apfs_btree_node_phys {
 #define APFS_BTREE_PHYSICAL		0x00000010
 #define APFS_BTREE_NONPERSISTENT	0x00000020
 #define APFS_BTREE_KV_NONALIGNED	0x00000040
+#define APFS_BTREE_HASHED		0x00000080
 #define APFS_BTREE_FLAGS_VALID_MASK	(APFS_BTREE_UINT64_KEYS \
 					| APFS_BTREE_SEQUENTIAL_INSERT \
 					| APFS_BTREE_ALLOW_GHOSTS \
 					| APFS_BTREE_EPHEMERAL \
 					| APFS_BTREE_PHYSICAL \
 					| APFS_BTREE_NONPERSISTENT \
-					| APFS_BTREE_KV_NONALIGNED)
+					| APFS_BTREE_KV_NONALIGNED \
+					| APFS_BTREE_HASHED)
 
 /*
  * Structure used to store information about a B-tree that won't change
@@ -227,6 +257,8 @@ struct apfs_drec_val {
 #define APFS_PEXT_KIND_MASK	0xf000000000000000ULL
 #define APFS_PEXT_KIND_SHIFT	60
 
+#define APFS_OWNING_OBJ_ID_INVALID	(~0ULL)
+
 /* The kind of a physical extent record */
 enum {
 	APFS_KIND_ANY		= 0,
@@ -469,6 +501,31 @@ struct apfs_sibling_map_val {
 	__le64 file_id;
 } __packed;
 
+/* Bit masks for the 'info_and_lba' field of a file info key */
+#define APFS_FILE_INFO_LBA_MASK		0x00ffffffffffffffULL
+#define APFS_FILE_INFO_TYPE_MASK	0xff00000000000000ULL
+#define APFS_FILE_INFO_TYPE_SHIFT	56
+
+/* File info types */
+#define APFS_FILE_INFO_DATA_HASH	1
+
+/*
+ * Structure of the key for a file info record
+ */
+struct apfs_file_info_key {
+	struct apfs_key_header hdr;
+	__le64 info_and_lba;
+} __packed;
+
+/*
+ * Structure of a file info record holding the hash of a range of data blocks
+ */
+struct apfs_file_data_hash_val {
+	__le16 hashed_len;
+	u8 hash_size;
+	u8 hash[0];
+} __packed;
+
 /*
  * Structure of a key in an object map B-tree
  */
@@ -500,7 +557,8 @@ enum {
 	APFS_TYPE_DIR_STATS		= 10,
 	APFS_TYPE_SNAP_NAME		= 11,
 	APFS_TYPE_SIBLING_MAP		= 12,
-	APFS_TYPE_MAX_VALID		= 12,
+	APFS_TYPE_FILE_INFO		= 13,
+	APFS_TYPE_MAX_VALID		= 13,
 	APFS_TYPE_MAX			= 15,
 	APFS_TYPE_INVALID		= 15,
 };
@@ -594,6 +652,35 @@ struct apfs_xattr_key {
 	u8 name[0];
 } __packed;
 
+/*
+ * Structure of the key for a snapshot metadata record; the id is the xid
+ */
+struct apfs_snap_metadata_key {
+	struct apfs_key_header hdr;
+} __packed;
+
+/* Flags for the snapshot metadata */
+#define APFS_SNAP_META_PENDING_DATALESS	0x00000001
+#define APFS_SNAP_META_MERGE_IN_PROGRESS	0x00000002
+
+/*
+ * Structure of the value for a snapshot metadata record
+ */
+struct apfs_snap_metadata_val {
+	__le64 extentref_tree_oid;
+	__le64 sblock_oid;
+	__le64 create_time;
+	__le64 change_time;
+	__le64 inum;
+	__le32 extentref_tree_type;
+	__le32 flags;
+	__le16 name_len;
+	u8 name[0];
+} __packed;
+
+/* The object id for all snapshot name records */
+#define APFS_SNAP_NAME_OBJ_ID	(~0ULL & APFS_OBJ_ID_MASK)
+
 /*
  * Structure of the key for a snapshot name record
  */
@@ -603,6 +690,13 @@ struct apfs_snap_name_key {
 	u8 name[0];
 } __packed;
 
+/*
+ * Structure of the value for a snapshot name record
+ */
+struct apfs_snap_name_val {
+	__le64 snap_xid;
+} __packed;
+
 /*
  * Structure of the key for a sibling link record
  */
@@ -860,6 +954,10 @@ struct apfs_nx_efi_jumpstart {
 #define APFS_NX_MAXIMUM_BLOCK_SIZE		65536
 #define APFS_NX_MINIMUM_CONTAINER_SIZE		1048576
 
+/* Highest bit of nx_xp_desc_blocks and nx_xp_data_blocks */
+#define APFS_NX_XP_NONCONTIGUOUS		0x80000000
+#define APFS_NX_XP_BLOCKS_MASK			0x7FFFFFFF
+
 /* Indexes into a container superblock's array of counters */
 enum {
 	APFS_NX_CNTR_OBJ_CKSUM_SET	= 0,
@@ -925,6 +1023,51 @@ struct apfs_nx_superblock {
 	struct apfs_prange nx_fusion_wbc;
 } __packed;
 
+/* Object types for keybags, stored in plaintext after decryption */
+#define APFS_OBJECT_TYPE_CONTAINER_KEYBAG	0x6b657973 /* 'keys' */
+#define APFS_OBJECT_TYPE_VOLUME_KEYBAG		0x72656373 /* 'recs' */
+
+#define APFS_KEYBAG_VERSION	2
+
+/* Keybag entry tags */
+#define APFS_KB_TAG_UNKNOWN			0
+#define APFS_KB_TAG_RESERVED_1			1
+#define APFS_KB_TAG_VOLUME_KEY			2
+#define APFS_KB_TAG_VOLUME_UNLOCK_RECORDS	3
+#define APFS_KB_TAG_VOLUME_PASSPHRASE_HINT	4
+#define APFS_KB_TAG_WRAPPING_M_KEY		5
+#define APFS_KB_TAG_VOLUME_M_KEY		6
+
+/*
+ * Entry in a keybag; entries are aligned to 16 bytes
+ */
+struct apfs_keybag_entry {
+	char ke_uuid[UUID_SIZE];
+	__le16 ke_tag;
+	__le16 ke_keylen;
+	u8 padding[4];
+	u8 ke_keydata[];
+} __packed;
+
+/*
+ * Header for the list of entries in a keybag
+ */
+struct apfs_kb_locker {
+	__le16 kl_version;
+	__le16 kl_nkeys;
+	__le32 kl_nbytes;
+	u8 padding[8];
+	struct apfs_keybag_entry kl_entries[];
+} __packed;
+
+/*
+ * Keybag object, for either the container or a volume
+ */
+struct apfs_media_keybag {
+	struct apfs_obj_phys mk_obj;
+	struct apfs_kb_locker mk_locker;
+} __packed;
+
 /*
  * A mapping from an ephemeral object id to its physical address
  */
@@ -1017,11 +1160,14 @@ struct apfs_checkpoint_map_phys {
 #define APFS_INCOMPAT_DATALESS_SNAPS		0x00000002LL
 #define APFS_INCOMPAT_ENC_ROLLED		0x00000004LL
 #define APFS_INCOMPAT_NORMALIZATION_INSENSITIVE	0x00000008LL
+#define APFS_INCOMPAT_INCOMPLETE_RESTORE	0x00000010LL
+#define APFS_INCOMPAT_SEALED_VOLUME		0x00000020LL
 
 #define APFS_SUPPORTED_INCOMPAT_MASK  (APFS_INCOMPAT_CASE_INSENSITIVE \
 				      | APFS_INCOMPAT_DATALESS_SNAPS \
 				      | APFS_INCOMPAT_ENC_ROLLED \
-				      | APFS_INCOMPAT_NORMALIZATION_INSENSITIVE)
+				      | APFS_INCOMPAT_NORMALIZATION_INSENSITIVE \
+				      | APFS_INCOMPAT_SEALED_VOLUME)
 
 #define APFS_MODIFIED_NAMELEN	      32
 
@@ -1119,6 +1265,55 @@ struct apfs_superblock {
 
 /*3C8*/	__le64 apfs_root_to_xid;
 	__le64 apfs_er_state_oid;
+/*3D8*/	__le64 apfs_cloneinfo_id_epoch;
+	__le64 apfs_cloneinfo_xid;
+/*3E8*/	__le64 apfs_snap_meta_ext_oid;
+	u8 apfs_volume_group_id[16];
+/*400*/	__le64 apfs_integrity_meta_oid;
+	__le64 apfs_fext_tree_oid;
+/*410*/	__le32 apfs_fext_tree_type;
+	__le32 apfs_reserved_type;
+	__le64 apfs_reserved_oid;
+} __packed;
+
+/* Hash types for sealed volumes */
+#define APFS_HASH_INVALID		0
+#define APFS_HASH_SHA256		1
+#define APFS_HASH_SHA512_256		2
+#define APFS_HASH_SHA384		3
+#define APFS_HASH_SHA512		4
+
+/* Integrity metadata flags */
+#define APFS_SEAL_BROKEN		0x00000001
+
+/*
+ * Integrity metadata object for a sealed volume
+ */
+struct apfs_integrity_meta_phys {
+/*00*/	struct apfs_obj_phys im_o;
+
+/*20*/	__le32 im_version;
+	__le32 im_flags;
+	__le32 im_hash_type;
+	__le32 im_root_hash_offset;
+/*30*/	__le64 im_broken_xid;
+	__le64 im_reserved[9];
+} __packed;
+
+/*
+ * Structure of a key in the file extent tree of a sealed volume
+ */
+struct apfs_fext_tree_key {
+	__le64 private_id;
+	__le64 logical_addr;
+} __packed;
+
+/*
+ * Structure of a value in the file extent tree of a sealed volume
+ */
+struct apfs_fext_tree_val {
+	__le64 len_and_flags;
+	__le64 phys_block_num;
 } __packed;
 
 /* Extended attributes constants */
@@ -1187,4 +1382,37 @@ struct apfs_compress_rsrc_data {
 	} __packed block[0];
 } __packed;
 
+/*
+ * The fsync log is not part of the official format: it lives in the blocks of
+ * a regular file in private-dir, so other implementations just ignore it.
+ */
+#define APFS_FSYNC_LOG_NAME		"com.github.linux-apfs.fsync-log"
+#define APFS_FSYNC_LOG_BLOCKS		64
+
+/* Object type for the fsync log blocks, outside the range used by Apple */
+#define APFS_OBJECT_TYPE_FSYNC_LOG	0x00004c46
+
+/*
+ * Run of data blocks written by a transaction that never got committed
+ */
+struct apfs_fsync_log_extent {
+	__le64 fe_lblk;		/* First logical block in the file */
+	__le64 fe_pblk;		/* First physical block */
+	__le64 fe_count;	/* Block count */
+} __packed;
+
+/*
+ * Block of the fsync log, with all that's needed to replay one fsync() call
+ */
+struct apfs_fsync_log_phys {
+/*00*/	struct apfs_obj_phys fl_o;	/* o_xid is the base checkpoint */
+/*20*/	__le32 fl_index;		/* Position of the block in the log */
+	__le32 fl_ext_count;
+	__le64 fl_ino;
+/*30*/	__le64 fl_size;
+	__le64 fl_mtime;
+/*40*/	__le64 fl_ctime;
+	struct apfs_fsync_log_extent fl_exts[];
+} __packed;
+
 #endif	/* _APFS_RAW_H */
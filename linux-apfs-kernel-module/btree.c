@@ -3,7 +3,9 @@
  * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <linux/bsearch.h>
 #include <linux/buffer_head.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include "apfs.h"
 
@@ -11,14 +13,27 @@
  * apfs_child_from_query - Read the child id found by a successful nonleaf query
  * @query:	the query that found the record
  * @child:	Return parameter.  The child id found.
+ * @hash:	Return parameter.  The hash of the child, or NULL if not hashed.
  *
  * Reads the child id in the nonleaf node record into @child and performs a
  * basic sanity check as a protection against crafted filesystems.  Returns 0
  * on success or -EFSCORRUPTED otherwise.
  */
-static int apfs_child_from_query(struct apfs_query *query, u64 *child)
+static int apfs_child_from_query(struct apfs_query *query, u64 *child,
+				 const u8 **hash)
 {
 	char *raw = query->node->object.bh->b_data;
+	struct apfs_btn_index_node_val *val;
+
+	*hash = NULL;
+	if (apfs_node_is_hashed(query->node)) {
+		if (query->len != sizeof(*val))
+			return -EFSCORRUPTED;
+		val = (struct apfs_btn_index_node_val *)(raw + query->off);
+		*child = le64_to_cpu(val->binv_child_oid);
+		*hash = val->binv_child_hash;
+		return 0;
+	}
 
 	if (query->len != 8) /* The data on a nonleaf node is the child id */
 		return -EFSCORRUPTED;
@@ -28,23 +43,274 @@ static int apfs_child_from_query(struct apfs_query *query, u64 *child)
 }
 
 /**
- * apfs_omap_lookup_block - Find the block number of a b-tree node from its id
+ * apfs_omap_rec_from_query - Read the omap record found by a successful query
+ * @query:	the query that found the record
+ * @oid:	object id that was searched for
+ * @xid:	on return, the transaction id for the record
+ * @flags:	on return, the flags for the record
+ *
+ * Returns 0 on success, -ENODATA if the record belongs to a different object,
+ * or -EFSCORRUPTED if the record is invalid.
+ */
+static int apfs_omap_rec_from_query(struct apfs_query *query, u64 oid, u64 *xid, u32 *flags)
+{
+	struct apfs_omap_val *omap_val;
+	char *raw = query->node->object.bh->b_data;
+	struct apfs_key key;
+	int err;
+
+	err = apfs_read_omap_key(raw + query->key_off, query->key_len, &key);
+	if (err)
+		return err;
+	if (key.id != oid)
+		return -ENODATA;
+
+	if (query->len != sizeof(*omap_val))
+		return -EFSCORRUPTED;
+	omap_val = (struct apfs_omap_val *)(raw + query->off);
+
+	*xid = key.number;
+	*flags = le32_to_cpu(omap_val->ov_flags);
+	return 0;
+}
+
+/**
+ * apfs_omap_rec_is_shared - Check if an omap record is referenced by snapshots
+ * @sb:		filesystem superblock
+ * @xid:	transaction id for the record
+ */
+static inline bool apfs_omap_rec_is_shared(struct super_block *sb, u64 xid)
+{
+	return xid != APFS_NXI(sb)->nx_xid && xid <= APFS_SB(sb)->s_latest_snap;
+}
+
+/* Height limit for the walk of the omap, to stop loops on corrupted trees */
+#define APFS_OMAP_INDEX_MAX_LEVEL	16
+/* Don't let a corrupted record count take all the memory (256 MiB) */
+#define APFS_OMAP_INDEX_MAX_ENTRIES	(1ULL << 24)
+
+/*
+ * State of the walk that builds the flat omap index
+ */
+struct apfs_omap_index_walk {
+	struct apfs_omap_map *map;	/* Array of mappings found so far */
+	u64 len;			/* Length of @map */
+	u64 cap;			/* Number of entries allocated for @map */
+};
+
+/**
+ * apfs_omap_index_leaf - Add the records of an omap leaf to the flat index
+ * @sb:		filesystem superblock
+ * @node:	the leaf node
+ * @walk:	state of the walk
+ *
+ * The records are sorted by oid and then by xid, so the latest version of each
+ * object always comes last. Deleted objects get a zero block number for now.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_omap_index_leaf(struct super_block *sb, struct apfs_node *node,
+				struct apfs_omap_index_walk *walk)
+{
+	u64 curr_xid = APFS_NXI(sb)->nx_xid;
+	char *raw = node->object.bh->b_data;
+	int i;
+
+	for (i = 0; i < node->records; ++i) {
+		struct apfs_omap_key *key;
+		struct apfs_omap_val *val;
+		struct apfs_omap_map *map;
+		int key_off, val_off;
+		u64 oid;
+
+		if (apfs_node_locate_key(node, i, &key_off) != sizeof(*key) ||
+		    apfs_node_locate_data(node, i, &val_off) != sizeof(*val))
+			return -EFSCORRUPTED;
+		key = (struct apfs_omap_key *)(raw + key_off);
+		val = (struct apfs_omap_val *)(raw + val_off);
+
+		if (le64_to_cpu(key->ok_xid) > curr_xid)
+			continue;
+		oid = le64_to_cpu(key->ok_oid);
+
+		map = walk->len ? &walk->map[walk->len - 1] : NULL;
+		if (map && map->oid > oid)
+			return -EFSCORRUPTED;
+		if (!map || map->oid != oid) {
+			if (walk->len == walk->cap)
+				return -EFSCORRUPTED;
+			map = &walk->map[walk->len++];
+			map->oid = oid;
+		}
+		if (le32_to_cpu(val->ov_flags) & APFS_OMAP_VAL_DELETED)
+			map->bno = 0;
+		else
+			map->bno = le64_to_cpu(val->ov_paddr);
+	}
+	return 0;
+}
+
+/**
+ * apfs_omap_index_node - Add all the records under an omap node to the index
+ * @sb:		filesystem superblock
+ * @node:	the node
+ * @walk:	state of the walk
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_omap_index_node(struct super_block *sb, struct apfs_node *node,
+				struct apfs_omap_index_walk *walk)
+{
+	struct apfs_btree_node_phys *raw;
+	int level, i, err;
+
+	if (apfs_node_is_leaf(node))
+		return apfs_omap_index_leaf(sb, node, walk);
+
+	raw = (struct apfs_btree_node_phys *)node->object.bh->b_data;
+	level = le16_to_cpu(raw->btn_level);
+	if (level > APFS_OMAP_INDEX_MAX_LEVEL)
+		return -EFSCORRUPTED;
+
+	for (i = 0; i < node->records; ++i) {
+		struct apfs_btree_node_phys *child_raw;
+		struct apfs_node *child;
+		int off;
+
+		if (apfs_node_locate_data(node, i, &off) != sizeof(__le64))
+			return -EFSCORRUPTED;
+		child = apfs_read_node(sb, le64_to_cpup((__le64 *)(node->object.bh->b_data + off)),
+				       APFS_OBJ_PHYSICAL, false /* write */);
+		if (IS_ERR(child))
+			return PTR_ERR(child);
+
+		child_raw = (struct apfs_btree_node_phys *)child->object.bh->b_data;
+		if (le16_to_cpu(child_raw->btn_level) != level - 1)
+			err = -EFSCORRUPTED;
+		else
+			err = apfs_omap_index_node(sb, child, walk);
+		apfs_node_put(child);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/**
+ * apfs_omap_index_build - Make a flat copy of the volume omap
+ * @sb: filesystem superblock
+ *
+ * Only meant for read-only mounts, where the omap never changes. Afterwards,
+ * the lookups for virtual objects are a binary search in memory instead of a
+ * descent of the omap tree. Returns 0 on success or a negative error code in
+ * case of failure.
+ */
+int apfs_omap_index_build(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_node *root = sbi->s_omap_root;
+	struct apfs_btree_info *info;
+	struct apfs_omap_index_walk walk = {0};
+	u64 i, j;
+	int err;
+
+	ASSERT(sb->s_flags & SB_RDONLY);
+
+	info = (void *)root->object.bh->b_data + sb->s_blocksize - sizeof(*info);
+	walk.cap = le64_to_cpu(info->bt_key_count);
+	if (walk.cap > APFS_OMAP_INDEX_MAX_ENTRIES)
+		return -EFBIG;
+	walk.map = kvmalloc_array(walk.cap, sizeof(*walk.map), GFP_KERNEL);
+	if (!walk.map)
+		return -ENOMEM;
+
+	err = apfs_omap_index_node(sb, root, &walk);
+	if (err) {
+		kvfree(walk.map);
+		return err;
+	}
+
+	/* Now forget the deleted objects */
+	for (i = 0, j = 0; i < walk.len; ++i) {
+		if (walk.map[i].bno)
+			walk.map[j++] = walk.map[i];
+	}
+	sbi->s_omap_index = walk.map;
+	sbi->s_omap_index_len = j;
+	return 0;
+}
+
+/**
+ * apfs_omap_index_free - Free the flat copy of the volume omap, if any
+ * @sb: filesystem superblock
+ */
+void apfs_omap_index_free(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	kvfree(sbi->s_omap_index);
+	sbi->s_omap_index = NULL;
+	sbi->s_omap_index_len = 0;
+}
+
+static int apfs_omap_map_cmp(const void *key, const void *elt)
+{
+	u64 oid = *(const u64 *)key;
+	const struct apfs_omap_map *map = elt;
+
+	if (oid < map->oid)
+		return -1;
+	return oid > map->oid;
+}
+
+/**
+ * apfs_omap_index_lookup - Find the block number of an object in the flat omap
+ * @sb:		filesystem superblock
+ * @id:		id of the object
+ * @block:	on return, the found block number
+ *
+ * Returns 0 on success or -ENODATA if the object doesn't exist.
+ */
+static int apfs_omap_index_lookup(struct super_block *sb, u64 id, u64 *block)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_omap_map *map;
+
+	map = bsearch(&id, sbi->s_omap_index, sbi->s_omap_index_len,
+		      sizeof(*map), apfs_omap_map_cmp);
+	if (!map)
+		return -ENODATA;
+	*block = map->bno;
+	return 0;
+}
+
+/**
+ * __apfs_omap_lookup_block - Find the block number of a b-tree node from its id
  * @sb:		filesystem superblock
  * @tbl:	Root of the object map to be searched
  * @id:		id of the node
  * @block:	on return, the found block number
  * @write:	get write access to the object?
+ * @nowait:	fail with -EAGAIN instead of reading uncached omap nodes?
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
-			   u64 id, u64 *block, bool write)
+static int __apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
+				    u64 id, u64 *block, bool write, bool nowait)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_query *query;
 	struct apfs_key key;
+	u64 xid;
+	u32 flags;
 	int ret = 0;
 
+	ASSERT(!write || !nowait);
+
+	/* The flat copy is only valid while the omap can't change */
+	if (!write && sb_rdonly(sb) && tbl == APFS_SB(sb)->s_omap_root &&
+	    APFS_SB(sb)->s_omap_index)
+		return apfs_omap_index_lookup(sb, id, block);
+
 	query = apfs_alloc_query(tbl, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
@@ -52,11 +318,22 @@ int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
 	apfs_init_omap_key(id, nxi->nx_xid, &key);
 	query->key = &key;
 	query->flags |= APFS_QUERY_OMAP;
+	if (nowait)
+		query->flags |= APFS_QUERY_NOWAIT;
 
 	ret = apfs_btree_query(sb, &query);
 	if (ret)
 		goto fail;
 
+	ret = apfs_omap_rec_from_query(query, id, &xid, &flags);
+	if (ret)
+		goto fail;
+	/* A deletion record hides all the older versions of the object */
+	if (flags & APFS_OMAP_VAL_DELETED) {
+		ret = -ENODATA;
+		goto fail;
+	}
+
 	ret = apfs_bno_from_query(query, block);
 	if (ret) {
 		apfs_alert(sb, "bad object map leaf block: 0x%llx",
@@ -68,20 +345,31 @@ int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
 		struct apfs_omap_key key;
 		struct apfs_omap_val val;
 		struct buffer_head *new_bh;
-
-		new_bh = apfs_read_object_block(sb, *block, write);
+		bool shared;
+
+		/* The container's omap has no snapshots */
+		shared = tbl == APFS_SB(sb)->s_omap_root && apfs_omap_rec_is_shared(sb, xid);
+		if (shared)
+			new_bh = apfs_read_snap_object_block(sb, *block);
+		else
+			new_bh = apfs_read_object_block(sb, *block, write);
 		if (IS_ERR(new_bh)) {
 			ret = PTR_ERR(new_bh);
 			goto fail;
 		}
 
 		key.ok_oid = cpu_to_le64(id);
-		key.ok_xid = cpu_to_le64(nxi->nx_xid); /* TODO: snapshots? */
+		key.ok_xid = cpu_to_le64(nxi->nx_xid);
 		val.ov_flags = 0; /* TODO: preserve the flags */
 		val.ov_size = cpu_to_le32(sb->s_blocksize);
 		val.ov_paddr = cpu_to_le64(new_bh->b_blocknr);
-		ret = apfs_btree_replace(query, &key, sizeof(key),
-					 &val, sizeof(val));
+		/* Keep the old version of the object for the snapshots */
+		if (shared)
+			ret = apfs_btree_insert(query, &key, sizeof(key),
+						&val, sizeof(val));
+		else
+			ret = apfs_btree_replace(query, &key, sizeof(key),
+						 &val, sizeof(val));
 
 		*block = new_bh->b_blocknr;
 		brelse(new_bh);
@@ -92,6 +380,71 @@ fail:
 	return ret;
 }
 
+/**
+ * apfs_omap_lookup_block - Find the block number of a b-tree node from its id
+ * @sb:		filesystem superblock
+ * @tbl:	Root of the object map to be searched
+ * @id:		id of the node
+ * @block:	on return, the found block number
+ * @write:	get write access to the object?
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
+			   u64 id, u64 *block, bool write)
+{
+	return __apfs_omap_lookup_block(sb, tbl, id, block, write, false /* nowait */);
+}
+
+/**
+ * apfs_omap_lookup_block_nowait - Find a node's block number without blocking
+ * @sb:		filesystem superblock
+ * @tbl:	Root of the object map to be searched
+ * @id:		id of the node
+ * @block:	on return, the found block number
+ *
+ * Like apfs_omap_lookup_block() without write access, but returns -EAGAIN if
+ * any of the omap nodes needed for the lookup is not in memory.
+ */
+int apfs_omap_lookup_block_nowait(struct super_block *sb, struct apfs_node *tbl,
+				  u64 id, u64 *block)
+{
+	return __apfs_omap_lookup_block(sb, tbl, id, block, false /* write */, true /* nowait */);
+}
+
+/**
+ * apfs_omap_lookup_flags - Find the flags for the latest version of an object
+ * @sb:		filesystem superblock
+ * @id:		id of the object
+ * @flags:	on return, the flags from the volume's omap record
+ *
+ * The flat omap index doesn't keep the flags, so this always searches the
+ * tree.  Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_omap_lookup_flags(struct super_block *sb, u64 id, u32 *flags)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_query *query;
+	struct apfs_key key;
+	u64 xid;
+	int ret;
+
+	query = apfs_alloc_query(APFS_SB(sb)->s_omap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+
+	apfs_init_omap_key(id, nxi->nx_xid, &key);
+	query->key = &key;
+	query->flags |= APFS_QUERY_OMAP;
+
+	ret = apfs_btree_query(sb, &query);
+	if (!ret)
+		ret = apfs_omap_rec_from_query(query, id, &xid, flags);
+
+	apfs_free_query(sb, query);
+	return ret;
+}
+
 /**
  * apfs_create_omap_rec - Create a record in the volume's omap tree
  * @sb:		filesystem superblock
@@ -140,15 +493,23 @@ fail:
  * apfs_delete_omap_rec - Delete an existing record from the volume's omap tree
  * @sb:		filesystem superblock
  * @oid:	object id for the record
+ * @shared:	on return, is the object still referenced by a snapshot?
  *
- * Returns 0 on success or a negative error code in case of failure.
+ * If some older version of the object may still be in use by a snapshot, a
+ * deletion record is left in the omap.  When @shared is set, the caller must
+ * not free the object's block.  Returns 0 on success or a negative error code
+ * in case of failure.
  */
-int apfs_delete_omap_rec(struct super_block *sb, u64 oid)
+int apfs_delete_omap_rec(struct super_block *sb, u64 oid, bool *shared)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_query *query;
 	struct apfs_key key;
+	struct apfs_omap_key raw_key;
+	struct apfs_omap_val raw_val;
+	u64 xid;
+	u32 flags;
 	int ret;
 
 	query = apfs_alloc_query(sbi->s_omap_root, NULL /* parent */);
@@ -160,11 +521,49 @@ int apfs_delete_omap_rec(struct super_block *sb, u64 oid)
 	query->flags |= APFS_QUERY_OMAP;
 
 	ret = apfs_btree_query(sb, &query);
+	if (!ret)
+		ret = apfs_omap_rec_from_query(query, oid, &xid, &flags);
+	if (!ret && (flags & APFS_OMAP_VAL_DELETED))
+		ret = -ENODATA;
 	if (ret == -ENODATA)
 		ret = -EFSCORRUPTED;
-	if (!ret)
+	if (ret)
+		goto fail;
+
+	*shared = apfs_omap_rec_is_shared(sb, xid);
+	if (!*shared) {
 		ret = apfs_btree_remove(query);
+		if (ret || !sbi->s_snap_count)
+			goto fail;
+
+		/* Check if some snapshot still has an older version */
+		apfs_free_query(sb, query);
+		query = apfs_alloc_query(sbi->s_omap_root, NULL /* parent */);
+		if (!query)
+			return -ENOMEM;
+		query->key = &key;
+		query->flags |= APFS_QUERY_OMAP;
+
+		ret = apfs_btree_query(sb, &query);
+		if (!ret)
+			ret = apfs_omap_rec_from_query(query, oid, &xid, &flags);
+		if (ret == -ENODATA) {
+			ret = 0;
+			goto fail;
+		}
+		if (ret)
+			goto fail;
+	}
+
+	raw_key.ok_oid = cpu_to_le64(oid);
+	raw_key.ok_xid = cpu_to_le64(nxi->nx_xid);
+	raw_val.ov_flags = cpu_to_le32(APFS_OMAP_VAL_DELETED);
+	raw_val.ov_size = cpu_to_le32(sb->s_blocksize);
+	raw_val.ov_paddr = 0;
+	ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key),
+				&raw_val, sizeof(raw_val));
 
+fail:
 	apfs_free_query(sb, query);
 	return ret;
 }
@@ -236,6 +635,7 @@ static int apfs_query_set_before_first(struct super_block *sb, struct apfs_query
 {
 	struct apfs_node *node;
 	u64 child_id;
+	const u8 *hash;
 	u32 storage = apfs_query_storage(*query);
 	int err;
 
@@ -246,7 +646,7 @@ static int apfs_query_set_before_first(struct super_block *sb, struct apfs_query
 		}
 		apfs_node_query_first(*query);
 
-		err = apfs_child_from_query(*query, &child_id);
+		err = apfs_child_from_query(*query, &child_id, &hash);
 		if (err) {
 			apfs_alert(sb, "bad index block: 0x%llx",
 				   (*query)->node->object.block_nr);
@@ -257,6 +657,13 @@ static int apfs_query_set_before_first(struct super_block *sb, struct apfs_query
 		node = apfs_read_node(sb, child_id, storage, false /* write */);
 		if (IS_ERR(node))
 			return PTR_ERR(node);
+		if (hash) {
+			err = apfs_seal_verify_node(node, hash);
+			if (err) {
+				apfs_node_put(node);
+				return err;
+			}
+		}
 
 		*query = apfs_alloc_query(node, *query);
 		apfs_node_put(node);
@@ -278,13 +685,16 @@ static int apfs_query_set_before_first(struct super_block *sb, struct apfs_query
  * @query->index fields to the results of the query. @query->node will now
  * point to the leaf node holding the record.
  *
- * In case of failure returns an appropriate error code.
+ * In case of failure returns an appropriate error code; that will be -EAGAIN
+ * if the query has the APFS_QUERY_NOWAIT flag and needs a node not in memory.
+ * If APFS_QUERY_READAHEAD is also set, a read of that node will be started.
  */
 int apfs_btree_query(struct super_block *sb, struct apfs_query **query)
 {
 	struct apfs_node *node;
 	struct apfs_query *parent;
 	u64 child_id;
+	const u8 *hash;
 	u32 storage = apfs_query_storage(*query);
 	int err;
 
@@ -325,7 +735,7 @@ next_node:
 	if (apfs_node_is_leaf((*query)->node)) /* All done */
 		return 0;
 
-	err = apfs_child_from_query(*query, &child_id);
+	err = apfs_child_from_query(*query, &child_id, &hash);
 	if (err) {
 		apfs_alert(sb, "bad index block: 0x%llx",
 			   (*query)->node->object.block_nr);
@@ -333,12 +743,26 @@ next_node:
 	}
 
 	/* Now go a level deeper and search the child */
-	node = apfs_read_node(sb, child_id, storage, false /* write */);
-	if (IS_ERR(node))
+	if ((*query)->flags & APFS_QUERY_NOWAIT)
+		node = apfs_read_node_nowait(sb, child_id, storage);
+	else
+		node = apfs_read_node(sb, child_id, storage, false /* write */);
+	if (IS_ERR(node)) {
+		if (PTR_ERR(node) == -EAGAIN &&
+		    (*query)->flags & APFS_QUERY_READAHEAD)
+			apfs_node_readahead(sb, child_id, storage);
 		return PTR_ERR(node);
+	}
 
 	if (node->object.oid != child_id)
 		apfs_debug(sb, "corrupt b-tree");
+	if (hash) {
+		err = apfs_seal_verify_node(node, hash);
+		if (err) {
+			apfs_node_put(node);
+			return err;
+		}
+	}
 
 	/*
 	 * Remember the parent node and index in case the search needs
@@ -370,6 +794,74 @@ struct apfs_node *apfs_omap_read_node(struct super_block *sb, u64 id)
 	return result;
 }
 
+/**
+ * apfs_query_vol_root - Check if a query is for the root of a volume tree
+ * @query: the query to check
+ *
+ * Returns a pointer to the field of the superblock info that holds the root
+ * if @query is for the catalog or object map root of the volume; otherwise
+ * returns NULL.
+ */
+static struct apfs_node **apfs_query_vol_root(struct apfs_query *query)
+{
+	struct apfs_node *node = query->node;
+	struct apfs_sb_info *sbi = APFS_SB(node->object.sb);
+	struct apfs_node *old_root = &sbi->s_transaction.t_old_omap_root;
+	u64 bno = node->object.block_nr;
+
+	if (query->parent || !apfs_node_is_root(node))
+		return NULL;
+
+	switch (query->flags & APFS_QUERY_TREE_MASK) {
+	case APFS_QUERY_CAT:
+		return sbi->s_cat_root ? &sbi->s_cat_root : NULL;
+	case APFS_QUERY_OMAP:
+		/* Don't confuse the container's object map with the volume's */
+		if (!sbi->s_omap_root)
+			return NULL;
+		if (bno == sbi->s_omap_root->object.block_nr)
+			return &sbi->s_omap_root;
+		if (old_root->object.bh && bno == old_root->object.block_nr)
+			return &sbi->s_omap_root;
+		return NULL;
+	default:
+		/* The callers are expected to copy the roots of other trees */
+		return NULL;
+	}
+}
+
+/**
+ * apfs_query_join_root - Add the root of a volume tree to the transaction
+ * @query: any query for the tree
+ *
+ * The root of the catalog and of the object map get copied lazily, the first
+ * time a query needs to modify them.  After this, the root query for @query
+ * will point to the new root node.  Returns 0 on success, or a negative error
+ * code in case of failure.
+ */
+static int apfs_query_join_root(struct apfs_query *query)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_node **root;
+	int err;
+
+	while (query->parent)
+		query = query->parent;
+	root = apfs_query_vol_root(query);
+	if (!root)
+		return 0;
+
+	err = apfs_transaction_join_root(sb, root == &APFS_SB(sb)->s_cat_root);
+	if (err)
+		return err;
+	if (query->node != *root) {
+		apfs_node_put(query->node);
+		query->node = *root;
+		apfs_node_get(query->node);
+	}
+	return 0;
+}
+
 /**
  * apfs_query_join_transaction - Add the found node to the current transaction
  * @query: query that found the node
@@ -386,6 +878,10 @@ int apfs_query_join_transaction(struct apfs_query *query)
 	/* Ephemeral objects are always checkpoint data */
 	ASSERT(storage != APFS_OBJ_EPHEMERAL);
 
+	/* The superblock must report the new location of a volume tree root */
+	if (apfs_query_vol_root(query))
+		return apfs_query_join_root(query);
+
 	node = apfs_read_node(sb, oid, storage, true /* write */);
 	if (IS_ERR(node))
 		return PTR_ERR(node);
@@ -573,6 +1069,12 @@ int apfs_btree_insert(struct apfs_query *query, void *key, int key_len,
 	struct apfs_btree_node_phys *node_raw;
 	int err;
 
+	/* The info footer of the root may be modified */
+	err = apfs_query_join_root(query);
+	if (err)
+		return err;
+	node = query->node;
+
 	/* Do this first, or node splits may cause @query->parent to be gone */
 	if (apfs_node_is_leaf(node))
 		apfs_btree_change_rec_count(query, 1 /* change */,
@@ -627,6 +1129,12 @@ int apfs_btree_remove(struct apfs_query *query)
 	int later_entries = node->records - query->index - 1;
 	int err;
 
+	/* The info footer of the root may be modified */
+	err = apfs_query_join_root(query);
+	if (err)
+		return err;
+	node = query->node;
+
 	/* Do this first, or node splits may cause @query->parent to be gone */
 	if (apfs_node_is_leaf(node))
 		apfs_btree_change_rec_count(query, -1 /* change */,
@@ -722,15 +1230,20 @@ int apfs_btree_replace(struct apfs_query *query, void *key, int key_len,
 	ASSERT(key || val);
 
 	/* Do this first, or node splits may cause @query->parent to be gone */
-	if (apfs_node_is_leaf(node)) {
-		if (apfs_query_is_orphan(query)) {
-			err = apfs_query_refresh(query);
-			if (err)
-				return err;
-		}
+	if (apfs_node_is_leaf(node) && apfs_query_is_orphan(query)) {
+		err = apfs_query_refresh(query);
+		if (err)
+			return err;
+	}
+
+	/* The info footer of the root may be modified */
+	err = apfs_query_join_root(query);
+	if (err)
+		return err;
+	node = query->node;
+	if (apfs_node_is_leaf(node))
 		apfs_btree_change_rec_count(query, 0 /* change */,
 					    key_len, val_len);
-	}
 
 	err = apfs_query_join_transaction(query);
 	if (err)
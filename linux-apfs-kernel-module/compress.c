@@ -9,35 +9,11 @@
 
 #include "apfs.h"
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
-
-#include <linux/vmalloc.h>
-
-static inline void *kvmalloc(size_t size, gfp_t flags)
-{
-	gfp_t kmalloc_flags = flags;
-	void *ret;
-
-	if ((flags & GFP_KERNEL) != GFP_KERNEL)
-		return kmalloc(size, flags);
-
-	if (size > PAGE_SIZE)
-		kmalloc_flags |= __GFP_NOWARN | __GFP_NORETRY;
-
-	ret = kmalloc(size, flags);
-	if (ret || size < PAGE_SIZE)
-		return ret;
-
-	return vmalloc(size);
-}
-
-#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0) */
-
 /* maximum size of compressed data currently supported */
 #define MAX_FBUF_SIZE		(128 * 1024 * 1024)
 
 struct apfs_compress_file_data {
-	struct apfs_compress_hdr hdr;
+	const struct apfs_compress_info *ci;
 	loff_t size;
 	void *data;
 	u8 *buf;
@@ -53,6 +29,7 @@ static inline int apfs_compress_is_rsrc(u32 algo)
 
 static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 {
+	struct apfs_compress_info *ci = &APFS_I(inode)->i_cmpf;
 	struct apfs_compress_file_data *fd;
 	ssize_t res;
 	u8 *tmp = NULL, *cdata;
@@ -65,12 +42,9 @@ static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 	if(!fd)
 		return -ENOMEM;
 	mutex_init(&fd->mtx);
+	fd->ci = ci;
 
-	res = ____apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, &fd->hdr, sizeof(fd->hdr), 0);
-	if(res != sizeof(fd->hdr))
-		goto fail;
-
-	if(apfs_compress_is_rsrc(le32_to_cpu(fd->hdr.algo))) {
+	if(!ci->ci_inline) {
 		fd->buf = kvmalloc(APFS_COMPRESS_BLOCK, GFP_KERNEL);
 		if(!fd->buf)
 			goto fail_enomem;
@@ -92,31 +66,32 @@ static int apfs_compress_file_open(struct inode *inode, struct file *filp)
 		if(res != fd->size)
 			goto fail;
 	} else {
-		if(le64_to_cpu(fd->hdr.size) > MAX_FBUF_SIZE)
+		if(ci->ci_size > MAX_FBUF_SIZE)
 			goto fail_enomem;
 
-		fd->size = le64_to_cpu(fd->hdr.size);
-		fd->data = kvmalloc(le64_to_cpu(fd->hdr.size), GFP_KERNEL);
+		fd->size = ci->ci_size;
+		fd->data = kvmalloc(ci->ci_size, GFP_KERNEL);
 		if(!fd->data)
 			goto fail_enomem;
 
-		res = ____apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, NULL, 0, 0);
-		if(res < sizeof(fd->hdr) + 1)
+		/* The length of the xattr was found when the inode was read */
+		res = ci->ci_xattr_len;
+		if(res < sizeof(struct apfs_compress_hdr) + 1)
 			goto fail;
-		csize = res - sizeof(fd->hdr);
+		csize = res - sizeof(struct apfs_compress_hdr);
 		if(res > MAX_FBUF_SIZE)
 			goto fail_enomem;
 
 		tmp = kvmalloc(res, GFP_KERNEL);
 		if(!tmp)
 			goto fail_enomem;
-		cdata = tmp + sizeof(fd->hdr);
+		cdata = tmp + sizeof(struct apfs_compress_hdr);
 
-		res = ____apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, tmp, csize + sizeof(fd->hdr), 1);
-		if(res != csize + sizeof(fd->hdr))
+		res = ____apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, tmp, csize + sizeof(struct apfs_compress_hdr), 1);
+		if(res != csize + sizeof(struct apfs_compress_hdr))
 			goto fail;
 
-		switch(le32_to_cpu(fd->hdr.algo)) {
+		switch(ci->ci_algo) {
 		case APFS_COMPRESS_ZLIB_ATTR:
 			if(cdata[0] == 0x78 && csize >= 2) {
 				res = zlib_inflate_blob(fd->data, fd->size, cdata + 2, csize - 2);
@@ -167,10 +142,10 @@ static ssize_t apfs_compress_file_read_block(struct apfs_compress_file_data *fd,
 	size_t csize, bsize;
 	ssize_t res;
 
-	if(off >= le64_to_cpu(fd->hdr.size))
+	if(off >= fd->ci->ci_size)
 		return 0;
-	if(size > le64_to_cpu(fd->hdr.size) - off)
-		size = le64_to_cpu(fd->hdr.size) - off;
+	if(size > fd->ci->ci_size - off)
+		size = fd->ci->ci_size - off;
 
 	block = off / APFS_COMPRESS_BLOCK;
 	off -= block * APFS_COMPRESS_BLOCK;
@@ -187,7 +162,7 @@ static ssize_t apfs_compress_file_read_block(struct apfs_compress_file_data *fd,
 		if(block >= le32_to_cpu(cd->num))
 			return 0;
 
-		bsize = le64_to_cpu(fd->hdr.size) - block * APFS_COMPRESS_BLOCK;
+		bsize = fd->ci->ci_size - block * APFS_COMPRESS_BLOCK;
 		if(bsize > APFS_COMPRESS_BLOCK)
 			bsize = APFS_COMPRESS_BLOCK;
 
@@ -197,7 +172,7 @@ static ssize_t apfs_compress_file_read_block(struct apfs_compress_file_data *fd,
 			return -EINVAL;
 		cdata = fd->data + doffs + coffs;
 
-		switch(le32_to_cpu(fd->hdr.algo)) {
+		switch(fd->ci->ci_algo) {
 		case APFS_COMPRESS_ZLIB_RSRC:
 			if(cdata[0] == 0x78 && csize >= 2) {
 				res = zlib_inflate_blob(tmp, bsize, cdata + 2, csize - 2);
@@ -233,7 +208,7 @@ static ssize_t apfs_compress_file_read(struct file *filp, char __user *buf, size
 	loff_t step;
 	ssize_t block, res;
 
-	if(apfs_compress_is_rsrc(le32_to_cpu(fd->hdr.algo))) {
+	if(!fd->ci->ci_inline) {
 		step = 0;
 		while(step < size) {
 			block = APFS_COMPRESS_BLOCK - ((*off + step) & (APFS_COMPRESS_BLOCK - 1));
@@ -283,12 +258,23 @@ const struct file_operations apfs_compress_file_operations = {
 	.release	= apfs_compress_file_release,
 };
 
-int apfs_compress_get_size(struct inode *inode, loff_t *size)
+/**
+ * apfs_compress_load - Read the decmpfs header for a compressed inode
+ * @inode:	the inode, still being set up
+ *
+ * Parses the header into APFS_I(@inode)->i_cmpf so that the rest of the driver
+ * never needs to look it up again.  Returns 0 on success, 1 if the compression
+ * format is not supported, or a negative error code in case of failure.
+ */
+int apfs_compress_load(struct inode *inode)
 {
+	struct apfs_compress_info *ci = &APFS_I(inode)->i_cmpf;
 	struct apfs_compress_hdr hdr;
-	int res = ____apfs_xattr_get(inode, APFS_XATTR_NAME_COMPRESSED, &hdr, sizeof(hdr), 0);
+	int res, len;
 	u32 algo;
 
+	ci->ci_algo = 0;
+	res = apfs_xattr_get_head(inode, APFS_XATTR_NAME_COMPRESSED, &hdr, sizeof(hdr), &len);
 	if(res < 0)
 		return res;
 	if(res != sizeof(hdr))
@@ -299,6 +285,9 @@ int apfs_compress_get_size(struct inode *inode, loff_t *size)
 	   algo != APFS_COMPRESS_ZLIB_ATTR)
 		return 1;
 
-	*size = le64_to_cpu(hdr.size);
+	ci->ci_algo = algo;
+	ci->ci_inline = !apfs_compress_is_rsrc(algo);
+	ci->ci_size = le64_to_cpu(hdr.size);
+	ci->ci_xattr_len = len;
 	return 0;
 }
@@ -0,0 +1,897 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <crypto/hash.h>
+#include <crypto/skcipher.h>
+#include <keys/user-type.h>
+#include <linux/buffer_head.h>
+#include <linux/hashtable.h>
+#include <linux/key.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include "apfs.h"
+
+#define APFS_CRYPT_SECTOR_SIZE	512	/* Size of each aes-xts data unit */
+#define APFS_CRYPT_CACHE_BITS	10
+#define APFS_CRYPT_CACHE_MAX	4096	/* Decrypted nodes kept in memory */
+
+#define APFS_VEK_SIZE		32	/* The volume key is for aes-xts-128 */
+#define APFS_KEK_SIZE		32
+#define APFS_WRAPPED_KEY_SIZE	40	/* Wrapped 32-byte keys */
+#define APFS_KW_IV		0xa6a6a6a6a6a6a6a6ULL
+
+/* DER tags for the key blobs in the keybag entries */
+#define APFS_DER_SEQUENCE	0x30
+#define APFS_DER_KEYBLOB	0xa3
+#define APFS_DER_WRAPPED	0x83
+#define APFS_DER_ITERATIONS	0x84
+#define APFS_DER_SALT		0x85
+
+/*
+ * Decrypted copy of a metadata block
+ */
+struct apfs_crypt_node {
+	struct hlist_node cn_hash;	/* Hash table entry */
+	struct list_head cn_lru;	/* Position in the lru list */
+	struct buffer_head *cn_bh;	/* Private buffer with the plaintext */
+};
+
+/*
+ * Software encryption state for a volume
+ */
+struct apfs_crypt {
+	struct crypto_skcipher *c_tfm;	/* aes-xts, with the volume key */
+
+	spinlock_t c_lock;		/* Protects the fields below */
+	DECLARE_HASHTABLE(c_table, APFS_CRYPT_CACHE_BITS);
+	struct list_head c_lru;		/* Cached nodes, least recent first */
+	unsigned int c_count;		/* Number of cached nodes */
+};
+
+/*
+ * Unwrapping parameters, from the key blob of a keybag entry
+ */
+struct apfs_key_blob {
+	const u8 *wrapped;	/* The wrapped key */
+	u32 wrapped_len;
+	const u8 *salt;		/* Salt for the passphrase, only for kek blobs */
+	u32 salt_len;
+	u32 iterations;		/* PBKDF2 iterations, only for kek blobs */
+};
+
+/**
+ * apfs_xts_decrypt - Decrypt a block with aes-xts, one sector at a time
+ * @tfm:	the cipher, with the key already set
+ * @src:	the ciphertext
+ * @page:	first page for the plaintext
+ * @offset:	offset of the plaintext in @page, may be past its end
+ * @len:	length to decrypt, a multiple of the sector size
+ * @sector:	tweak for the first sector
+ * @gfp:	allocation flags for the request
+ *
+ * The destination must be physically contiguous.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_xts_decrypt(struct crypto_skcipher *tfm, const void *src,
+			    struct page *page, unsigned int offset,
+			    unsigned int len, u64 sector, gfp_t gfp)
+{
+	struct skcipher_request *req;
+	struct scatterlist sg_src, sg_dst;
+	__le64 iv[2];
+	unsigned int off, dst;
+	int err = 0;
+
+	req = skcipher_request_alloc(tfm, gfp);
+	if (!req)
+		return -ENOMEM;
+	skcipher_request_set_callback(req, 0, NULL, NULL);
+
+	for (off = 0; off < len; off += APFS_CRYPT_SECTOR_SIZE) {
+		iv[0] = cpu_to_le64(sector++);
+		iv[1] = 0;
+		dst = offset + off;
+
+		sg_init_one(&sg_src, src + off, APFS_CRYPT_SECTOR_SIZE);
+		sg_init_table(&sg_dst, 1);
+		sg_set_page(&sg_dst, page + (dst >> PAGE_SHIFT),
+			    APFS_CRYPT_SECTOR_SIZE, dst & ~PAGE_MASK);
+		skcipher_request_set_crypt(req, &sg_src, &sg_dst,
+					   APFS_CRYPT_SECTOR_SIZE, iv);
+		err = crypto_skcipher_decrypt(req);
+		if (err)
+			break;
+	}
+
+	skcipher_request_free(req);
+	return err;
+}
+
+/**
+ * apfs_read_keybag - Read and decrypt a keybag
+ * @sb:		filesystem superblock
+ * @range:	location of the keybag
+ * @uuid:	uuid that serves as the key for the keybag
+ * @type:	expected object type
+ *
+ * Returns the keybag in a buffer that the caller must free, or an error
+ * pointer in case of failure.
+ */
+static struct apfs_media_keybag *apfs_read_keybag(struct super_block *sb,
+						  struct apfs_prange *range,
+						  const char *uuid, u32 type)
+{
+	struct crypto_skcipher *tfm;
+	struct apfs_media_keybag *kb = NULL;
+	struct buffer_head *bh = NULL;
+	u64 bno = le64_to_cpu(range->pr_start_paddr);
+	u8 key[2 * UUID_SIZE];
+	u32 nbytes;
+	int err;
+
+	/* Keybags are never larger than a block, as far as I know */
+	if (le64_to_cpu(range->pr_block_count) != 1) {
+		apfs_warn(sb, "unsupported keybag size");
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	tfm = crypto_alloc_skcipher("xts(aes)", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm))
+		return ERR_CAST(tfm);
+	memcpy(key, uuid, UUID_SIZE);
+	memcpy(key + UUID_SIZE, uuid, UUID_SIZE);
+	err = crypto_skcipher_setkey(tfm, key, sizeof(key));
+	if (err)
+		goto out;
+
+	kb = kmalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!kb) {
+		err = -ENOMEM;
+		goto out;
+	}
+	bh = apfs_sb_bread(sb, bno);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	err = apfs_xts_decrypt(tfm, bh->b_data, virt_to_page(kb),
+			       offset_in_page(kb), sb->s_blocksize,
+			       bno << (sb->s_blocksize_bits - 9), GFP_KERNEL);
+	if (err)
+		goto out;
+
+	if (!apfs_obj_verify_csum(sb, &kb->mk_obj) ||
+	    (le32_to_cpu(kb->mk_obj.o_type) & APFS_OBJECT_TYPE_MASK) != type) {
+		apfs_err(sb, "bad keybag in block 0x%llx", bno);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	if (le16_to_cpu(kb->mk_locker.kl_version) != APFS_KEYBAG_VERSION) {
+		apfs_warn(sb, "unsupported keybag version");
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+	nbytes = le32_to_cpu(kb->mk_locker.kl_nbytes);
+	if (nbytes > sb->s_blocksize - sizeof(*kb)) {
+		apfs_err(sb, "bad keybag in block 0x%llx", bno);
+		err = -EFSCORRUPTED;
+	}
+
+out:
+	brelse(bh);
+	memzero_explicit(key, sizeof(key));
+	crypto_free_skcipher(tfm);
+	if (err) {
+		kfree(kb);
+		return ERR_PTR(err);
+	}
+	return kb;
+}
+
+/**
+ * apfs_keybag_next - Find the next entry of a keybag with the given tag
+ * @kb:		the keybag
+ * @pos:	offset to start the search, updated on return
+ * @uuid:	uuid for the entry, or NULL to accept any
+ * @tag:	tag for the entry
+ *
+ * Returns the entry, or NULL if there are no more.
+ */
+static struct apfs_keybag_entry *apfs_keybag_next(struct apfs_media_keybag *kb,
+						  u32 *pos, const char *uuid,
+						  u16 tag)
+{
+	struct apfs_kb_locker *locker = &kb->mk_locker;
+	u32 nbytes = le32_to_cpu(locker->kl_nbytes);
+	struct apfs_keybag_entry *entry;
+	u32 len;
+
+	while (*pos + sizeof(*entry) <= nbytes) {
+		entry = (void *)locker->kl_entries + *pos;
+		len = sizeof(*entry) + le16_to_cpu(entry->ke_keylen);
+		if (*pos + len > nbytes)
+			return NULL;
+		/* Entries are 16-byte aligned */
+		*pos += round_up(len, 16);
+
+		if (le16_to_cpu(entry->ke_tag) != tag)
+			continue;
+		if (uuid && memcmp(entry->ke_uuid, uuid, UUID_SIZE))
+			continue;
+		return entry;
+	}
+	return NULL;
+}
+
+/**
+ * apfs_der_find - Find an element in a DER encoded sequence
+ * @buf:	contents of the sequence
+ * @len:	length of @buf
+ * @tag:	tag of the wanted element
+ * @vlen:	on return, length of the element
+ *
+ * Only single-byte tags are supported, which is all the key blobs need.
+ * Returns a pointer to the contents of the element, or NULL if not found.
+ */
+static const u8 *apfs_der_find(const u8 *buf, u32 len, u8 tag, u32 *vlen)
+{
+	while (len >= 2) {
+		u32 hdr = 2, l = buf[1];
+		int i, n;
+
+		if (l & 0x80) {
+			n = l & 0x7f;
+			if (n == 0 || n > 2 || len < 2 + n)
+				return NULL;
+			for (l = 0, i = 0; i < n; ++i)
+				l = (l << 8) | buf[2 + i];
+			hdr += n;
+		}
+		if (l > len - hdr)
+			return NULL;
+
+		if (buf[0] == tag) {
+			*vlen = l;
+			return buf + hdr;
+		}
+		buf += hdr + l;
+		len -= hdr + l;
+	}
+	return NULL;
+}
+
+/**
+ * apfs_parse_key_blob - Parse the key blob from a keybag entry
+ * @data:	contents of the entry
+ * @len:	length of @data
+ * @kek:	is this a blob for a key encryption key?
+ * @blob:	on return, the unwrapping parameters
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_parse_key_blob(const u8 *data, u32 len, bool kek,
+			       struct apfs_key_blob *blob)
+{
+	const u8 *seq, *val;
+	u32 seq_len, vlen;
+
+	seq = apfs_der_find(data, len, APFS_DER_SEQUENCE, &seq_len);
+	if (!seq)
+		return -EFSCORRUPTED;
+	seq = apfs_der_find(seq, seq_len, APFS_DER_KEYBLOB, &seq_len);
+	if (!seq)
+		return -EFSCORRUPTED;
+	blob->wrapped = apfs_der_find(seq, seq_len, APFS_DER_WRAPPED,
+				      &blob->wrapped_len);
+	if (!blob->wrapped)
+		return -EFSCORRUPTED;
+	if (!kek)
+		return 0;
+
+	blob->salt = apfs_der_find(seq, seq_len, APFS_DER_SALT, &blob->salt_len);
+	val = apfs_der_find(seq, seq_len, APFS_DER_ITERATIONS, &vlen);
+	if (!blob->salt || !val)
+		return -EFSCORRUPTED;
+	/* Leading zeroes keep the integer positive */
+	while (vlen > 0 && *val == 0) {
+		++val;
+		--vlen;
+	}
+	if (vlen == 0 || vlen > sizeof(blob->iterations))
+		return -EFSCORRUPTED;
+	for (blob->iterations = 0; vlen > 0; --vlen)
+		blob->iterations = (blob->iterations << 8) | *val++;
+	return 0;
+}
+
+/**
+ * apfs_pbkdf2 - Derive a key from a passphrase with PBKDF2-HMAC-SHA256
+ * @pw:		the passphrase
+ * @pwlen:	length of @pw
+ * @salt:	the salt
+ * @saltlen:	length of @salt
+ * @iterations:	number of iterations
+ * @out:	on return, the derived key (APFS_KEK_SIZE bytes)
+ *
+ * Only a single block of output is ever needed.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_pbkdf2(const char *pw, unsigned int pwlen, const u8 *salt,
+		       unsigned int saltlen, u32 iterations, u8 *out)
+{
+	struct crypto_shash *tfm;
+	u8 u[APFS_KEK_SIZE];
+	__be32 one = cpu_to_be32(1);
+	u32 i;
+	int j, err;
+
+	tfm = crypto_alloc_shash("hmac(sha256)", 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+	err = crypto_shash_setkey(tfm, pw, pwlen);
+	if (err)
+		goto out;
+
+	{
+		SHASH_DESC_ON_STACK(desc, tfm);
+
+		desc->tfm = tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0) /* Flags were removed in 5.1 */
+		desc->flags = 0;
+#endif
+		err = crypto_shash_init(desc);
+		if (!err)
+			err = crypto_shash_update(desc, salt, saltlen);
+		if (!err)
+			err = crypto_shash_finup(desc, (u8 *)&one, sizeof(one), u);
+		memcpy(out, u, sizeof(u));
+
+		for (i = 1; !err && i < iterations; ++i) {
+			err = crypto_shash_digest(desc, u, sizeof(u), u);
+			for (j = 0; j < sizeof(u); ++j)
+				out[j] ^= u[j];
+			if (!(i & 0xfff))
+				cond_resched();
+		}
+		shash_desc_zero(desc);
+	}
+	memzero_explicit(u, sizeof(u));
+	if (err)
+		memzero_explicit(out, APFS_KEK_SIZE);
+
+out:
+	crypto_free_shash(tfm);
+	return err;
+}
+
+/**
+ * apfs_aes_unwrap - Unwrap a key with the aes key wrap algorithm (RFC 3394)
+ * @kek:	the key encryption key
+ * @keklen:	length of @kek
+ * @wrapped:	the wrapped key
+ * @len:	length of @wrapped, must be APFS_WRAPPED_KEY_SIZE
+ * @out:	on return, the unwrapped key
+ *
+ * Returns 0 on success, -EKEYREJECTED if the integrity check fails, which
+ * usually means that the kek was wrong, or another negative error code in
+ * case of failure.
+ */
+static int apfs_aes_unwrap(const u8 *kek, unsigned int keklen,
+			   const u8 *wrapped, unsigned int len, u8 *out)
+{
+	struct crypto_skcipher *tfm;
+	struct skcipher_request *req = NULL;
+	struct scatterlist sg;
+	__be64 *buf = NULL; /* The integrity register and a single block */
+	__be64 a;
+	unsigned int n = len / 8 - 1;
+	int i, j, err;
+
+	if (len != APFS_WRAPPED_KEY_SIZE)
+		return -EINVAL;
+
+	tfm = crypto_alloc_skcipher("ecb(aes)", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+	err = crypto_skcipher_setkey(tfm, kek, keklen);
+	if (err)
+		goto out;
+
+	req = skcipher_request_alloc(tfm, GFP_KERNEL);
+	buf = kmalloc(2 * sizeof(*buf), GFP_KERNEL);
+	if (!req || !buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	skcipher_request_set_callback(req, 0, NULL, NULL);
+	sg_init_one(&sg, buf, 2 * sizeof(*buf));
+	skcipher_request_set_crypt(req, &sg, &sg, 2 * sizeof(*buf), NULL);
+
+	memcpy(&a, wrapped, sizeof(a));
+	memcpy(out, wrapped + 8, len - 8);
+	for (j = 5; j >= 0; --j) {
+		for (i = n; i >= 1; --i) {
+			buf[0] = a ^ cpu_to_be64((u64)n * j + i);
+			memcpy(&buf[1], out + 8 * (i - 1), 8);
+			err = crypto_skcipher_decrypt(req);
+			if (err)
+				goto out;
+			a = buf[0];
+			memcpy(out + 8 * (i - 1), &buf[1], 8);
+		}
+	}
+	if (a != cpu_to_be64(APFS_KW_IV))
+		err = -EKEYREJECTED;
+
+out:
+	if (buf) {
+		memzero_explicit(buf, 2 * sizeof(*buf));
+		kfree(buf);
+	}
+	skcipher_request_free(req);
+	crypto_free_skcipher(tfm);
+	if (err)
+		memzero_explicit(out, len - 8);
+	return err;
+}
+
+/**
+ * apfs_crypt_get_passphrase - Get the passphrase for a volume from the keyring
+ * @sb:		filesystem superblock
+ * @pw:		on return, a copy of the passphrase that the caller must free
+ * @pwlen:	on return, length of @pw
+ *
+ * The passphrase must be added by the user before the mount, as a logon key
+ * with the description "apfs:<volume uuid>".  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_crypt_get_passphrase(struct super_block *sb, char **pw,
+				     unsigned int *pwlen)
+{
+	const struct user_key_payload *payload;
+	struct key *key;
+	char desc[64];
+	int err = 0;
+
+	snprintf(desc, sizeof(desc), "apfs:%pUb",
+		 APFS_SB(sb)->s_vsb_raw->apfs_vol_uuid);
+	key = request_key(&key_type_logon, desc, NULL);
+	if (IS_ERR(key)) {
+		apfs_warn(sb, "no passphrase for encrypted volume (%s)", desc);
+		return PTR_ERR(key);
+	}
+
+	down_read(&key->sem);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+	payload = user_key_payload(key);
+#else
+	payload = user_key_payload_locked(key);
+#endif
+	if (!payload) {
+		/* The key was revoked */
+		err = -EKEYREVOKED;
+		goto out;
+	}
+	*pw = kmemdup(payload->data, payload->datalen, GFP_KERNEL);
+	if (!*pw) {
+		err = -ENOMEM;
+		goto out;
+	}
+	*pwlen = payload->datalen;
+out:
+	up_read(&key->sem);
+	key_put(key);
+	return err;
+}
+
+/**
+ * apfs_crypt_unlock - Get the volume encryption key
+ * @sb:		filesystem superblock
+ * @vek:	on return, the volume key (APFS_VEK_SIZE bytes)
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_crypt_unlock(struct super_block *sb, u8 *vek)
+{
+	struct apfs_nx_superblock *msb_raw = APFS_NXI(sb)->nx_raw;
+	const char *uuid = APFS_SB(sb)->s_vsb_raw->apfs_vol_uuid;
+	struct apfs_media_keybag *nx_kb, *vol_kb = NULL;
+	struct apfs_keybag_entry *entry;
+	struct apfs_key_blob vek_blob, kek_blob;
+	struct apfs_prange range;
+	char *pw = NULL;
+	unsigned int pwlen = 0;
+	u8 pwkey[APFS_KEK_SIZE], kek[APFS_KEK_SIZE];
+	u32 pos;
+	int err;
+
+	nx_kb = apfs_read_keybag(sb, &msb_raw->nx_keylocker, msb_raw->nx_uuid,
+				 APFS_OBJECT_TYPE_CONTAINER_KEYBAG);
+	if (IS_ERR(nx_kb)) {
+		apfs_err(sb, "unable to read the container keybag");
+		return PTR_ERR(nx_kb);
+	}
+
+	pos = 0;
+	entry = apfs_keybag_next(nx_kb, &pos, uuid, APFS_KB_TAG_VOLUME_KEY);
+	if (!entry) {
+		apfs_err(sb, "no wrapped key for the volume");
+		err = -ENOKEY;
+		goto out;
+	}
+	err = apfs_parse_key_blob(entry->ke_keydata,
+				  le16_to_cpu(entry->ke_keylen), false, &vek_blob);
+	if (err) {
+		apfs_err(sb, "bad key blob for the volume");
+		goto out;
+	}
+	if (vek_blob.wrapped_len != APFS_WRAPPED_KEY_SIZE) {
+		apfs_warn(sb, "unsupported volume key size");
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	pos = 0;
+	entry = apfs_keybag_next(nx_kb, &pos, uuid,
+				 APFS_KB_TAG_VOLUME_UNLOCK_RECORDS);
+	if (!entry || le16_to_cpu(entry->ke_keylen) != sizeof(range)) {
+		apfs_err(sb, "no unlock records for the volume");
+		err = -ENOKEY;
+		goto out;
+	}
+	memcpy(&range, entry->ke_keydata, sizeof(range));
+	vol_kb = apfs_read_keybag(sb, &range, uuid,
+				  APFS_OBJECT_TYPE_VOLUME_KEYBAG);
+	if (IS_ERR(vol_kb)) {
+		apfs_err(sb, "unable to read the volume keybag");
+		err = PTR_ERR(vol_kb);
+		vol_kb = NULL;
+		goto out;
+	}
+
+	err = apfs_crypt_get_passphrase(sb, &pw, &pwlen);
+	if (err)
+		goto out;
+
+	/* Each user (and the recovery key) has its own wrapped kek */
+	err = -ENOKEY;
+	pos = 0;
+	while ((entry = apfs_keybag_next(vol_kb, &pos, NULL,
+					 APFS_KB_TAG_VOLUME_UNLOCK_RECORDS))) {
+		if (apfs_parse_key_blob(entry->ke_keydata,
+					le16_to_cpu(entry->ke_keylen), true,
+					&kek_blob))
+			continue;
+		if (kek_blob.wrapped_len != APFS_WRAPPED_KEY_SIZE)
+			continue;
+
+		err = apfs_pbkdf2(pw, pwlen, kek_blob.salt, kek_blob.salt_len,
+				  kek_blob.iterations, pwkey);
+		if (err)
+			break;
+		err = apfs_aes_unwrap(pwkey, sizeof(pwkey), kek_blob.wrapped,
+				      kek_blob.wrapped_len, kek);
+		if (err == -EKEYREJECTED)
+			continue;
+		if (err)
+			break;
+		err = apfs_aes_unwrap(kek, sizeof(kek), vek_blob.wrapped,
+				      vek_blob.wrapped_len, vek);
+		if (err != -EKEYREJECTED)
+			break;
+	}
+	if (err == -EKEYREJECTED)
+		apfs_warn(sb, "wrong passphrase for encrypted volume");
+	else if (err == -ENOKEY)
+		apfs_warn(sb, "no supported unlock records for the volume");
+
+out:
+	memzero_explicit(pwkey, sizeof(pwkey));
+	memzero_explicit(kek, sizeof(kek));
+	if (pw) {
+		memzero_explicit(pw, pwlen);
+		kfree(pw);
+	}
+	kfree(vol_kb);
+	kfree(nx_kb);
+	return err;
+}
+
+/**
+ * apfs_crypt_put_bh - Drop a reference to a private decrypted buffer
+ * @bh: the buffer
+ */
+void apfs_crypt_put_bh(struct buffer_head *bh)
+{
+	if (!atomic_dec_and_test(&bh->b_count))
+		return;
+	kfree(bh->b_data);
+	free_buffer_head(bh);
+}
+
+/**
+ * apfs_crypt_node_alloc - Allocate a cache entry for a decrypted block
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @gfp:	allocation flags
+ *
+ * The buffer is not attached to any page, so the plaintext never lands in
+ * the page cache of the block device.  Returns NULL on failure.
+ */
+static struct apfs_crypt_node *apfs_crypt_node_alloc(struct super_block *sb,
+						     u64 bno, gfp_t gfp)
+{
+	struct apfs_crypt_node *cn;
+	struct buffer_head *bh;
+
+	cn = kmalloc(sizeof(*cn), gfp);
+	if (!cn)
+		return NULL;
+	bh = alloc_buffer_head(gfp);
+	if (!bh)
+		goto fail;
+	bh->b_data = kmalloc(sb->s_blocksize, gfp);
+	if (!bh->b_data) {
+		free_buffer_head(bh);
+		goto fail;
+	}
+
+	bh->b_size = sb->s_blocksize;
+	bh->b_blocknr = bno;
+	bh->b_bdev = APFS_NXI(sb)->nx_bdev;
+	set_buffer_uptodate(bh);
+	set_buffer_decrypted(bh);
+	atomic_set(&bh->b_count, 1);
+	cn->cn_bh = bh;
+	return cn;
+
+fail:
+	kfree(cn);
+	return NULL;
+}
+
+static void apfs_crypt_node_free(struct apfs_crypt_node *cn)
+{
+	apfs_crypt_put_bh(cn->cn_bh);
+	kfree(cn);
+}
+
+/**
+ * apfs_crypt_cache_get - Look up a decrypted block in the cache
+ * @crypt:	encryption state for the volume
+ * @bno:	block number
+ *
+ * Returns the buffer with an extra reference, or NULL if it's not cached.
+ */
+static struct buffer_head *apfs_crypt_cache_get(struct apfs_crypt *crypt,
+						u64 bno)
+{
+	struct apfs_crypt_node *cn;
+	struct buffer_head *bh = NULL;
+
+	spin_lock(&crypt->c_lock);
+	hash_for_each_possible(crypt->c_table, cn, cn_hash, bno) {
+		if (cn->cn_bh->b_blocknr != bno)
+			continue;
+		bh = cn->cn_bh;
+		get_bh(bh);
+		list_move_tail(&cn->cn_lru, &crypt->c_lru);
+		break;
+	}
+	spin_unlock(&crypt->c_lock);
+	return bh;
+}
+
+/**
+ * apfs_crypt_cache_add - Add a decrypted block to the cache
+ * @crypt:	encryption state for the volume
+ * @new:	the new entry, consumed by this function
+ *
+ * Another reader may have decrypted the same block in the meantime; in that
+ * case @new is dropped and the existing buffer is returned instead.  Either
+ * way, the caller gets its own reference to the buffer.
+ */
+static struct buffer_head *apfs_crypt_cache_add(struct apfs_crypt *crypt,
+						struct apfs_crypt_node *new)
+{
+	struct apfs_crypt_node *cn, *victim = NULL;
+	struct buffer_head *bh = new->cn_bh;
+	u64 bno = bh->b_blocknr;
+
+	spin_lock(&crypt->c_lock);
+	hash_for_each_possible(crypt->c_table, cn, cn_hash, bno) {
+		if (cn->cn_bh->b_blocknr != bno)
+			continue;
+		bh = cn->cn_bh;
+		get_bh(bh);
+		spin_unlock(&crypt->c_lock);
+		apfs_crypt_node_free(new);
+		return bh;
+	}
+
+	hash_add(crypt->c_table, &new->cn_hash, bno);
+	list_add_tail(&new->cn_lru, &crypt->c_lru);
+	get_bh(bh);
+	if (++crypt->c_count > APFS_CRYPT_CACHE_MAX) {
+		victim = list_first_entry(&crypt->c_lru, struct apfs_crypt_node,
+					  cn_lru);
+		hash_del(&victim->cn_hash);
+		list_del(&victim->cn_lru);
+		--crypt->c_count;
+	}
+	spin_unlock(&crypt->c_lock);
+
+	/* Nodes still in use keep their own reference to the buffer */
+	if (victim)
+		apfs_crypt_node_free(victim);
+	return bh;
+}
+
+/**
+ * apfs_crypt_read_node_block - Read and decrypt a b-tree node block
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @nowait:	fail with -EAGAIN instead of reading from disk?
+ *
+ * Returns a private buffer with the plaintext, which must be released with
+ * apfs_crypt_put_bh(); or an error pointer in case of failure.
+ */
+struct buffer_head *apfs_crypt_read_node_block(struct super_block *sb,
+					       u64 bno, bool nowait)
+{
+	struct apfs_crypt *crypt = APFS_SB(sb)->s_crypt;
+	struct apfs_crypt_node *cn;
+	struct buffer_head *raw, *bh;
+	gfp_t gfp = nowait ? GFP_NOWAIT : GFP_NOFS;
+	int err;
+
+	bh = apfs_crypt_cache_get(crypt, bno);
+	if (bh)
+		return bh;
+
+	raw = nowait ? apfs_sb_bread_nowait(sb, bno) : apfs_sb_bread(sb, bno);
+	if (!raw)
+		return ERR_PTR(nowait ? -EAGAIN : -EIO);
+
+	cn = apfs_crypt_node_alloc(sb, bno, gfp);
+	if (!cn) {
+		brelse(raw);
+		return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
+	}
+	bh = cn->cn_bh;
+
+	err = apfs_xts_decrypt(crypt->c_tfm, raw->b_data,
+			       virt_to_page(bh->b_data),
+			       offset_in_page(bh->b_data), sb->s_blocksize,
+			       bno << (sb->s_blocksize_bits - 9), gfp);
+	brelse(raw);
+	if (err == -ENOMEM && nowait)
+		err = -EAGAIN;
+	if (!err && !apfs_obj_verify_bh_csum(sb, bh)) {
+		apfs_alert(sb, "bad checksum for encrypted node in block 0x%llx",
+			   bno);
+		err = -EFSBADCRC;
+	}
+	if (err) {
+		apfs_crypt_node_free(cn);
+		return ERR_PTR(err);
+	}
+	return apfs_crypt_cache_add(crypt, cn);
+}
+
+/**
+ * apfs_crypt_read_data - Read and decrypt a block of file data
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @tweak:	tweak for the first sector of the block
+ * @page:	page for the plaintext
+ * @offset:	offset of the block in @page
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_crypt_read_data(struct super_block *sb, u64 bno, u64 tweak,
+			 struct page *page, unsigned int offset)
+{
+	struct apfs_crypt *crypt = APFS_SB(sb)->s_crypt;
+	struct buffer_head *raw;
+	int err;
+
+	raw = apfs_sb_bread(sb, bno);
+	if (!raw)
+		return -EIO;
+	err = apfs_xts_decrypt(crypt->c_tfm, raw->b_data, page, offset,
+			       sb->s_blocksize, tweak, GFP_NOFS);
+	brelse(raw);
+	return err;
+}
+
+/**
+ * apfs_crypt_init - Set up software decryption for a volume, if needed
+ * @sb: filesystem superblock
+ *
+ * Volumes encrypted in software have their catalog flagged as encrypted in
+ * the object map.  The object map itself must already be set up.  Returns 0
+ * on success, or a negative error code in case of failure.
+ */
+int apfs_crypt_init(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_crypt *crypt;
+	u64 root_oid = le64_to_cpu(sbi->s_vsb_raw->apfs_root_tree_oid);
+	u8 vek[APFS_VEK_SIZE];
+	u32 flags;
+	int err;
+
+	/* Only virtual objects can be encrypted */
+	if (apfs_cat_storage(sb) != APFS_OBJ_VIRTUAL)
+		return 0;
+	err = apfs_omap_lookup_flags(sb, root_oid, &flags);
+	if (err) {
+		apfs_err(sb, "omap lookup failed for catalog root 0x%llx",
+			 root_oid);
+		return err;
+	}
+	if (!(flags & APFS_OMAP_VAL_ENCRYPTED))
+		return 0;
+
+	if (!sb_rdonly(sb)) {
+		apfs_warn(sb, "software encrypted volumes must be mounted read-only");
+		return -EINVAL;
+	}
+
+	crypt = kzalloc(sizeof(*crypt), GFP_KERNEL);
+	if (!crypt)
+		return -ENOMEM;
+	spin_lock_init(&crypt->c_lock);
+	hash_init(crypt->c_table);
+	INIT_LIST_HEAD(&crypt->c_lru);
+
+	crypt->c_tfm = crypto_alloc_skcipher("xts(aes)", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(crypt->c_tfm)) {
+		err = PTR_ERR(crypt->c_tfm);
+		apfs_err(sb, "aes-xts is not available (%d)", err);
+		goto fail;
+	}
+
+	err = apfs_crypt_unlock(sb, vek);
+	if (!err)
+		err = crypto_skcipher_setkey(crypt->c_tfm, vek, sizeof(vek));
+	memzero_explicit(vek, sizeof(vek));
+	if (err) {
+		crypto_free_skcipher(crypt->c_tfm);
+		goto fail;
+	}
+
+	sbi->s_crypt = crypt;
+	return 0;
+
+fail:
+	kfree(crypt);
+	return err;
+}
+
+/**
+ * apfs_crypt_free - Tear down software decryption for a volume
+ * @sb: filesystem superblock
+ *
+ * Buffers still referenced by b-tree nodes are freed when the nodes go away.
+ */
+void apfs_crypt_free(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_crypt *crypt = sbi->s_crypt;
+	struct apfs_crypt_node *cn, *tmp;
+
+	if (!crypt)
+		return;
+	list_for_each_entry_safe(cn, tmp, &crypt->c_lru, cn_lru)
+		apfs_crypt_node_free(cn);
+	crypto_free_skcipher(crypt->c_tfm);
+	kfree(crypt);
+	sbi->s_crypt = NULL;
+}
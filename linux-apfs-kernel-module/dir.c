@@ -5,6 +5,8 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/namei.h>
+#include <linux/sort.h>
 #include "apfs.h"
 
 /**
@@ -140,9 +142,10 @@ int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_query *query;
 	struct apfs_drec drec;
+	u64 locked;
 	int err = 0;
 
-	down_read(&nxi->nx_big_sem);
+	locked = apfs_big_down_read(nxi, APFS_LOCK_SITE_LOOKUP);
 	query = apfs_dentry_lookup(dir, child, &drec);
 	if (IS_ERR(query)) {
 		err = PTR_ERR(query);
@@ -151,7 +154,7 @@ int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
 	*ino = drec.ino;
 	apfs_free_query(sb, query);
 out:
-	up_read(&nxi->nx_big_sem);
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_LOOKUP, locked);
 	return err;
 }
 
@@ -164,11 +167,12 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 	struct apfs_key key;
 	struct apfs_query *query;
 	u64 cnid = apfs_ino(inode);
+	u64 locked;
 	loff_t pos;
 	bool hashed = apfs_is_normalization_insensitive(sb);
 	int err = 0;
 
-	down_read(&nxi->nx_big_sem);
+	locked = apfs_big_down_read(nxi, APFS_LOCK_SITE_READDIR);
 
 	/* Inode numbers might overflow here; follow btrfs in ignoring that */
 	if (!dir_emit_dots(file, ctx))
@@ -222,7 +226,294 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 	apfs_free_query(sb, query);
 
 out:
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_READDIR, locked);
+	return err;
+}
+
+/*
+ * Directory record collected by apfs_prefetch_dir()
+ */
+struct apfs_prefetch_ent {
+	struct list_head list;
+	u64 ino;
+	int name_len;
+	char name[];
+};
+
+/*
+ * Directory waiting in the apfs_prefetch_tree() queue
+ */
+struct apfs_prefetch_dir {
+	struct list_head list;
+	struct dentry *dentry;
+};
+
+/**
+ * apfs_prefetch_charge - Charge some memory against the prefetch budget
+ * @pf:		prefetch request
+ * @bytes:	number of bytes to charge
+ *
+ * Returns false if the budget is now exhausted.
+ */
+static bool apfs_prefetch_charge(struct apfs_prefetch *pf, u64 bytes)
+{
+	pf->used += bytes;
+	return pf->used <= pf->budget;
+}
+
+static int apfs_prefetch_cmp(const void *a, const void *b)
+{
+	u64 ino_a = *(const u64 *)a;
+	u64 ino_b = *(const u64 *)b;
+
+	if (ino_a < ino_b)
+		return -1;
+	return ino_a > ino_b;
+}
+
+/**
+ * apfs_prefetch_collect - Collect the records for a directory being prefetched
+ * @sb:		filesystem superblock
+ * @cnid:	inode number for the directory
+ * @pf:		prefetch request
+ * @ents:	list to receive the records
+ * @count:	on return, number of records collected
+ *
+ * Stops early, without error, if the budget runs out.  Returns 0 on success or
+ * a negative error code in case of failure; the caller must free the list in
+ * both cases.  Must be called with nx_big_sem held.
+ */
+static int apfs_prefetch_collect(struct super_block *sb, u64 cnid,
+				 struct apfs_prefetch *pf,
+				 struct list_head *ents, int *count)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_key key;
+	struct apfs_query *query;
+	bool hashed = apfs_is_normalization_insensitive(sb);
+	int err = 0;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_drec_key(sb, cnid, NULL /* name */, &key, hashed);
+	query->key = &key;
+	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+
+	while (1) {
+		struct apfs_prefetch_ent *ent;
+		struct apfs_drec drec;
+		size_t size;
+
+		err = apfs_btree_query(sb, &query);
+		if (err == -ENODATA) { /* Got all the records */
+			err = 0;
+			break;
+		}
+		if (err)
+			break;
+
+		err = apfs_drec_from_query(query, &drec, hashed);
+		if (err) {
+			apfs_alert(sb, "bad dentry record in directory 0x%llx",
+				   cnid);
+			break;
+		}
+
+		size = sizeof(*ent) + drec.name_len;
+		if (!apfs_prefetch_charge(pf, size + sizeof(struct apfs_inode_info)))
+			break;
+		ent = kmalloc(size, GFP_KERNEL);
+		if (!ent) {
+			err = -ENOMEM;
+			break;
+		}
+		ent->ino = drec.ino;
+		ent->name_len = drec.name_len;
+		memcpy(ent->name, drec.name, drec.name_len);
+		list_add_tail(&ent->list, ents);
+		++*count;
+	}
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_prefetch_inodes - Start reading the catalog leaves for a list of inodes
+ * @sb:		filesystem superblock
+ * @cnids:	inode numbers, will be sorted
+ * @count:	number of entries in @cnids
+ * @pf:		prefetch request
+ *
+ * Walks the inode records in key order without blocking, so that the reads
+ * for all the uncached nodes are in flight at the same time.  Must be called
+ * with nx_big_sem held.
+ */
+static void apfs_prefetch_inodes(struct super_block *sb, u64 *cnids, int count,
+				 struct apfs_prefetch *pf)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	u64 last_bno = 0;
+	int last_index = -1;
+	int i;
+
+	sort(cnids, count, sizeof(*cnids), apfs_prefetch_cmp, NULL);
+
+	for (i = 0; i < count; ++i) {
+		struct apfs_key key;
+		struct apfs_query *query;
+		int err;
+
+		if (i && cnids[i] == cnids[i - 1]) /* Hard links */
+			continue;
+
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query)
+			return;
+		apfs_init_inode_key(cnids[i], &key);
+		query->key = &key;
+		query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT |
+			       APFS_QUERY_NOWAIT | APFS_QUERY_READAHEAD;
+
+		err = apfs_btree_query(sb, &query);
+		if (err == -EAGAIN) {
+			/*
+			 * The query stopped at the parent of the missing node,
+			 * so neighbouring inodes will often miss on the same
+			 * child: only charge each read once.
+			 */
+			if (query->node->object.block_nr != last_bno ||
+			    query->index != last_index) {
+				last_bno = query->node->object.block_nr;
+				last_index = query->index;
+				pf->reads++;
+				if (!apfs_prefetch_charge(pf, sb->s_blocksize))
+					count = 0;
+			}
+		}
+		apfs_free_query(sb, query);
+	}
+}
+
+/**
+ * apfs_prefetch_queue - Add a directory to the prefetch queue
+ * @dentry:	dentry for the directory, the queue takes over the reference
+ * @queue:	the queue
+ *
+ * Returns 0 on success, or -ENOMEM in case of failure.
+ */
+static int apfs_prefetch_queue(struct dentry *dentry, struct list_head *queue)
+{
+	struct apfs_prefetch_dir *dir;
+
+	dir = kmalloc(sizeof(*dir), GFP_KERNEL);
+	if (!dir) {
+		dput(dentry);
+		return -ENOMEM;
+	}
+	dir->dentry = dentry;
+	list_add_tail(&dir->list, queue);
+	return 0;
+}
+
+/**
+ * apfs_prefetch_dir - Prefetch the children of a directory
+ * @parent:	dentry for the directory
+ * @pf:		prefetch request
+ * @queue:	queue for the subdirectories found
+ *
+ * Directories that the caller is not allowed to list are skipped, along with
+ * their whole subtree.  Returns 0 on success, or a negative error code in case
+ * of failure.
+ */
+static int apfs_prefetch_dir(struct dentry *parent, struct apfs_prefetch *pf,
+			     struct list_head *queue)
+{
+	struct inode *inode = d_inode(parent);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_prefetch_ent *ent, *tmp;
+	LIST_HEAD(ents);
+	u64 *cnids = NULL;
+	int count = 0;
+	int i, err;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	if (inode_permission(inode, MAY_READ))
+#else
+	if (inode_permission(&init_user_ns, inode, MAY_READ))
+#endif
+		return 0;
+
+	down_read(&nxi->nx_big_sem);
+	err = apfs_prefetch_collect(sb, apfs_ino(inode), pf, &ents, &count);
+	if (!err && count) {
+		/* The readahead is only an optimization, so ignore failures */
+		cnids = kvmalloc_array(count, sizeof(*cnids), GFP_KERNEL);
+		if (cnids) {
+			i = 0;
+			list_for_each_entry(ent, &ents, list)
+				cnids[i++] = ent->ino;
+			apfs_prefetch_inodes(sb, cnids, count, pf);
+		}
+	}
 	up_read(&nxi->nx_big_sem);
+	kvfree(cnids);
+
+	/* The lookups take nx_big_sem themselves */
+	list_for_each_entry_safe(ent, tmp, &ents, list) {
+		struct dentry *child;
+
+		if (!err && fatal_signal_pending(current))
+			err = -EINTR;
+		if (!err) {
+			child = lookup_one_len_unlocked(ent->name, parent,
+							ent->name_len);
+			if (!IS_ERR(child)) {
+				if (d_really_is_positive(child))
+					pf->inodes++;
+				if (d_is_dir(child))
+					err = apfs_prefetch_queue(child, queue);
+				else
+					dput(child);
+			}
+		}
+		list_del(&ent->list);
+		kfree(ent);
+	}
+	return err;
+}
+
+/**
+ * apfs_prefetch_tree - Bring the metadata for a directory tree into memory
+ * @root:	dentry for the root of the tree
+ * @pf:		prefetch request, updated with the results
+ *
+ * Walks the tree breadth first, populating the inode and dentry caches along
+ * with the catalog and omap nodes they depend on.  The walk ends early once
+ * @pf->budget bytes have been charged.  Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+int apfs_prefetch_tree(struct dentry *root, struct apfs_prefetch *pf)
+{
+	struct apfs_prefetch_dir *dir;
+	LIST_HEAD(queue);
+	int err;
+
+	err = apfs_prefetch_queue(dget(root), &queue);
+	if (err)
+		return err;
+
+	while (!list_empty(&queue)) {
+		dir = list_first_entry(&queue, struct apfs_prefetch_dir, list);
+		list_del(&dir->list);
+		/* Once we stop, just drain the queue */
+		if (!err && pf->used <= pf->budget)
+			err = apfs_prefetch_dir(dir->dentry, pf, &queue);
+		dput(dir->dentry);
+		kfree(dir);
+		cond_resched();
+	}
 	return err;
 }
 
@@ -628,7 +919,7 @@ int apfs_mkany(struct inode *dir, struct dentry *dentry, umode_t mode,
 		goto out_abort;
 	}
 
-	err = apfs_create_inode_rec(sb, inode, dentry);
+	err = apfs_create_inode_rec(sb, inode, &dentry->d_name);
 	if (err)
 		goto out_discard_inode;
 
@@ -668,6 +959,50 @@ out_abort:
 	return err;
 }
 
+/**
+ * apfs_create_private_file - Create a hidden regular file inside private-dir
+ * @sb:		filesystem superblock
+ * @qname:	filename
+ *
+ * Must be called inside a transaction. Returns the new inode on success, or an
+ * error pointer in case of failure.
+ */
+struct inode *apfs_create_private_file(struct super_block *sb, struct qstr *qname)
+{
+	struct inode *priv_dir = APFS_SB(sb)->s_private_dir;
+	struct inode *inode;
+	int err;
+
+	inode = apfs_new_inode(priv_dir, S_IFREG | 0600, 0 /* rdev */);
+	if (IS_ERR(inode))
+		return inode;
+
+	err = apfs_create_inode_rec(sb, inode, qname);
+	if (err)
+		goto fail;
+	err = apfs_create_dentry_rec(inode, qname, apfs_ino(priv_dir),
+				     0 /* sibling_id */);
+	if (err)
+		goto fail;
+
+	/* Now update the child count for private-dir */
+	priv_dir->i_mtime = priv_dir->i_ctime = current_time(priv_dir);
+	++APFS_I(priv_dir)->i_nchildren;
+	apfs_inode_join_transaction(sb, priv_dir);
+
+	unlock_new_inode(inode);
+	return inode;
+
+fail:
+	discard_new_inode(inode);
+	return ERR_PTR(err);
+}
+int APFS_CREATE_PRIVATE_FILE_MAXOPS(void)
+{
+	return APFS_CREATE_INODE_REC_MAXOPS() + APFS_CREATE_DENTRY_REC_MAXOPS +
+	       APFS_UPDATE_INODE_MAXOPS();
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
 int apfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	       dev_t rdev)
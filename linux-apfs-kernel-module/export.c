@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/exportfs.h>
+#include <linux/fs.h>
+#include "apfs.h"
+
+/*
+ * File handle types.  Catalog ids are never reused inside a volume, so there
+ * is no need for a generation number.  The values must stay clear of the ones
+ * reserved in enum fid_type.
+ */
+#define APFS_FILEID_INO64		0xa1 /* 64-bit cnid */
+#define APFS_FILEID_INO64_PARENT	0xa2 /* 64-bit cnid and parent cnid */
+
+/*
+ * Layout of the file handle; it's only 32-bit aligned, so the fields must be
+ * copied out before use.
+ */
+struct apfs_fid {
+	u64 ino;
+	u64 parent_ino;
+} __packed;
+
+/* Lengths of the handle types, in 32-bit words */
+#define APFS_FID_LEN		(sizeof(u64) / sizeof(__u32))
+#define APFS_FID_PARENT_LEN	(sizeof(struct apfs_fid) / sizeof(__u32))
+
+/**
+ * apfs_encode_fh - Build a file handle for an inode
+ * @inode:	the inode
+ * @fh:		buffer for the handle
+ * @max_len:	length of @fh in 32-bit words, updated with the length used
+ * @parent:	parent directory to encode in the handle, may be NULL
+ *
+ * Returns the handle type, or FILEID_INVALID if @fh is too small.
+ */
+static int apfs_encode_fh(struct inode *inode, __u32 *fh, int *max_len,
+			  struct inode *parent)
+{
+	struct apfs_fid fid;
+	int len = parent ? APFS_FID_PARENT_LEN : APFS_FID_LEN;
+
+	if (*max_len < len) {
+		*max_len = len;
+		return FILEID_INVALID;
+	}
+
+	fid.ino = apfs_ino(inode);
+	fid.parent_ino = parent ? apfs_ino(parent) : 0;
+	memcpy(fh, &fid, len * sizeof(__u32));
+	*max_len = len;
+	return parent ? APFS_FILEID_INO64_PARENT : APFS_FILEID_INO64;
+}
+
+/**
+ * apfs_export_iget - Get the dentry for the inode referenced by a file handle
+ * @sb:		filesystem superblock
+ * @ino:	inode number from the handle
+ *
+ * Returns the dentry, or an error pointer in case of failure; that will be
+ * -ESTALE if the inode no longer exists.
+ */
+static struct dentry *apfs_export_iget(struct super_block *sb, u64 ino)
+{
+	struct inode *inode;
+
+	/* The private directory and the special files are never exported */
+	if (ino != APFS_ROOT_DIR_INO_NUM && ino < APFS_MIN_USER_INO_NUM)
+		return ERR_PTR(-ESTALE);
+
+	inode = apfs_iget(sb, ino);
+	if (IS_ERR(inode)) {
+		if (PTR_ERR(inode) == -ENODATA)
+			return ERR_PTR(-ESTALE);
+		return ERR_CAST(inode);
+	}
+	if (inode->i_nlink == 0) {
+		iput(inode);
+		return ERR_PTR(-ESTALE);
+	}
+	/* Nor are the files in the private directory, like the fsync log */
+	if (APFS_I(inode)->i_parent_id == APFS_PRIV_DIR_INO_NUM) {
+		iput(inode);
+		return ERR_PTR(-ESTALE);
+	}
+	return d_obtain_alias(inode);
+}
+
+/**
+ * apfs_fh_ino - Read an inode number from a file handle
+ * @fid:	the file handle
+ * @fh_len:	length of @fid in 32-bit words
+ * @fh_type:	type of the file handle
+ * @parent:	read the parent inode number instead?
+ *
+ * Returns the inode number, or 0 if the handle is not valid.
+ */
+static u64 apfs_fh_ino(struct fid *fid, int fh_len, int fh_type, bool parent)
+{
+	struct apfs_fid afid;
+
+	switch (fh_type) {
+	case APFS_FILEID_INO64:
+		if (parent || fh_len < APFS_FID_LEN)
+			return 0;
+		break;
+	case APFS_FILEID_INO64_PARENT:
+		if (fh_len < APFS_FID_PARENT_LEN)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	memcpy(&afid, fid->raw, fh_len < APFS_FID_PARENT_LEN ?
+	       APFS_FID_LEN * sizeof(__u32) : sizeof(afid));
+	return parent ? afid.parent_ino : afid.ino;
+}
+
+static struct dentry *apfs_fh_to_dentry(struct super_block *sb, struct fid *fid,
+					int fh_len, int fh_type)
+{
+	u64 ino = apfs_fh_ino(fid, fh_len, fh_type, false /* parent */);
+
+	if (!ino)
+		return NULL;
+	return apfs_export_iget(sb, ino);
+}
+
+static struct dentry *apfs_fh_to_parent(struct super_block *sb, struct fid *fid,
+					int fh_len, int fh_type)
+{
+	u64 ino = apfs_fh_ino(fid, fh_len, fh_type, true /* parent */);
+
+	if (!ino)
+		return NULL;
+	return apfs_export_iget(sb, ino);
+}
+
+/**
+ * apfs_get_parent - Get the dentry for the parent of a directory
+ * @child:	dentry for the directory
+ *
+ * Directories can't have hard links, so the primary parent recorded in the
+ * inode is the only one.
+ */
+static struct dentry *apfs_get_parent(struct dentry *child)
+{
+	struct inode *inode = d_inode(child);
+
+	return apfs_export_iget(inode->i_sb, APFS_I(inode)->i_parent_id);
+}
+
+const struct export_operations apfs_export_ops = {
+	.encode_fh	= apfs_encode_fh,
+	.fh_to_dentry	= apfs_fh_to_dentry,
+	.fh_to_parent	= apfs_fh_to_parent,
+	.get_parent	= apfs_get_parent,
+};
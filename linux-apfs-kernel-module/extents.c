@@ -52,6 +52,100 @@ int apfs_extent_from_query(struct apfs_query *query,
 	return 0;
 }
 
+/**
+ * apfs_fext_from_query - Read the sealed extent found by a successful query
+ * @query:	the query that found the record
+ * @extent:	Return parameter.  The extent found.
+ *
+ * Same as apfs_extent_from_query(), but for the file extent tree of a sealed
+ * volume.  Returns 0 on success or -EFSCORRUPTED otherwise.
+ */
+static int apfs_fext_from_query(struct apfs_query *query,
+				struct apfs_file_extent *extent)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_fext_tree_val *ext;
+	struct apfs_fext_tree_key *ext_key;
+	char *raw = query->node->object.bh->b_data;
+	u64 ext_len;
+
+	if (query->len != sizeof(*ext) || query->key_len != sizeof(*ext_key))
+		return -EFSCORRUPTED;
+
+	ext = (struct apfs_fext_tree_val *)(raw + query->off);
+	ext_key = (struct apfs_fext_tree_key *)(raw + query->key_off);
+	ext_len = le64_to_cpu(ext->len_and_flags) & APFS_FILE_EXTENT_LEN_MASK;
+
+	/* Extent length must be a multiple of the block size */
+	if (ext_len & (sb->s_blocksize - 1))
+		return -EFSCORRUPTED;
+
+	extent->logical_addr = le64_to_cpu(ext_key->logical_addr);
+	extent->phys_block_num = le64_to_cpu(ext->phys_block_num);
+	extent->len = ext_len;
+	extent->crypto_id = 0;
+	return 0;
+}
+
+/**
+ * apfs_fext_read - Read the sealed extent record that covers a block
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the wanted block
+ * @extent:	Return parameter.  The extent found.
+ *
+ * Sealed volumes keep their file extents in a separate tree, not in the
+ * catalog.  Blocks not covered by any record are reported as a one-block hole.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_fext_read(struct apfs_dstream_info *dstream, sector_t dsblock,
+			  struct apfs_file_extent *extent)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_key key, found;
+	struct apfs_query *query;
+	char *raw;
+	u64 iaddr = dsblock << sb->s_blocksize_bits;
+	int ret;
+
+	apfs_init_fext_key(dstream->ds_id, iaddr, &key);
+
+	query = apfs_alloc_query(sbi->s_fext_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = &key;
+	query->flags = APFS_QUERY_FEXT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA)
+		goto done;
+
+	if (!ret) {
+		ret = apfs_fext_from_query(query, extent);
+		if (ret) {
+			apfs_alert(sb, "bad fext record for dstream 0x%llx", dstream->ds_id);
+			goto done;
+		}
+		raw = query->node->object.bh->b_data;
+		ret = apfs_read_fext_key(raw + query->key_off, query->key_len, &found);
+		if (ret)
+			goto done;
+		if (found.id == dstream->ds_id &&
+		    iaddr < extent->logical_addr + extent->len)
+			goto done;
+	}
+
+	ret = 0;
+	extent->logical_addr = iaddr;
+	extent->phys_block_num = 0;
+	extent->len = sb->s_blocksize;
+	extent->crypto_id = 0;
+
+done:
+	apfs_free_query(sb, query);
+	return ret;
+}
+
 /**
  * apfs_extent_read - Read the extent record that covers a block
  * @dstream:	data stream info
@@ -81,6 +175,17 @@ static int apfs_extent_read(struct apfs_dstream_info *dstream, sector_t dsblock,
 	}
 	spin_unlock(&dstream->ds_ext_lock);
 
+	/* Sealed volumes are read-only, so the cached extent is never dirty */
+	if (sbi->s_fext_root) {
+		ret = apfs_fext_read(dstream, dsblock, extent);
+		if (ret)
+			return ret;
+		spin_lock(&dstream->ds_ext_lock);
+		*cache = *extent;
+		spin_unlock(&dstream->ds_ext_lock);
+		return 0;
+	}
+
 	/* We will search for the extent that covers iblock */
 	apfs_init_file_extent_key(dstream->ds_id, iaddr, &key);
 
@@ -115,6 +220,36 @@ done:
 	return ret;
 }
 
+/**
+ * apfs_dstream_map_tweak - Map a block of a data stream and find its xts tweak
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the wanted block
+ * @bno:	on return, the physical block number, or 0 for a hole
+ * @tweak:	on return, the tweak for the first sector of the block
+ *
+ * On software encrypted volumes, the crypto id of each extent is the tweak for
+ * its first 512-byte sector, and it goes up by one for each sector after that.
+ * The caller must hold the big semaphore.  Returns 0 on success or a negative
+ * error code in case of failure.
+ */
+int apfs_dstream_map_tweak(struct apfs_dstream_info *dstream, sector_t dsblock,
+			   u64 *bno, u64 *tweak)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent ext;
+	u64 blk_off;
+	int ret;
+
+	ret = apfs_extent_read(dstream, dsblock, &ext);
+	if (ret)
+		return ret;
+
+	blk_off = dsblock - (ext.logical_addr >> sb->s_blocksize_bits);
+	*bno = apfs_ext_is_hole(&ext) ? 0 : ext.phys_block_num + blk_off;
+	*tweak = ext.crypto_id + (blk_off << (sb->s_blocksize_bits - 9));
+	return 0;
+}
+
 /* This does the same as apfs_get_block(), but without taking any locks */
 int __apfs_get_block(struct apfs_dstream_info *dstream, sector_t dsblock,
 		     struct buffer_head *bh_result, int create)
@@ -611,68 +746,6 @@ static int apfs_update_extent(struct apfs_dstream_info *dstream, const struct ap
 }
 #define APFS_UPDATE_EXTENTS_MAXOPS	(1 + 2 * APFS_CRYPTO_ADJ_REFCNT_MAXOPS())
 
-/**
- * apfs_insert_phys_extent - Create or grow the physical record for an extent
- * @dstream:	data stream info for the extent
- * @extent:	new in-memory file extent
- *
- * Only works for appending to extents, for now. TODO: reference counting.
- * Returns 0 on success or a negative error code in case of failure.
- */
-static int apfs_insert_phys_extent(struct apfs_dstream_info *dstream, const struct apfs_file_extent *extent)
-{
-	struct super_block *sb = dstream->ds_sb;
-	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
-	struct apfs_node *extref_root;
-	struct apfs_key key;
-	struct apfs_query *query = NULL;
-	struct apfs_phys_ext_key raw_key;
-	struct apfs_phys_ext_val raw_val;
-	u64 kind = (u64)APFS_KIND_NEW << APFS_PEXT_KIND_SHIFT;
-	u64 blkcnt = extent->len >> sb->s_blocksize_bits;
-	int ret;
-
-	extref_root = apfs_read_node(sb,
-				le64_to_cpu(vsb_raw->apfs_extentref_tree_oid),
-				APFS_OBJ_PHYSICAL, true /* write */);
-	if (IS_ERR(extref_root))
-		return PTR_ERR(extref_root);
-	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(extref_root->object.oid);
-
-	query = apfs_alloc_query(extref_root, NULL /* parent */);
-	if (!query) {
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	apfs_init_extent_key(extent->phys_block_num, &key);
-	query->key = &key;
-	/* The query is exact for now because we assume single-block extents */
-	query->flags = APFS_QUERY_EXTENTREF | APFS_QUERY_EXACT;
-
-	ret = apfs_btree_query(sb, &query);
-	if (ret && ret != -ENODATA)
-		goto fail;
-
-	apfs_key_set_hdr(APFS_TYPE_EXTENT, extent->phys_block_num, &raw_key);
-	raw_val.len_and_kind = cpu_to_le64(kind | blkcnt);
-	raw_val.owning_obj_id = cpu_to_le64(dstream->ds_id);
-	raw_val.refcnt = cpu_to_le32(1);
-
-	if (ret)
-		ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key),
-					&raw_val, sizeof(raw_val));
-	else
-		ret = apfs_btree_replace(query, &raw_key, sizeof(raw_key),
-					 &raw_val, sizeof(raw_val));
-
-fail:
-	apfs_free_query(sb, query);
-	apfs_node_put(extref_root);
-	return ret;
-}
-
 /**
  * apfs_phys_ext_from_query - Read the physical extent record found by a query
  * @query:	the (successful) query that found the record
@@ -699,6 +772,7 @@ static int apfs_phys_ext_from_query(struct apfs_query *query, struct apfs_phys_e
 	pext->blkcount = le64_to_cpu(val->len_and_kind) & APFS_PEXT_LEN_MASK;
 	pext->len = pext->blkcount << sb->s_blocksize_bits;
 	pext->refcnt = le32_to_cpu(val->refcnt);
+	pext->kind = (le64_to_cpu(val->len_and_kind) & APFS_PEXT_KIND_MASK) >> APFS_PEXT_KIND_SHIFT;
 	return 0;
 }
 
@@ -711,10 +785,7 @@ static int apfs_phys_ext_from_query(struct apfs_query *query, struct apfs_phys_e
  */
 static int apfs_free_phys_ext(struct super_block *sb, struct apfs_phys_extent *pext)
 {
-	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
-
-	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -pext->blkcount);
+	apfs_vol_alloc_add(sb, -pext->blkcount);
 
 	return apfs_free_queue_insert(sb, pext->bno, pext->blkcount);
 }
@@ -723,18 +794,35 @@ static int apfs_free_phys_ext(struct super_block *sb, struct apfs_phys_extent *p
  * apfs_put_phys_extent - Reduce the reference count for a physical extent
  * @pext:	physical extent data, already read
  * @query:	query that found the extent
+ * @refs:	number of references to drop
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_put_phys_extent(struct apfs_phys_extent *pext, struct apfs_query *query)
+static int apfs_put_phys_extent(struct apfs_phys_extent *pext, struct apfs_query *query, u32 refs)
 {
+	struct super_block *sb = query->node->object.sb;
 	struct apfs_phys_ext_val *val;
 	void *raw;
 	int err;
 
-	if (--pext->refcnt == 0) {
-		struct super_block *sb = query->node->object.sb;
-
+	if (pext->refcnt < refs) {
+		apfs_alert(sb, "bad refcount for physical extent at block 0x%llx", pext->bno);
+		return -EFSCORRUPTED;
+	}
+	pext->refcnt -= refs;
+	if (pext->refcnt == 0 && pext->kind == APFS_KIND_UPDATE) {
+		/* The blocks still belong to a snapshot, leave them to the reaper */
+		err = apfs_query_join_transaction(query);
+		if (err)
+			return err;
+		raw = query->node->object.bh->b_data;
+		val = raw + query->off;
+		val->len_and_kind = cpu_to_le64((u64)APFS_KIND_DEAD << APFS_PEXT_KIND_SHIFT | pext->blkcount);
+		val->owning_obj_id = cpu_to_le64(APFS_OWNING_OBJ_ID_INVALID);
+		val->refcnt = 0;
+		return 0;
+	}
+	if (pext->refcnt == 0) {
 		err = apfs_btree_remove(query);
 		if (err)
 			return err;
@@ -890,129 +978,932 @@ static int apfs_split_phys_ext(struct apfs_query *query, u64 div)
 }
 
 /**
- * apfs_delete_phys_extent - Delete (or modify) physical extent records in range
- * @sb:		superblock structure
- * @extent:	range of physical blocks to delete
+ * apfs_insert_snap_phys_ext - Give the live volume its own record for blocks
+ *			       owned by a snapshot
+ * @query:	query that failed to find a live record for the blocks
+ * @start:	first block without a live record
+ * @end:	first block after the range
+ * @refs:	change to the number of references
+ * @new_start:	on return, first block covered by the new record
  *
- * The range to delete must either be a whole extent, the tail of an extent, or
- * a single block. Returns 0 on success or a negative error code in case of
- * failure.
+ * The reference count is copied from the youngest snapshot with a record for
+ * the blocks, plus @refs.  If nothing is left the record is dead, but the
+ * blocks are not freed: it's up to the reaper to release them once no snapshot
+ * needs them.  Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_delete_phys_extent(struct super_block *sb, const struct apfs_file_extent *extent)
+static int apfs_insert_snap_phys_ext(struct apfs_query *query, u64 start, u64 end,
+				     s64 refs, u64 *new_start)
 {
-	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
-	struct apfs_node *extref_root;
-	struct apfs_key key;
-	struct apfs_query *query = NULL;
-	struct apfs_phys_extent prev_ext;
-	u64 del_start, del_end, prev_start, prev_end;
-	bool second_run = false;
-	int ret;
-
-	if (extent->len == 0)
-		return 0;
-
-	extref_root = apfs_read_node(sb,
-				le64_to_cpu(vsb_raw->apfs_extentref_tree_oid),
-				APFS_OBJ_PHYSICAL, true /* write */);
-	if (IS_ERR(extref_root))
-		return PTR_ERR(extref_root);
-	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(extref_root->object.oid);
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_phys_extent snap;
+	struct apfs_phys_ext_key raw_key;
+	struct apfs_phys_ext_val raw_val;
+	u64 kind = APFS_KIND_UPDATE;
+	s64 refcnt;
+	int err;
 
-	apfs_init_extent_key(extent->phys_block_num, &key);
+	err = apfs_snap_extentref_find(sb, end - 1, &snap, &raw_val);
+	if (err == -ENODATA || (!err && snap.kind == APFS_KIND_DEAD)) {
+		apfs_alert(sb, "missing physical extent at block 0x%llx", end - 1);
+		return -EFSCORRUPTED;
+	}
+	if (err)
+		return err;
+	refcnt = snap.refcnt + refs;
+	if (refcnt < 0) {
+		apfs_alert(sb, "bad refcount for physical extent at block 0x%llx", end - 1);
+		return -EFSCORRUPTED;
+	}
+	if (refcnt > U32_MAX)
+		return -EMLINK;
+	start = max(start, snap.bno);
 
-search_and_insert:
-	query = apfs_alloc_query(extref_root, NULL /* parent */);
-	if (!query) {
-		ret = -ENOMEM;
-		goto fail;
+	if (refcnt == 0) {
+		kind = APFS_KIND_DEAD;
+		raw_val.owning_obj_id = cpu_to_le64(APFS_OWNING_OBJ_ID_INVALID);
 	}
-	query->key = &key;
-	query->flags = APFS_QUERY_EXTENTREF;
+	apfs_key_set_hdr(APFS_TYPE_EXTENT, start, &raw_key);
+	raw_val.len_and_kind = cpu_to_le64(kind << APFS_PEXT_KIND_SHIFT | (end - start));
+	raw_val.refcnt = cpu_to_le32(refcnt);
+	*new_start = start;
+	return apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
+}
 
-	ret = apfs_btree_query(sb, &query);
-	if (ret == -ENODATA)
-		ret = -EFSCORRUPTED;
-	if (ret)
-		goto fail;
+/**
+ * apfs_extentref_put_range - Drop references to a range of physical blocks
+ * @extref_root:	root of the live extent reference tree, in the transaction
+ * @del_start:		first block of the range
+ * @blkcount:		length of the range (in blocks)
+ * @refs:		number of references to drop
+ *
+ * The range may span several physical records, and cover any part of them.
+ * Records shared with other extents are split as needed, so that only the
+ * reference count of the deleted range drops.  Returns 0 on success or a
+ * negative error code in case of failure.
+ */
+static int apfs_extentref_put_range(struct apfs_node *extref_root, u64 del_start,
+				    u64 blkcount, u32 refs)
+{
+	struct super_block *sb = extref_root->object.sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_key key;
+	struct apfs_query *query = NULL;
+	struct apfs_phys_extent prev_ext;
+	u64 del_end = del_start + blkcount;
+	u64 start, prev_start = 0, prev_end = 0;
+	bool shrink;
+	int ret = 0;
 
-	ret = apfs_phys_ext_from_query(query, &prev_ext);
-	if (ret)
-		goto fail;
-	del_start = extent->phys_block_num;
-	del_end = del_start + (extent->len >> sb->s_blocksize_bits);
-	prev_start = prev_ext.bno;
-	prev_end = prev_ext.bno + prev_ext.blkcount;
-
-	if (prev_ext.len == extent->len) {
-		/* The range to free is the whole extent */
-		ret = apfs_put_phys_extent(&prev_ext, query);
-	} else if (prev_ext.refcnt > 1) {
-		ret = -EOPNOTSUPP; /* TODO */
-	} else if (prev_start == del_start) {
-		/* The range to free is the first block of the extent */
-		if (extent->len != sb->s_blocksize) {
-			apfs_alert(sb, "deleting a large physical extent's head at 0x%llx", del_start);
-			ret = -EFSCORRUPTED;
-		} else {
-			ret = apfs_shrink_phys_ext_head(query, del_end);
+	/* Work backwards from the last record that overlaps the range */
+	while (del_start < del_end) {
+		apfs_init_extent_key(del_end - 1, &key);
+		query = apfs_alloc_query(extref_root, NULL /* parent */);
+		if (!query) {
+			ret = -ENOMEM;
+			goto fail;
 		}
-	} else if (prev_end == del_end) {
-		/* The range to free is the tail of the extent */
-		ret = apfs_shrink_phys_ext_tail(query, del_start);
-	} else if (prev_start < del_start && prev_end > del_end) {
-		/* The range to free is a block in the middle of the extent */
-		if (second_run) {
-			/* I don't know if this is possible, but be safe */
-			apfs_alert(sb, "recursion splitting physical extents at block 0x%llx", del_start);
+		query->key = &key;
+		query->flags = APFS_QUERY_EXTENTREF;
+
+		ret = apfs_btree_query(sb, &query);
+		if (ret && ret != -ENODATA)
+			goto fail;
+		if (!ret) {
+			ret = apfs_phys_ext_from_query(query, &prev_ext);
+			if (ret)
+				goto fail;
+			prev_start = prev_ext.bno;
+			prev_end = prev_ext.bno + prev_ext.blkcount;
+			if (prev_end <= del_start)
+				ret = -ENODATA;
+		}
+		if (ret == -ENODATA || prev_end < del_end) {
+			u64 gap_start = ret ? del_start : prev_end;
+
+			/* Blocks not in the live tree can only belong to a snapshot */
+			if (!sbi->s_snap_count) {
+				apfs_alert(sb, "missing physical extent at block 0x%llx", gap_start);
+				ret = -EFSCORRUPTED;
+				goto fail;
+			}
+			ret = apfs_insert_snap_phys_ext(query, gap_start, del_end, -(s64)refs, &del_end);
+			if (ret)
+				goto fail;
+			goto next;
+		}
+		if (prev_ext.kind == APFS_KIND_DEAD) {
+			apfs_alert(sb, "physical extent at block 0x%llx is already dead", del_start);
 			ret = -EFSCORRUPTED;
 			goto fail;
 		}
-		ret = apfs_split_phys_ext(query, del_end);
+
+		start = max(prev_start, del_start);
+		/* Snapshot blocks are never freed here, so they can't be shrunk */
+		shrink = prev_ext.refcnt == refs && prev_ext.kind != APFS_KIND_UPDATE;
+		if (start == prev_start && del_end == prev_end) {
+			/* The range covers the whole record */
+			ret = apfs_put_phys_extent(&prev_ext, query, refs);
+		} else if (shrink && start == prev_start) {
+			ret = apfs_shrink_phys_ext_head(query, del_end);
+		} else if (shrink && del_end == prev_end) {
+			ret = apfs_shrink_phys_ext_tail(query, start);
+		} else {
+			/*
+			 * Give the range a record of its own. The split may make
+			 * the query invalid, so search again.
+			 */
+			ret = apfs_split_phys_ext(query, del_end < prev_end ? del_end : start);
+			if (ret)
+				goto fail;
+			goto next;
+		}
 		if (ret)
 			goto fail;
-		/* The split may make the query invalid */
+		del_end = start;
+next:
 		apfs_free_query(sb, query);
-		second_run = true;
-		goto search_and_insert;
-	} else {
-		/* I don't know how we got here, be safe */
-		apfs_alert(sb, "strange physical extents at block 0x%llx", del_start);
-		ret = -EFSCORRUPTED;
+		query = NULL;
 	}
 
 fail:
 	apfs_free_query(sb, query);
-	apfs_node_put(extref_root);
 	return ret;
 }
 
-/**
- * apfs_dstream_cache_is_tail - Is the tail of this dstream in its extent cache?
- * @dstream: dstream to check
+/*
+ * Pending drop of references to a range of physical blocks.  The ranges in the
+ * delta of a transaction never overlap, and they are sorted by block number.
  */
-static inline bool apfs_dstream_cache_is_tail(struct apfs_dstream_info *dstream)
+struct apfs_extref_delta {
+	struct rb_node node;
+	u64 bno;	/* First block of the range */
+	u64 blkcount;	/* Length of the range (in blocks) */
+	u32 refs;	/* Number of references to drop */
+};
+
+static inline u64 apfs_extref_delta_end(struct apfs_extref_delta *delta)
 {
-	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
-
-	/* nx_big_sem provides the locking for the cache here */
-	return cache->len && (dstream->ds_size <= cache->logical_addr + cache->len);
+	return delta->bno + delta->blkcount;
 }
 
 /**
- * apfs_flush_extent_cache - Write the cached extent to the catalog, if dirty
- * @dstream: data stream to flush
+ * apfs_extref_delta_first - Find the first pending range that ends after a block
+ * @sb:		superblock structure
+ * @bno:	the block number
  *
- * Returns 0 on success or a negative error code in case of failure.
+ * Returns NULL if there is no such range.
  */
-int apfs_flush_extent_cache(struct apfs_dstream_info *dstream)
+static struct apfs_extref_delta *apfs_extref_delta_first(struct super_block *sb, u64 bno)
 {
-	struct apfs_file_extent *ext = &dstream->ds_cached_ext;
-	int err;
-
-	if (!dstream->ds_ext_dirty)
-		return 0;
+	struct rb_node *node = APFS_SB(sb)->s_transaction.t_extref_delta.rb_node;
+	struct apfs_extref_delta *delta, *found = NULL;
+
+	while (node) {
+		delta = rb_entry(node, struct apfs_extref_delta, node);
+		if (apfs_extref_delta_end(delta) > bno) {
+			found = delta;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return found;
+}
+
+static inline struct apfs_extref_delta *apfs_extref_delta_next(struct apfs_extref_delta *delta)
+{
+	struct rb_node *node = rb_next(&delta->node);
+
+	return node ? rb_entry(node, struct apfs_extref_delta, node) : NULL;
+}
+
+/**
+ * apfs_extref_delta_insert - Add a new range to the extentref delta
+ * @sb:		superblock structure
+ * @bno:	first block of the range
+ * @blkcount:	length of the range (in blocks)
+ * @refs:	number of references to drop
+ *
+ * The caller must make sure that the new range doesn't overlap any other.
+ * Returns the new range, or NULL on allocation failure.
+ */
+static struct apfs_extref_delta *apfs_extref_delta_insert(struct super_block *sb, u64 bno,
+							  u64 blkcount, u32 refs)
+{
+	struct apfs_vol_transaction *vol_trans = &APFS_SB(sb)->s_transaction;
+	struct rb_node **p = &vol_trans->t_extref_delta.rb_node;
+	struct rb_node *parent = NULL;
+	struct apfs_extref_delta *delta, *curr;
+
+	delta = kmalloc(sizeof(*delta), GFP_NOFS);
+	if (!delta)
+		return NULL;
+	delta->bno = bno;
+	delta->blkcount = blkcount;
+	delta->refs = refs;
+
+	while (*p) {
+		parent = *p;
+		curr = rb_entry(parent, struct apfs_extref_delta, node);
+		if (bno < curr->bno)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&delta->node, parent, p);
+	rb_insert_color(&delta->node, &vol_trans->t_extref_delta);
+	vol_trans->t_extref_count++;
+	return delta;
+}
+
+/**
+ * apfs_extref_delta_remove - Remove a range from the extentref delta
+ * @sb:		superblock structure
+ * @delta:	the range to remove
+ */
+static void apfs_extref_delta_remove(struct super_block *sb, struct apfs_extref_delta *delta)
+{
+	struct apfs_vol_transaction *vol_trans = &APFS_SB(sb)->s_transaction;
+
+	rb_erase(&delta->node, &vol_trans->t_extref_delta);
+	vol_trans->t_extref_count--;
+	kfree(delta);
+}
+
+/**
+ * apfs_extref_delta_split - Break a pending range in two
+ * @sb:		superblock structure
+ * @delta:	the range to split
+ * @div:	first block for the second half
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_extref_delta_split(struct super_block *sb, struct apfs_extref_delta *delta, u64 div)
+{
+	u64 end = apfs_extref_delta_end(delta);
+
+	if (!apfs_extref_delta_insert(sb, div, end - div, delta->refs))
+		return -ENOMEM;
+	delta->blkcount = div - delta->bno;
+	return 0;
+}
+
+/**
+ * apfs_extref_delta_add - Record a pending drop of one reference to a range
+ * @sb:		superblock structure
+ * @bno:	first block of the range
+ * @blkcount:	length of the range (in blocks)
+ *
+ * Overlaps with pending ranges are resolved by splitting them, and adjacent
+ * ranges with the same count get merged, so that the delta stays small for
+ * sequential truncations and overwrites.  Returns 0 on success or a negative
+ * error code in case of failure.
+ */
+static int apfs_extref_delta_add(struct super_block *sb, u64 bno, u64 blkcount)
+{
+	struct apfs_extref_delta *delta, *next;
+	u64 start = bno, end = bno + blkcount;
+	int err;
+
+	while (bno < end) {
+		delta = apfs_extref_delta_first(sb, bno);
+		if (!delta || delta->bno >= end) {
+			if (!apfs_extref_delta_insert(sb, bno, end - bno, 1))
+				return -ENOMEM;
+			break;
+		}
+		if (delta->bno > bno) {
+			if (!apfs_extref_delta_insert(sb, bno, delta->bno - bno, 1))
+				return -ENOMEM;
+			bno = delta->bno;
+			continue;
+		}
+		if (delta->bno < bno) {
+			err = apfs_extref_delta_split(sb, delta, bno);
+			if (err)
+				return err;
+			continue;
+		}
+		if (apfs_extref_delta_end(delta) > end) {
+			err = apfs_extref_delta_split(sb, delta, end);
+			if (err)
+				return err;
+		}
+		if (delta->refs == U32_MAX)
+			return -EFSCORRUPTED;
+		delta->refs++;
+		bno = apfs_extref_delta_end(delta);
+	}
+
+	/* Merge everything that got touched with its neighbours */
+	delta = apfs_extref_delta_first(sb, start ? start - 1 : 0);
+	while (delta && delta->bno <= end) {
+		next = apfs_extref_delta_next(delta);
+		if (!next)
+			break;
+		if (apfs_extref_delta_end(delta) == next->bno && delta->refs == next->refs) {
+			delta->blkcount += next->blkcount;
+			apfs_extref_delta_remove(sb, next);
+			continue;
+		}
+		delta = next;
+	}
+	return 0;
+}
+
+/**
+ * apfs_extref_delta_apply_range - Apply the pending drops that overlap a range
+ * @extref_root:	root of the live extent reference tree, in the transaction
+ * @bno:		first block of the range
+ * @end:		first block after the range
+ *
+ * The pending ranges are applied whole and in ascending order, so that the
+ * tree is walked in a single pass.  Returns 0 on success or a negative error
+ * code in case of failure.
+ */
+static int apfs_extref_delta_apply_range(struct apfs_node *extref_root, u64 bno, u64 end)
+{
+	struct super_block *sb = extref_root->object.sb;
+	struct apfs_extref_delta *delta, *next;
+	int err;
+
+	delta = apfs_extref_delta_first(sb, bno);
+	while (delta && delta->bno < end) {
+		err = apfs_extentref_put_range(extref_root, delta->bno, delta->blkcount, delta->refs);
+		if (err)
+			return err;
+		next = apfs_extref_delta_next(delta);
+		apfs_extref_delta_remove(sb, delta);
+		delta = next;
+	}
+	return 0;
+}
+
+/**
+ * apfs_extref_delta_pending - Check if any pending drops overlap a range
+ * @sb:		superblock structure
+ * @bno:	first block of the range
+ * @end:	first block after the range
+ */
+static inline bool apfs_extref_delta_pending(struct super_block *sb, u64 bno, u64 end)
+{
+	struct apfs_extref_delta *delta = apfs_extref_delta_first(sb, bno);
+
+	return delta && delta->bno < end;
+}
+
+/**
+ * apfs_extentref_root_join - Get write access to the live extentref tree root
+ * @sb:	superblock structure
+ *
+ * Returns the root node, or an error pointer in case of failure.
+ */
+static struct apfs_node *apfs_extentref_root_join(struct super_block *sb)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *extref_root;
+
+	extref_root = apfs_read_node(sb,
+				le64_to_cpu(vsb_raw->apfs_extentref_tree_oid),
+				APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(extref_root))
+		return extref_root;
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(extref_root->object.oid);
+	return extref_root;
+}
+
+/**
+ * apfs_extref_delta_apply - Apply all pending extentref drops for a volume
+ * @sb:	superblock structure
+ *
+ * Must be called before the transaction commits, and before anything else
+ * reads the reference counts from the live extentref tree.  Returns 0 on
+ * success or a negative error code in case of failure.
+ */
+int apfs_extref_delta_apply(struct super_block *sb)
+{
+	struct apfs_node *extref_root;
+	int err;
+
+	/* Don't cow the root for nothing */
+	if (RB_EMPTY_ROOT(&APFS_SB(sb)->s_transaction.t_extref_delta))
+		return 0;
+
+	extref_root = apfs_extentref_root_join(sb);
+	if (IS_ERR(extref_root))
+		return PTR_ERR(extref_root);
+	err = apfs_extref_delta_apply_range(extref_root, 0, U64_MAX);
+	apfs_node_put(extref_root);
+	return err;
+}
+
+/**
+ * apfs_extref_delta_free - Forget all pending extentref drops for a volume
+ * @sb:	superblock structure
+ *
+ * Only meant for transaction aborts.
+ */
+void apfs_extref_delta_free(struct super_block *sb)
+{
+	struct apfs_vol_transaction *vol_trans = &APFS_SB(sb)->s_transaction;
+	struct apfs_extref_delta *delta, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(delta, tmp, &vol_trans->t_extref_delta, node)
+		kfree(delta);
+	vol_trans->t_extref_delta = RB_ROOT;
+	vol_trans->t_extref_count = 0;
+}
+
+/**
+ * apfs_delete_phys_extent - Drop a reference to a range of physical blocks
+ * @sb:		superblock structure
+ * @extent:	range of physical blocks to delete
+ *
+ * The change is only recorded in the extentref delta of the transaction, and
+ * the tree gets updated in a single ordered pass before the commit, or when the
+ * next operation starts if the delta grows too big.  The blocks are not freed
+ * until then either, so they can't be reallocated in the meantime.  Returns 0
+ * on success or a negative error code in case of failure.
+ */
+static int apfs_delete_phys_extent(struct super_block *sb, const struct apfs_file_extent *extent)
+{
+	if (extent->len == 0)
+		return 0;
+	return apfs_extref_delta_add(sb, extent->phys_block_num, extent->len >> sb->s_blocksize_bits);
+}
+
+/**
+ * apfs_insert_phys_extent - Create or grow the physical record for an extent
+ * @dstream:	data stream info for the extent
+ * @extent:	new in-memory file extent
+ *
+ * Only works for appending to extents, for now.  If the original blocks are
+ * shared, the appended ones get a separate record.  Returns 0 on success or a
+ * negative error code in case of failure.
+ */
+static int apfs_insert_phys_extent(struct apfs_dstream_info *dstream, const struct apfs_file_extent *extent)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_node *extref_root;
+	struct apfs_key key;
+	struct apfs_query *query = NULL;
+	struct apfs_phys_ext_key raw_key;
+	struct apfs_phys_ext_val raw_val;
+	u64 kind = (u64)APFS_KIND_NEW << APFS_PEXT_KIND_SHIFT;
+	u64 blkcnt = extent->len >> sb->s_blocksize_bits;
+	int ret;
+
+	extref_root = apfs_extentref_root_join(sb);
+	if (IS_ERR(extref_root))
+		return PTR_ERR(extref_root);
+
+again:
+	query = apfs_alloc_query(extref_root, NULL /* parent */);
+	if (!query) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	apfs_init_extent_key(extent->phys_block_num, &key);
+	query->key = &key;
+	/* The query is exact for now because we assume single-block extents */
+	query->flags = APFS_QUERY_EXTENTREF | APFS_QUERY_EXACT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA)
+		goto fail;
+
+	apfs_key_set_hdr(APFS_TYPE_EXTENT, extent->phys_block_num, &raw_key);
+	if (!ret) {
+		struct apfs_phys_extent pext;
+
+		ret = apfs_phys_ext_from_query(query, &pext);
+		if (ret)
+			goto fail;
+		if (apfs_extref_delta_pending(sb, pext.bno, pext.bno + pext.blkcount)) {
+			/* The record is about to change, get that out of the way */
+			apfs_free_query(sb, query);
+			query = NULL;
+			ret = apfs_extref_delta_apply_range(extref_root, pext.bno,
+							    pext.bno + pext.blkcount);
+			if (ret)
+				goto fail;
+			goto again;
+		}
+		if (pext.refcnt > 1) {
+			/* Shared blocks keep their record, the new tail gets its own */
+			if (pext.blkcount >= blkcnt)
+				goto fail;
+			apfs_key_set_hdr(APFS_TYPE_EXTENT, pext.bno + pext.blkcount, &raw_key);
+			blkcnt -= pext.blkcount;
+			ret = -ENODATA;
+		}
+	}
+	raw_val.len_and_kind = cpu_to_le64(kind | blkcnt);
+	raw_val.owning_obj_id = cpu_to_le64(dstream->ds_id);
+	raw_val.refcnt = cpu_to_le32(1);
+
+	if (ret)
+		ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key),
+					&raw_val, sizeof(raw_val));
+	else
+		ret = apfs_btree_replace(query, &raw_key, sizeof(raw_key),
+					 &raw_val, sizeof(raw_val));
+
+fail:
+	apfs_free_query(sb, query);
+	apfs_node_put(extref_root);
+	return ret;
+}
+
+/**
+ * apfs_get_phys_extent - Take a new reference on a range of physical blocks
+ * @sb:		superblock structure
+ * @bno:	first block of the range
+ * @blkcount:	length of the range (in blocks)
+ *
+ * The range may span several physical records, which are split as needed so
+ * that only the range gets its reference count raised.  Blocks that only a
+ * snapshot has a record for get a live one, with the count raised from the
+ * snapshot's.  Returns 0 on success or a negative error code in case of
+ * failure.
+ */
+static int apfs_get_phys_extent(struct super_block *sb, u64 bno, u64 blkcount)
+{
+	struct apfs_node *extref_root;
+	struct apfs_key key;
+	struct apfs_query *query = NULL;
+	struct apfs_phys_extent prev_ext;
+	struct apfs_phys_ext_val *val;
+	u64 end = bno + blkcount;
+	u64 prev_end = 0, start;
+	int ret = 0;
+
+	extref_root = apfs_extentref_root_join(sb);
+	if (IS_ERR(extref_root))
+		return PTR_ERR(extref_root);
+
+	while (bno < end) {
+		apfs_init_extent_key(end - 1, &key);
+		query = apfs_alloc_query(extref_root, NULL /* parent */);
+		if (!query) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		query->key = &key;
+		query->flags = APFS_QUERY_EXTENTREF;
+
+		ret = apfs_btree_query(sb, &query);
+		if (ret && ret != -ENODATA)
+			goto fail;
+		if (!ret) {
+			ret = apfs_phys_ext_from_query(query, &prev_ext);
+			if (ret)
+				goto fail;
+			prev_end = prev_ext.bno + prev_ext.blkcount;
+			if (prev_end <= bno)
+				ret = -ENODATA;
+		}
+		if (ret == -ENODATA || prev_end < end) {
+			u64 gap_start = ret ? bno : prev_end;
+
+			/* Blocks not in the live tree can only belong to a snapshot */
+			if (!APFS_SB(sb)->s_snap_count) {
+				apfs_alert(sb, "missing physical extent at block 0x%llx", end - 1);
+				ret = -EFSCORRUPTED;
+				goto fail;
+			}
+			ret = apfs_insert_snap_phys_ext(query, gap_start, end, 1, &end);
+			if (ret)
+				goto fail;
+			goto next;
+		}
+		if (apfs_extref_delta_pending(sb, prev_ext.bno, prev_end)) {
+			/* Pending drops must come first, or the count could overflow */
+			apfs_free_query(sb, query);
+			query = NULL;
+			ret = apfs_extref_delta_apply_range(extref_root, prev_ext.bno, prev_end);
+			if (ret)
+				goto fail;
+			continue;
+		}
+		if (prev_ext.kind == APFS_KIND_DEAD) {
+			apfs_alert(sb, "physical extent at block 0x%llx is dead", end - 1);
+			ret = -EFSCORRUPTED;
+			goto fail;
+		}
+
+		start = max(prev_ext.bno, bno);
+		if (start != prev_ext.bno || end != prev_end) {
+			/* Same as for deletion, give the range its own record */
+			ret = apfs_split_phys_ext(query, end < prev_end ? end : start);
+			if (ret)
+				goto fail;
+			goto next;
+		}
+
+		if (prev_ext.refcnt == U32_MAX) {
+			ret = -EMLINK;
+			goto fail;
+		}
+		ret = apfs_query_join_transaction(query);
+		if (ret)
+			goto fail;
+		val = (void *)query->node->object.bh->b_data + query->off;
+		val->refcnt = cpu_to_le32(prev_ext.refcnt + 1);
+		end = start;
+next:
+		apfs_free_query(sb, query);
+		query = NULL;
+	}
+
+fail:
+	apfs_free_query(sb, query);
+	apfs_node_put(extref_root);
+	return ret;
+}
+
+/**
+ * apfs_extentref_lookup - Find the last physical extent record that starts at
+ *			   or before a given block
+ * @root:	root of the extent reference tree
+ * @bno:	block number to search for
+ * @pext:	on return, the physical extent found
+ * @val:	on return, a copy of the raw record value
+ *
+ * Returns 0 on success, -ENODATA if no such record exists, or another negative
+ * error code in case of failure.
+ */
+int apfs_extentref_lookup(struct apfs_node *root, u64 bno, struct apfs_phys_extent *pext,
+			  struct apfs_phys_ext_val *val)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	struct apfs_key key;
+	char *raw;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_extent_key(bno, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_EXTENTREF;
+
+	err = apfs_btree_query(sb, &query);
+	if (err)
+		goto fail;
+	err = apfs_phys_ext_from_query(query, pext);
+	if (err)
+		goto fail;
+	raw = query->node->object.bh->b_data;
+	*val = *(struct apfs_phys_ext_val *)(raw + query->off);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_extentref_insert - Insert a new physical extent record
+ * @root:	root of the extent reference tree
+ * @bno:	first block for the extent
+ * @blkcount:	length of the extent (in blocks)
+ * @val:	record value to copy, except for the length
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_extentref_insert(struct apfs_node *root, u64 bno, u64 blkcount,
+				 const struct apfs_phys_ext_val *val)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	struct apfs_key key;
+	struct apfs_phys_extent prev;
+	struct apfs_phys_ext_key raw_key;
+	struct apfs_phys_ext_val raw_val;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_extent_key(bno, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_EXTENTREF;
+
+	err = apfs_btree_query(sb, &query);
+	if (!err) {
+		err = apfs_phys_ext_from_query(query, &prev);
+		if (!err && prev.bno + prev.blkcount > bno)
+			err = -EFSCORRUPTED;
+		if (err)
+			goto fail;
+	} else if (err != -ENODATA) {
+		goto fail;
+	}
+
+	apfs_key_set_hdr(APFS_TYPE_EXTENT, bno, &raw_key);
+	raw_val = *val;
+	apfs_set_phys_ext_length(&raw_val, blkcount);
+	err = apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_extentref_truncate - Shrink a physical extent record in its tail
+ * @root:	root of the extent reference tree
+ * @bno:	first block for the extent
+ * @blkcount:	new length of the extent (in blocks), or 0 to remove the record
+ *
+ * Unlike apfs_shrink_phys_ext_tail(), this doesn't free the blocks that are
+ * cut off.  Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_extentref_truncate(struct apfs_node *root, u64 bno, u64 blkcount)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	struct apfs_key key;
+	void *raw;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_extent_key(bno, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_EXTENTREF | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (err)
+		goto fail;
+
+	if (!blkcount) {
+		err = apfs_btree_remove(query);
+		goto fail;
+	}
+	err = apfs_query_join_transaction(query);
+	if (err)
+		goto fail;
+	raw = query->node->object.bh->b_data;
+	apfs_set_phys_ext_length(raw + query->off, blkcount);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_extentref_set_kind - Change the kind of a physical extent record
+ * @root:	root of the extent reference tree
+ * @bno:	first block for the extent
+ * @kind:	the new kind
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_extentref_set_kind(struct apfs_node *root, u64 bno, u8 kind)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	struct apfs_phys_ext_val *val;
+	struct apfs_key key;
+	u64 len_and_kind;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_extent_key(bno, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_EXTENTREF | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (err)
+		goto fail;
+	err = apfs_query_join_transaction(query);
+	if (err)
+		goto fail;
+	val = (void *)query->node->object.bh->b_data + query->off;
+	len_and_kind = le64_to_cpu(val->len_and_kind) & APFS_PEXT_LEN_MASK;
+	val->len_and_kind = cpu_to_le64((u64)kind << APFS_PEXT_KIND_SHIFT | len_and_kind);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_extentref_merge_step - Merge the last record of an extentref tree into
+ *			       another
+ * @src_root:	root of the extentref tree of a deleted snapshot
+ * @dst_root:	root of the extentref tree for the next snapshot, or the volume
+ *
+ * Moves the tail of the last record of @src_root into @dst_root. Blocks that
+ * were allocated before the deleted snapshot and were dead by the time of the
+ * next one are no longer needed by anybody, so they get freed; records that the
+ * next tree updated from this one go back to the previous owner.  Returns 0 on
+ * success, -ENODATA if @src_root is already empty, or another negative error
+ * code in case of failure.
+ */
+int apfs_extentref_merge_step(struct apfs_node *src_root, struct apfs_node *dst_root)
+{
+	struct super_block *sb = src_root->object.sb;
+	struct apfs_phys_extent src, dst, dead = {0};
+	struct apfs_phys_ext_val src_val, dst_val;
+	u64 src_end, dst_end, merged;
+	int err;
+
+	err = apfs_extentref_lookup(src_root, ~0ULL, &src, &src_val);
+	if (err)
+		return err;
+	if (!src.blkcount)
+		return -EFSCORRUPTED;
+	src_end = src.bno + src.blkcount;
+
+	err = apfs_extentref_lookup(dst_root, src_end - 1, &dst, &dst_val);
+	if (err == -ENODATA) {
+		dst.bno = dst.blkcount = 0;
+		err = 0;
+	}
+	if (err)
+		return err;
+	dst_end = dst.bno + dst.blkcount;
+
+	if (dst_end <= src.bno) {
+		/* No overlap, so the whole record moves */
+		merged = src.bno;
+		err = apfs_extentref_insert(dst_root, merged, src_end - merged, &src_val);
+	} else if (dst_end < src_end) {
+		/* Move the tail, the rest will overlap */
+		merged = dst_end;
+		err = apfs_extentref_insert(dst_root, merged, src_end - merged, &src_val);
+	} else if (dst.kind == APFS_KIND_UPDATE && src.kind != APFS_KIND_DEAD) {
+		/*
+		 * The next tree already has the up-to-date count, but the
+		 * blocks now belong to whoever owned them before the deleted
+		 * snapshot, if anybody.
+		 */
+		merged = max(src.bno, dst.bno);
+		err = apfs_extentref_set_kind(dst_root, dst.bno, src.kind);
+	} else if (dst.kind != APFS_KIND_DEAD) {
+		apfs_alert(sb, "snapshot extent at block 0x%llx is still live", src_end - 1);
+		err = -EFSCORRUPTED;
+	} else {
+		merged = max(src.bno, dst.bno);
+		/* Blocks updated from an older snapshot still belong to it */
+		if (src.kind != APFS_KIND_DEAD && src.kind != APFS_KIND_UPDATE) {
+			/* Nobody needs these blocks anymore */
+			dead.bno = merged;
+			dead.blkcount = src_end - merged;
+			dead.len = dead.blkcount << sb->s_blocksize_bits;
+			err = apfs_free_phys_ext(sb, &dead);
+			if (err)
+				return err;
+
+			err = apfs_extentref_truncate(dst_root, dst.bno, merged - dst.bno);
+			if (!err && src_end < dst_end)
+				err = apfs_extentref_insert(dst_root, src_end, dst_end - src_end, &dst_val);
+		}
+		/* If both ranges are dead, the next tree already has the record */
+	}
+	if (err)
+		return err;
+
+	return apfs_extentref_truncate(src_root, src.bno, merged - src.bno);
+}
+
+/**
+ * apfs_dstream_cache_is_tail - Is the tail of this dstream in its extent cache?
+ * @dstream: dstream to check
+ */
+static inline bool apfs_dstream_cache_is_tail(struct apfs_dstream_info *dstream)
+{
+	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
+
+	/* nx_big_sem provides the locking for the cache here */
+	return cache->len && (dstream->ds_size <= cache->logical_addr + cache->len);
+}
+
+/**
+ * apfs_flush_extent_cache - Write the cached extent to the catalog, if dirty
+ * @dstream: data stream to flush
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_flush_extent_cache(struct apfs_dstream_info *dstream)
+{
+	struct apfs_file_extent *ext = &dstream->ds_cached_ext;
+	int err;
+
+	if (!dstream->ds_ext_dirty)
+		return 0;
 	ASSERT(ext->len > 0);
 
 	err = apfs_update_extent(dstream, ext);
@@ -1171,7 +2062,6 @@ static void apfs_zero_bh_tail(struct super_block *sb, struct buffer_head *bh, u6
 int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsblock, struct buffer_head *bh_result)
 {
 	struct super_block *sb = dstream->ds_sb;
-	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
 	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
 	u64 phys_bno, logical_addr, cache_blks, dstream_blks;
 	int err;
@@ -1184,8 +2074,7 @@ int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsblock, s
 	err = apfs_spaceman_allocate_block(sb, &phys_bno, false /* backwards */);
 	if (err)
 		return err;
-	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-	le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+	apfs_vol_alloc_add(sb, 1);
 
 	apfs_map_bh(bh_result, sb, phys_bno);
 	err = apfs_transaction_join(sb, bh_result);
@@ -1203,7 +2092,13 @@ int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsblock, s
 		apfs_zero_bh_tail(sb, bh_result, dstream->ds_size - logical_addr);
 	}
 
+	/*
+	 * A clean cache may describe blocks that a snapshot also owns, so
+	 * growing it would mix them up with the new blocks in the extentref
+	 * tree.
+	 */
 	if (apfs_dstream_cache_is_tail(dstream) &&
+	    (dstream->ds_ext_dirty || !APFS_SB(sb)->s_snap_count) &&
 	    logical_addr == cache->logical_addr + cache->len &&
 	    phys_bno == cache->phys_block_num + cache_blks) {
 		cache->len += sb->s_blocksize;
@@ -1245,6 +2140,314 @@ int apfs_get_new_block(struct inode *inode, sector_t iblock,
 	return apfs_dstream_get_new_block(&ai->i_dstream, iblock, bh_result);
 }
 
+/**
+ * apfs_dstream_count_extents - Count the extents that map a range of a dstream
+ * @dstream:	data stream info
+ * @start:	first logical block of the range
+ * @end:	first logical block after the range
+ * @count:	on return, the number of extents found (holes are not counted)
+ *
+ * The caller must hold the big semaphore. Returns 0 on success or a negative
+ * error code in case of failure.
+ */
+int apfs_dstream_count_extents(struct apfs_dstream_info *dstream, u64 start, u64 end, u64 *count)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent extent;
+	u64 next;
+	int err;
+
+	*count = 0;
+	while (start < end) {
+		err = apfs_extent_read(dstream, start, &extent);
+		if (err == -ENODATA)
+			return 0;
+		if (err)
+			return err;
+
+		/* The last extent may end before the dstream does */
+		next = (extent.logical_addr + extent.len) >> sb->s_blocksize_bits;
+		if (next <= start)
+			return 0;
+		if (!apfs_ext_is_hole(&extent))
+			++*count;
+		start = next;
+	}
+	return 0;
+}
+
+/**
+ * apfs_replace_extent_range - Replace all the extents in a range with a new one
+ * @dstream:	data stream info
+ * @extent:	new in-memory extent
+ *
+ * Unlike apfs_update_extent(), this works for extents of any length and in any
+ * position of the dstream: every record that overlaps @extent gets removed or
+ * shrunk, along with its physical records, and then @extent gets inserted.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_replace_extent_range(struct apfs_dstream_info *dstream, const struct apfs_file_extent *extent)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_key key;
+	struct apfs_query *query = NULL;
+	struct apfs_file_extent_key raw_key;
+	struct apfs_file_extent_val raw_val;
+	struct apfs_file_extent prev_ext;
+	u64 extent_id = dstream->ds_id;
+	u64 start = extent->logical_addr;
+	u64 end = extent->logical_addr + extent->len;
+	u64 prev_end, new_crypto;
+	int ret;
+
+	/* Work backwards from the last record that overlaps the new extent */
+	apfs_init_file_extent_key(extent_id, end - 1, &key);
+	for (;;) {
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query)
+			return -ENOMEM;
+		query->key = &key;
+		query->flags = APFS_QUERY_CAT;
+
+		ret = apfs_btree_query(sb, &query);
+		if (ret && ret != -ENODATA)
+			goto out;
+		if (ret == -ENODATA || !apfs_query_found_extent(query))
+			break;
+
+		if (apfs_extent_from_query(query, &prev_ext)) {
+			apfs_alert(sb, "bad extent record on dstream 0x%llx", extent_id);
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+		prev_end = prev_ext.logical_addr + prev_ext.len;
+
+		if (prev_end <= start) {
+			/* Nothing left to remove */
+			break;
+		} else if (prev_end > end) {
+			/* Keep the part of the old extent after the new one */
+			ret = apfs_split_extent(query, end);
+			if (ret)
+				goto out;
+		} else if (prev_ext.logical_addr < start) {
+			/* Keep the part of the old extent before the new one */
+			ret = apfs_shrink_extent_tail(query, dstream, start);
+			if (ret)
+				goto out;
+			break;
+		} else {
+			/* The whole old extent is replaced */
+			ret = apfs_btree_remove(query);
+			if (ret)
+				goto out;
+			if (apfs_ext_is_hole(&prev_ext)) {
+				dstream->ds_sparse_bytes -= prev_ext.len;
+			} else {
+				ret = apfs_delete_phys_extent(sb, &prev_ext);
+				if (ret)
+					goto out;
+			}
+			ret = apfs_crypto_adj_refcnt(sb, prev_ext.crypto_id, -1);
+			if (ret)
+				goto out;
+			if (prev_ext.logical_addr == start)
+				break;
+		}
+		apfs_free_query(sb, query);
+		query = NULL;
+	}
+	apfs_free_query(sb, query);
+
+	apfs_key_set_hdr(APFS_TYPE_FILE_EXTENT, extent_id, &raw_key);
+	raw_key.logical_addr = cpu_to_le64(extent->logical_addr);
+	raw_val.len_and_flags = cpu_to_le64(extent->len);
+	raw_val.phys_block_num = cpu_to_le64(extent->phys_block_num);
+	new_crypto = apfs_vol_is_encrypted(sb) ? extent_id : 0;
+	raw_val.crypto_id = cpu_to_le64(new_crypto);
+
+	apfs_init_file_extent_key(extent_id, extent->logical_addr, &key);
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = &key;
+	query->flags = APFS_QUERY_CAT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA)
+		goto out;
+	ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
+	if (ret)
+		goto out;
+	ret = apfs_crypto_adj_refcnt(sb, new_crypto, 1);
+
+out:
+	apfs_free_query(sb, query);
+	return ret;
+}
+
+/**
+ * apfs_dstream_defrag_flush - Write a run of moved blocks to the catalog
+ * @dstream:	data stream info
+ * @run:	run of blocks built by apfs_dstream_defrag_block()
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_dstream_defrag_flush(struct apfs_dstream_info *dstream, struct apfs_file_extent *run)
+{
+	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
+	int err;
+
+	if (!run->len)
+		return 0;
+	ASSERT(!dstream->ds_ext_dirty);
+
+	err = apfs_replace_extent_range(dstream, run);
+	if (err)
+		return err;
+	err = apfs_insert_phys_extent(dstream, run);
+	if (err)
+		return err;
+
+	/* The cached extent may map some of the old blocks */
+	spin_lock(&dstream->ds_ext_lock);
+	cache->len = 0;
+	spin_unlock(&dstream->ds_ext_lock);
+
+	run->len = 0;
+	return 0;
+}
+
+/**
+ * apfs_dstream_defrag_block - Move a block of a data stream to a new location
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the block to move
+ * @bh:		buffer head with the up-to-date contents of the block
+ * @run:	run of moved blocks that are still not in the catalog
+ *
+ * Allocates a new block and maps @bh to it, so that the data gets written there
+ * when the transaction commits. Blocks that follow @run both logically and
+ * physically are merged into it, so that they all end up in a single extent;
+ * otherwise @run is flushed and started over. The caller must flush the last
+ * run with apfs_dstream_defrag_flush().
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_dstream_defrag_block(struct apfs_dstream_info *dstream, u64 dsblock,
+			      struct buffer_head *bh, struct apfs_file_extent *run)
+{
+	struct super_block *sb = dstream->ds_sb;
+	u64 phys_bno, logical_addr, run_blks;
+	int err;
+
+	logical_addr = dsblock << sb->s_blocksize_bits;
+
+	err = apfs_spaceman_allocate_block(sb, &phys_bno, false /* backwards */);
+	if (err)
+		return err;
+	apfs_vol_alloc_add(sb, 1);
+
+	run_blks = run->len >> sb->s_blocksize_bits;
+	if (run->len && (logical_addr != run->logical_addr + run->len ||
+			 phys_bno != run->phys_block_num + run_blks)) {
+		err = apfs_dstream_defrag_flush(dstream, run);
+		if (err)
+			return err;
+	}
+	if (!run->len) {
+		run->logical_addr = logical_addr;
+		run->phys_block_num = phys_bno;
+	}
+	run->len += sb->s_blocksize;
+
+	apfs_map_bh(bh, sb, phys_bno);
+	err = apfs_transaction_join(sb, bh);
+	if (err)
+		return err;
+	if (dstream->ds_size > logical_addr)
+		apfs_zero_bh_tail(sb, bh, dstream->ds_size - logical_addr);
+	return 0;
+}
+int APFS_DEFRAG_BLOCK_MAXOPS(void)
+{
+	/* Each block may remove an old record, and each run may split one */
+	return 2 * APFS_UPDATE_EXTENTS_MAXOPS;
+}
+
+/**
+ * apfs_dstream_share_range - Map a range of a dstream to the blocks of another
+ * @src:	data stream that owns the blocks
+ * @dst:	data stream to remap
+ * @src_blk:	first logical block of the range in @src
+ * @dst_blk:	first logical block of the range in @dst
+ * @blkcount:	length of the range (in blocks)
+ * @shared:	incremented by the number of blocks remapped
+ *
+ * The physical blocks for the range in @src get an extra reference, and replace
+ * whatever was mapped in @dst, whose old blocks are put.  Holes in @src are
+ * left alone, so the caller must only use this when both ranges have the same
+ * contents.  The caller must flush the extent caches for both dstreams first.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_dstream_share_range(struct apfs_dstream_info *src, struct apfs_dstream_info *dst,
+			     u64 src_blk, u64 dst_blk, u64 blkcount, u64 *shared)
+{
+	struct super_block *sb = src->ds_sb;
+	struct apfs_file_extent *cache = &dst->ds_cached_ext;
+	struct apfs_file_extent extent, share;
+	u64 end = src_blk + blkcount;
+	u64 ext_blk, next, count;
+	int err = 0;
+
+	ASSERT(!src->ds_ext_dirty && !dst->ds_ext_dirty);
+
+	while (src_blk < end) {
+		err = apfs_extent_read(src, src_blk, &extent);
+		if (err == -ENODATA) {
+			err = 0;
+			break;
+		}
+		if (err)
+			break;
+
+		/* The last extent may end before the dstream does */
+		ext_blk = extent.logical_addr >> sb->s_blocksize_bits;
+		next = (extent.logical_addr + extent.len) >> sb->s_blocksize_bits;
+		if (next <= src_blk)
+			break;
+		next = min(next, end);
+		count = next - src_blk;
+
+		if (!apfs_ext_is_hole(&extent)) {
+			share.logical_addr = (dst_blk + blkcount - (end - src_blk)) << sb->s_blocksize_bits;
+			share.phys_block_num = extent.phys_block_num + src_blk - ext_blk;
+			share.len = count << sb->s_blocksize_bits;
+
+			/* Take the new reference first, in case @dst already has it */
+			err = apfs_get_phys_extent(sb, share.phys_block_num, count);
+			if (err)
+				break;
+			err = apfs_replace_extent_range(dst, &share);
+			if (err)
+				break;
+			*shared += count;
+		}
+		src_blk = next;
+	}
+
+	/* The cached extent may map some of the old blocks */
+	spin_lock(&dst->ds_ext_lock);
+	cache->len = 0;
+	spin_unlock(&dst->ds_ext_lock);
+	return err;
+}
+int APFS_SHARE_BLOCK_MAXOPS(void)
+{
+	/* Each block may be a new extent, with two splits for its references */
+	return 2 * APFS_UPDATE_EXTENTS_MAXOPS + 2;
+}
+
 /**
  * apfs_shrink_dstream_last_extent - Shrink last extent of dstream being resized
  * @dstream:	data stream info
@@ -22,8 +22,8 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 	struct super_block *sb = inode->i_sb;
 	struct buffer_head *bh, *head;
 	vm_fault_t ret = VM_FAULT_LOCKED;
-	struct apfs_max_ops maxops;
 	int blkcount = PAGE_SIZE >> inode->i_blkbits;
+	int delayed = 0;
 	unsigned int blocksize, block_start, len;
 	u64 size;
 	int err = 0;
@@ -31,33 +31,32 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 	sb_start_pagefault(inode->i_sb);
 	file_update_time(vma->vm_file);
 
-	/* Placeholder values, I need to get back to this in the future */
-	maxops.cat = APFS_UPDATE_INODE_MAXOPS() +
-		     blkcount * APFS_GET_NEW_BLOCK_MAXOPS();
-	maxops.blks = blkcount;
-
-	err = apfs_transaction_start(sb, maxops);
+	/*
+	 * The actual CoW allocation is left for apfs_writepages(). Reserve for
+	 * the worst case here, before the page gets locked.
+	 */
+	err = apfs_reserve_blocks(sb, blkcount);
 	if (err)
 		goto out;
-	apfs_inode_join_transaction(sb, inode);
 
 	lock_page(page);
-	wait_for_stable_page(page);
-	if (page->mapping != inode->i_mapping) {
+	size = i_size_read(inode);
+	if (page->mapping != inode->i_mapping || page_offset(page) >= size) {
+		unlock_page(page);
 		ret = VM_FAULT_NOPAGE;
-		goto out_unlock;
+		goto out_release;
 	}
 
 	if (!page_has_buffers(page))
 		create_empty_buffers(page, sb->s_blocksize, 0);
+	apfs_wait_page_inflight(page);
 
-	size = i_size_read(inode);
 	if (page->index == size >> PAGE_SHIFT)
 		len = size & ~PAGE_MASK;
 	else
 		len = PAGE_SIZE;
 
-	/* The blocks were read on the fault, mark them as unmapped for CoW */
+	/* The blocks were read on the fault, mark them as delayed for CoW */
 	head = page_buffers(page);
 	blocksize = head->b_size;
 	for (bh = head, block_start = 0; bh != head || !block_start;
@@ -65,30 +64,22 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 		if (len > block_start) {
 			/* If it's not a hole, the fault read it already */
 			ASSERT(!buffer_mapped(bh) || buffer_uptodate(bh));
-			if (buffer_trans(bh))
+			if (buffer_trans(bh) || buffer_delay(bh))
 				continue;
 			clear_buffer_mapped(bh);
+			set_buffer_uptodate(bh);
+			set_buffer_delay(bh);
+			++delayed;
 		}
 	}
-	unlock_page(page); /* XXX: race? */
+	if (delayed)
+		atomic_add(delayed, &APFS_I(inode)->i_delayed_blks);
 
-	err = block_page_mkwrite(vma, vmf, apfs_get_new_block);
-	if (err)
-		goto out_abort;
 	set_page_dirty(page);
+	wait_for_stable_page(page);
 
-	/* An immediate commit would leave the page unlocked */
-	APFS_SB(sb)->s_nxi->nx_transaction.t_state |= APFS_NX_TRANS_DEFER_COMMIT;
-
-	err = apfs_transaction_commit(sb);
-	if (err)
-		goto out_unlock;
-	goto out;
-
-out_unlock:
-	unlock_page(page);
-out_abort:
-	apfs_transaction_abort(sb);
+out_release:
+	apfs_release_blocks(sb, blkcount - delayed);
 out:
 	if (err)
 		ret = block_page_mkwrite_return(err);
@@ -113,26 +104,230 @@ static int apfs_file_mmap(struct file * file, struct vm_area_struct * vma)
 	return 0;
 }
 
+/**
+ * apfs_file_read_iter - Read data from a regular file
+ * @iocb:	metadata for the io operation
+ * @to:		destination for the data read
+ *
+ * With IOCB_NOWAIT, the read is restricted to the page cache: any readahead
+ * would map its whole window with apfs_get_block(), which sleeps on the big
+ * semaphore and on catalog node reads.  The caller gets -EAGAIN and can retry
+ * from a context that is allowed to block.
+ */
+static ssize_t apfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0) /* No IOCB_NOIO before */
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		iocb->ki_flags |= IOCB_NOIO;
+#endif
+	return generic_file_read_iter(iocb, to);
+}
+
+static int apfs_file_open(struct inode *inode, struct file *filp)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	/* Buffered reads honor IOCB_NOWAIT, see apfs_file_read_iter() */
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
+	return generic_file_open(inode, filp);
+}
+
 /*
- * Just flush the whole transaction for now (TODO), since that's technically
- * correct and easy to implement.
+ * Changes to the data of a file can usually be made durable through the fsync
+ * log; everything else requires flushing the whole transaction.
  */
 int apfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
 	struct inode *inode = file->f_mapping->host;
 	struct super_block *sb = inode->i_sb;
+	int err;
+
+	/* Pages dirtied through mmap still need their blocks allocated */
+	err = filemap_write_and_wait_range(inode->i_mapping, start, end);
+	if (err)
+		return err;
+	if (!apfs_fsync_log_write(inode))
+		return 0;
+	return apfs_fsync_log_commit(sb);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0) /* No remap_file_range() before */
+
+/* Maximum number of blocks remapped in a single transaction */
+#define APFS_DEDUPE_CHUNK_BLOCKS	256
+
+/**
+ * apfs_dedupe_chunk - Share a range of blocks between two files
+ * @src:	inode that owns the blocks
+ * @dst:	inode to remap
+ * @src_blk:	first logical block of the range in @src
+ * @dst_blk:	first logical block of the range in @dst
+ * @blkcount:	length of the range (in blocks)
+ * @shared:	incremented by the number of blocks remapped
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_dedupe_chunk(struct inode *src, struct inode *dst, u64 src_blk,
+			     u64 dst_blk, u64 blkcount, u64 *shared)
+{
+	struct super_block *sb = dst->i_sb;
+	struct apfs_dstream_info *src_ds = &APFS_I(src)->i_dstream;
+	struct apfs_dstream_info *dst_ds = &APFS_I(dst)->i_dstream;
+	struct apfs_max_ops maxops;
+	u64 count = 0;
+	int err;
+
+	maxops.cat = 2 * APFS_UPDATE_INODE_MAXOPS() + blkcount * APFS_SHARE_BLOCK_MAXOPS();
+	maxops.blks = 0;
+
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+	/* The source inode changes too, when its extent cache gets flushed */
+	apfs_inode_join_transaction(sb, src);
+	apfs_inode_join_transaction(sb, dst);
 
-	return apfs_sync_fs(sb, true /* wait */);
+	/* The cached extents must reach the catalog before the records change */
+	err = apfs_flush_extent_cache(src_ds);
+	if (err)
+		goto fail;
+	err = apfs_flush_extent_cache(dst_ds);
+	if (err)
+		goto fail;
+
+	err = apfs_dstream_share_range(src_ds, dst_ds, src_blk, dst_blk, blkcount, &count);
+	if (err)
+		goto fail;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	*shared += count;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
 }
 
+/**
+ * apfs_unmap_range_buffers - Drop the block mappings of cached buffers
+ * @inode:	the inode
+ * @start:	first byte of the range
+ * @end:	last byte of the range
+ *
+ * The buffers keep their contents, but they will have to be mapped again before
+ * their next write.
+ */
+static void apfs_unmap_range_buffers(struct inode *inode, loff_t start, loff_t end)
+{
+	pgoff_t index;
+
+	for (index = start >> PAGE_SHIFT; index <= end >> PAGE_SHIFT; ++index) {
+		struct buffer_head *bh, *head;
+		struct page *page;
+		loff_t pos;
+
+		page = find_lock_page(inode->i_mapping, index);
+		if (!page)
+			continue;
+		wait_on_page_writeback(page);
+		if (page_has_buffers(page)) {
+			pos = page_offset(page);
+			head = bh = page_buffers(page);
+			do {
+				if (pos >= start && pos <= end)
+					clear_buffer_mapped(bh);
+				pos += bh->b_size;
+				bh = bh->b_this_page;
+			} while (bh != head);
+		}
+		unlock_page(page);
+		put_page(page);
+		cond_resched();
+	}
+}
+
+/*
+ * Only deduplication is supported for now: the ranges are compared by the vfs
+ * and then the destination gets remapped to the blocks of the source.
+ */
+static loff_t apfs_remap_file_range(struct file *src_file, loff_t src_off,
+				    struct file *dst_file, loff_t dst_off,
+				    loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(src_file);
+	struct inode *dst = file_inode(dst_file);
+	struct super_block *sb = dst->i_sb;
+	u64 src_blk, dst_blk, blkcount, chunk, shared = 0;
+	int err;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+	if (!(remap_flags & REMAP_FILE_DEDUP))
+		return -EOPNOTSUPP;
+	/* Each file gets its own key on encrypted volumes */
+	if (apfs_vol_is_encrypted(sb))
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+
+	err = generic_remap_file_range_prep(src_file, src_off, dst_file, dst_off,
+					    &len, remap_flags);
+	if (err < 0 || len == 0)
+		goto out;
+
+	/* A partial last block can only be shared if it ends both files */
+	if (src_off + len != i_size_read(src) || dst_off + len != i_size_read(dst))
+		len = round_down(len, sb->s_blocksize);
+	src_blk = src_off >> sb->s_blocksize_bits;
+	dst_blk = dst_off >> sb->s_blocksize_bits;
+	blkcount = (len + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+
+	while (blkcount) {
+		chunk = min_t(u64, blkcount, APFS_DEDUPE_CHUNK_BLOCKS);
+		err = apfs_dedupe_chunk(src, dst, src_blk, dst_blk, chunk, &shared);
+		if (err)
+			break;
+		src_blk += chunk;
+		dst_blk += chunk;
+		blkcount -= chunk;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	/*
+	 * The cached pages have the same contents, but their buffers may still
+	 * be mapped to the old blocks, which may get reused. The remap is
+	 * already committed, so the pages that can't be dropped just get their
+	 * mappings cleared instead.
+	 */
+	if (shared && invalidate_inode_pages2_range(dst->i_mapping, dst_off >> PAGE_SHIFT,
+						    (dst_off + len - 1) >> PAGE_SHIFT))
+		apfs_unmap_range_buffers(dst, dst_off, dst_off + len - 1);
+
+out:
+	unlock_two_nondirectories(src, dst);
+	if (err < 0)
+		return err;
+	return len;
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0) */
+
 const struct file_operations apfs_file_operations = {
 	.llseek		= generic_file_llseek,
-	.read_iter	= generic_file_read_iter,
+	.read_iter	= apfs_file_read_iter,
 	.write_iter	= generic_file_write_iter,
 	.mmap		= apfs_file_mmap,
-	.open		= generic_file_open,
+	.open		= apfs_file_open,
 	.fsync		= apfs_fsync,
 	.unlocked_ioctl	= apfs_file_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	.remap_file_range = apfs_remap_file_range,
+#endif
 };
 
 const struct inode_operations apfs_file_inode_operations = {
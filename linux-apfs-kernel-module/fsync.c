@@ -0,0 +1,857 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include "apfs.h"
+
+/*
+ * An fsync() call used to force a full checkpoint, which rewrites the spaceman
+ * and the roots of every tree that changed, and waits for it all. The fsync log
+ * allows a cheaper alternative for the common case of a file that only had its
+ * data modified: the new data blocks get written in place, since they are free
+ * on the latest checkpoint, and a single log block records where they belong.
+ * If the transaction never gets committed, the next read-write mount finds the
+ * log entries that are newer than the volume superblock and replays them, while
+ * all writers to the container are held back. A log that can't be replayed is
+ * never dropped: the volume stays read-only instead, until it gets fixed.
+ *
+ * Everything else still goes through a full checkpoint: changes to the names,
+ * the attributes or the xattrs of the inode, truncations and sparse files.
+ */
+
+static struct qstr apfs_fsync_log_qname = QSTR_INIT(APFS_FSYNC_LOG_NAME,
+					sizeof(APFS_FSYNC_LOG_NAME) - 1);
+
+/*
+ * Data block of a file to be written by an fsync() call
+ */
+struct apfs_fsync_log_buf {
+	struct buffer_head *bh;
+	u64 lblk;	/* Logical block number in the file */
+};
+
+static int apfs_fsync_log_buf_cmp(const void *a, const void *b)
+{
+	const struct apfs_fsync_log_buf *buf_a = a;
+	const struct apfs_fsync_log_buf *buf_b = b;
+
+	if (buf_a->lblk < buf_b->lblk)
+		return -1;
+	return buf_a->lblk > buf_b->lblk;
+}
+
+/**
+ * apfs_fsync_log_max_exts - Maximum number of extents in a log block
+ * @sb: filesystem superblock
+ */
+static inline u32 apfs_fsync_log_max_exts(struct super_block *sb)
+{
+	struct apfs_fsync_log_phys *raw;
+
+	return (sb->s_blocksize - sizeof(*raw)) / sizeof(raw->fl_exts[0]);
+}
+
+/**
+ * apfs_fsync_log_load - Find the fsync log file for a volume, if it exists
+ * @sb: filesystem superblock
+ *
+ * A missing log file is fine, the first fsync() call will create it. Returns 0
+ * on success or a negative error code in case of failure; in that case the log
+ * stays disabled, and the caller keeps the volume read-only.
+ */
+static int apfs_fsync_log_load(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_fsync_log *log = &sbi->s_fsync_log;
+	struct apfs_dstream_info *dstream;
+	struct inode *inode;
+	u64 ino;
+	int i, err;
+
+	err = apfs_inode_by_name(sbi->s_private_dir, &apfs_fsync_log_qname, &ino);
+	if (err == -ENODATA)
+		return 0;
+	if (err)
+		goto fail;
+
+	inode = apfs_iget(sb, ino);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto fail;
+	}
+	dstream = &APFS_I(inode)->i_dstream;
+	if (!S_ISREG(inode->i_mode) ||
+	    dstream->ds_size != APFS_FSYNC_LOG_BLOCKS << sb->s_blocksize_bits) {
+		err = -EFSCORRUPTED;
+		goto fail_put;
+	}
+
+	down_read(&nxi->nx_big_sem);
+	for (i = 0; i < APFS_FSYNC_LOG_BLOCKS; ++i) {
+		struct buffer_head map_bh = {0};
+
+		map_bh.b_size = sb->s_blocksize;
+		err = __apfs_get_block(dstream, i, &map_bh, 0 /* create */);
+		if (!err && !buffer_mapped(&map_bh))
+			err = -EFSCORRUPTED;
+		if (err)
+			break;
+		log->fl_map[i] = map_bh.b_blocknr;
+	}
+	up_read(&nxi->nx_big_sem);
+	if (err)
+		goto fail_put;
+
+	log->fl_inode = inode;
+	return 0;
+
+fail_put:
+	iput(inode);
+fail:
+	apfs_warn(sb, "the fsync log is not usable (%d)", err);
+	log->fl_disabled = true;
+	return err;
+}
+
+/**
+ * apfs_fsync_log_put - Release the fsync log file on unmount
+ * @sb: filesystem superblock
+ */
+void apfs_fsync_log_put(struct super_block *sb)
+{
+	struct apfs_fsync_log *log = &APFS_SB(sb)->s_fsync_log;
+
+	iput(log->fl_inode);
+	log->fl_inode = NULL;
+}
+
+/**
+ * apfs_fsync_log_create - Create the file for the fsync log
+ * @sb: filesystem superblock
+ *
+ * The file gets a fixed size, and its blocks are zeroed on commit; they never
+ * move after that. Returns 0 on success or a negative error code in case of
+ * failure.
+ */
+static int apfs_fsync_log_create(struct super_block *sb)
+{
+	struct apfs_fsync_log *log = &APFS_SB(sb)->s_fsync_log;
+	struct apfs_dstream_info *dstream;
+	struct apfs_file_extent run = {0};
+	struct inode *inode;
+	pgoff_t index, last;
+	u64 dsblock = 0;
+	int err;
+
+	inode = apfs_create_private_file(sb, &apfs_fsync_log_qname);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	dstream = &APFS_I(inode)->i_dstream;
+
+	err = apfs_inode_create_dstream_rec(inode);
+	if (err)
+		goto fail;
+
+	last = ((loff_t)APFS_FSYNC_LOG_BLOCKS << sb->s_blocksize_bits) >> PAGE_SHIFT;
+	for (index = 0; index < last; ++index) {
+		struct buffer_head *bh, *head;
+		struct page *page;
+
+		page = grab_cache_page(inode->i_mapping, index);
+		if (!page) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		if (!page_has_buffers(page))
+			create_empty_buffers(page, sb->s_blocksize, 0);
+		zero_user(page, 0, PAGE_SIZE);
+
+		head = bh = page_buffers(page);
+		do {
+			err = apfs_dstream_defrag_block(dstream, dsblock, bh, &run);
+			if (err)
+				break;
+			set_buffer_uptodate(bh);
+			log->fl_map[dsblock++] = bh->b_blocknr;
+			bh = bh->b_this_page;
+		} while (bh != head);
+
+		SetPageUptodate(page);
+		unlock_page(page);
+		put_page(page);
+		if (err)
+			goto fail;
+	}
+	err = apfs_dstream_defrag_flush(dstream, &run);
+	if (err)
+		goto fail;
+
+	dstream->ds_size = (u64)APFS_FSYNC_LOG_BLOCKS << sb->s_blocksize_bits;
+	i_size_write(inode, dstream->ds_size);
+	apfs_inode_join_transaction(sb, inode);
+
+	log->fl_inode = inode;
+	return 0;
+
+fail:
+	iput(inode);
+	return err;
+}
+static int APFS_FSYNC_LOG_CREATE_MAXOPS(void)
+{
+	return APFS_CREATE_PRIVATE_FILE_MAXOPS() + 1 /* dstream record */ +
+	       APFS_UPDATE_INODE_MAXOPS() +
+	       APFS_FSYNC_LOG_BLOCKS * APFS_DEFRAG_BLOCK_MAXOPS();
+}
+
+/**
+ * apfs_fsync_log_commit - Full fallback for fsync() calls that can't be logged
+ * @sb: filesystem superblock
+ *
+ * Commits the whole transaction, and creates the fsync log file first if it
+ * doesn't exist yet. Returns 0 on success or a negative error code in case of
+ * failure.
+ */
+int apfs_fsync_log_commit(struct super_block *sb)
+{
+	struct apfs_fsync_log *log = &APFS_SB(sb)->s_fsync_log;
+	struct apfs_max_ops maxops = {0};
+	bool create;
+	int err;
+
+	/* The log doesn't keep track of the crypto records */
+	create = !log->fl_inode && !log->fl_disabled && !apfs_vol_is_encrypted(sb);
+	if (create) {
+		maxops.cat = APFS_FSYNC_LOG_CREATE_MAXOPS();
+		maxops.blks = APFS_FSYNC_LOG_BLOCKS;
+	}
+
+	err = apfs_transaction_start(sb, maxops);
+	if (err == -ENOSPC && create)
+		return apfs_sync_fs(sb, true /* wait */);
+	if (err)
+		return err;
+
+	/* Check again under the lock, another fsync() may have beaten us */
+	if (create && !log->fl_inode) {
+		err = apfs_fsync_log_create(sb);
+		if (err)
+			goto fail;
+	}
+
+	APFS_NXI(sb)->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_fsync_log_wait - Wait for the checkpoints that are already sealed
+ * @sb: filesystem superblock
+ *
+ * Returns 0 if they all reached the disk, or a negative error code otherwise.
+ */
+static int apfs_fsync_log_wait(struct super_block *sb)
+{
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+	int err;
+
+	mutex_lock(&nx_trans->t_flush_mutex);
+	err = nx_trans->t_flush_err;
+	mutex_unlock(&nx_trans->t_flush_mutex);
+	return err;
+}
+
+/**
+ * apfs_fsync_log_build - Prepare the log block for an fsync() call
+ * @inode:	the inode being synced
+ * @bufs:	data buffers for the inode in the current transaction
+ * @nbufs:	number of buffers in @bufs, sorted by logical block
+ * @raw:	buffer for the log block, already zeroed
+ *
+ * Merges the buffers into extents and fills the inode fields of @raw; only the
+ * fields that depend on the position in the log are left unset. Returns 0 on
+ * success, or -EOPNOTSUPP if the extents don't fit in a single block.
+ */
+static int apfs_fsync_log_build(struct inode *inode, struct apfs_fsync_log_buf *bufs,
+				u32 nbufs, struct apfs_fsync_log_phys *raw)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_fsync_log_extent *ext = NULL;
+	u32 max_exts = apfs_fsync_log_max_exts(sb);
+	u32 ext_count = 0;
+	u32 i;
+
+	for (i = 0; i < nbufs; ++i) {
+		u64 lblk = bufs[i].lblk;
+		u64 pblk = bufs[i].bh->b_blocknr;
+
+		if (ext) {
+			u64 ext_count_blks = le64_to_cpu(ext->fe_count);
+
+			if (lblk == le64_to_cpu(ext->fe_lblk) + ext_count_blks &&
+			    pblk == le64_to_cpu(ext->fe_pblk) + ext_count_blks) {
+				le64_add_cpu(&ext->fe_count, 1);
+				continue;
+			}
+		}
+		if (ext_count == max_exts)
+			return -EOPNOTSUPP;
+		ext = &raw->fl_exts[ext_count++];
+		ext->fe_lblk = cpu_to_le64(lblk);
+		ext->fe_pblk = cpu_to_le64(pblk);
+		ext->fe_count = cpu_to_le64(1);
+	}
+
+	raw->fl_o.o_type = cpu_to_le32(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_FSYNC_LOG);
+	raw->fl_ext_count = cpu_to_le32(ext_count);
+	raw->fl_ino = cpu_to_le64(apfs_ino(inode));
+	raw->fl_size = cpu_to_le64(dstream->ds_size);
+	raw->fl_mtime = cpu_to_le64(timespec64_to_ns(&inode->i_mtime));
+	raw->fl_ctime = cpu_to_le64(timespec64_to_ns(&inode->i_ctime));
+	return 0;
+}
+
+/**
+ * apfs_fsync_log_append - Write a prepared block at the end of the fsync log
+ * @sb:		filesystem superblock
+ * @raw:	contents of the block, built by apfs_fsync_log_build()
+ * @xid:	transaction that made the logged changes
+ *
+ * The caller must hold the log mutex, and the data blocks must already be on
+ * disk. Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_fsync_log_append(struct super_block *sb,
+				 struct apfs_fsync_log_phys *raw, u64 xid)
+{
+	struct apfs_fsync_log *log = &APFS_SB(sb)->s_fsync_log;
+	struct buffer_head *bh;
+	u64 bno;
+	int err;
+
+	lockdep_assert_held(&log->fl_lock);
+
+	if (log->fl_xid > xid) {
+		/* A later fsync() already waited for our checkpoint */
+		return 0;
+	}
+	if (log->fl_xid < xid) {
+		log->fl_xid = xid;
+		log->fl_next = 0;
+	}
+	if (log->fl_next >= APFS_FSYNC_LOG_BLOCKS)
+		return -EOPNOTSUPP;
+
+	/* The log entries must never build on top of a missing checkpoint */
+	err = apfs_fsync_log_wait(sb);
+	if (err)
+		goto fail;
+
+	bno = log->fl_map[log->fl_next];
+	raw->fl_o.o_oid = cpu_to_le64(bno);
+	raw->fl_o.o_xid = cpu_to_le64(xid - 1);
+	raw->fl_index = cpu_to_le32(log->fl_next);
+	apfs_obj_set_csum(sb, &raw->fl_o);
+
+	bh = __getblk(APFS_NXI(sb)->nx_bdev, bno, sb->s_blocksize);
+	if (!bh) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	lock_buffer(bh);
+	memcpy(bh->b_data, raw, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	/* The flush takes care of the data blocks, FUA of the log block */
+	submit_bh(REQ_OP_WRITE, REQ_SYNC | REQ_PREFLUSH | REQ_FUA, bh);
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh))
+		err = -EIO;
+	brelse(bh);
+	if (err)
+		goto fail;
+
+	log->fl_next++;
+	return 0;
+
+fail:
+	/* Don't leave a gap in the log, later entries would be lost */
+	log->fl_next = APFS_FSYNC_LOG_BLOCKS;
+	return err;
+}
+
+/**
+ * apfs_fsync_log_write - Make the changes to an inode durable through the log
+ * @inode: the inode to sync, with its dirty pages already written back
+ *
+ * Returns 0 on success, -EOPNOTSUPP if the changes can't be logged, or another
+ * negative error code in case of failure. The caller should fall back to a
+ * full checkpoint on any error.
+ */
+int apfs_fsync_log_write(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	struct apfs_fsync_log *log = &APFS_SB(sb)->s_fsync_log;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_fsync_log_buf *bufs = NULL;
+	struct apfs_fsync_log_phys *raw = NULL;
+	struct apfs_bh_info *bhi;
+	u32 nbufs = 0, i;
+	u64 xid;
+	int err;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	apfs_big_down_write(nxi, APFS_LOCK_SITE_OTHER);
+	if (!log->fl_inode || (sb->s_flags & SB_RDONLY)) {
+		err = -EOPNOTSUPP;
+		goto out_unlock;
+	}
+	if (!nx_trans->t_old_msb) {
+		/* No transaction in progress, so all changes are already sealed */
+		apfs_big_up_write(nxi);
+		return apfs_fsync_log_wait(sb);
+	}
+	xid = nxi->nx_xid;
+	if (ai->i_nolog_xid == xid || ai->i_dstream.ds_sparse_bytes) {
+		err = -EOPNOTSUPP;
+		goto out_unlock;
+	}
+
+	raw = kzalloc(sb->s_blocksize, GFP_NOFS);
+	bufs = kvmalloc_array(nx_trans->t_buffers_count + 1, sizeof(*bufs), GFP_NOFS);
+	if (!raw || !bufs) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+
+	/* The data blocks for the file were all allocated by this transaction */
+	list_for_each_entry(bhi, &nx_trans->t_buffers, list) {
+		struct buffer_head *bh = bhi->bh;
+		struct page *page = bh->b_page;
+
+		if (!page || page->mapping != inode->i_mapping)
+			continue;
+		if (!buffer_uptodate(bh)) {
+			err = -EOPNOTSUPP;
+			goto out_put;
+		}
+		get_bh(bh);
+		bufs[nbufs].bh = bh;
+		bufs[nbufs].lblk = ((u64)page->index << (PAGE_SHIFT - inode->i_blkbits)) +
+				   (bh_offset(bh) >> inode->i_blkbits);
+		++nbufs;
+	}
+	if (!nbufs && list_empty(&ai->i_list)) {
+		/* The inode is clean in this transaction */
+		apfs_big_up_write(nxi);
+		err = apfs_fsync_log_wait(sb);
+		goto out_free;
+	}
+
+	sort(bufs, nbufs, sizeof(*bufs), apfs_fsync_log_buf_cmp, NULL);
+	err = apfs_fsync_log_build(inode, bufs, nbufs, raw);
+	if (err)
+		goto out_put;
+
+	/* Start the data writes now, but wait for them without the big lock */
+	for (i = 0; i < nbufs; ++i) {
+		struct buffer_head *bh = bufs[i].bh;
+
+		lock_buffer(bh);
+		get_bh(bh);
+		bh->b_end_io = end_buffer_write_sync;
+		submit_bh(REQ_OP_WRITE, REQ_SYNC, bh);
+	}
+	apfs_big_up_write(nxi);
+
+	for (i = 0; i < nbufs; ++i) {
+		wait_on_buffer(bufs[i].bh);
+		if (!buffer_uptodate(bufs[i].bh))
+			err = -EIO;
+	}
+	if (!err) {
+		mutex_lock(&log->fl_lock);
+		err = apfs_fsync_log_append(sb, raw, xid);
+		mutex_unlock(&log->fl_lock);
+	}
+	goto out_free;
+
+out_put:
+	for (i = 0; i < nbufs; ++i)
+		brelse(bufs[i].bh);
+	nbufs = 0;
+out_unlock:
+	apfs_big_up_write(nxi);
+out_free:
+	for (i = 0; i < nbufs; ++i)
+		brelse(bufs[i].bh);
+	kvfree(bufs);
+	kfree(raw);
+	return err;
+}
+
+/**
+ * apfs_fsync_log_block_valid - Check if a log block belongs to a checkpoint
+ * @sb:		filesystem superblock
+ * @bh:		buffer head for the log block
+ * @base:	xid of the checkpoint
+ * @index:	expected position of the block in the log
+ */
+static bool apfs_fsync_log_block_valid(struct super_block *sb, struct buffer_head *bh,
+				       u64 base, u32 index)
+{
+	struct apfs_fsync_log_phys *raw = (void *)bh->b_data;
+
+	if (le32_to_cpu(raw->fl_o.o_type) != (APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_FSYNC_LOG))
+		return false;
+	if (le64_to_cpu(raw->fl_o.o_oid) != bh->b_blocknr)
+		return false;
+	if (le64_to_cpu(raw->fl_o.o_xid) != base)
+		return false;
+	if (le32_to_cpu(raw->fl_index) != index)
+		return false;
+	if (le32_to_cpu(raw->fl_ext_count) > apfs_fsync_log_max_exts(sb))
+		return false;
+	return apfs_obj_verify_csum(sb, &raw->fl_o);
+}
+
+/*
+ * Run of physical blocks listed in the fsync log
+ */
+struct apfs_fsync_log_run {
+	u64 pblk;
+	u64 count;
+};
+
+static int apfs_fsync_log_run_cmp(const void *a, const void *b)
+{
+	const struct apfs_fsync_log_run *run_a = a;
+	const struct apfs_fsync_log_run *run_b = b;
+
+	if (run_a->pblk < run_b->pblk)
+		return -1;
+	return run_a->pblk > run_b->pblk;
+}
+
+/**
+ * apfs_fsync_log_claim - Mark as used all data blocks listed in the log
+ * @sb:		filesystem superblock
+ * @bhs:	buffer heads for the log blocks
+ * @count:	number of log blocks in @bhs
+ * @ext_total:	total number of extents in the log blocks
+ *
+ * The same block may be logged by more than one fsync() call, so the extents
+ * get merged first. Every block left must still be free; if it isn't, another
+ * writer has reused it since the checkpoint and the logged data is gone.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_fsync_log_claim(struct super_block *sb, struct buffer_head **bhs,
+				u32 count, u32 ext_total)
+{
+	struct apfs_fsync_log_run *runs;
+	u32 nruns = 0, i, j;
+	u64 bno = 0;
+	int err = 0;
+
+	runs = kvmalloc_array(ext_total, sizeof(*runs), GFP_NOFS);
+	if (!runs)
+		return -ENOMEM;
+	for (i = 0; i < count; ++i) {
+		struct apfs_fsync_log_phys *raw = (void *)bhs[i]->b_data;
+
+		for (j = 0; j < le32_to_cpu(raw->fl_ext_count); ++j) {
+			runs[nruns].pblk = le64_to_cpu(raw->fl_exts[j].fe_pblk);
+			runs[nruns].count = le64_to_cpu(raw->fl_exts[j].fe_count);
+			++nruns;
+		}
+	}
+	sort(runs, nruns, sizeof(*runs), apfs_fsync_log_run_cmp, NULL);
+
+	for (i = 0; i < nruns; ++i) {
+		u64 end = runs[i].pblk + runs[i].count;
+
+		/* Skip the blocks that were already claimed for an earlier run */
+		for (bno = max(bno, runs[i].pblk); bno < end; ++bno) {
+			err = apfs_spaceman_claim_block(sb, bno);
+			if (err == -EEXIST) {
+				apfs_err(sb, "logged block 0x%llx was reused", bno);
+				err = -EFSCORRUPTED;
+			}
+			if (err)
+				goto out;
+			apfs_vol_alloc_add(sb, 1);
+		}
+	}
+out:
+	kvfree(runs);
+	return err;
+}
+
+/**
+ * apfs_fsync_log_apply_extent - Map a logged run of blocks into a data stream
+ * @dstream:	data stream info
+ * @lblk:	first logical block of the run
+ * @pblk:	first physical block of the run
+ * @count:	number of blocks in the run
+ *
+ * The same blocks may be logged more than once, so the parts of the run that
+ * are already mapped get skipped. Returns 0 on success or a negative error code
+ * in case of failure.
+ */
+static int apfs_fsync_log_apply_extent(struct apfs_dstream_info *dstream,
+				       u64 lblk, u64 pblk, u64 count)
+{
+	struct super_block *sb = dstream->ds_sb;
+	int err;
+
+	while (count) {
+		struct buffer_head map_bh = {0};
+		struct apfs_file_extent run = {0};
+		u64 size_blks, len;
+		bool mapped = false;
+
+		size_blks = (dstream->ds_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+		if (lblk < size_blks) {
+			map_bh.b_size = min(count, size_blks - lblk) << sb->s_blocksize_bits;
+			err = __apfs_get_block(dstream, lblk, &map_bh, 0 /* create */);
+			if (err)
+				return err;
+			len = map_bh.b_size >> sb->s_blocksize_bits;
+			if (!len)
+				return -EFSCORRUPTED;
+			mapped = buffer_mapped(&map_bh) && map_bh.b_blocknr == pblk;
+		} else {
+			len = count;
+		}
+
+		if (!mapped) {
+			run.logical_addr = lblk << sb->s_blocksize_bits;
+			run.phys_block_num = pblk;
+			run.len = len << sb->s_blocksize_bits;
+			err = apfs_dstream_defrag_flush(dstream, &run);
+			if (err)
+				return err;
+		}
+		lblk += len;
+		pblk += len;
+		count -= len;
+	}
+	return 0;
+}
+
+/**
+ * apfs_fsync_log_apply - Replay the changes recorded in a log block
+ * @inode:	the inode that was synced
+ * @raw:	the log block
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_fsync_log_apply(struct inode *inode, struct apfs_fsync_log_phys *raw)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	u32 ext_count = le32_to_cpu(raw->fl_ext_count);
+	u64 size = le64_to_cpu(raw->fl_size);
+	u32 i;
+	int err;
+
+	apfs_inode_join_transaction(sb, inode);
+	err = apfs_inode_create_dstream_rec(inode);
+	if (err)
+		return err;
+
+	for (i = 0; i < ext_count; ++i) {
+		struct apfs_fsync_log_extent *ext = &raw->fl_exts[i];
+
+		err = apfs_fsync_log_apply_extent(dstream, le64_to_cpu(ext->fe_lblk),
+						  le64_to_cpu(ext->fe_pblk),
+						  le64_to_cpu(ext->fe_count));
+		if (err)
+			return err;
+	}
+
+	/* Truncations are never logged */
+	if (size > dstream->ds_size) {
+		dstream->ds_size = size;
+		i_size_write(inode, size);
+	}
+	inode->i_mtime = ns_to_timespec64(le64_to_cpu(raw->fl_mtime));
+	inode->i_ctime = ns_to_timespec64(le64_to_cpu(raw->fl_ctime));
+	return 0;
+}
+
+/**
+ * apfs_fsync_log_replay - Replay the fsync log entries that never got committed
+ * @sb: filesystem superblock
+ *
+ * Called on read-write mounts, with all other writers to the container held
+ * back. The log entries were written for the checkpoint before the transaction
+ * that made the changes; if the volume superblock is not newer than that, the
+ * transaction never reached the disk and the entries must be replayed, even if
+ * other volumes of the container have been committed since. Returns 0 on
+ * success or a negative error code in case of failure.
+ */
+static int apfs_fsync_log_replay(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	struct apfs_fsync_log *log = &APFS_SB(sb)->s_fsync_log;
+	struct buffer_head **bhs = NULL;
+	struct inode **inodes = NULL;
+	struct apfs_max_ops maxops;
+	u32 count = 0, ext_total = 0, i;
+	u64 base = 0, vol_xid;
+	int err = 0;
+
+	if (!log->fl_inode)
+		return 0;
+
+	/* No transaction has touched this volume since the mount */
+	down_read(&nxi->nx_big_sem);
+	vol_xid = le64_to_cpu(APFS_SB(sb)->s_vsb_raw->apfs_o.o_xid);
+	up_read(&nxi->nx_big_sem);
+
+	bhs = kcalloc(APFS_FSYNC_LOG_BLOCKS, sizeof(*bhs), GFP_KERNEL);
+	inodes = kcalloc(APFS_FSYNC_LOG_BLOCKS, sizeof(*inodes), GFP_KERNEL);
+	if (!bhs || !inodes) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (count = 0; count < APFS_FSYNC_LOG_BLOCKS; ++count) {
+		struct apfs_fsync_log_phys *raw;
+		struct buffer_head *bh;
+		struct inode *inode;
+
+		bh = apfs_sb_bread(sb, log->fl_map[count]);
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+		raw = (void *)bh->b_data;
+		if (!count)
+			base = le64_to_cpu(raw->fl_o.o_xid);
+		if (base < vol_xid || !apfs_fsync_log_block_valid(sb, bh, base, count)) {
+			/* The end of the log, or a log that is already committed */
+			brelse(bh);
+			break;
+		}
+
+		/* Get the inodes now, it can't be done inside the transaction */
+		inode = apfs_iget(sb, le64_to_cpu(raw->fl_ino));
+		if (IS_ERR(inode)) {
+			err = PTR_ERR(inode);
+			brelse(bh);
+			break;
+		}
+		if (!S_ISREG(inode->i_mode)) {
+			err = -EFSCORRUPTED;
+			iput(inode);
+			brelse(bh);
+			break;
+		}
+		bhs[count] = bh;
+		inodes[count] = inode;
+		ext_total += le32_to_cpu(raw->fl_ext_count);
+	}
+	if (err || !count)
+		goto out;
+
+	maxops.cat = count * APFS_UPDATE_INODE_MAXOPS() +
+		     ext_total * APFS_DEFRAG_BLOCK_MAXOPS();
+	maxops.blks = 0;
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		goto out;
+
+	/* Claim all the blocks before the tree updates can allocate them */
+	err = apfs_fsync_log_claim(sb, bhs, count, ext_total);
+	if (err)
+		goto out_abort;
+	for (i = 0; i < count; ++i) {
+		err = apfs_fsync_log_apply(inodes[i], (void *)bhs[i]->b_data);
+		if (err)
+			goto out_abort;
+	}
+
+	nx_trans->t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto out_abort;
+	apfs_notice(sb, "replayed %u fsync log entries", count);
+	goto out;
+
+out_abort:
+	apfs_transaction_abort(sb);
+out:
+	for (i = 0; i < count; ++i) {
+		iput(inodes[i]);
+		brelse(bhs[i]);
+	}
+	kfree(inodes);
+	kfree(bhs);
+	return err;
+}
+
+/**
+ * apfs_fsync_log_mount - Load and replay the fsync log on a read-write mount
+ * @sb: filesystem superblock
+ *
+ * The writers to the container stay blocked until this is done. If the log
+ * can't be replayed, the volume is set read-only so that its entries are not
+ * overwritten or left behind by a new checkpoint.
+ */
+void apfs_fsync_log_mount(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	int err;
+
+	mutex_lock(&nxi->nx_replay_mutex);
+	WRITE_ONCE(nxi->nx_replay_task, current);
+	err = apfs_fsync_log_load(sb);
+	if (!err)
+		err = apfs_fsync_log_replay(sb);
+	WRITE_ONCE(nxi->nx_replay_task, NULL);
+	mutex_unlock(&nxi->nx_replay_mutex);
+
+	if (err) {
+		apfs_big_down_write(nxi, APFS_LOCK_SITE_OTHER);
+		sb->s_flags |= SB_RDONLY;
+		apfs_big_up_write(nxi);
+		apfs_err(sb, "failed to replay the fsync log (%d), mounting read-only", err);
+	}
+
+	if (atomic_dec_and_test(&nxi->nx_replay_count))
+		wake_up_all(&nxi->nx_replay_wait);
+}
+
+/**
+ * apfs_fsync_log_wait_replay - Wait for the fsync logs of new mounts to replay
+ * @nxi: container superblock info
+ *
+ * Called before each transaction; the replay itself is let through.
+ */
+void apfs_fsync_log_wait_replay(struct apfs_nxsb_info *nxi)
+{
+	wait_event(nxi->nx_replay_wait, !atomic_read(&nxi->nx_replay_count) ||
+					READ_ONCE(nxi->nx_replay_task) == current);
+}
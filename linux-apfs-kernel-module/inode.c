@@ -38,6 +38,133 @@ static int apfs_readpages(struct file *file, struct address_space *mapping,
 
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0) */
 
+/**
+ * apfs_sealed_readpage - Read a page from a sealed volume and verify its data
+ * @file:	file being read, may be NULL
+ * @page:	the locked page
+ *
+ * The data blocks go through the block device cache, so that each hash only
+ * needs to be checked once while the blocks stay in memory.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+static int apfs_sealed_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	unsigned int blocks = PAGE_SIZE >> inode->i_blkbits;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+	loff_t isize = i_size_read(inode);
+	loff_t tail = isize - page_offset(page);
+	char *kaddr;
+	unsigned int i;
+	int err = 0;
+
+	kaddr = kmap(page);
+	down_read(&nxi->nx_big_sem);
+	for (i = 0; i < blocks; ++i, ++iblock) {
+		struct buffer_head map = {0};
+		struct buffer_head *bh;
+		char *dst = kaddr + (i << inode->i_blkbits);
+
+		if ((loff_t)iblock << inode->i_blkbits >= isize) {
+			memset(dst, 0, (blocks - i) << inode->i_blkbits);
+			break;
+		}
+
+		map.b_size = sb->s_blocksize;
+		err = __apfs_get_block(dstream, iblock, &map, 0 /* create */);
+		if (err)
+			break;
+		if (!buffer_mapped(&map)) {
+			memset(dst, 0, sb->s_blocksize);
+			continue;
+		}
+
+		bh = apfs_seal_bread(dstream, iblock, map.b_blocknr);
+		if (IS_ERR(bh)) {
+			err = PTR_ERR(bh);
+			break;
+		}
+		memcpy(dst, bh->b_data, sb->s_blocksize);
+		brelse(bh);
+	}
+	up_read(&nxi->nx_big_sem);
+
+	/* The hashes cover whole blocks, but the page must be clean after EOF */
+	if (tail > 0 && tail < PAGE_SIZE)
+		memset(kaddr + tail, 0, PAGE_SIZE - tail);
+	kunmap(page);
+
+	if (err) {
+		SetPageError(page);
+	} else {
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+	}
+	unlock_page(page);
+	return err;
+}
+
+/**
+ * apfs_crypt_readpage - Read a page from a software encrypted volume
+ * @file:	file being read, may be NULL
+ * @page:	the locked page
+ *
+ * Each block is decrypted straight into the page, so the plaintext never
+ * reaches the block device cache.  Returns 0 on success, or a negative error
+ * code in case of failure.
+ */
+static int apfs_crypt_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	unsigned int blocks = PAGE_SIZE >> inode->i_blkbits;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+	loff_t isize = i_size_read(inode);
+	loff_t tail = isize - page_offset(page);
+	unsigned int i;
+	int err = 0;
+
+	down_read(&nxi->nx_big_sem);
+	for (i = 0; i < blocks; ++i, ++iblock) {
+		unsigned int offset = i << inode->i_blkbits;
+		u64 bno, tweak;
+
+		if ((loff_t)iblock << inode->i_blkbits >= isize) {
+			zero_user(page, offset, PAGE_SIZE - offset);
+			break;
+		}
+
+		err = apfs_dstream_map_tweak(dstream, iblock, &bno, &tweak);
+		if (err)
+			break;
+		if (!bno) {
+			zero_user(page, offset, sb->s_blocksize);
+			continue;
+		}
+		err = apfs_crypt_read_data(sb, bno, tweak, page, offset);
+		if (err)
+			break;
+	}
+	up_read(&nxi->nx_big_sem);
+
+	if (!err && tail > 0 && tail < PAGE_SIZE)
+		zero_user(page, tail, PAGE_SIZE - tail);
+
+	if (err) {
+		SetPageError(page);
+	} else {
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+	}
+	unlock_page(page);
+	return err;
+}
+
 /**
  * apfs_create_dstream_rec - Create a data stream record
  * @dstream: data stream info
@@ -84,7 +211,7 @@ out:
  * Does nothing if the record already exists.  TODO: support cloned files.
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_inode_create_dstream_rec(struct inode *inode)
+int apfs_inode_create_dstream_rec(struct inode *inode)
 {
 	struct apfs_inode_info *ai = APFS_I(inode);
 	int err;
@@ -367,6 +494,29 @@ out:
 	return ret;
 }
 
+/**
+ * apfs_forget_delayed_blocks - Drop reservations for blocks already allocated
+ * @inode:	the vfs inode
+ * @page:	the locked page
+ *
+ * Delayed blocks that got their CoW allocation from ->write_begin() don't need
+ * to wait for writeback anymore.
+ */
+static void apfs_forget_delayed_blocks(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bh, *head;
+
+	head = bh = page_buffers(page);
+	do {
+		if (buffer_delay(bh) && buffer_trans(bh)) {
+			clear_buffer_delay(bh);
+			atomic_dec(&APFS_I(inode)->i_delayed_blks);
+			apfs_release_blocks(inode->i_sb, 1);
+		}
+		bh = bh->b_this_page;
+	} while (bh != head);
+}
+
 static int apfs_write_begin(struct file *file, struct address_space *mapping,
 			    loff_t pos, unsigned int len, unsigned int flags,
 			    struct page **pagep, void **fsdata)
@@ -393,10 +543,10 @@ static int apfs_write_begin(struct file *file, struct address_space *mapping,
 		     blkcount * APFS_GET_NEW_BLOCK_MAXOPS();
 	maxops.blks = blkcount;
 
-	err = apfs_transaction_start(sb, maxops);
+	err = __apfs_transaction_start(sb, maxops, APFS_LOCK_SITE_WRITE_BEGIN);
 	if (err)
 		return err;
-	apfs_inode_join_transaction(sb, inode);
+	apfs_inode_join_transaction_data(sb, inode);
 
 	err = apfs_inode_create_dstream_rec(inode);
 	if (err)
@@ -416,6 +566,7 @@ static int apfs_write_begin(struct file *file, struct address_space *mapping,
 	}
 	if (!page_has_buffers(page))
 		create_empty_buffers(page, sb->s_blocksize, 0);
+	apfs_wait_page_inflight(page);
 
 	/* CoW moves existing blocks, so read them but mark them as unmapped */
 	head = page_buffers(page);
@@ -434,7 +585,8 @@ static int apfs_write_begin(struct file *file, struct address_space *mapping,
 	     block_start = block_end, bh = bh->b_this_page, ++iblock) {
 		block_end = block_start + blocksize;
 		if (to > block_start && from < block_end) {
-			if (buffer_trans(bh))
+			/* Delayed blocks already have the latest data */
+			if (buffer_trans(bh) || buffer_delay(bh))
 				continue;
 			if (!buffer_mapped(bh)) {
 				err = __apfs_get_block(dstream, iblock, bh,
@@ -460,6 +612,7 @@ static int apfs_write_begin(struct file *file, struct address_space *mapping,
 	err = __block_write_begin(page, pos, len, apfs_get_new_block);
 	if (err)
 		goto out_put_page;
+	apfs_forget_delayed_blocks(inode, page);
 
 	*pagep = page;
 	return 0;
@@ -498,8 +651,172 @@ out_abort:
 	return err;
 }
 
-static void apfs_noop_invalidatepage(struct page *page, unsigned int offset, unsigned int length)
+/**
+ * apfs_delalloc_page - Allocate the delayed blocks for a page under writeback
+ * @inode:	the vfs inode
+ * @page:	the locked page
+ *
+ * Must be called inside a transaction. The new blocks get written to disk with
+ * the rest of the transaction buffers, on commit. Returns the number of blocks
+ * allocated on success, or a negative error code in case of failure.
+ */
+static int apfs_delalloc_page(struct inode *inode, struct page *page)
 {
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct buffer_head *bh, *head;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+	loff_t size = i_size_read(inode);
+	unsigned int block_start;
+	int count = 0;
+	int err;
+
+	if (!page_has_buffers(page))
+		return 0;
+
+	head = page_buffers(page);
+	for (bh = head, block_start = 0; bh != head || !block_start;
+	     block_start += bh->b_size, bh = bh->b_this_page, ++iblock) {
+		if (!buffer_delay(bh))
+			continue;
+
+		/* The file was truncated after the fault */
+		if (page_offset(page) + block_start < size) {
+			err = apfs_get_new_block(inode, iblock, bh, 1 /* create */);
+			if (err)
+				return err;
+			++count;
+		}
+		clear_buffer_delay(bh);
+		atomic_dec(&ai->i_delayed_blks);
+		apfs_release_blocks(sb, 1);
+	}
+	return count;
+}
+
+/* Maximum number of pages to allocate for in a single writeback transaction */
+#define APFS_WB_BATCH_PAGES	64
+
+/*
+ * Progress of a writeback transaction, for apfs_writepage_delalloc()
+ */
+struct apfs_wb_batch {
+	struct inode *inode;
+	int pages;	/* Pages with delayed blocks allocated so far */
+	bool full;	/* Were some pages left for the next transaction? */
+};
+
+static int apfs_writepage_delalloc(struct page *page, struct writeback_control *wbc, void *data)
+{
+	struct apfs_wb_batch *batch = data;
+	int ret;
+
+	if (batch->pages >= APFS_WB_BATCH_PAGES) {
+		batch->full = true;
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	ret = apfs_delalloc_page(batch->inode, page);
+	unlock_page(page);
+	if (ret < 0)
+		return ret;
+	if (ret)
+		batch->pages++;
+	return 0;
+}
+
+/**
+ * apfs_writepages - Allocate the blocks for pages dirtied through mmap
+ * @mapping:	address space to write back
+ * @wbc:	writeback control
+ *
+ * Write faults only reserve space, so the CoW happens here, in batches of up
+ * to APFS_WB_BATCH_PAGES pages per transaction. Pages dirtied by write() got
+ * their blocks on ->write_begin(), so they are left alone.
+ */
+static int apfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct apfs_wb_batch batch;
+	struct apfs_max_ops maxops;
+	int blkcount = PAGE_SIZE >> inode->i_blkbits;
+	int err;
+
+	if (!atomic_read(&APFS_I(inode)->i_delayed_blks))
+		return 0;
+
+	maxops.cat = APFS_CREATE_DSTREAM_REC_MAXOPS +
+		     APFS_CREATE_CRYPTO_REC_MAXOPS +
+		     APFS_UPDATE_INODE_MAXOPS() +
+		     APFS_WB_BATCH_PAGES * blkcount * APFS_GET_NEW_BLOCK_MAXOPS();
+	maxops.blks = 0; /* Already reserved by apfs_page_mkwrite() */
+
+	batch.inode = inode;
+	do {
+		batch.pages = 0;
+		batch.full = false;
+
+		err = apfs_transaction_start(sb, maxops);
+		if (err)
+			return err;
+		apfs_inode_join_transaction_data(sb, inode);
+
+		err = apfs_inode_create_dstream_rec(inode);
+		if (err)
+			goto fail;
+		if (apfs_vol_is_encrypted(sb)) {
+			err = apfs_create_crypto_rec(inode);
+			if (err)
+				goto fail;
+		}
+
+		err = write_cache_pages(mapping, wbc, apfs_writepage_delalloc, &batch);
+		if (err)
+			goto fail;
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+	} while (batch.full);
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_invalidatepage - Drop the reservations for a page being invalidated
+ * @page:	the page
+ * @offset:	start of the invalidated range within the page
+ * @length:	length of the range
+ *
+ * Buffers are otherwise left in place, to be released after the transaction.
+ */
+static void apfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *bh, *head;
+	unsigned int block_start, block_end;
+	unsigned int stop = offset + length;
+
+	if (!page_has_buffers(page))
+		return;
+
+	head = page_buffers(page);
+	for (bh = head, block_start = 0; bh != head || !block_start;
+	     block_start = block_end, bh = bh->b_this_page) {
+		block_end = block_start + bh->b_size;
+		if (block_end > stop)
+			break;
+		if (block_start < offset || !buffer_delay(bh))
+			continue;
+		clear_buffer_delay(bh);
+		atomic_dec(&APFS_I(inode)->i_delayed_blks);
+		apfs_release_blocks(inode->i_sb, 1);
+	}
 }
 
 /* bmap is not implemented to avoid issues with CoW on swapfiles */
@@ -510,11 +827,22 @@ static const struct address_space_operations apfs_aops = {
 #else
 	.readpages      = apfs_readpages,
 #endif
+	.writepages	= apfs_writepages,
 	.write_begin	= apfs_write_begin,
 	.write_end	= apfs_write_end,
 
 	/* The intention is to keep bhs around until the transaction is over */
-	.invalidatepage	= apfs_noop_invalidatepage,
+	.invalidatepage	= apfs_invalidatepage,
+};
+
+/* Sealed volumes are always read-only */
+static const struct address_space_operations apfs_sealed_aops = {
+	.readpage	= apfs_sealed_readpage,
+};
+
+/* So are software encrypted volumes, for now */
+static const struct address_space_operations apfs_crypt_aops = {
+	.readpage	= apfs_crypt_readpage,
 };
 
 /**
@@ -535,7 +863,12 @@ static void apfs_inode_set_ops(struct inode *inode, dev_t rdev, bool compressed)
 			inode->i_fop = &apfs_compress_file_operations;
 		else
 			inode->i_fop = &apfs_file_operations;
-		inode->i_mapping->a_ops = &apfs_aops;
+		if (apfs_vol_is_sealed(inode->i_sb))
+			inode->i_mapping->a_ops = &apfs_sealed_aops;
+		else if (apfs_vol_is_soft_encrypted(inode->i_sb))
+			inode->i_mapping->a_ops = &apfs_crypt_aops;
+		else
+			inode->i_mapping->a_ops = &apfs_aops;
 		break;
 	case S_IFDIR:
 		inode->i_op = &apfs_dir_inode_operations;
@@ -612,7 +945,8 @@ static int apfs_inode_from_query(struct apfs_query *query, struct inode *inode)
 	dstream->ds_size = inode->i_size = inode->i_blocks = 0;
 	ai->i_has_dstream = false;
 	if ((bsd_flags & APFS_INOBSD_COMPRESSED) && !S_ISDIR(inode->i_mode)) {
-		if (!apfs_compress_get_size(inode, &inode->i_size)) {
+		if (!apfs_compress_load(inode)) {
+			inode->i_size = ai->i_cmpf.ci_size;
 			inode->i_blocks = (inode->i_size + 511) >> 9;
 			compressed = true;
 		}
@@ -741,6 +1075,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct inode *inode;
 	struct apfs_query *query;
+	u64 locked;
 	int err;
 
 	inode = apfs_iget_locked(sb, cnid);
@@ -749,7 +1084,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	if (!(inode->i_state & I_NEW))
 		return inode;
 
-	down_read(&nxi->nx_big_sem);
+	locked = apfs_big_down_read(nxi, APFS_LOCK_SITE_LOOKUP);
 	query = apfs_inode_lookup(inode);
 	if (IS_ERR(query)) {
 		err = PTR_ERR(query);
@@ -759,7 +1094,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	apfs_free_query(sb, query);
 	if (err)
 		goto fail;
-	up_read(&nxi->nx_big_sem);
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_LOOKUP, locked);
 
 	/* Allow the user to override the ownership */
 	if (uid_valid(sbi->s_uid))
@@ -772,7 +1107,7 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	return inode;
 
 fail:
-	up_read(&nxi->nx_big_sem);
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_LOOKUP, locked);
 	iget_failed(inode);
 	return ERR_PTR(err);
 }
@@ -1162,6 +1497,10 @@ int apfs_update_inode(struct inode *inode, char *new_name)
 	if (err)
 		return err;
 
+	/* A new primary link is beyond what the fsync log can replay */
+	if (new_name)
+		ai->i_nolog_xid = APFS_NXI(sb)->nx_xid;
+
 	query = apfs_inode_lookup(inode);
 	if (IS_ERR(query))
 		return PTR_ERR(query);
@@ -1376,6 +1715,9 @@ struct inode *apfs_new_inode(struct inode *dir, umode_t mode, dev_t rdev)
 	dstream->ds_size = 0;
 	dstream->ds_sparse_bytes = 0;
 
+	/* The fsync log can't recreate the inode itself */
+	ai->i_nolog_xid = APFS_NXI(sb)->nx_xid;
+
 	now = current_time(inode);
 	inode->i_atime = inode->i_mtime = inode->i_ctime = ai->i_crtime = now;
 	vsb_raw->apfs_last_mod_time = cpu_to_le64(timespec64_to_ns(&now));
@@ -1406,12 +1748,12 @@ struct inode *apfs_new_inode(struct inode *dir, umode_t mode, dev_t rdev)
  * apfs_create_inode_rec - Create an inode record in the catalog b-tree
  * @sb:		filesystem superblock
  * @inode:	vfs inode to record
- * @dentry:	dentry for primary link
+ * @qname:	filename for the primary link
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
 int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
-			  struct dentry *dentry)
+			  struct qstr *qname)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_key key;
@@ -1434,7 +1776,7 @@ int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
 
 	apfs_key_set_hdr(APFS_TYPE_INODE, apfs_ino(inode), &raw_key);
 
-	val_len = apfs_build_inode_val(inode, &dentry->d_name, &raw_val);
+	val_len = apfs_build_inode_val(inode, qname, &raw_val);
 	if (val_len < 0) {
 		ret = val_len;
 		goto fail;
@@ -1552,7 +1894,7 @@ int apfs_update_time(struct inode *inode, struct timespec64 *time, int flags)
 	err = apfs_transaction_start(sb, maxops);
 	if (err)
 		return err;
-	apfs_inode_join_transaction(sb, inode);
+	apfs_inode_join_transaction_data(sb, inode);
 
 	err = generic_update_time(inode, time, flags);
 	if (err)
@@ -1592,13 +1934,13 @@ static int apfs_ioc_set_dflt_pfk(struct file *file, void __user *user_pfk)
 	}
 	pfk->refcnt = cpu_to_le32(1);
 
-	down_write(&nxi->nx_big_sem);
+	apfs_big_down_write(nxi, APFS_LOCK_SITE_OTHER);
 
 	if (sbi->s_dflt_pfk)
 		kfree(sbi->s_dflt_pfk);
 	sbi->s_dflt_pfk = pfk;
 
-	up_write(&nxi->nx_big_sem);
+	apfs_big_up_write(nxi);
 
 	return 0;
 }
@@ -1946,6 +2288,483 @@ int apfs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry,
 
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0) */
 
+/* Blocks moved by a single defrag transaction */
+#define APFS_DEFRAG_CHUNK_BLOCKS	256
+
+/**
+ * apfs_defrag_page - Move the blocks of a page that belong to a defrag chunk
+ * @inode:	the vfs inode
+ * @page:	the locked page
+ * @start:	first logical block of the chunk
+ * @end:	first logical block after the chunk
+ * @run:	run of moved blocks that are still not in the catalog
+ * @moved:	incremented by the number of blocks moved
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_defrag_page(struct inode *inode, struct page *page, u64 start,
+			    u64 end, struct apfs_file_extent *run, u64 *moved)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct buffer_head *bh, *head;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+	u64 i_blks_end;
+	unsigned int block_start;
+	int err;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, sb->s_blocksize, 0);
+
+	i_blks_end = (i_size_read(inode) + sb->s_blocksize - 1) >> inode->i_blkbits;
+	if (end > i_blks_end)
+		end = i_blks_end;
+
+	head = page_buffers(page);
+	for (bh = head, block_start = 0; bh != head || !block_start;
+	     block_start += bh->b_size, bh = bh->b_this_page, ++iblock) {
+		if (iblock < start || iblock >= end)
+			continue;
+
+		/* New blocks will be allocated anyway, so leave them alone */
+		if (buffer_trans(bh) || buffer_delay(bh)) {
+			err = apfs_dstream_defrag_flush(dstream, run);
+			if (err)
+				return err;
+			continue;
+		}
+		if (!buffer_mapped(bh)) {
+			err = __apfs_get_block(dstream, iblock, bh, false /* create */);
+			if (err)
+				return err;
+		}
+		if (!buffer_mapped(bh)) {
+			/* Holes have nothing to move */
+			err = apfs_dstream_defrag_flush(dstream, run);
+			if (err)
+				return err;
+			continue;
+		}
+		if (!buffer_uptodate(bh)) {
+			get_bh(bh);
+			lock_buffer(bh);
+			bh->b_end_io = end_buffer_read_sync;
+			submit_bh(REQ_OP_READ, 0, bh);
+			wait_on_buffer(bh);
+			if (!buffer_uptodate(bh))
+				return -EIO;
+		}
+
+		err = apfs_dstream_defrag_block(dstream, iblock, bh, run);
+		if (err)
+			return err;
+		++*moved;
+	}
+	return 0;
+}
+
+/**
+ * apfs_defrag_chunk - Move a range of file blocks to contiguous locations
+ * @inode:	the vfs inode
+ * @start:	first logical block of the chunk
+ * @end:	first logical block after the chunk
+ * @moved:	incremented by the number of blocks moved
+ *
+ * The blocks keep their contents in the page cache, and get written to their
+ * new locations when the transaction commits. The old blocks are freed as with
+ * any other CoW. Returns 0 on success, or a negative error code in case of
+ * failure.
+ */
+static int apfs_defrag_chunk(struct inode *inode, u64 start, u64 end, u64 *moved)
+{
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_file_extent run = {0};
+	struct apfs_max_ops maxops;
+	unsigned int blks_per_page = PAGE_SIZE >> inode->i_blkbits;
+	pgoff_t index, last_index;
+	u64 count = 0;
+	int err;
+
+	maxops.cat = APFS_UPDATE_INODE_MAXOPS() + (end - start) * APFS_DEFRAG_BLOCK_MAXOPS();
+	maxops.blks = end - start;
+
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+	apfs_inode_join_transaction(sb, inode);
+
+	/* The cached extent must reach the catalog before the records change */
+	err = apfs_flush_extent_cache(dstream);
+	if (err)
+		goto fail;
+
+	last_index = (end - 1) / blks_per_page;
+	for (index = start / blks_per_page; index <= last_index; ++index) {
+		struct page *page;
+
+		page = find_or_create_page(mapping, index,
+					   mapping_gfp_constraint(mapping, ~__GFP_FS));
+		if (!page) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		err = apfs_defrag_page(inode, page, start, end, &run, &count);
+		unlock_page(page);
+		put_page(page);
+		if (err)
+			goto fail;
+	}
+
+	err = apfs_dstream_defrag_flush(dstream, &run);
+	if (err)
+		goto fail;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	*moved += count;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_ioc_defrag - Ioctl handler for APFS_IOC_DEFRAG
+ * @file:	affected file
+ * @user_range:	ioctl argument, a struct apfs_defrag_range
+ *
+ * Rewrites the fragmented parts of a file range into new contiguous extents,
+ * one transaction for each chunk. Chunks that are already mapped by a single
+ * extent are skipped. Returns 0 on success, or a negative error code in case
+ * of failure.
+ */
+static int apfs_ioc_defrag(struct file *file, void __user *user_range)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_defrag_range range;
+	u64 start, end, chunk_end, i_blks_end, extents;
+	int err = 0;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (sb->s_flags & SB_RDONLY)
+		return -EROFS;
+	if (IS_IMMUTABLE(inode))
+		return -EPERM;
+	if (copy_from_user(&range, user_range, sizeof(range)))
+		return -EFAULT;
+	if (range.flags & ~APFS_DEFRAG_VALID_FLAGS)
+		return -EINVAL;
+
+	inode_lock(inode);
+
+	i_blks_end = (i_size_read(inode) + sb->s_blocksize - 1) >> inode->i_blkbits;
+	start = range.start >> inode->i_blkbits;
+	end = i_blks_end;
+	if (range.len && range.start + range.len > range.start) {
+		u64 len_end = (range.start + range.len + sb->s_blocksize - 1) >> inode->i_blkbits;
+
+		end = min(end, len_end);
+	}
+	range.extents = 0;
+	range.moved = 0;
+	if (start >= end)
+		goto out;
+
+	down_read(&nxi->nx_big_sem);
+	err = apfs_dstream_count_extents(dstream, start, end, &range.extents);
+	up_read(&nxi->nx_big_sem);
+	if (err || (range.flags & APFS_DEFRAG_DRY_RUN))
+		goto out;
+
+	for (; start < end; start = chunk_end) {
+		chunk_end = min_t(u64, end, start + APFS_DEFRAG_CHUNK_BLOCKS);
+
+		down_read(&nxi->nx_big_sem);
+		err = apfs_dstream_count_extents(dstream, start, chunk_end, &extents);
+		up_read(&nxi->nx_big_sem);
+		if (err)
+			break;
+		if (extents <= 1)
+			continue;
+
+		err = apfs_defrag_chunk(inode, start, chunk_end, &range.moved);
+		if (err)
+			break;
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+out:
+	inode_unlock(inode);
+	if (err)
+		return err;
+	if (copy_to_user(user_range, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+static int apfs_ioc_scrub_start(struct file *file)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	return apfs_scrub_start(sb);
+}
+
+static int apfs_ioc_scrub_cancel(struct file *file)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	apfs_scrub_stop(sb);
+	return 0;
+}
+
+/**
+ * apfs_ioc_snap_name - Read the snapshot name argument for a snapshot ioctl
+ * @file:	directory the ioctl was called on
+ * @user_name:	ioctl argument, a struct apfs_snap_name
+ * @name:	on return, the snapshot name
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_ioc_snap_name(struct file *file, void __user *user_name, struct apfs_snap_name *name)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (sb->s_flags & SB_RDONLY)
+		return -EROFS;
+	if (copy_from_user(name, user_name, sizeof(*name)))
+		return -EFAULT;
+	if (!memchr(name->name, 0, sizeof(name->name)) || !name->name[0])
+		return -EINVAL;
+	return 0;
+}
+
+static int apfs_ioc_snap_create(struct file *file, void __user *user_name)
+{
+	struct apfs_snap_name name;
+	int err;
+
+	err = apfs_ioc_snap_name(file, user_name, &name);
+	if (err)
+		return err;
+	return apfs_snapshot_create(file_inode(file)->i_sb, name.name);
+}
+
+static int apfs_ioc_snap_destroy(struct file *file, void __user *user_name)
+{
+	struct apfs_snap_name name;
+	int err;
+
+	err = apfs_ioc_snap_name(file, user_name, &name);
+	if (err)
+		return err;
+	return apfs_snapshot_destroy(file_inode(file)->i_sb, name.name);
+}
+
+/**
+ * apfs_bstat_from_query - Read the inode found by a query into a bulkstat record
+ * @query:	the query that found the inode record
+ * @id:		inode number for the record
+ * @bs:		on return, the bulkstat record
+ *
+ * Returns 0 on success or -EFSCORRUPTED if the record is not valid.
+ */
+static int apfs_bstat_from_query(struct apfs_query *query, u64 id,
+				 struct apfs_bstat *bs)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_inode_val *inode_val;
+	char *raw = query->node->object.bh->b_data;
+	char *xval = NULL;
+	int xlen;
+
+	if (query->len < sizeof(*inode_val)) {
+		apfs_alert(sb, "bad inode record for id 0x%llx", id);
+		return -EFSCORRUPTED;
+	}
+	inode_val = (struct apfs_inode_val *)(raw + query->off);
+
+	memset(bs, 0, sizeof(*bs));
+	bs->ino = id;
+	bs->parent_ino = le64_to_cpu(inode_val->parent_id);
+	bs->crtime = le64_to_cpu(inode_val->create_time);
+	bs->mtime = le64_to_cpu(inode_val->mod_time);
+	bs->ctime = le64_to_cpu(inode_val->change_time);
+	bs->atime = le64_to_cpu(inode_val->access_time);
+	bs->internal_flags = le64_to_cpu(inode_val->internal_flags);
+	bs->bsd_flags = le32_to_cpu(inode_val->bsd_flags);
+	bs->mode = le16_to_cpu(inode_val->mode);
+	bs->nlink = le32_to_cpu(inode_val->nlink);
+
+	/* Same as apfs_iget(), let the user override the ownership */
+	if (uid_valid(sbi->s_uid))
+		bs->uid = from_kuid_munged(current_user_ns(), sbi->s_uid);
+	else
+		bs->uid = le32_to_cpu(inode_val->owner);
+	if (gid_valid(sbi->s_gid))
+		bs->gid = from_kgid_munged(current_user_ns(), sbi->s_gid);
+	else
+		bs->gid = le32_to_cpu(inode_val->group);
+
+	xlen = apfs_find_xfield(inode_val->xfields,
+				query->len - sizeof(*inode_val),
+				APFS_INO_EXT_TYPE_DSTREAM, &xval);
+	if (xlen >= sizeof(struct apfs_dstream)) {
+		struct apfs_dstream *dstream_raw = (struct apfs_dstream *)xval;
+
+		bs->size = le64_to_cpu(dstream_raw->size);
+		bs->alloced_size = le64_to_cpu(dstream_raw->alloced_size);
+	}
+	return 0;
+}
+
+/**
+ * apfs_bulkstat_fill - Read a batch of inode records in catalog key order
+ * @sb:		filesystem superblock
+ * @cursor:	first inode number to check, updated for the next batch
+ * @bs:		array for the records
+ * @max:	length of @bs
+ * @count:	on return, number of records read
+ *
+ * The leaves are walked one record at a time, and only need a new descent when
+ * the walk moves on to the next one.  Returns 0 on success, or a negative error
+ * code in case of failure.  Must be called with nx_big_sem held.
+ */
+static int apfs_bulkstat_fill(struct super_block *sb, u64 *cursor,
+			      struct apfs_bstat *bs, u32 max, u32 *count)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query, *next;
+	struct apfs_key key;
+	int err;
+
+	*count = 0;
+
+	/* Position the query right before the first record for the cursor */
+	apfs_init_inode_key(*cursor, &key);
+	key.type = 0;
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = &key;
+	query->flags = APFS_QUERY_CAT;
+	err = apfs_btree_query(sb, &query);
+	if (err && err != -ENODATA)
+		goto out;
+
+	while (*count < max) {
+		err = apfs_query_leaf_next(query, &key);
+		if (err == -EAGAIN) {
+			/* The key still points into a parent node of @query */
+			err = apfs_query_next_key(query, &key);
+			if (err)
+				goto out;
+			next = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+			if (!next) {
+				err = -ENOMEM;
+				goto out;
+			}
+			next->key = &key;
+			next->flags = APFS_QUERY_CAT;
+			err = apfs_btree_query(sb, &next);
+			apfs_free_query(sb, query);
+			query = next;
+			if (err)
+				goto out;
+			/* Step back, so the loop will read the record we found */
+			query->index--;
+			cond_resched();
+			continue;
+		}
+		if (err)
+			goto out;
+
+		if (key.type != APFS_TYPE_INODE)
+			continue;
+		err = apfs_bstat_from_query(query, key.id, &bs[*count]);
+		if (err)
+			goto out;
+		++*count;
+		*cursor = key.id + 1;
+	}
+
+out:
+	apfs_free_query(sb, query);
+	return err == -ENODATA ? 0 : err;
+}
+
+static int apfs_ioc_bulkstat(struct file *file, void __user *user_req)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_bulkstat req;
+	struct apfs_bstat *bs;
+	u32 count;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&req, user_req, sizeof(req)))
+		return -EFAULT;
+	if (!req.count)
+		return -EINVAL;
+	count = min_t(u32, req.count, APFS_BULKSTAT_MAX);
+
+	bs = kvmalloc_array(count, sizeof(*bs), GFP_KERNEL);
+	if (!bs)
+		return -ENOMEM;
+
+	down_read(&nxi->nx_big_sem);
+	err = apfs_bulkstat_fill(sb, &req.ino, bs, count, &req.count);
+	up_read(&nxi->nx_big_sem);
+	if (err)
+		goto out;
+
+	if (copy_to_user(u64_to_user_ptr(req.buf), bs, req.count * sizeof(*bs)) ||
+	    copy_to_user(user_req, &req, sizeof(req)))
+		err = -EFAULT;
+out:
+	kvfree(bs);
+	return err;
+}
+
+static int apfs_ioc_prefetch(struct file *file, void __user *user_pf)
+{
+	struct apfs_prefetch pf;
+	int err;
+
+	if (copy_from_user(&pf, user_pf, sizeof(pf)))
+		return -EFAULT;
+	if (!pf.budget)
+		pf.budget = APFS_PREFETCH_DFLT_BUDGET;
+	pf.budget = min_t(u64, pf.budget, APFS_PREFETCH_MAX_BUDGET);
+	pf.inodes = pf.reads = pf.used = 0;
+
+	err = apfs_prefetch_tree(file->f_path.dentry, &pf);
+	if (err)
+		return err;
+	if (copy_to_user(user_pf, &pf, sizeof(pf)))
+		return -EFAULT;
+	return 0;
+}
+
 long apfs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	void __user *argp = (void __user *)arg;
@@ -1963,6 +2782,18 @@ long apfs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return apfs_ioc_set_dir_class(file, argp);
 	case APFS_IOC_GET_CLASS:
 		return apfs_ioc_get_class(file, argp);
+	case APFS_IOC_SCRUB_START:
+		return apfs_ioc_scrub_start(file);
+	case APFS_IOC_SCRUB_CANCEL:
+		return apfs_ioc_scrub_cancel(file);
+	case APFS_IOC_SNAP_CREATE:
+		return apfs_ioc_snap_create(file, argp);
+	case APFS_IOC_SNAP_DESTROY:
+		return apfs_ioc_snap_destroy(file, argp);
+	case APFS_IOC_PREFETCH:
+		return apfs_ioc_prefetch(file, argp);
+	case APFS_IOC_BULKSTAT:
+		return apfs_ioc_bulkstat(file, argp);
 	default:
 		return -ENOTTY;
 	}
@@ -1985,6 +2816,8 @@ long apfs_file_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return apfs_ioc_get_class(file, argp);
 	case APFS_IOC_GET_PFK:
 		return apfs_ioc_get_pfk(file, argp);
+	case APFS_IOC_DEFRAG:
+		return apfs_ioc_defrag(file, argp);
 	default:
 		return -ENOTTY;
 	}
@@ -115,6 +115,15 @@ int apfs_read_cat_key(void *raw, int size, struct apfs_key *key, bool hashed)
 		key->number = 0;
 		key->name = ((struct apfs_xattr_key *)raw)->name;
 		break;
+	case APFS_TYPE_SNAP_NAME:
+		if (size < sizeof(struct apfs_snap_name_key) + 1 ||
+		    *((char *)raw + size - 1) != 0) {
+			/* Snapshot name must have NULL-termination */
+			return -EFSCORRUPTED;
+		}
+		key->number = 0;
+		key->name = ((struct apfs_snap_name_key *)raw)->name;
+		break;
 	case APFS_TYPE_FILE_EXTENT:
 		if (size != sizeof(struct apfs_file_extent_key))
 			return -EFSCORRUPTED;
@@ -129,6 +138,13 @@ int apfs_read_cat_key(void *raw, int size, struct apfs_key *key, bool hashed)
 			((struct apfs_sibling_link_key *)raw)->sibling_id);
 		key->name = NULL;
 		break;
+	case APFS_TYPE_FILE_INFO:
+		if (size != sizeof(struct apfs_file_info_key))
+			return -EFSCORRUPTED;
+		key->number = le64_to_cpu(
+			((struct apfs_file_info_key *)raw)->info_and_lba);
+		key->name = NULL;
+		break;
 	default:
 		key->number = 0;
 		key->name = NULL;
@@ -202,6 +218,44 @@ int apfs_read_extentref_key(void *raw, int size, struct apfs_key *key)
 	return 0;
 }
 
+/**
+ * apfs_read_omap_snap_key - Parse an on-disk omap snapshot tree key
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @key:	apfs_key structure to store the result
+ *
+ * Returns 0 on success, or a negative error code otherwise.
+ */
+int apfs_read_omap_snap_key(void *raw, int size, struct apfs_key *key)
+{
+	if (size != sizeof(__le64))
+		return -EFSCORRUPTED;
+	key->id = le64_to_cpup(raw);
+	key->type = 0;
+	key->number = 0;
+	key->name = NULL;
+	return 0;
+}
+
+/**
+ * apfs_read_fext_key - Parse an on-disk file extent tree key
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @key:	apfs_key structure to store the result
+ *
+ * Returns 0 on success, or a negative error code otherwise.
+ */
+int apfs_read_fext_key(void *raw, int size, struct apfs_key *key)
+{
+	if (size != sizeof(struct apfs_fext_tree_key))
+		return -EFSCORRUPTED;
+	key->id = le64_to_cpu(((struct apfs_fext_tree_key *)raw)->private_id);
+	key->type = 0;
+	key->number = le64_to_cpu(((struct apfs_fext_tree_key *)raw)->logical_addr);
+	key->name = NULL;
+	return 0;
+}
+
 /**
  * apfs_init_drec_key - Initialize an in-memory key for a dentry query
  * @sb:		filesystem superblock
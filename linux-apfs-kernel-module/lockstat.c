@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include "apfs.h"
+
+/*
+ * Wait and hold times for the container locks, kept without lockdep or
+ * CONFIG_LOCK_STAT so that they can be checked on production systems.  Only
+ * the main entry points are wrapped; the remaining lock users go uncounted.
+ *
+ * The counters are per cpu, so that the lock users don't fight over them, and
+ * they only get added up when sysfs asks.  A reset can't clear the counters of
+ * other cpus safely, so it records the current totals and later reads subtract
+ * them.
+ */
+
+static const char * const apfs_lock_kind_names[] = {
+	[APFS_LOCK_BIG_READ]	= "big_read",
+	[APFS_LOCK_BIG_WRITE]	= "big_write",
+	[APFS_LOCK_NXS]		= "nxs_mutex",
+};
+
+static const char * const apfs_lock_site_names[] = {
+	[APFS_LOCK_SITE_LOOKUP]		= "lookup",
+	[APFS_LOCK_SITE_READDIR]	= "readdir",
+	[APFS_LOCK_SITE_WRITE_BEGIN]	= "write_begin",
+	[APFS_LOCK_SITE_COMMIT]		= "commit",
+	[APFS_LOCK_SITE_STATFS]		= "statfs",
+	[APFS_LOCK_SITE_XATTR]		= "xattr",
+	[APFS_LOCK_SITE_MOUNT]		= "mount",
+	[APFS_LOCK_SITE_UNMOUNT]	= "unmount",
+	[APFS_LOCK_SITE_OTHER]		= "other",
+};
+
+/*
+ * Statistics for the nxs_mutex users that have no container to charge, either
+ * because it doesn't exist yet or because it may go away under the lock.  They
+ * are shown along with those of every container.
+ */
+static DEFINE_PER_CPU(struct apfs_lock_stats, apfs_global_lock_stats);
+static struct apfs_lockstat apfs_global_lockstat = {
+	.ls_pcpu	= &apfs_global_lock_stats,
+	.ls_base_lock	= __SPIN_LOCK_UNLOCKED(apfs_global_lockstat.ls_base_lock),
+};
+
+/* The holder of nxs_mutex, protected by the mutex itself */
+static u64 apfs_nxs_start;
+static enum apfs_lock_site apfs_nxs_site;
+
+static struct apfs_lockstat *apfs_lockstat_get(struct apfs_nxsb_info *nxi)
+{
+	return nxi ? &nxi->nx_lockstat : &apfs_global_lockstat;
+}
+
+/**
+ * apfs_lock_hist_bucket - Find the histogram bucket for a lock time
+ * @ns: the time in nanoseconds
+ *
+ * The first bucket is for times under a microsecond (roughly, to avoid the
+ * division), and each of the others covers four times as much as the one
+ * before.  The last bucket collects everything over a second.
+ */
+static int apfs_lock_hist_bucket(u64 ns)
+{
+	u64 us = ns >> 10;
+
+	if (!us)
+		return 0;
+	return min_t(int, 1 + ilog2(us) / 2, APFS_LOCK_HIST_BUCKETS - 1);
+}
+
+/*
+ * The lock users only ever touch the counters of their own cpu, and never from
+ * interrupt context, so disabling preemption is enough.  Readers on other cpus
+ * go through READ_ONCE().
+ */
+
+static void apfs_lock_account_count(struct apfs_lockstat *ls,
+				    enum apfs_lock_kind kind,
+				    enum apfs_lock_site site)
+{
+	struct apfs_lock_stats *pcpu = get_cpu_ptr(ls->ls_pcpu);
+
+	WRITE_ONCE(pcpu->ls_stats[kind][site].ls_count,
+		   pcpu->ls_stats[kind][site].ls_count + 1);
+	put_cpu_ptr(ls->ls_pcpu);
+}
+
+static void apfs_lock_account_wait(struct apfs_lockstat *ls,
+				   enum apfs_lock_kind kind,
+				   enum apfs_lock_site site, u64 ns)
+{
+	struct apfs_lock_stats *pcpu = get_cpu_ptr(ls->ls_pcpu);
+	struct apfs_lock_stat *stat = &pcpu->ls_stats[kind][site];
+	int bucket = apfs_lock_hist_bucket(ns);
+
+	WRITE_ONCE(stat->ls_count, stat->ls_count + 1);
+	WRITE_ONCE(stat->ls_wait_ns, stat->ls_wait_ns + ns);
+	if (ns > stat->ls_wait_max)
+		WRITE_ONCE(stat->ls_wait_max, ns);
+	WRITE_ONCE(stat->ls_wait_hist[bucket], stat->ls_wait_hist[bucket] + 1);
+	put_cpu_ptr(ls->ls_pcpu);
+}
+
+static void apfs_lock_account_hold(struct apfs_lockstat *ls,
+				   enum apfs_lock_kind kind,
+				   enum apfs_lock_site site, u64 ns)
+{
+	struct apfs_lock_stats *pcpu = get_cpu_ptr(ls->ls_pcpu);
+	struct apfs_lock_stat *stat = &pcpu->ls_stats[kind][site];
+	int bucket = apfs_lock_hist_bucket(ns);
+
+	WRITE_ONCE(stat->ls_hold_ns, stat->ls_hold_ns + ns);
+	if (ns > stat->ls_hold_max)
+		WRITE_ONCE(stat->ls_hold_max, ns);
+	WRITE_ONCE(stat->ls_hold_hist[bucket], stat->ls_hold_hist[bucket] + 1);
+	put_cpu_ptr(ls->ls_pcpu);
+}
+
+/**
+ * apfs_big_down_read - Lock the container for reading, and count the wait
+ * @nxi:	container information
+ * @site:	entry point taking the lock
+ *
+ * Returns the time the lock was taken, to be passed to apfs_big_up_read().
+ */
+u64 apfs_big_down_read(struct apfs_nxsb_info *nxi, enum apfs_lock_site site)
+{
+	u64 start, locked;
+
+	start = ktime_get_ns();
+	down_read(&nxi->nx_big_sem);
+	locked = ktime_get_ns();
+	apfs_lock_account_wait(&nxi->nx_lockstat, APFS_LOCK_BIG_READ, site,
+			       locked - start);
+	return locked;
+}
+
+/**
+ * apfs_big_up_read - Unlock the container after reading, and count the hold
+ * @nxi:	container information
+ * @site:	entry point that took the lock
+ * @locked:	time the lock was taken, from apfs_big_down_read()
+ */
+void apfs_big_up_read(struct apfs_nxsb_info *nxi, enum apfs_lock_site site,
+		      u64 locked)
+{
+	u64 held = ktime_get_ns() - locked;
+
+	up_read(&nxi->nx_big_sem);
+	apfs_lock_account_hold(&nxi->nx_lockstat, APFS_LOCK_BIG_READ, site, held);
+}
+
+/**
+ * apfs_big_down_write - Lock the container for writing, and count the wait
+ * @nxi:	container information
+ * @site:	entry point taking the lock
+ */
+void apfs_big_down_write(struct apfs_nxsb_info *nxi, enum apfs_lock_site site)
+{
+	struct apfs_lockstat *ls = &nxi->nx_lockstat;
+	u64 start, locked;
+
+	start = ktime_get_ns();
+	down_write(&nxi->nx_big_sem);
+	locked = ktime_get_ns();
+	apfs_lock_account_wait(ls, APFS_LOCK_BIG_WRITE, site, locked - start);
+
+	/* There is a single writer, so the container can keep track of it */
+	ls->ls_write_start = locked;
+	ls->ls_write_site = site;
+}
+
+/**
+ * apfs_big_write_site - Charge the rest of a write hold to another entry point
+ * @nxi:	container information
+ * @site:	the new entry point
+ *
+ * Used to tell apart the time spent committing from the time spent by the
+ * operation that started the transaction.  Must be called with the big lock
+ * held for writing.
+ */
+void apfs_big_write_site(struct apfs_nxsb_info *nxi, enum apfs_lock_site site)
+{
+	struct apfs_lockstat *ls = &nxi->nx_lockstat;
+	u64 now = ktime_get_ns();
+
+	lockdep_assert_held_write(&nxi->nx_big_sem);
+	if (ls->ls_write_site == site)
+		return;
+	apfs_lock_account_hold(ls, APFS_LOCK_BIG_WRITE, ls->ls_write_site,
+			       now - ls->ls_write_start);
+	/* Count the commit, but not as a wait: the lock was already held */
+	apfs_lock_account_count(ls, APFS_LOCK_BIG_WRITE, site);
+	ls->ls_write_start = now;
+	ls->ls_write_site = site;
+}
+
+/**
+ * apfs_big_up_write - Unlock the container after writing, and count the hold
+ * @nxi: container information
+ */
+void apfs_big_up_write(struct apfs_nxsb_info *nxi)
+{
+	struct apfs_lockstat *ls = &nxi->nx_lockstat;
+	enum apfs_lock_site site = ls->ls_write_site;
+	u64 held = ktime_get_ns() - ls->ls_write_start;
+
+	up_write(&nxi->nx_big_sem);
+	apfs_lock_account_hold(ls, APFS_LOCK_BIG_WRITE, site, held);
+}
+
+/**
+ * apfs_nxs_lock - Take the mutex for the list of containers, counting the wait
+ * @nxi:	container that will get charged for the lock, or NULL
+ * @site:	entry point taking the lock
+ *
+ * The mutex is global, but the times are recorded for the container that
+ * needed it.  Mounts and unmounts pass NULL to charge the global statistics
+ * instead.
+ */
+void apfs_nxs_lock(struct apfs_nxsb_info *nxi, enum apfs_lock_site site)
+{
+	u64 start, locked;
+
+	start = ktime_get_ns();
+	mutex_lock(&nxs_mutex);
+	locked = ktime_get_ns();
+	apfs_lock_account_wait(apfs_lockstat_get(nxi), APFS_LOCK_NXS, site,
+			       locked - start);
+	apfs_nxs_start = locked;
+	apfs_nxs_site = site;
+}
+
+/**
+ * apfs_nxs_unlock - Release the mutex for the list of containers
+ * @nxi: same as for apfs_nxs_lock()
+ */
+void apfs_nxs_unlock(struct apfs_nxsb_info *nxi)
+{
+	enum apfs_lock_site site = apfs_nxs_site;
+	u64 held = ktime_get_ns() - apfs_nxs_start;
+
+	mutex_unlock(&nxs_mutex);
+	apfs_lock_account_hold(apfs_lockstat_get(nxi), APFS_LOCK_NXS, site, held);
+}
+
+/**
+ * apfs_lockstat_init - Set up the lock statistics for a new container
+ * @nxi: container information
+ *
+ * Returns 0 on success, or -ENOMEM in case of failure.
+ */
+int apfs_lockstat_init(struct apfs_nxsb_info *nxi)
+{
+	struct apfs_lockstat *ls = &nxi->nx_lockstat;
+
+	ls->ls_pcpu = alloc_percpu(struct apfs_lock_stats);
+	if (!ls->ls_pcpu)
+		return -ENOMEM;
+	spin_lock_init(&ls->ls_base_lock);
+	return 0;
+}
+
+/**
+ * apfs_lockstat_free - Clean up apfs_lockstat_init()
+ * @nxi: container information
+ */
+void apfs_lockstat_free(struct apfs_nxsb_info *nxi)
+{
+	free_percpu(nxi->nx_lockstat.ls_pcpu);
+	nxi->nx_lockstat.ls_pcpu = NULL;
+}
+
+static struct apfs_lock_stat *apfs_lock_stat_cpu(struct apfs_lockstat *ls,
+						int cpu, int kind, int site)
+{
+	return &per_cpu_ptr(ls->ls_pcpu, cpu)->ls_stats[kind][site];
+}
+
+/**
+ * apfs_lockstat_sum - Add up the per-cpu counters for a lock and entry point
+ * @ls:		lock statistics
+ * @kind:	the lock
+ * @site:	the entry point
+ * @sum:	on return, the totals
+ *
+ * The caller must hold the base lock.  Nothing is subtracted for the maximums,
+ * because the reset clears them directly.
+ */
+static void apfs_lockstat_sum(struct apfs_lockstat *ls, int kind, int site,
+			      struct apfs_lock_stat *sum)
+{
+	struct apfs_lock_stat *stat;
+	u64 wait_max, hold_max;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stat = apfs_lock_stat_cpu(ls, cpu, kind, site);
+		wait_max = READ_ONCE(stat->ls_wait_max);
+		hold_max = READ_ONCE(stat->ls_hold_max);
+
+		sum->ls_count += READ_ONCE(stat->ls_count);
+		sum->ls_wait_ns += READ_ONCE(stat->ls_wait_ns);
+		sum->ls_wait_max = max(sum->ls_wait_max, wait_max);
+		sum->ls_hold_ns += READ_ONCE(stat->ls_hold_ns);
+		sum->ls_hold_max = max(sum->ls_hold_max, hold_max);
+		for (i = 0; i < APFS_LOCK_HIST_BUCKETS; ++i) {
+			sum->ls_wait_hist[i] += READ_ONCE(stat->ls_wait_hist[i]);
+			sum->ls_hold_hist[i] += READ_ONCE(stat->ls_hold_hist[i]);
+		}
+	}
+}
+
+/**
+ * apfs_lockstat_add - Add the statistics since the last reset to a total
+ * @ls:		lock statistics
+ * @kind:	the lock
+ * @site:	the entry point
+ * @total:	the total to update
+ */
+static void apfs_lockstat_add(struct apfs_lockstat *ls, int kind, int site,
+			      struct apfs_lock_stat *total)
+{
+	struct apfs_lock_stat sum, *base;
+	int i;
+
+	spin_lock(&ls->ls_base_lock);
+	apfs_lockstat_sum(ls, kind, site, &sum);
+	base = &ls->ls_base.ls_stats[kind][site];
+	total->ls_count += sum.ls_count - base->ls_count;
+	total->ls_wait_ns += sum.ls_wait_ns - base->ls_wait_ns;
+	total->ls_wait_max = max(total->ls_wait_max, sum.ls_wait_max);
+	total->ls_hold_ns += sum.ls_hold_ns - base->ls_hold_ns;
+	total->ls_hold_max = max(total->ls_hold_max, sum.ls_hold_max);
+	for (i = 0; i < APFS_LOCK_HIST_BUCKETS; ++i) {
+		total->ls_wait_hist[i] += sum.ls_wait_hist[i] -
+					  base->ls_wait_hist[i];
+		total->ls_hold_hist[i] += sum.ls_hold_hist[i] -
+					  base->ls_hold_hist[i];
+	}
+	spin_unlock(&ls->ls_base_lock);
+}
+
+/**
+ * apfs_lockstat_read - Get the statistics for a lock and entry point
+ * @nxi:	container information
+ * @kind:	the lock
+ * @site:	the entry point
+ * @stat:	on return, the statistics
+ *
+ * The global statistics are included, so that each container shows the mounts
+ * and unmounts that waited for nxs_mutex.
+ */
+static void apfs_lockstat_read(struct apfs_nxsb_info *nxi, int kind, int site,
+			       struct apfs_lock_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	apfs_lockstat_add(&nxi->nx_lockstat, kind, site, stat);
+	apfs_lockstat_add(&apfs_global_lockstat, kind, site, stat);
+}
+
+static void __apfs_lockstat_reset(struct apfs_lockstat *ls)
+{
+	struct apfs_lock_stat *stat;
+	int kind, site, cpu;
+
+	spin_lock(&ls->ls_base_lock);
+	for (kind = 0; kind < APFS_LOCK_KIND_NR; ++kind) {
+		for (site = 0; site < APFS_LOCK_SITE_NR; ++site) {
+			stat = &ls->ls_base.ls_stats[kind][site];
+			apfs_lockstat_sum(ls, kind, site, stat);
+			for_each_possible_cpu(cpu) {
+				stat = apfs_lock_stat_cpu(ls, cpu, kind, site);
+				WRITE_ONCE(stat->ls_wait_max, 0);
+				WRITE_ONCE(stat->ls_hold_max, 0);
+			}
+		}
+	}
+	spin_unlock(&ls->ls_base_lock);
+}
+
+/**
+ * apfs_lockstat_reset - Clear the lock statistics for a container
+ * @nxi: container information
+ *
+ * The global statistics get cleared as well, so this affects the output for
+ * other containers.  Lock operations in progress may still add to the new
+ * counters.
+ */
+void apfs_lockstat_reset(struct apfs_nxsb_info *nxi)
+{
+	__apfs_lockstat_reset(&nxi->nx_lockstat);
+	__apfs_lockstat_reset(&apfs_global_lockstat);
+}
+
+/**
+ * apfs_lockstat_show - Print the totals of the lock statistics for sysfs
+ * @nxi:	container information
+ * @buf:	page-sized output buffer
+ *
+ * One line per lock and entry point, skipping those never used: acquisitions,
+ * total and longest wait, total and longest hold.  Returns the length printed.
+ */
+ssize_t apfs_lockstat_show(struct apfs_nxsb_info *nxi, char *buf)
+{
+	struct apfs_lock_stat stat;
+	ssize_t len = 0;
+	int kind, site;
+
+	for (kind = 0; kind < APFS_LOCK_KIND_NR; ++kind) {
+		for (site = 0; site < APFS_LOCK_SITE_NR; ++site) {
+			apfs_lockstat_read(nxi, kind, site, &stat);
+			if (!stat.ls_count)
+				continue;
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%s %s %llu %llu %llu %llu %llu\n",
+					 apfs_lock_kind_names[kind],
+					 apfs_lock_site_names[site],
+					 stat.ls_count, stat.ls_wait_ns,
+					 stat.ls_wait_max, stat.ls_hold_ns,
+					 stat.ls_hold_max);
+		}
+	}
+	return len;
+}
+
+/**
+ * apfs_lockstat_show_hist - Print the lock time histograms for sysfs
+ * @nxi:	container information
+ * @buf:	page-sized output buffer
+ * @hold:	print the hold times instead of the wait times?
+ *
+ * One line per lock and entry point, skipping those never used, with the
+ * count for each bucket of apfs_lock_hist_bucket().  Returns the length
+ * printed.
+ */
+ssize_t apfs_lockstat_show_hist(struct apfs_nxsb_info *nxi, char *buf,
+				bool hold)
+{
+	struct apfs_lock_stat stat;
+	u32 *hist;
+	ssize_t len = 0;
+	int kind, site, i;
+
+	for (kind = 0; kind < APFS_LOCK_KIND_NR; ++kind) {
+		for (site = 0; site < APFS_LOCK_SITE_NR; ++site) {
+			apfs_lockstat_read(nxi, kind, site, &stat);
+			if (!stat.ls_count)
+				continue;
+			hist = hold ? stat.ls_hold_hist : stat.ls_wait_hist;
+
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%s %s",
+					 apfs_lock_kind_names[kind],
+					 apfs_lock_site_names[site]);
+			for (i = 0; i < APFS_LOCK_HIST_BUCKETS; ++i)
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 " %u", hist[i]);
+			len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+		}
+	}
+	return len;
+}
@@ -0,0 +1,428 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/hashtable.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include "apfs.h"
+
+/*
+ * Cache of b-tree node blocks for containers that are never written to. The
+ * blocks are read with our own bios, so readahead is asynchronous, and they
+ * are kept in an lru list that the sb shrinker can trim. Writable containers
+ * still go through buffer heads in the page cache of the block device: the
+ * transaction code relies on them for the dirty state and the writeback of
+ * every block it touches.
+ */
+
+#define APFS_METABUF_CACHE_MAX	8192	/* Node blocks kept in memory */
+
+/*
+ * Cached copy of a metadata block
+ */
+struct apfs_metabuf {
+	struct hlist_node mb_hash;	/* Hash table entry */
+	struct list_head mb_lru;	/* Position in the lru list */
+	struct buffer_head *mb_bh;	/* Private buffer with the block */
+};
+
+/**
+ * apfs_metabuf_init - Set up the metadata cache for a new container
+ * @nxi: container information
+ */
+void apfs_metabuf_init(struct apfs_nxsb_info *nxi)
+{
+	struct apfs_metabuf_cache *cache = &nxi->nx_metabuf;
+
+	spin_lock_init(&cache->mc_lock);
+	hash_init(cache->mc_table);
+	INIT_LIST_HEAD(&cache->mc_lru);
+	cache->mc_count = 0;
+	atomic_set(&cache->mc_inflight, 0);
+	init_waitqueue_head(&cache->mc_wait);
+}
+
+/**
+ * apfs_metabuf_put - Drop a reference to a private buffer from the cache
+ * @bh: the buffer
+ *
+ * Safe to call from the bio completion handler.
+ */
+void apfs_metabuf_put(struct buffer_head *bh)
+{
+	if (!atomic_dec_and_test(&bh->b_count))
+		return;
+	free_page((unsigned long)bh->b_data);
+	free_buffer_head(bh);
+}
+
+/**
+ * apfs_metabuf_alloc - Allocate a cache entry for a block
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @gfp:	allocation flags
+ *
+ * The buffer is locked and not uptodate, ready to be submitted for reading.
+ * Returns NULL on failure.
+ */
+static struct apfs_metabuf *apfs_metabuf_alloc(struct super_block *sb, u64 bno,
+					       gfp_t gfp)
+{
+	struct apfs_metabuf *mb;
+	struct buffer_head *bh;
+
+	mb = kmalloc(sizeof(*mb), gfp);
+	if (!mb)
+		return NULL;
+	bh = alloc_buffer_head(gfp);
+	if (!bh)
+		goto fail;
+	/*
+	 * Block sizes above PAGE_SIZE are not supported. Small kmalloc() caches
+	 * are only guaranteed to be aligned since 5.4, and the bio needs the
+	 * block inside a single page.
+	 */
+	bh->b_data = (void *)__get_free_page(gfp);
+	if (!bh->b_data) {
+		free_buffer_head(bh);
+		goto fail;
+	}
+
+	bh->b_size = sb->s_blocksize;
+	bh->b_blocknr = bno;
+	bh->b_bdev = APFS_NXI(sb)->nx_bdev;
+	set_buffer_mapped(bh);
+	set_buffer_metabuf(bh);
+	set_buffer_locked(bh);
+	atomic_set(&bh->b_count, 1);
+	mb->mb_bh = bh;
+	return mb;
+
+fail:
+	kfree(mb);
+	return NULL;
+}
+
+static void apfs_metabuf_free_entry(struct apfs_metabuf *mb)
+{
+	apfs_metabuf_put(mb->mb_bh);
+	kfree(mb);
+}
+
+/**
+ * apfs_metabuf_free - Drop every block in the metadata cache of a container
+ * @nxi: container information
+ *
+ * Called once the last volume is unmounted, but readahead may still be in
+ * flight, so wait for it before the device goes away.  This includes the reads
+ * for entries already evicted from the cache.
+ */
+void apfs_metabuf_free(struct apfs_nxsb_info *nxi)
+{
+	struct apfs_metabuf_cache *cache = &nxi->nx_metabuf;
+	struct apfs_metabuf *mb, *tmp;
+
+	wait_event(cache->mc_wait, !atomic_read(&cache->mc_inflight));
+	/* Make sure the last completion is done with the waitqueue */
+	spin_lock_irq(&cache->mc_wait.lock);
+	spin_unlock_irq(&cache->mc_wait.lock);
+
+	list_for_each_entry_safe(mb, tmp, &cache->mc_lru, mb_lru) {
+		hash_del(&mb->mb_hash);
+		list_del(&mb->mb_lru);
+		apfs_metabuf_free_entry(mb);
+	}
+	cache->mc_count = 0;
+}
+
+/**
+ * apfs_metabuf_count - Count the blocks in the metadata cache for the shrinker
+ * @sb: filesystem superblock
+ *
+ * The cache is shared by the whole container, so each volume only reports its
+ * share, same as apfs_pinned_buffers(). This is racy, so only good for the
+ * shrinker.
+ */
+unsigned long apfs_metabuf_count(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	unsigned long count = READ_ONCE(nxi->nx_metabuf.mc_count);
+	unsigned int vols = max_t(unsigned int, READ_ONCE(nxi->nx_refcnt), 1);
+
+	return DIV_ROUND_UP(count, vols);
+}
+
+/**
+ * apfs_metabuf_shrink - Evict the least recently used blocks from the cache
+ * @sb:		filesystem superblock
+ * @nr:		maximum number of blocks to evict
+ *
+ * Blocks still in use by a node or a read only go away once released. Returns
+ * the number of blocks evicted.
+ */
+unsigned long apfs_metabuf_shrink(struct super_block *sb, unsigned long nr)
+{
+	struct apfs_metabuf_cache *cache = &APFS_NXI(sb)->nx_metabuf;
+	struct apfs_metabuf *mb, *tmp;
+	unsigned long freed = 0;
+	LIST_HEAD(victims);
+
+	spin_lock(&cache->mc_lock);
+	list_for_each_entry_safe(mb, tmp, &cache->mc_lru, mb_lru) {
+		if (freed == nr)
+			break;
+		hash_del(&mb->mb_hash);
+		list_move(&mb->mb_lru, &victims);
+		--cache->mc_count;
+		++freed;
+	}
+	spin_unlock(&cache->mc_lock);
+
+	list_for_each_entry_safe(mb, tmp, &victims, mb_lru)
+		apfs_metabuf_free_entry(mb);
+	return freed;
+}
+
+/**
+ * apfs_metabuf_end_io - Completion handler for the read of a cached block
+ * @bio: the bio
+ */
+static void apfs_metabuf_end_io(struct bio *bio)
+{
+	struct buffer_head *bh = bio->bi_private;
+	struct apfs_metabuf_cache *cache = bh->b_private;
+	unsigned long flags;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	int err = blk_status_to_errno(bio->bi_status);
+#else
+	int err = bio->bi_error;
+#endif
+
+	if (!err)
+		set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	apfs_metabuf_put(bh);
+	bio_put(bio);
+
+	/* Under the waitqueue lock, so that apfs_metabuf_free() can't race */
+	spin_lock_irqsave(&cache->mc_wait.lock, flags);
+	if (atomic_dec_and_test(&cache->mc_inflight))
+		wake_up_locked(&cache->mc_wait);
+	spin_unlock_irqrestore(&cache->mc_wait.lock, flags);
+}
+
+/**
+ * apfs_metabuf_submit - Start the read for a new cache entry
+ * @sb: filesystem superblock
+ * @bh: locked buffer for the entry
+ *
+ * The bio keeps its own reference to @bh, so the entry may be evicted from the
+ * cache before the read completes.  Readers wait for the buffer to unlock, and
+ * apfs_metabuf_free() waits for the count of reads in flight to drop to zero.
+ */
+static void apfs_metabuf_submit(struct super_block *sb, struct buffer_head *bh)
+{
+	struct apfs_metabuf_cache *cache = &APFS_NXI(sb)->nx_metabuf;
+	struct bio *bio;
+
+	get_bh(bh);
+	bh->b_private = cache;
+	atomic_inc(&cache->mc_inflight);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	bio = bio_alloc(bh->b_bdev, 1, REQ_OP_READ | REQ_META | REQ_PRIO, GFP_NOIO);
+#else
+	bio = bio_alloc(GFP_NOIO, 1);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	bio_set_dev(bio, bh->b_bdev);
+#else
+	bio->bi_bdev = bh->b_bdev;
+#endif
+	bio_set_op_attrs(bio, REQ_OP_READ, REQ_META | REQ_PRIO);
+#endif
+	bio->bi_iter.bi_sector = bh->b_blocknr << (sb->s_blocksize_bits - 9);
+	bio_add_page(bio, virt_to_page(bh->b_data), bh->b_size,
+		     offset_in_page(bh->b_data));
+	bio->bi_end_io = apfs_metabuf_end_io;
+	bio->bi_private = bh;
+	submit_bio(bio);
+}
+
+/**
+ * apfs_metabuf_lookup - Look up a block in the metadata cache
+ * @cache:	the cache
+ * @bno:	block number
+ *
+ * Returns the buffer with an extra reference, or NULL if it's not cached.  The
+ * caller must hold the cache lock.
+ */
+static struct buffer_head *apfs_metabuf_lookup(struct apfs_metabuf_cache *cache,
+					       u64 bno)
+{
+	struct apfs_metabuf *mb;
+
+	hash_for_each_possible(cache->mc_table, mb, mb_hash, bno) {
+		if (mb->mb_bh->b_blocknr != bno)
+			continue;
+		get_bh(mb->mb_bh);
+		list_move_tail(&mb->mb_lru, &cache->mc_lru);
+		return mb->mb_bh;
+	}
+	return NULL;
+}
+
+/**
+ * apfs_metabuf_get - Get a block from the cache, starting a read if needed
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @gfp:	allocation flags for a new entry
+ *
+ * Returns the buffer with an extra reference, or NULL if it wasn't cached and
+ * a new entry couldn't be allocated.  The buffer may still be locked for the
+ * read, or even not be uptodate if the read failed.
+ */
+static struct buffer_head *apfs_metabuf_get(struct super_block *sb, u64 bno,
+					    gfp_t gfp)
+{
+	struct apfs_metabuf_cache *cache = &APFS_NXI(sb)->nx_metabuf;
+	struct apfs_metabuf *new, *victim = NULL;
+	struct buffer_head *bh;
+
+	spin_lock(&cache->mc_lock);
+	bh = apfs_metabuf_lookup(cache, bno);
+	spin_unlock(&cache->mc_lock);
+	if (bh)
+		return bh;
+
+	new = apfs_metabuf_alloc(sb, bno, gfp);
+	if (!new)
+		return NULL;
+
+	spin_lock(&cache->mc_lock);
+	/* Another reader may have added the same block in the meantime */
+	bh = apfs_metabuf_lookup(cache, bno);
+	if (bh) {
+		spin_unlock(&cache->mc_lock);
+		apfs_metabuf_free_entry(new);
+		return bh;
+	}
+	bh = new->mb_bh;
+	hash_add(cache->mc_table, &new->mb_hash, bno);
+	list_add_tail(&new->mb_lru, &cache->mc_lru);
+	get_bh(bh);
+	if (++cache->mc_count > APFS_METABUF_CACHE_MAX) {
+		victim = list_first_entry(&cache->mc_lru, struct apfs_metabuf,
+					  mb_lru);
+		hash_del(&victim->mb_hash);
+		list_del(&victim->mb_lru);
+		--cache->mc_count;
+	}
+	spin_unlock(&cache->mc_lock);
+
+	/* Nodes and reads still in flight keep their own reference */
+	if (victim)
+		apfs_metabuf_free_entry(victim);
+
+	apfs_metabuf_submit(sb, bh);
+	return bh;
+}
+
+/**
+ * apfs_metabuf_forget - Remove a block that failed to read from the cache
+ * @sb: filesystem superblock
+ * @bh: the buffer
+ *
+ * Later readers will then retry the read instead of failing right away.
+ */
+static void apfs_metabuf_forget(struct super_block *sb, struct buffer_head *bh)
+{
+	struct apfs_metabuf_cache *cache = &APFS_NXI(sb)->nx_metabuf;
+	struct apfs_metabuf *mb, *found = NULL;
+
+	spin_lock(&cache->mc_lock);
+	hash_for_each_possible(cache->mc_table, mb, mb_hash, bh->b_blocknr) {
+		if (mb->mb_bh != bh)
+			continue;
+		hash_del(&mb->mb_hash);
+		list_del(&mb->mb_lru);
+		--cache->mc_count;
+		found = mb;
+		break;
+	}
+	spin_unlock(&cache->mc_lock);
+
+	if (found)
+		apfs_metabuf_free_entry(found);
+}
+
+/**
+ * apfs_metabuf_read - Read a b-tree node block through the metadata cache
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @nowait:	fail with -EAGAIN instead of waiting for the disk?
+ *
+ * Returns a private buffer, which must be released with apfs_metabuf_put(); or
+ * an error pointer in case of failure.
+ */
+struct buffer_head *apfs_metabuf_read(struct super_block *sb, u64 bno,
+				      bool nowait)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_metabuf_cache *cache = &nxi->nx_metabuf;
+	struct buffer_head *bh;
+
+	if (nowait) {
+		spin_lock(&cache->mc_lock);
+		bh = apfs_metabuf_lookup(cache, bno);
+		spin_unlock(&cache->mc_lock);
+		if (!bh)
+			return ERR_PTR(-EAGAIN);
+		if (!buffer_uptodate(bh)) {
+			apfs_metabuf_put(bh);
+			return ERR_PTR(-EAGAIN);
+		}
+	} else {
+		bh = apfs_metabuf_get(sb, bno, GFP_NOFS);
+		if (!bh)
+			return ERR_PTR(-ENOMEM);
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			apfs_metabuf_forget(sb, bh);
+			apfs_metabuf_put(bh);
+			return ERR_PTR(-EIO);
+		}
+	}
+
+	if (nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_bh_csum(sb, bh)) {
+		apfs_metabuf_put(bh);
+		return ERR_PTR(-EFSBADCRC);
+	}
+	return bh;
+}
+
+/**
+ * apfs_metabuf_readahead - Start an asynchronous read for a node block
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ *
+ * Falls back to the page cache of the block device if the metadata cache is
+ * not in use.  Errors are ignored, since readahead is only a hint.
+ */
+void apfs_metabuf_readahead(struct super_block *sb, u64 bno)
+{
+	struct buffer_head *bh;
+
+	if (!apfs_metabuf_enabled(sb)) {
+		apfs_sb_breadahead(sb, bno);
+		return;
+	}
+	bh = apfs_metabuf_get(sb, bno, GFP_NOFS | __GFP_NOWARN);
+	if (bh)
+		apfs_metabuf_put(bh);
+}
@@ -33,12 +33,28 @@ static bool apfs_node_is_valid(struct super_block *sb,
 	return records * entry_size <= index_size;
 }
 
+/**
+ * apfs_node_put_bh - Release the buffer head for a node block
+ * @bh: the buffer head
+ *
+ * Private buffers are not in the block device, so brelse() can't be used.
+ */
+static void apfs_node_put_bh(struct buffer_head *bh)
+{
+	if (buffer_decrypted(bh))
+		apfs_crypt_put_bh(bh);
+	else if (buffer_metabuf(bh))
+		apfs_metabuf_put(bh);
+	else
+		brelse(bh);
+}
+
 static void apfs_node_release(struct kref *kref)
 {
 	struct apfs_node *node =
 		container_of(kref, struct apfs_node, refcount);
 
-	brelse(node->object.bh);
+	apfs_node_put_bh(node->object.bh);
 	kfree(node);
 }
 
@@ -53,19 +69,20 @@ void apfs_node_put(struct apfs_node *node)
 }
 
 /**
- * apfs_read_node - Read a node header from disk
+ * __apfs_read_node - Read a node header from disk
  * @sb:		filesystem superblock
  * @oid:	object id for the node
  * @storage:	storage type for the node object
  * @write:	request write access?
+ * @nowait:	fail with -EAGAIN if the node (or its omap path) isn't cached?
  *
  * Returns ERR_PTR in case of failure, otherwise return a pointer to the
  * resulting apfs_node structure with the initial reference taken.
  *
  * For now we assume the node has not been read before.
  */
-struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
-				 bool write)
+static struct apfs_node *__apfs_read_node(struct super_block *sb, u64 oid,
+					  u32 storage, bool write, bool nowait)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
@@ -79,21 +96,40 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 	switch (storage) {
 	case APFS_OBJ_VIRTUAL:
 		/* All virtual nodes are inside a volume, at least for now */
-		err = apfs_omap_lookup_block(sb, sbi->s_omap_root, oid,
-					     &bno, write);
+		if (nowait)
+			err = apfs_omap_lookup_block_nowait(sb, sbi->s_omap_root,
+							    oid, &bno);
+		else
+			err = apfs_omap_lookup_block(sb, sbi->s_omap_root, oid,
+						     &bno, write);
 		if (err)
 			return ERR_PTR(err);
-		bh = apfs_read_object_block(sb, bno, write);
+		if (sbi->s_crypt)
+			bh = apfs_crypt_read_node_block(sb, bno, nowait);
+		else if (!write && apfs_metabuf_enabled(sb))
+			bh = apfs_metabuf_read(sb, bno, nowait);
+		else if (nowait)
+			bh = apfs_read_object_block_nowait(sb, bno);
+		else
+			bh = apfs_read_object_block(sb, bno, write);
 		if (IS_ERR(bh))
 			return (void *)bh;
 		break;
 	case APFS_OBJ_PHYSICAL:
-		bh = apfs_read_object_block(sb, oid, write);
+		if (!write && apfs_metabuf_enabled(sb))
+			bh = apfs_metabuf_read(sb, oid, nowait);
+		else if (nowait)
+			bh = apfs_read_object_block_nowait(sb, oid);
+		else
+			bh = apfs_read_object_block(sb, oid, write);
 		if (IS_ERR(bh))
 			return (void *)bh;
 		oid = bh->b_blocknr;
 		break;
 	case APFS_OBJ_EPHEMERAL:
+		/* Only the free queue is ephemeral, and readers never need it */
+		if (nowait)
+			return ERR_PTR(-EAGAIN);
 		/* Ephemeral objects are checkpoint data, so ignore 'write' */
 		bh = apfs_read_ephemeral_object(sb, oid);
 		if (IS_ERR(bh))
@@ -102,10 +138,10 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 	}
 	raw = (struct apfs_btree_node_phys *) bh->b_data;
 
-	node = kmalloc(sizeof(*node), GFP_KERNEL);
+	node = kmalloc(sizeof(*node), nowait ? GFP_NOWAIT : GFP_KERNEL);
 	if (!node) {
-		brelse(bh);
-		return ERR_PTR(-ENOMEM);
+		apfs_node_put_bh(bh);
+		return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
 	}
 
 	node->tree_type = le32_to_cpu(raw->btn_o.o_subtype);
@@ -128,9 +164,8 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 
 	kref_init(&node->refcount);
 
-	if (nxi->nx_flags & APFS_CHECK_NODES &&
-	    !apfs_obj_verify_csum(sb, &raw->btn_o)) {
-		/* TODO: don't check this twice for virtual/physical objects */
+	/* Already verified for virtual and physical objects, so this is cheap */
+	if (nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_bh_csum(sb, bh)) {
 		apfs_alert(sb, "bad checksum for node in block 0x%llx", bh->b_blocknr);
 		apfs_node_put(node);
 		return ERR_PTR(-EFSBADCRC);
@@ -144,6 +179,70 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 	return node;
 }
 
+/**
+ * apfs_read_node - Read a node header from disk
+ * @sb:		filesystem superblock
+ * @oid:	object id for the node
+ * @storage:	storage type for the node object
+ * @write:	request write access?
+ *
+ * Returns ERR_PTR in case of failure, otherwise return a pointer to the
+ * resulting apfs_node structure with the initial reference taken.
+ */
+struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
+				 bool write)
+{
+	return __apfs_read_node(sb, oid, storage, write, false /* nowait */);
+}
+
+/**
+ * apfs_read_node_nowait - Read a node header only if it's already in memory
+ * @sb:		filesystem superblock
+ * @oid:	object id for the node
+ * @storage:	storage type for the node object
+ *
+ * Same as apfs_read_node() without write access, but never blocks on disk
+ * reads: returns ERR_PTR(-EAGAIN) if the node block, or any omap node needed
+ * to find it, is not cached.
+ */
+struct apfs_node *apfs_read_node_nowait(struct super_block *sb, u64 oid,
+					u32 storage)
+{
+	return __apfs_read_node(sb, oid, storage, false /* write */, true /* nowait */);
+}
+
+/**
+ * apfs_node_readahead - Start an asynchronous read for a node block
+ * @sb:		filesystem superblock
+ * @oid:	object id for the node
+ * @storage:	storage type for the node object
+ *
+ * Meant to be called after apfs_read_node_nowait() fails with -EAGAIN, so that
+ * a later blocking read will find the node in the cache.  Omap nodes needed to
+ * resolve a virtual @oid are read synchronously.  Errors are ignored, since
+ * readahead is only a hint.
+ */
+void apfs_node_readahead(struct super_block *sb, u64 oid, u32 storage)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	u64 bno;
+
+	switch (storage) {
+	case APFS_OBJ_VIRTUAL:
+		if (apfs_omap_lookup_block(sb, sbi->s_omap_root, oid, &bno,
+					   false /* write */))
+			return;
+		break;
+	case APFS_OBJ_PHYSICAL:
+		bno = oid;
+		break;
+	default:
+		/* Ephemeral nodes are never read without waiting */
+		return;
+	}
+	apfs_metabuf_readahead(sb, bno);
+}
+
 /**
  * apfs_min_table_size - Return the minimum size for a node's table of contents
  * @sb:		superblock structure
@@ -168,6 +267,11 @@ static int apfs_node_min_table_size(struct super_block *sb, u32 type, u16 flags)
 		val_size = sizeof(__le64); /* We assume no ghosts here */
 		toc_size = sizeof(struct apfs_kvoff);
 		break;
+	case APFS_OBJECT_TYPE_OMAP_SNAPSHOT:
+		key_size = sizeof(__le64);
+		val_size = leaf ? sizeof(struct apfs_omap_snapshot) : sizeof(__le64);
+		toc_size = sizeof(struct apfs_kvoff);
+		break;
 	default:
 		/* Make room for one record at least */
 		toc_size = sizeof(struct apfs_kvloc);
@@ -191,10 +295,8 @@ static int apfs_node_min_table_size(struct super_block *sb, u32 type, u16 flags)
  */
 static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
-	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
 	struct apfs_node *node;
 	struct buffer_head *bh;
 	struct apfs_btree_node_phys *raw;
@@ -206,7 +308,7 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 		err = apfs_spaceman_allocate_block(sb, &bno, true /* backwards */);
 		if (err)
 			return ERR_PTR(err);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+		apfs_vol_alloc_add(sb, 1);
 
 		oid = le64_to_cpu(msb_raw->nx_next_oid);
 		le64_add_cpu(&msb_raw->nx_next_oid, 1);
@@ -219,7 +321,7 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 		if (err)
 			return ERR_PTR(err);
 		/* We don't write to the container's omap */
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+		apfs_vol_alloc_add(sb, 1);
 		oid = bno;
 		break;
 	case APFS_OBJ_EPHEMERAL:
@@ -282,6 +384,55 @@ fail:
 	return ERR_PTR(err);
 }
 
+/**
+ * apfs_create_root_node - Allocates the empty root node for a new b-tree
+ * @sb:		filesystem superblock
+ * @tree_type:	subtype for the new tree
+ * @fixed:	static information for the info footer
+ *
+ * The node is physical, since only the physical trees of a volume are ever
+ * created after mkfs.  On success returns a pointer to the in-memory node; on
+ * failure, returns an error pointer.
+ */
+struct apfs_node *apfs_create_root_node(struct super_block *sb, u32 tree_type,
+					const struct apfs_btree_info_fixed *fixed)
+{
+	struct apfs_node *node;
+	struct apfs_btree_node_phys *raw;
+	struct apfs_btree_info *info;
+
+	node = apfs_create_node(sb, APFS_OBJ_PHYSICAL);
+	if (IS_ERR(node))
+		return node;
+	raw = (void *)node->object.bh->b_data;
+
+	node->tree_type = tree_type;
+	node->flags = APFS_BTNODE_ROOT | APFS_BTNODE_LEAF;
+	switch (tree_type) {
+	case APFS_OBJECT_TYPE_OMAP:
+	case APFS_OBJECT_TYPE_SPACEMAN_FREE_QUEUE:
+	case APFS_OBJECT_TYPE_OMAP_SNAPSHOT:
+		node->flags |= APFS_BTNODE_FIXED_KV_SIZE;
+		break;
+	}
+	node->records = 0;
+	node->key = sizeof(*raw) + apfs_node_min_table_size(sb, tree_type, node->flags);
+	node->free = node->key;
+	node->data = sb->s_blocksize - sizeof(*info);
+	node->key_free_list_len = 0;
+	node->val_free_list_len = 0;
+
+	info = (void *)raw + sb->s_blocksize - sizeof(*info);
+	info->bt_fixed = *fixed;
+	info->bt_longest_key = 0;
+	info->bt_longest_val = 0;
+	info->bt_key_count = 0;
+	info->bt_node_count = cpu_to_le64(1);
+
+	apfs_update_node(node);
+	return node;
+}
+
 /**
  * apfs_delete_node - Deletes a nonroot node from disk
  * @query: query pointing to the node
@@ -292,10 +443,10 @@ fail:
 int apfs_delete_node(struct apfs_query *query)
 {
 	struct super_block *sb = query->node->object.sb;
-	struct apfs_superblock *vsb_raw;
 	struct apfs_node *node = query->node;
 	u64 oid = node->object.oid;
 	u64 bno = node->object.block_nr;
+	bool shared;
 	int err;
 
 	ASSERT(query->parent);
@@ -310,25 +461,24 @@ int apfs_delete_node(struct apfs_query *query)
 
 	switch (query->flags & APFS_QUERY_TREE_MASK) {
 	case APFS_QUERY_CAT:
-		err = apfs_free_queue_insert(sb, bno, 1);
-		if (err)
+		/* A node still used by a snapshot must stay where it is */
+		err = apfs_delete_omap_rec(sb, oid, &shared);
+		if (err || shared)
 			return err;
-		err = apfs_delete_omap_rec(sb, oid);
+		err = apfs_free_queue_insert(sb, bno, 1);
 		if (err)
 			return err;
-		vsb_raw = APFS_SB(sb)->s_vsb_raw;
-		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -1);
+		apfs_vol_alloc_add(sb, -1);
 		return 0;
 	case APFS_QUERY_OMAP:
 	case APFS_QUERY_EXTENTREF:
+	case APFS_QUERY_SNAP_META:
+	case APFS_QUERY_OMAP_SNAP:
 		err = apfs_free_queue_insert(sb, bno, 1);
 		if (err)
 			return err;
 		/* We don't write to the container's omap */
-		vsb_raw = APFS_SB(sb)->s_vsb_raw;
-		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
-		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -1);
+		apfs_vol_alloc_add(sb, -1);
 		return 0;
 	case APFS_QUERY_FREE_QUEUE:
 		err = apfs_cpoint_data_free(sb, bno);
@@ -413,7 +563,11 @@ int apfs_node_locate_key(struct apfs_node *node, int index, int *off)
 		struct apfs_kvoff *entry;
 
 		entry = (struct apfs_kvoff *)raw->btn_data + index;
-		len = 16;
+		/* Omap snapshot keys are just a transaction id */
+		if (node->tree_type == APFS_OBJECT_TYPE_OMAP_SNAPSHOT)
+			len = 8;
+		else
+			len = 16;
 		/* Translate offset in key area to offset in block */
 		*off = node->key + le16_to_cpu(entry->k);
 	} else {
@@ -444,7 +598,7 @@ int apfs_node_locate_key(struct apfs_node *node, int index, int *off)
  * block; callers must use the returned value to make sure they never operate
  * outside its bounds.
  */
-static int apfs_node_locate_data(struct apfs_node *node, int index, int *off)
+int apfs_node_locate_data(struct apfs_node *node, int index, int *off)
 {
 	struct super_block *sb = node->object.sb;
 	struct apfs_btree_node_phys *raw;
@@ -465,7 +619,7 @@ static int apfs_node_locate_data(struct apfs_node *node, int index, int *off)
 				return 0;
 			len = 8;
 		} else {
-			/* This is an object-map node */
+			/* Object map or omap snapshot node, same value sizes */
 			len = apfs_node_is_leaf(node) ? 16 : 8;
 		}
 		/*
@@ -577,6 +731,15 @@ static int apfs_key_from_query(struct apfs_query *query, struct apfs_key *key)
 	case APFS_QUERY_EXTENTREF:
 		err = apfs_read_extentref_key(raw_key, query->key_len, key);
 		break;
+	case APFS_QUERY_SNAP_META:
+		err = apfs_read_cat_key(raw_key, query->key_len, key, false /* hashed */);
+		break;
+	case APFS_QUERY_OMAP_SNAP:
+		err = apfs_read_omap_snap_key(raw_key, query->key_len, key);
+		break;
+	case APFS_QUERY_FEXT:
+		err = apfs_read_fext_key(raw_key, query->key_len, key);
+		break;
 	default:
 		/* Not implemented yet */
 		err = -EINVAL;
@@ -742,6 +905,62 @@ void apfs_node_query_first(struct apfs_query *query)
 	query->len = apfs_node_locate_data(node, query->index, &query->off);
 }
 
+/**
+ * apfs_query_next_key - Read the key that follows the one found by a query
+ * @query:	query that found a record, either in a leaf or before the first
+ * @key:	on return, the next key in the tree
+ *
+ * The query itself is not changed, so the caller must requery to get to the
+ * next record.  Returns 0 on success, -ENODATA if there is no next record in
+ * the tree, or another negative error code in case of failure.
+ */
+int apfs_query_next_key(struct apfs_query *query, struct apfs_key *key)
+{
+	struct apfs_query tmp;
+
+	for (; query; query = query->parent) {
+		if (query->index + 1 >= query->node->records)
+			continue;
+		/*
+		 * The first key of a node matches the key of its record in the
+		 * parent, so this is the next key in the leaves as well.
+		 */
+		tmp = *query;
+		tmp.index++;
+		tmp.key_len = apfs_node_locate_key(tmp.node, tmp.index, &tmp.key_off);
+		if (!tmp.key_len)
+			return -EFSCORRUPTED;
+		tmp.flags &= ~(APFS_QUERY_ANY_NAME | APFS_QUERY_ANY_NUMBER);
+		return apfs_key_from_query(&tmp, key);
+	}
+	return -ENODATA;
+}
+
+/**
+ * apfs_query_leaf_next - Move a query to the next record in the same leaf
+ * @query:	query that found a record, either in a leaf or before the first
+ * @key:	on return, the key for the new record
+ *
+ * Returns 0 on success, -EAGAIN if the query was already on the last record of
+ * the leaf, or another negative error code in case of failure.
+ */
+int apfs_query_leaf_next(struct apfs_query *query, struct apfs_key *key)
+{
+	struct apfs_node *node = query->node;
+
+	if (query->index + 1 >= node->records)
+		return -EAGAIN;
+	query->index++;
+
+	query->key_len = apfs_node_locate_key(node, query->index, &query->key_off);
+	if (!query->key_len)
+		return -EFSCORRUPTED;
+	query->len = apfs_node_locate_data(node, query->index, &query->off);
+	if (!query->len)
+		return -EFSCORRUPTED;
+	return apfs_key_from_query(query, key);
+}
+
 /**
  * apfs_bno_from_query - Read the block number found by a successful omap query
  * @query:	the query that found the record
@@ -1220,8 +1439,9 @@ static void apfs_node_free_list_unlink(struct apfs_nloc *prev, struct apfs_nloc
  * @len:	length to allocate
  * @value:	true to allocate in the value area, false for the key area
  *
- * Returns the offset in the node on success, or a negative error code in case
- * of failure.
+ * Picks the smallest segment that fits, so that large holes are kept for large
+ * records.  Returns the offset in the node on success, or a negative error
+ * code in case of failure.
  */
 static int apfs_node_free_list_alloc(struct apfs_node *node, u16 len, bool value)
 {
@@ -1229,6 +1449,8 @@ static int apfs_node_free_list_alloc(struct apfs_node *node, u16 len, bool value
 	struct buffer_head *bh = node->object.bh;
 	struct apfs_btree_node_phys *node_raw = (void *)bh->b_data;
 	struct apfs_nloc *head, *curr, *prev;
+	struct apfs_nloc *best = NULL, *best_prev = NULL;
+	u16 best_off = 0, best_len = 0;
 	offcalc rel_to_off;
 	int *list_len;
 	int bound = sb->s_blocksize;
@@ -1255,26 +1477,37 @@ static int apfs_node_free_list_alloc(struct apfs_node *node, u16 len, bool value
 		u16 curr_len;
 
 		if (curr_off == APFS_BTOFF_INVALID)
-			return -ENOSPC;
+			break;
 		if (abs_off + sizeof(*curr) > sb->s_blocksize)
 			return -EFSCORRUPTED;
 		curr = (void *)node_raw + abs_off;
 
 		curr_len = le16_to_cpu(curr->len);
-		if (curr_len >= len) {
+		if (curr_len >= len && (!best || curr_len < best_len)) {
 			if (abs_off + curr_len > sb->s_blocksize)
 				return -EFSCORRUPTED;
-			*list_len -= curr_len;
-			apfs_node_free_list_unlink(prev, curr);
-			apfs_node_free_list_add(node, abs_off + len, curr_len - len);
-			return abs_off;
+			best = curr;
+			best_prev = prev;
+			best_off = abs_off;
+			best_len = curr_len;
+			/* Nothing can beat an exact fit */
+			if (curr_len == len)
+				break;
 		}
 
 		prev = curr;
 	}
 
 	/* Don't loop forever if the free list is corrupted and doesn't end */
-	return -EFSCORRUPTED;
+	if (bound < 0)
+		return -EFSCORRUPTED;
+	if (!best)
+		return -ENOSPC;
+
+	*list_len -= best_len;
+	apfs_node_free_list_unlink(best_prev, best);
+	apfs_node_free_list_add(node, best_off + len, best_len - len);
+	return best_off;
 }
 
 /**
@@ -1318,18 +1551,147 @@ static int apfs_node_alloc_val(struct apfs_node *node, u16 len)
 }
 
 /**
- * apfs_node_replace - Replace a record in a node
- * @query:	exact query that found the record
- * @key:	new on-disk record key (NULL if unchanged)
- * @key_len:	length of @key
- * @val:	new on-disk record value (NULL if unchanged)
- * @val_len:	length of @val
+ * apfs_node_compact_key_base - Find the start of the key area after compaction
+ * @node: the node
  *
- * Returns 0 on success, and @query is left pointing to the same record. Returns
- * a negative error code in case of failure, which may be -ENOSPC if the node
- * seems full.
+ * The table of contents is resized to fit one more record, rounded up to the
+ * usual increment, so that any excess from earlier growth is returned.
  */
-int apfs_node_replace(struct apfs_query *query, void *key, int key_len, void *val, int val_len)
+static int apfs_node_compact_key_base(struct apfs_node *node)
+{
+	struct super_block *sb = node->object.sb;
+	struct apfs_btree_node_phys *raw = (void *)node->object.bh->b_data;
+	int toc_start, toc_size, toc_entry_size;
+
+	if (apfs_node_has_fixed_kv_size(node))
+		toc_entry_size = sizeof(struct apfs_kvoff);
+	else
+		toc_entry_size = sizeof(struct apfs_kvloc);
+
+	toc_start = sizeof(*raw) + le16_to_cpu(raw->btn_table_space.off);
+	toc_size = toc_entry_size * round_up(node->records + 1, APFS_BTREE_TOC_ENTRY_INCREMENT);
+	toc_size = max(toc_size, apfs_node_min_table_size(sb, node->tree_type, node->flags));
+	return toc_start + toc_size;
+}
+
+/**
+ * apfs_node_compact_room - Free space that a node would have after compaction
+ * @node: the node
+ */
+static inline int apfs_node_compact_room(struct apfs_node *node)
+{
+	int room = node->data - node->free;
+
+	room += node->key_free_list_len + node->val_free_list_len;
+	return room + node->key - apfs_node_compact_key_base(node);
+}
+
+/**
+ * apfs_node_compact - Defragment the free space of a node in place
+ * @query:	query pointing to a record in the node, or to index -1
+ * @drop_key:	leave out the key of the query record, which is being replaced?
+ * @drop_val:	leave out the value of the query record, which is being replaced?
+ *
+ * Packs all keys right after the table of contents and all values at the end
+ * of the value area, so that the free lists are emptied and every free byte
+ * ends up in the middle.  The offsets in @query are updated to match.  Returns
+ * 0 on success or a negative error code in case of failure.
+ */
+static int apfs_node_compact(struct apfs_query *query, bool drop_key, bool drop_val)
+{
+	struct apfs_node *node = query->node;
+	struct super_block *sb = node->object.sb;
+	struct apfs_btree_node_phys *raw = (void *)node->object.bh->b_data;
+	bool fixed = apfs_node_has_fixed_kv_size(node);
+	int key_base, value_end, free, data, i;
+	char *old;
+	int err = 0;
+
+	apfs_assert_in_transaction(sb, &raw->btn_o);
+
+	old = kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (!old)
+		return -ENOMEM;
+	memcpy(old, raw, sb->s_blocksize);
+
+	value_end = sb->s_blocksize;
+	if (apfs_node_is_root(node))
+		value_end -= sizeof(struct apfs_btree_info);
+	key_base = apfs_node_compact_key_base(node);
+	free = key_base;
+	data = value_end;
+
+	/* The toc entries are read before they get overwritten */
+	for (i = 0; i < node->records; ++i) {
+		int key_off, key_len, val_off, val_len;
+		bool ghost = false;
+
+		key_len = apfs_node_locate_key(node, i, &key_off);
+		if (!key_len) {
+			err = -EFSCORRUPTED;
+			goto fail;
+		}
+		val_len = apfs_node_locate_data(node, i, &val_off);
+		if (i == query->index) {
+			if (drop_key)
+				key_len = 0;
+			if (drop_val)
+				val_len = 0;
+		}
+		if (free + key_len > data - val_len) {
+			err = -EFSCORRUPTED;
+			goto fail;
+		}
+
+		memcpy((void *)raw + free, old + key_off, key_len);
+		data -= val_len;
+		memcpy((void *)raw + data, old + val_off, val_len);
+
+		if (fixed) {
+			struct apfs_kvoff *kvoff;
+
+			kvoff = (struct apfs_kvoff *)raw->btn_data + i;
+			ghost = le16_to_cpu(kvoff->v) == APFS_BTOFF_INVALID;
+			kvoff->k = cpu_to_le16(free - key_base);
+			if (!ghost)
+				kvoff->v = cpu_to_le16(value_end - data);
+		} else {
+			struct apfs_kvloc *kvloc;
+
+			kvloc = (struct apfs_kvloc *)raw->btn_data + i;
+			kvloc->k.off = cpu_to_le16(free - key_base);
+			kvloc->k.len = cpu_to_le16(key_len);
+			kvloc->v.off = cpu_to_le16(value_end - data);
+			kvloc->v.len = cpu_to_le16(val_len);
+		}
+
+		if (i == query->index) {
+			query->key_off = free;
+			query->key_len = key_len;
+			query->off = data;
+			query->len = val_len;
+		}
+		free += key_len;
+	}
+
+	node->key = key_base;
+	node->free = free;
+	node->data = data;
+	node->key_free_list_len = 0;
+	node->val_free_list_len = 0;
+	apfs_update_node(node);
+	goto out;
+
+fail:
+	/* The earlier records are already moved, so put everything back */
+	memcpy(raw, old, sb->s_blocksize);
+out:
+	kfree(old);
+	return err;
+}
+
+/* Like apfs_node_replace(), but gives up on fragmented nodes */
+static int __apfs_node_replace(struct apfs_query *query, void *key, int key_len, void *val, int val_len)
 {
 	struct apfs_node *node = query->node;
 	struct super_block *sb = node->object.sb;
@@ -1420,19 +1782,41 @@ fail:
 }
 
 /**
- * apfs_node_insert - Insert a new record in a node
- * @query:	query run to search for the record
- * @key:	on-disk record key
+ * apfs_node_replace - Replace a record in a node
+ * @query:	exact query that found the record
+ * @key:	new on-disk record key (NULL if unchanged)
  * @key_len:	length of @key
- * @val:	on-disk record value (NULL for ghost records)
- * @val_len:	length of @val (0 for ghost records)
+ * @val:	new on-disk record value (NULL if unchanged)
+ * @val_len:	length of @val
  *
- * The new record is placed right after the one found by @query. On success,
- * returns 0 and sets @query to the new record. In case of failure, returns a
- * negative error code and leaves @query pointing to the same record. The error
- * may be -ENOSPC if the node seems full.
+ * Returns 0 on success, and @query is left pointing to the same record. Returns
+ * a negative error code in case of failure, which may be -ENOSPC if the node
+ * seems full.
  */
-int apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len)
+int apfs_node_replace(struct apfs_query *query, void *key, int key_len, void *val, int val_len)
+{
+	struct apfs_node *node = query->node;
+	int needed, room, err;
+
+	err = __apfs_node_replace(query, key, key_len, val, val_len);
+	if (err != -ENOSPC)
+		return err;
+
+	/* The free space may just be too fragmented, so try to avoid a split */
+	needed = (key ? key_len : 0) + (val ? val_len : 0);
+	room = apfs_node_compact_room(node);
+	room += (key ? query->key_len : 0) + (val ? query->len : 0);
+	if (room < needed)
+		return -ENOSPC;
+
+	err = apfs_node_compact(query, key != NULL, val != NULL);
+	if (err)
+		return err;
+	return __apfs_node_replace(query, key, key_len, val, val_len);
+}
+
+/* Like apfs_node_insert(), but gives up on fragmented nodes */
+static int __apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len)
 {
 	struct apfs_node *node = query->node;
 	struct apfs_btree_node_phys *node_raw = (void *)node->object.bh->b_data;
@@ -1454,7 +1838,14 @@ int apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val
 		int new_free_base = node->free;
 		int inc;
 
-		inc = APFS_BTREE_TOC_ENTRY_INCREMENT * toc_entry_size;
+		/*
+		 * Grow by a quarter of the records, so that big nodes don't
+		 * move their whole key area every few inserts. Fall back to
+		 * the minimum if that would leave no room for the record.
+		 */
+		inc = max(APFS_BTREE_TOC_ENTRY_INCREMENT, node->records / 4) * toc_entry_size;
+		if (node->free + inc + key_len + val_len > node->data)
+			inc = APFS_BTREE_TOC_ENTRY_INCREMENT * toc_entry_size;
 
 		new_key_base += inc;
 		new_free_base += inc;
@@ -1517,6 +1908,37 @@ fail:
 	return err;
 }
 
+/**
+ * apfs_node_insert - Insert a new record in a node
+ * @query:	query run to search for the record
+ * @key:	on-disk record key
+ * @key_len:	length of @key
+ * @val:	on-disk record value (NULL for ghost records)
+ * @val_len:	length of @val (0 for ghost records)
+ *
+ * The new record is placed right after the one found by @query. On success,
+ * returns 0 and sets @query to the new record. In case of failure, returns a
+ * negative error code and leaves @query pointing to the same record. The error
+ * may be -ENOSPC if the node seems full.
+ */
+int apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len)
+{
+	struct apfs_node *node = query->node;
+	int err;
+
+	err = __apfs_node_insert(query, key, key_len, val, val_len);
+	if (err != -ENOSPC)
+		return err;
+
+	/* Compaction is a lot cheaper than a split, and the node stays dense */
+	if (apfs_node_compact_room(node) < key_len + (val ? val_len : 0))
+		return -ENOSPC;
+	err = apfs_node_compact(query, false /* drop_key */, false /* drop_val */);
+	if (err)
+		return err;
+	return __apfs_node_insert(query, key, key_len, val, val_len);
+}
+
 /**
  * apfs_create_single_rec_node - Creates a new node with a single record
  * @query:	query run to search for the record
@@ -41,6 +41,28 @@ int apfs_obj_verify_csum(struct super_block *sb, struct apfs_obj_phys *obj)
 				 sb->s_blocksize - APFS_MAX_CKSUM_SIZE));
 }
 
+/**
+ * apfs_obj_verify_bh_csum - Verify the checksum of an object block only once
+ * @sb:	superblock structure
+ * @bh:	buffer head for the object
+ *
+ * A good checksum is remembered with the BH_CSUM_OK state bit until the block
+ * is modified or read again from disk (see apfs_sb_find_get_block() and the
+ * write completion handler), so repeated lookups of the same cached
+ * metadata are free. Blocks in the current transaction are not checked, their
+ * checksum only gets updated on commit. Returns 1 if the checksum is correct,
+ * 0 otherwise.
+ */
+int apfs_obj_verify_bh_csum(struct super_block *sb, struct buffer_head *bh)
+{
+	if (buffer_csum_ok(bh) || buffer_trans(bh))
+		return 1;
+	if (!apfs_obj_verify_csum(sb, (struct apfs_obj_phys *)bh->b_data))
+		return 0;
+	set_buffer_csum_ok(bh);
+	return 1;
+}
+
 /**
  * apfs_obj_set_csum - Set the fletcher checksum in an object header
  * @sb:		superblock structure
@@ -94,10 +116,10 @@ static int apfs_cpm_lookup_oid(struct super_block *sb,
  */
 static struct buffer_head *apfs_read_cpm_block(struct super_block *sb)
 {
-	struct apfs_nx_superblock *raw_sb = APFS_NXI(sb)->nx_raw;
-	u64 desc_base = le64_to_cpu(raw_sb->nx_xp_desc_base);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *raw_sb = nxi->nx_raw;
 	u32 desc_index = le32_to_cpu(raw_sb->nx_xp_desc_index);
-	u32 desc_blks = le32_to_cpu(raw_sb->nx_xp_desc_blocks);
+	u32 desc_blks = apfs_cpoint_desc_blocks(raw_sb);
 	u32 desc_len = le32_to_cpu(raw_sb->nx_xp_desc_len);
 	u64 cpm_bno;
 
@@ -105,7 +127,8 @@ static struct buffer_head *apfs_read_cpm_block(struct super_block *sb)
 		return NULL;
 
 	/* Last block in area is superblock; we want the last mapping block */
-	cpm_bno = desc_base + (desc_index + desc_len - 2) % desc_blks;
+	cpm_bno = apfs_cpoint_desc_bno(nxi,
+				       (desc_index + desc_len - 2) % desc_blks);
 	return apfs_sb_bread(sb, cpm_bno);
 }
 
@@ -257,9 +280,8 @@ struct buffer_head *apfs_read_ephemeral_object(struct super_block *sb, u64 oid)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_superblock *raw_sb = nxi->nx_raw;
-	u64 desc_base = le64_to_cpu(raw_sb->nx_xp_desc_base);
 	u32 desc_index = le32_to_cpu(raw_sb->nx_xp_desc_index);
-	u32 desc_blks = le32_to_cpu(raw_sb->nx_xp_desc_blocks);
+	u32 desc_blks = apfs_cpoint_desc_blocks(raw_sb);
 	u32 desc_len = le32_to_cpu(raw_sb->nx_xp_desc_len);
 	u32 i;
 
@@ -270,7 +292,8 @@ struct buffer_head *apfs_read_ephemeral_object(struct super_block *sb, u64 oid)
 	for (i = 0; i < desc_len - 1; ++i) {
 		struct buffer_head *bh;
 		struct apfs_checkpoint_map_phys *cpm;
-		u64 cpm_bno = desc_base + (desc_index + i) % desc_blks;
+		u32 desc_curr = (desc_index + i) % desc_blks;
+		u64 cpm_bno = apfs_cpoint_desc_bno(nxi, desc_curr);
 		u64 obj_bno;
 		int err;
 
@@ -296,17 +319,18 @@ struct buffer_head *apfs_read_ephemeral_object(struct super_block *sb, u64 oid)
 }
 
 /**
- * apfs_read_object_block - Map a non-ephemeral object block
+ * __apfs_read_object_block - Map a non-ephemeral object block
  * @sb:		superblock structure
  * @bno:	block number for the object
  * @write:	request write access?
+ * @preserve:	keep the old copy of the object allocated after a CoW?
  *
  * On success returns the mapped buffer head for the object, which may now be
  * in a new location if write access was requested.  Returns an error pointer
  * in case of failure.
  */
-struct buffer_head *apfs_read_object_block(struct super_block *sb, u64 bno,
-					   bool write)
+static struct buffer_head *__apfs_read_object_block(struct super_block *sb, u64 bno,
+						    bool write, bool preserve)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct buffer_head *bh, *new_bh;
@@ -322,7 +346,7 @@ struct buffer_head *apfs_read_object_block(struct super_block *sb, u64 bno,
 	obj = (struct apfs_obj_phys *)bh->b_data;
 	type = le32_to_cpu(obj->o_type);
 	ASSERT(!(type & APFS_OBJ_EPHEMERAL));
-	if (nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_csum(sb, obj)) {
+	if (nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_bh_csum(sb, bh)) {
 		err = -EFSBADCRC;
 		goto fail;
 	}
@@ -345,7 +369,13 @@ struct buffer_head *apfs_read_object_block(struct super_block *sb, u64 bno,
 	}
 	memcpy(new_bh->b_data, bh->b_data, sb->s_blocksize);
 
-	err = apfs_free_queue_insert(sb, bh->b_blocknr, 1);
+	if (preserve) {
+		/* The old block now belongs to a snapshot */
+		apfs_vol_alloc_add(sb, 1);
+		err = 0;
+	} else {
+		err = apfs_free_queue_insert(sb, bh->b_blocknr, 1);
+	}
 	brelse(bh);
 	bh = new_bh;
 	new_bh = NULL;
@@ -367,3 +397,60 @@ fail:
 	brelse(bh);
 	return ERR_PTR(err);
 }
+
+/**
+ * apfs_read_object_block - Map a non-ephemeral object block
+ * @sb:		superblock structure
+ * @bno:	block number for the object
+ * @write:	request write access?
+ *
+ * On success returns the mapped buffer head for the object, which may now be
+ * in a new location if write access was requested.  Returns an error pointer
+ * in case of failure.
+ */
+struct buffer_head *apfs_read_object_block(struct super_block *sb, u64 bno,
+					   bool write)
+{
+	return __apfs_read_object_block(sb, bno, write, false /* preserve */);
+}
+
+/**
+ * apfs_read_snap_object_block - Map a volume object block shared with snapshots
+ * @sb:		superblock structure
+ * @bno:	block number for the object
+ *
+ * Same as apfs_read_object_block() with write access, but the old copy of the
+ * object is left in place for the snapshot that still references it.  Returns
+ * the buffer head for the new copy, or an error pointer in case of failure.
+ */
+struct buffer_head *apfs_read_snap_object_block(struct super_block *sb, u64 bno)
+{
+	return __apfs_read_object_block(sb, bno, true /* write */, true /* preserve */);
+}
+
+/**
+ * apfs_read_object_block_nowait - Map a non-ephemeral object block, if cached
+ * @sb:		superblock structure
+ * @bno:	block number for the object
+ *
+ * Same as apfs_read_object_block() without write access, but never goes to
+ * disk: returns -EAGAIN if the block is not already in memory and uptodate.
+ */
+struct buffer_head *apfs_read_object_block_nowait(struct super_block *sb, u64 bno)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct buffer_head *bh;
+	struct apfs_obj_phys *obj;
+
+	bh = apfs_sb_bread_nowait(sb, bno);
+	if (!bh)
+		return ERR_PTR(-EAGAIN);
+
+	obj = (struct apfs_obj_phys *)bh->b_data;
+	ASSERT(!(le32_to_cpu(obj->o_type) & APFS_OBJ_EPHEMERAL));
+	if (nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_bh_csum(sb, bh)) {
+		brelse(bh);
+		return ERR_PTR(-EFSBADCRC);
+	}
+	return bh;
+}
@@ -0,0 +1,529 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "apfs.h"
+
+#define APFS_SCRUB_BATCH	64	/* Objects verified between lock drops */
+#define APFS_SCRUB_MAX_LEVEL	12	/* Taller trees are surely corrupted */
+#define APFS_SCRUB_MAX_RESTARTS	16	/* Give up on trees that change too much */
+
+/*
+ * State of a single scrub walk, private to the scrub thread
+ */
+struct apfs_scrub_ctx {
+	struct super_block *sb;
+	u64 start_xid;		/* Transaction when the current walk started */
+	unsigned int batch;	/* Objects verified since the lock was taken */
+	unsigned int window_objs; /* Objects verified in the current window */
+	unsigned long window;	/* Start of the rate limit window, in jiffies */
+};
+
+/**
+ * apfs_scrub_report - Report a corrupted object found by the scrub
+ * @ctx:	scrub context
+ * @bno:	block number for the object
+ * @what:	description of the problem
+ */
+static void apfs_scrub_report(struct apfs_scrub_ctx *ctx, u64 bno, const char *what)
+{
+	struct apfs_scrub *sc = &APFS_SB(ctx->sb)->s_scrub;
+
+	apfs_err(ctx->sb, "scrub: %s (0x%llx)", what, bno);
+	WRITE_ONCE(sc->sc_errors, sc->sc_errors + 1);
+}
+
+/**
+ * apfs_scrub_yield - Account for a verified object, and let others run
+ * @ctx: scrub context
+ *
+ * The big semaphore is dropped every few objects, and the thread sleeps if it
+ * went over the configured rate. Blocks freed by a transaction are only reused
+ * after the next one starts, so the tree being walked is still valid unless
+ * two transactions went by in the meantime.
+ *
+ * Returns 0 if the walk can go on, -EAGAIN if it must restart from the root,
+ * or -EINTR if the scrub was cancelled.
+ */
+static int apfs_scrub_yield(struct apfs_scrub_ctx *ctx)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_scrub *sc = &APFS_SB(sb)->s_scrub;
+	unsigned int rate = READ_ONCE(sc->sc_rate);
+	bool throttle;
+
+	WRITE_ONCE(sc->sc_objects, sc->sc_objects + 1);
+
+	if (time_after_eq(jiffies, ctx->window + HZ)) {
+		ctx->window = jiffies;
+		ctx->window_objs = 0;
+	}
+	throttle = rate && ++ctx->window_objs >= rate;
+	if (++ctx->batch < APFS_SCRUB_BATCH && !throttle)
+		return 0;
+	ctx->batch = 0;
+
+	up_read(&nxi->nx_big_sem);
+	if (throttle) {
+		/* This wakes up early if the thread is stopped */
+		schedule_timeout_interruptible(ctx->window + HZ - jiffies);
+		ctx->window = jiffies;
+		ctx->window_objs = 0;
+	} else {
+		cond_resched();
+	}
+	down_read(&nxi->nx_big_sem);
+
+	if (kthread_should_stop())
+		return -EINTR;
+	if (nxi->nx_xid > ctx->start_xid + 1)
+		return -EAGAIN;
+	return 0;
+}
+
+/**
+ * apfs_scrub_object - Verify the header of an object in a buffer
+ * @ctx:	scrub context
+ * @bh:		buffer head for the object
+ * @type:	expected object type
+ * @subtype:	expected object subtype
+ *
+ * Returns true if the object is sane, false if it was reported as corrupted.
+ */
+static bool apfs_scrub_object(struct apfs_scrub_ctx *ctx, struct buffer_head *bh,
+			      u32 type, u32 subtype)
+{
+	struct apfs_obj_phys *obj = (struct apfs_obj_phys *)bh->b_data;
+	u32 obj_type = le32_to_cpu(obj->o_type) & APFS_OBJECT_TYPE_MASK;
+
+	/* The checksum for objects in the transaction is only set on commit */
+	if (!buffer_trans(bh) && !apfs_obj_verify_csum(ctx->sb, obj)) {
+		apfs_scrub_report(ctx, bh->b_blocknr, "bad checksum");
+		return false;
+	}
+	if (obj_type != type || le32_to_cpu(obj->o_subtype) != subtype) {
+		apfs_scrub_report(ctx, bh->b_blocknr, "bad object type");
+		return false;
+	}
+	return true;
+}
+
+static int apfs_scrub_node(struct apfs_scrub_ctx *ctx, u64 bno, u32 tree_type,
+			   u32 storage, int level);
+
+/**
+ * apfs_scrub_children - Verify all the children of an index node
+ * @ctx:	scrub context
+ * @node:	the index node, which will be released by this function
+ * @storage:	storage type for the tree
+ *
+ * The child addresses are collected before the big semaphore gets dropped, and
+ * they are all submitted for readahead before any of them is verified, so that
+ * the device sees a batch of reads instead of one node at a time.
+ *
+ * Returns 0 on success, or a negative error code if the walk must stop.
+ */
+static int apfs_scrub_children(struct apfs_scrub_ctx *ctx, struct apfs_node *node,
+			       u32 storage)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_btree_node_phys *raw;
+	u32 tree_type = node->tree_type;
+	int level, records = node->records;
+	u64 *children;
+	int i, err = 0;
+
+	raw = (struct apfs_btree_node_phys *)node->object.bh->b_data;
+	level = le16_to_cpu(raw->btn_level);
+
+	children = kcalloc(records, sizeof(*children), GFP_KERNEL);
+	if (!children) {
+		apfs_node_put(node);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < records; ++i) {
+		int off, len;
+
+		/* Index records on hashed nodes also keep the child's hash */
+		len = apfs_node_locate_data(node, i, &off);
+		if (len != sizeof(__le64) && (!apfs_node_is_hashed(node) ||
+		    len != sizeof(struct apfs_btn_index_node_val))) {
+			apfs_scrub_report(ctx, node->object.block_nr, "bad index record");
+			continue;
+		}
+		children[i] = le64_to_cpup((__le64 *)(node->object.bh->b_data + off));
+		if (storage == APFS_OBJ_VIRTUAL &&
+		    apfs_omap_lookup_block(sb, sbi->s_omap_root, children[i],
+					   &children[i], false /* write */)) {
+			apfs_scrub_report(ctx, node->object.block_nr, "unmapped child");
+			children[i] = 0;
+			continue;
+		}
+		apfs_metabuf_readahead(sb, children[i]);
+	}
+	apfs_node_put(node);
+
+	/* The index node itself is done, so it can be accounted for now */
+	err = apfs_scrub_yield(ctx);
+	for (i = 0; !err && i < records; ++i) {
+		if (children[i])
+			err = apfs_scrub_node(ctx, children[i], tree_type, storage, level - 1);
+	}
+
+	kfree(children);
+	return err;
+}
+
+/**
+ * apfs_scrub_node - Verify a b-tree node and all of its descendants
+ * @ctx:	scrub context
+ * @bno:	block number for the node
+ * @tree_type:	expected subtype for the node object
+ * @storage:	storage type for the tree
+ * @level:	expected level of the node, or -1 for the root
+ *
+ * Corruption is reported and counted, but it doesn't stop the walk. Returns 0
+ * on success, or a negative error code if the walk must stop.
+ */
+static int apfs_scrub_node(struct apfs_scrub_ctx *ctx, u64 bno, u32 tree_type,
+			   u32 storage, int level)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_btree_node_phys *raw;
+	struct buffer_head *bh;
+	struct apfs_node *node;
+	u32 obj_type;
+	int node_level;
+	bool is_leaf;
+	int i;
+
+	bh = apfs_sb_bread(sb, bno);
+	if (!bh) {
+		apfs_scrub_report(ctx, bno, "unable to read node");
+		return apfs_scrub_yield(ctx);
+	}
+	raw = (struct apfs_btree_node_phys *)bh->b_data;
+	obj_type = level < 0 ? APFS_OBJECT_TYPE_BTREE : APFS_OBJECT_TYPE_BTREE_NODE;
+	if (!apfs_scrub_object(ctx, bh, obj_type, tree_type)) {
+		brelse(bh);
+		return apfs_scrub_yield(ctx);
+	}
+	node_level = le16_to_cpu(raw->btn_level);
+	is_leaf = le16_to_cpu(raw->btn_flags) & APFS_BTNODE_LEAF;
+	brelse(bh);
+
+	/* This also guarantees that the recursion will end */
+	if ((level >= 0 && node_level != level) || node_level >= APFS_SCRUB_MAX_LEVEL ||
+	    (is_leaf && node_level != 0) || (!is_leaf && node_level == 0)) {
+		apfs_scrub_report(ctx, bno, "bad node level");
+		return apfs_scrub_yield(ctx);
+	}
+
+	node = apfs_read_node(sb, bno, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(node)) {
+		if (PTR_ERR(node) == -ENOMEM)
+			return -ENOMEM;
+		apfs_scrub_report(ctx, bno, "invalid node header");
+		return apfs_scrub_yield(ctx);
+	}
+
+	for (i = 0; i < node->records; ++i) {
+		int off;
+
+		if (!apfs_node_locate_key(node, i, &off)) {
+			apfs_scrub_report(ctx, bno, "bad record key");
+			break;
+		}
+	}
+
+	if (apfs_node_is_leaf(node) || i < node->records) {
+		apfs_node_put(node);
+		return apfs_scrub_yield(ctx);
+	}
+
+	return apfs_scrub_children(ctx, node, storage);
+}
+
+/**
+ * apfs_scrub_omap - Verify an object map and its b-tree
+ * @ctx:	scrub context
+ * @bno:	block number for the object map
+ *
+ * Returns 0 on success, or a negative error code if the walk must stop.
+ */
+static int apfs_scrub_omap(struct apfs_scrub_ctx *ctx, u64 bno)
+{
+	struct apfs_omap_phys *omap_raw;
+	struct buffer_head *bh;
+	u64 tree_bno;
+	int err;
+
+	bh = apfs_sb_bread(ctx->sb, bno);
+	if (!bh) {
+		apfs_scrub_report(ctx, bno, "unable to read object map");
+		return apfs_scrub_yield(ctx);
+	}
+	if (!apfs_scrub_object(ctx, bh, APFS_OBJECT_TYPE_OMAP, APFS_OBJECT_TYPE_INVALID)) {
+		brelse(bh);
+		return apfs_scrub_yield(ctx);
+	}
+	omap_raw = (struct apfs_omap_phys *)bh->b_data;
+	tree_bno = le64_to_cpu(omap_raw->om_tree_oid);
+	brelse(bh);
+
+	err = apfs_scrub_yield(ctx);
+	if (err)
+		return err;
+	return apfs_scrub_node(ctx, tree_bno, APFS_OBJECT_TYPE_OMAP, APFS_OBJ_PHYSICAL, -1);
+}
+
+static int apfs_scrub_container_omap(struct apfs_scrub_ctx *ctx)
+{
+	struct apfs_nx_superblock *msb_raw = APFS_NXI(ctx->sb)->nx_raw;
+
+	return apfs_scrub_omap(ctx, le64_to_cpu(msb_raw->nx_omap_oid));
+}
+
+static int apfs_scrub_volume_omap(struct apfs_scrub_ctx *ctx)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(ctx->sb)->s_vsb_raw;
+
+	return apfs_scrub_omap(ctx, le64_to_cpu(vsb_raw->apfs_omap_oid));
+}
+
+static int apfs_scrub_catalog(struct apfs_scrub_ctx *ctx)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	u64 oid = le64_to_cpu(sbi->s_vsb_raw->apfs_root_tree_oid);
+	u32 storage = apfs_cat_storage(sb);
+	u64 bno = oid;
+
+	/* The raw nodes are ciphertext, they get checked as they are decrypted */
+	if (apfs_vol_is_soft_encrypted(sb))
+		return 0;
+
+	if (storage == APFS_OBJ_VIRTUAL &&
+	    apfs_omap_lookup_block(sb, sbi->s_omap_root, oid, &bno, false /* write */)) {
+		apfs_scrub_report(ctx, oid, "unmapped catalog root");
+		return 0;
+	}
+	return apfs_scrub_node(ctx, bno, APFS_OBJECT_TYPE_FSTREE, storage, -1);
+}
+
+static int apfs_scrub_extentref(struct apfs_scrub_ctx *ctx)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(ctx->sb)->s_vsb_raw;
+	u64 bno = le64_to_cpu(vsb_raw->apfs_extentref_tree_oid);
+
+	if (!bno)
+		return 0;
+	return apfs_scrub_node(ctx, bno, APFS_OBJECT_TYPE_BLOCKREFTREE, APFS_OBJ_PHYSICAL, -1);
+}
+
+/**
+ * apfs_scrub_spaceman - Verify the space manager and its chunk-info blocks
+ * @ctx: scrub context
+ *
+ * Returns 0 on success, or a negative error code if the walk must stop.
+ */
+static int apfs_scrub_spaceman(struct apfs_scrub_ctx *ctx)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_nx_superblock *msb_raw = APFS_NXI(sb)->nx_raw;
+	struct apfs_spaceman_phys *sm_raw;
+	struct apfs_spaceman_device *dev;
+	struct buffer_head *bh;
+	u64 oid = le64_to_cpu(msb_raw->nx_spaceman_oid);
+	u32 cib_count = 0, addr_off;
+	__le64 *addrs = NULL;
+	int i, err;
+
+	bh = apfs_read_ephemeral_object(sb, oid);
+	if (IS_ERR(bh)) {
+		apfs_scrub_report(ctx, oid, "unable to read space manager");
+		return apfs_scrub_yield(ctx);
+	}
+	if (!apfs_scrub_object(ctx, bh, APFS_OBJECT_TYPE_SPACEMAN, APFS_OBJECT_TYPE_INVALID))
+		goto out;
+
+	sm_raw = (struct apfs_spaceman_phys *)bh->b_data;
+	dev = &sm_raw->sm_dev[APFS_SD_MAIN];
+	if (le32_to_cpu(dev->sm_cab_count)) {
+		apfs_notice(sb, "scrub: chunk-info address blocks not supported");
+		goto out;
+	}
+	cib_count = le32_to_cpu(dev->sm_cib_count);
+	addr_off = le32_to_cpu(dev->sm_addr_offset);
+	if ((u64)addr_off + (u64)cib_count * sizeof(*addrs) > sb->s_blocksize) {
+		apfs_scrub_report(ctx, bh->b_blocknr, "bad chunk-info address array");
+		goto out;
+	}
+
+	/* The spaceman may change once the semaphore is dropped */
+	addrs = kmemdup(bh->b_data + addr_off, cib_count * sizeof(*addrs), GFP_KERNEL);
+	if (cib_count && !addrs) {
+		brelse(bh);
+		return -ENOMEM;
+	}
+	for (i = 0; i < cib_count; ++i)
+		apfs_sb_breadahead(sb, le64_to_cpu(addrs[i]));
+
+out:
+	brelse(bh);
+	err = apfs_scrub_yield(ctx);
+
+	for (i = 0; !err && addrs && i < cib_count; ++i) {
+		u64 bno = le64_to_cpu(addrs[i]);
+
+		bh = apfs_sb_bread(sb, bno);
+		if (!bh) {
+			apfs_scrub_report(ctx, bno, "unable to read chunk-info block");
+		} else {
+			apfs_scrub_object(ctx, bh, APFS_OBJECT_TYPE_SPACEMAN_CIB,
+					  APFS_OBJECT_TYPE_INVALID);
+			brelse(bh);
+		}
+		err = apfs_scrub_yield(ctx);
+	}
+
+	kfree(addrs);
+	return err;
+}
+
+/**
+ * apfs_scrub_walk - Run one of the scrub walks, restarting it if needed
+ * @ctx:	scrub context
+ * @walk:	function to run
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_scrub_walk(struct apfs_scrub_ctx *ctx, int (*walk)(struct apfs_scrub_ctx *))
+{
+	struct apfs_scrub *sc = &APFS_SB(ctx->sb)->s_scrub;
+	int restarts, err;
+
+	for (restarts = 0; ; ++restarts) {
+		ctx->start_xid = APFS_NXI(ctx->sb)->nx_xid;
+		err = walk(ctx);
+		if (err != -EAGAIN)
+			return err;
+		if (restarts >= APFS_SCRUB_MAX_RESTARTS) {
+			apfs_warn(ctx->sb, "scrub: metadata keeps changing, giving up");
+			return -EBUSY;
+		}
+		WRITE_ONCE(sc->sc_restarts, sc->sc_restarts + 1);
+	}
+}
+
+static int apfs_scrub_thread(void *data)
+{
+	static int (* const walks[])(struct apfs_scrub_ctx *) = {
+		apfs_scrub_container_omap,
+		apfs_scrub_volume_omap,
+		apfs_scrub_catalog,
+		apfs_scrub_extentref,
+		apfs_scrub_spaceman,
+	};
+	struct super_block *sb = data;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_scrub *sc = &APFS_SB(sb)->s_scrub;
+	struct apfs_scrub_ctx ctx = {0};
+	int i, err = 0;
+
+	ctx.sb = sb;
+	ctx.window = jiffies;
+
+	down_read(&nxi->nx_big_sem);
+	for (i = 0; !err && i < ARRAY_SIZE(walks); ++i)
+		err = apfs_scrub_walk(&ctx, walks[i]);
+	up_read(&nxi->nx_big_sem);
+
+	if (!err) {
+		apfs_info(sb, "scrub done: %llu objects, %llu errors",
+			  sc->sc_objects, sc->sc_errors);
+		WRITE_ONCE(sc->sc_state, APFS_SCRUB_DONE);
+	} else if (err == -EINTR) {
+		WRITE_ONCE(sc->sc_state, APFS_SCRUB_CANCELLED);
+	} else {
+		apfs_err(sb, "scrub failed (%d)", err);
+		WRITE_ONCE(sc->sc_state, APFS_SCRUB_FAILED);
+	}
+
+	/* Wait to be reaped by apfs_scrub_stop() or by the next scrub */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return err;
+}
+
+/**
+ * apfs_scrub_start - Start a background scrub of the volume metadata
+ * @sb: superblock structure
+ *
+ * Returns 0 on success, -EBUSY if a scrub is already running, or another
+ * negative error code in case of failure.
+ */
+int apfs_scrub_start(struct super_block *sb)
+{
+	struct apfs_scrub *sc = &APFS_SB(sb)->s_scrub;
+	struct task_struct *task;
+	int err = 0;
+
+	mutex_lock(&sc->sc_lock);
+	if (sc->sc_task) {
+		if (READ_ONCE(sc->sc_state) == APFS_SCRUB_RUNNING) {
+			err = -EBUSY;
+			goto out;
+		}
+		kthread_stop(sc->sc_task);
+		sc->sc_task = NULL;
+	}
+
+	WRITE_ONCE(sc->sc_objects, 0);
+	WRITE_ONCE(sc->sc_errors, 0);
+	WRITE_ONCE(sc->sc_restarts, 0);
+	WRITE_ONCE(sc->sc_state, APFS_SCRUB_RUNNING);
+
+	task = kthread_run(apfs_scrub_thread, sb, "apfs_scrub/%s", sb->s_id);
+	if (IS_ERR(task)) {
+		err = PTR_ERR(task);
+		WRITE_ONCE(sc->sc_state, APFS_SCRUB_FAILED);
+		goto out;
+	}
+	sc->sc_task = task;
+out:
+	mutex_unlock(&sc->sc_lock);
+	return err;
+}
+
+/**
+ * apfs_scrub_stop - Cancel the scrub thread for a volume, if any
+ * @sb: superblock structure
+ *
+ * Must not be called with the big semaphore held.
+ */
+void apfs_scrub_stop(struct super_block *sb)
+{
+	struct apfs_scrub *sc = &APFS_SB(sb)->s_scrub;
+
+	mutex_lock(&sc->sc_lock);
+	if (sc->sc_task) {
+		kthread_stop(sc->sc_task);
+		sc->sc_task = NULL;
+		/* The thread may get stopped before it ever runs */
+		if (READ_ONCE(sc->sc_state) == APFS_SCRUB_RUNNING)
+			WRITE_ONCE(sc->sc_state, APFS_SCRUB_CANCELLED);
+	}
+	mutex_unlock(&sc->sc_lock);
+}
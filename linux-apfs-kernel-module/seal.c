@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <crypto/hash.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include "apfs.h"
+
+/**
+ * apfs_seal_hash_name - Get the crypto api name for a seal hash type
+ * @type: on-disk hash type
+ *
+ * Returns NULL if the hash type is not supported.
+ */
+static const char *apfs_seal_hash_name(u32 type)
+{
+	switch (type) {
+	case APFS_HASH_SHA256:
+		return "sha256";
+	case APFS_HASH_SHA384:
+		return "sha384";
+	case APFS_HASH_SHA512:
+		return "sha512";
+	default:
+		/* The kernel has no SHA-512/256 */
+		return NULL;
+	}
+}
+
+/**
+ * apfs_seal_desc_init - Set up a hash descriptor for the seal of a volume
+ * @sb:		filesystem superblock
+ * @desc:	the descriptor, with room for the hash state
+ */
+static void apfs_seal_desc_init(struct super_block *sb, struct shash_desc *desc)
+{
+	desc->tfm = APFS_SB(sb)->s_seal_tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0) /* Flags were removed in 5.1 */
+	desc->flags = 0;
+#endif
+}
+
+/**
+ * apfs_seal_verify_node - Check the hash of a b-tree node of a sealed volume
+ * @node:	the node to check
+ * @hash:	the expected hash, as recorded by the parent
+ *
+ * A good hash is remembered with the BH_SEAL_OK state bit until the block is
+ * dropped from the cache, so each node is only hashed once.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+int apfs_seal_verify_node(struct apfs_node *node, const u8 *hash)
+{
+	struct super_block *sb = node->object.sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct buffer_head *bh = node->object.bh;
+	u8 digest[APFS_BTREE_NODE_HASH_SIZE_MAX];
+	int err;
+
+	if (buffer_seal_ok(bh))
+		return 0;
+
+	if (!sbi->s_seal_tfm) {
+		apfs_alert(sb, "hashed node in block 0x%llx of unsealed volume",
+			   bh->b_blocknr);
+		return -EFSCORRUPTED;
+	}
+
+	{
+		SHASH_DESC_ON_STACK(desc, sbi->s_seal_tfm);
+
+		apfs_seal_desc_init(sb, desc);
+		err = crypto_shash_digest(desc, bh->b_data, sb->s_blocksize, digest);
+		if (err)
+			return err;
+	}
+
+	if (memcmp(digest, hash, sbi->s_seal_hash_size)) {
+		apfs_alert(sb, "bad hash for node in block 0x%llx", bh->b_blocknr);
+		return -EFSBADCRC;
+	}
+	set_buffer_seal_ok(bh);
+	return 0;
+}
+
+/**
+ * apfs_seal_hash_lookup - Find the data hash record that covers a block
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the block
+ * @lba:	on return, first logical block covered by the hash
+ * @len:	on return, number of blocks covered by the hash
+ * @hash:	on return, the hash
+ *
+ * Every data block in a sealed volume must be covered by a hash, so a missing
+ * record is reported as corruption.  Returns 0 on success or a negative error
+ * code in case of failure.
+ */
+static int apfs_seal_hash_lookup(struct apfs_dstream_info *dstream, u64 dsblock,
+				 u64 *lba, u32 *len, u8 *hash)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query;
+	struct apfs_file_data_hash_val *val;
+	struct apfs_key key, found;
+	char *raw;
+	int ret;
+
+	apfs_init_data_hash_key(dstream->ds_id, dsblock, &key);
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = &key;
+	query->flags = APFS_QUERY_CAT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret == -ENODATA)
+		goto missing;
+	if (ret)
+		goto done;
+
+	raw = query->node->object.bh->b_data;
+	ret = apfs_read_cat_key(raw + query->key_off, query->key_len, &found,
+				apfs_is_normalization_insensitive(sb));
+	if (ret)
+		goto done;
+	if (found.id != dstream->ds_id || found.type != APFS_TYPE_FILE_INFO ||
+	    found.number >> APFS_FILE_INFO_TYPE_SHIFT != APFS_FILE_INFO_DATA_HASH)
+		goto missing;
+
+	val = (struct apfs_file_data_hash_val *)(raw + query->off);
+	if (query->len < sizeof(*val) ||
+	    val->hash_size != sbi->s_seal_hash_size ||
+	    query->len != sizeof(*val) + val->hash_size) {
+		apfs_alert(sb, "bad data hash record for dstream 0x%llx",
+			   dstream->ds_id);
+		ret = -EFSCORRUPTED;
+		goto done;
+	}
+
+	*lba = found.number & APFS_FILE_INFO_LBA_MASK;
+	*len = le16_to_cpu(val->hashed_len);
+	if (dsblock >= *lba + *len)
+		goto missing;
+	memcpy(hash, val->hash, val->hash_size);
+	goto done;
+
+missing:
+	apfs_alert(sb, "no data hash for block 0x%llx of dstream 0x%llx",
+		   dsblock, dstream->ds_id);
+	ret = -EFSCORRUPTED;
+done:
+	apfs_free_query(sb, query);
+	return ret;
+}
+
+/*
+ * A block in a data range being verified
+ */
+struct apfs_seal_blk {
+	u64 bno;		/* Physical block number, 0 for holes */
+	struct buffer_head *bh;	/* Buffer head, once read */
+};
+
+/**
+ * apfs_seal_range_verified - Check if a block is in the last verified range
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the block
+ *
+ * The BH_SEAL_OK bit only says that the block matched the hash of some data
+ * stream, and several streams may claim the same physical block.  The bit can
+ * be trusted by @dstream only if the hash range verified was its own.
+ */
+static bool apfs_seal_range_verified(struct apfs_dstream_info *dstream,
+				     u64 dsblock)
+{
+	bool ret;
+
+	spin_lock(&dstream->ds_ext_lock);
+	ret = dsblock >= dstream->ds_seal_lba &&
+	      dsblock - dstream->ds_seal_lba < dstream->ds_seal_len;
+	spin_unlock(&dstream->ds_ext_lock);
+	return ret;
+}
+
+/**
+ * apfs_seal_verify_range - Check the hash of the data range that has a block
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the block
+ * @bno:	physical block number, as mapped by the caller
+ *
+ * The whole range covered by the hash is mapped first and then read in a
+ * single batch, so that the block layer can merge the requests.  On success,
+ * all the buffers in the range are flagged with BH_SEAL_OK, and the range is
+ * remembered by @dstream.  The caller must hold the big semaphore.  Returns 0
+ * on success, or a negative error code in case of failure.
+ */
+static int apfs_seal_verify_range(struct apfs_dstream_info *dstream,
+				  u64 dsblock, u64 bno)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_seal_blk *blks = NULL;
+	struct blk_plug plug;
+	u8 hash[APFS_BTREE_NODE_HASH_SIZE_MAX];
+	u8 digest[APFS_BTREE_NODE_HASH_SIZE_MAX];
+	u64 lba;
+	u32 len, i;
+	int err;
+
+	err = apfs_seal_hash_lookup(dstream, dsblock, &lba, &len, hash);
+	if (err)
+		return err;
+
+	blks = kvmalloc_array(len, sizeof(*blks), GFP_KERNEL | __GFP_ZERO);
+	if (!blks)
+		return -ENOMEM;
+
+	for (i = 0; i < len; ++i) {
+		struct buffer_head map = {0};
+
+		map.b_size = sb->s_blocksize;
+		err = __apfs_get_block(dstream, lba + i, &map, 0 /* create */);
+		if (err)
+			goto out;
+		/* Holes are hashed as zeroes */
+		if (buffer_mapped(&map))
+			blks[i].bno = map.b_blocknr;
+	}
+	if (blks[dsblock - lba].bno != bno) {
+		apfs_alert(sb, "bad mapping for block 0x%llx of dstream 0x%llx",
+			   dsblock, dstream->ds_id);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i < len; ++i) {
+		if (blks[i].bno)
+			apfs_sb_breadahead(sb, blks[i].bno);
+	}
+	blk_finish_plug(&plug);
+
+	{
+		SHASH_DESC_ON_STACK(desc, sbi->s_seal_tfm);
+
+		apfs_seal_desc_init(sb, desc);
+		err = crypto_shash_init(desc);
+		for (i = 0; !err && i < len; ++i) {
+			const void *data = page_address(ZERO_PAGE(0));
+
+			if (blks[i].bno) {
+				blks[i].bh = apfs_sb_bread(sb, blks[i].bno);
+				if (!blks[i].bh) {
+					err = -EIO;
+					break;
+				}
+				data = blks[i].bh->b_data;
+			}
+			err = crypto_shash_update(desc, data, sb->s_blocksize);
+		}
+		if (!err)
+			err = crypto_shash_final(desc, digest);
+	}
+	if (err)
+		goto out;
+
+	if (memcmp(digest, hash, sbi->s_seal_hash_size)) {
+		apfs_alert(sb, "bad hash for blocks 0x%llx-0x%llx of dstream 0x%llx",
+			   lba, lba + len - 1, dstream->ds_id);
+		err = -EFSBADCRC;
+		goto out;
+	}
+	for (i = 0; i < len; ++i) {
+		if (blks[i].bh)
+			set_buffer_seal_ok(blks[i].bh);
+	}
+	spin_lock(&dstream->ds_ext_lock);
+	dstream->ds_seal_lba = lba;
+	dstream->ds_seal_len = len;
+	spin_unlock(&dstream->ds_ext_lock);
+
+out:
+	for (i = 0; i < len; ++i)
+		brelse(blks[i].bh);
+	kvfree(blks);
+	return err;
+}
+
+/**
+ * apfs_seal_bread - Read a data block of a sealed volume and verify its hash
+ * @dstream:	data stream info
+ * @dsblock:	logical number of the block
+ * @bno:	physical block number, as mapped by the extents
+ *
+ * Blocks are verified in whole hash ranges, and the result is remembered with
+ * the BH_SEAL_OK bit until the buffer is dropped from the cache.  The bit is
+ * only trusted inside the last range verified for @dstream, so a block shared
+ * with another stream gets checked against this stream's own hash first.  The
+ * caller must hold the big semaphore.  Returns the buffer head on success, or
+ * an error pointer in case of failure.
+ */
+struct buffer_head *apfs_seal_bread(struct apfs_dstream_info *dstream,
+				    u64 dsblock, u64 bno)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct buffer_head *bh;
+	int err;
+
+	bh = apfs_sb_bread(sb, bno);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	if (buffer_seal_ok(bh) && apfs_seal_range_verified(dstream, dsblock))
+		return bh;
+
+	err = apfs_seal_verify_range(dstream, dsblock, bno);
+	if (err) {
+		brelse(bh);
+		return ERR_PTR(err);
+	}
+	return bh;
+}
+
+/**
+ * apfs_seal_init - Set up the verification of a sealed volume
+ * @sb: filesystem superblock
+ *
+ * Reads the integrity metadata, checks the hash of the catalog root against
+ * it, and reads the file extent tree.  The catalog must already be in memory.
+ * Does nothing for unsealed volumes.  Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+int apfs_seal_init(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+	struct apfs_integrity_meta_phys *meta;
+	struct buffer_head *bh = NULL;
+	struct crypto_shash *tfm;
+	struct apfs_node *fext_root;
+	const char *alg;
+	u64 bno;
+	u32 off;
+	int err;
+
+	if (!apfs_vol_is_sealed(sb))
+		return 0;
+
+	err = apfs_omap_lookup_block(sb, sbi->s_omap_root,
+				     le64_to_cpu(vsb_raw->apfs_integrity_meta_oid),
+				     &bno, false /* write */);
+	if (err) {
+		apfs_err(sb, "unable to find the integrity metadata");
+		return err;
+	}
+	bh = apfs_read_object_block(sb, bno, false /* write */);
+	if (IS_ERR(bh)) {
+		apfs_err(sb, "unable to read the integrity metadata");
+		return PTR_ERR(bh);
+	}
+	meta = (struct apfs_integrity_meta_phys *)bh->b_data;
+
+	if (le32_to_cpu(meta->im_flags) & APFS_SEAL_BROKEN) {
+		apfs_warn(sb, "seal was broken in xid 0x%llx",
+			  le64_to_cpu(meta->im_broken_xid));
+		err = -EINVAL;
+		goto fail;
+	}
+
+	alg = apfs_seal_hash_name(le32_to_cpu(meta->im_hash_type));
+	if (!alg) {
+		apfs_warn(sb, "unsupported seal hash type (%u)",
+			  le32_to_cpu(meta->im_hash_type));
+		err = -EINVAL;
+		goto fail;
+	}
+	/* The crypto api will pick the fastest implementation available */
+	tfm = crypto_alloc_shash(alg, 0, 0);
+	if (IS_ERR(tfm)) {
+		apfs_err(sb, "unable to allocate %s", alg);
+		err = PTR_ERR(tfm);
+		goto fail;
+	}
+	sbi->s_seal_tfm = tfm;
+	sbi->s_seal_hash_size = crypto_shash_digestsize(tfm);
+
+	off = le32_to_cpu(meta->im_root_hash_offset);
+	if (off < sizeof(*meta) || off > sb->s_blocksize - sbi->s_seal_hash_size) {
+		apfs_err(sb, "bad offset for the root hash");
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	/* The rest of the catalog gets verified from the root */
+	err = apfs_seal_verify_node(sbi->s_cat_root, bh->b_data + off);
+	if (err)
+		goto fail;
+	brelse(bh);
+	bh = NULL;
+
+	/*
+	 * The extent tree is not covered by the seal, but a bad mapping can't
+	 * go unnoticed because the data hashes are in the catalog.
+	 */
+	fext_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_fext_tree_oid),
+				   APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(fext_root)) {
+		apfs_err(sb, "unable to read the file extent tree");
+		err = PTR_ERR(fext_root);
+		goto fail;
+	}
+	sbi->s_fext_root = fext_root;
+	return 0;
+
+fail:
+	brelse(bh);
+	apfs_seal_free(sb);
+	return err;
+}
+
+/**
+ * apfs_seal_free - Clean up after apfs_seal_init()
+ * @sb: filesystem superblock
+ */
+void apfs_seal_free(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	if (sbi->s_fext_root)
+		apfs_node_put(sbi->s_fext_root);
+	sbi->s_fext_root = NULL;
+	if (sbi->s_seal_tfm)
+		crypto_free_shash(sbi->s_seal_tfm);
+	sbi->s_seal_tfm = NULL;
+}
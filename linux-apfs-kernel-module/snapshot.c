@@ -0,0 +1,1521 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include "apfs.h"
+
+#define APFS_REAPER_BATCH	64	/* Records reaped in each transaction */
+#define APFS_SNAPSHOT_MAXOPS	4	/* Metadata and name records, plus margin */
+
+/**
+ * apfs_read_snap_meta_root - Find and read the snapshot metadata root node
+ * @sb:		superblock structure
+ * @write:	request write access?
+ *
+ * On success returns the root node; on failure returns an error pointer, which
+ * will be -ENODATA if the volume has no snapshot metadata tree.
+ */
+static struct apfs_node *apfs_read_snap_meta_root(struct super_block *sb, bool write)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *root;
+	u64 oid;
+
+	oid = le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid);
+	if (!oid)
+		return ERR_PTR(-ENODATA);
+
+	root = apfs_read_node(sb, oid, APFS_OBJ_PHYSICAL, write);
+	if (IS_ERR(root)) {
+		apfs_err(sb, "unable to read the snapshot metadata root");
+		return root;
+	}
+	if (write) {
+		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+		vsb_raw->apfs_snap_meta_tree_oid = cpu_to_le64(root->object.oid);
+	}
+	return root;
+}
+
+/**
+ * apfs_create_snap_meta_root - Create the snapshot metadata tree if missing
+ * @sb: superblock structure
+ *
+ * On success returns the root node, on failure returns an error pointer.
+ */
+static struct apfs_node *apfs_create_snap_meta_root(struct super_block *sb)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_btree_info_fixed fixed = {0};
+	struct apfs_node *root;
+
+	root = apfs_read_snap_meta_root(sb, true /* write */);
+	if (!IS_ERR(root) || PTR_ERR(root) != -ENODATA)
+		return root;
+
+	fixed.bt_flags = cpu_to_le32(APFS_BTREE_PHYSICAL);
+	fixed.bt_node_size = cpu_to_le32(sb->s_blocksize);
+	root = apfs_create_root_node(sb, APFS_OBJECT_TYPE_SNAPMETATREE, &fixed);
+	if (IS_ERR(root))
+		return root;
+
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_snap_meta_tree_type = cpu_to_le32(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE);
+	vsb_raw->apfs_snap_meta_tree_oid = cpu_to_le64(root->object.oid);
+	return root;
+}
+
+/**
+ * apfs_read_omap_phys - Get write access to the volume's omap object
+ * @sb: superblock structure
+ *
+ * Returns the buffer head for the object, or an error pointer in case of
+ * failure.
+ */
+static struct buffer_head *apfs_read_omap_phys(struct super_block *sb)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct buffer_head *bh;
+
+	bh = apfs_read_object_block(sb, le64_to_cpu(vsb_raw->apfs_omap_oid), true /* write */);
+	if (IS_ERR(bh)) {
+		apfs_err(sb, "unable to read the volume object map");
+		return bh;
+	}
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_omap_oid = cpu_to_le64(bh->b_blocknr);
+	return bh;
+}
+
+/**
+ * apfs_read_omap_snap_root - Find and read the omap snapshot tree root node
+ * @sb:		superblock structure
+ * @omap_raw:	the volume's omap object
+ * @write:	request write access?
+ *
+ * On success returns the root node; on failure returns an error pointer, which
+ * will be -ENODATA if the omap has no snapshot tree yet.
+ */
+static struct apfs_node *apfs_read_omap_snap_root(struct super_block *sb, struct apfs_omap_phys *omap_raw,
+						  bool write)
+{
+	struct apfs_node *root;
+	u64 oid;
+
+	oid = le64_to_cpu(omap_raw->om_snapshot_tree_oid);
+	if (!oid)
+		return ERR_PTR(-ENODATA);
+
+	root = apfs_read_node(sb, oid, APFS_OBJ_PHYSICAL, write);
+	if (IS_ERR(root)) {
+		apfs_err(sb, "unable to read the omap snapshot root");
+		return root;
+	}
+	if (write) {
+		apfs_assert_in_transaction(sb, &omap_raw->om_o);
+		omap_raw->om_snapshot_tree_oid = cpu_to_le64(root->object.oid);
+	}
+	return root;
+}
+
+/**
+ * apfs_omap_snap_next - Find the omap snapshot that follows a given xid
+ * @root:	root of the omap snapshot tree
+ * @xid:	transaction id to start the search from
+ * @next:	on return, the xid for the next snapshot
+ * @flags:	on return, the flags for the next snapshot (may be NULL)
+ *
+ * Returns 0 on success, -ENODATA if there are no more snapshots, or another
+ * negative error code in case of failure.
+ */
+static int apfs_omap_snap_next(struct apfs_node *root, u64 xid, u64 *next, u32 *flags)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	struct apfs_omap_snapshot *val;
+	struct apfs_key key;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_omap_snap_key(xid, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_OMAP_SNAP;
+
+	err = apfs_btree_query(sb, &query);
+	if (err && err != -ENODATA)
+		goto fail;
+	err = apfs_query_next_key(query, &key);
+	if (err)
+		goto fail;
+	*next = key.id;
+	if (!flags)
+		goto fail;
+
+	/* Now read the value for the snapshot we found */
+	apfs_free_query(sb, query);
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = &key;
+	query->flags = APFS_QUERY_OMAP_SNAP | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (err)
+		goto fail;
+	if (query->len != sizeof(*val)) {
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	*flags = le32_to_cpu(val->oms_flags);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_omap_snap_neighbours - Find the snapshots taken before and after another
+ * @root:	root of the omap snapshot tree
+ * @xid:	transaction id for the snapshot
+ * @older:	on return, the xid of the previous snapshot, or 0 if none
+ * @younger:	on return, the xid of the next snapshot, or 0 if none
+ *
+ * Deleted snapshots are taken into account as well, because they still own
+ * their records until reaped.  Returns 0 on success or a negative error code
+ * in case of failure.
+ */
+static int apfs_omap_snap_neighbours(struct apfs_node *root, u64 xid, u64 *older, u64 *younger)
+{
+	u64 curr = 0, next;
+	int err;
+
+	while (1) {
+		err = apfs_omap_snap_next(root, curr, &next, NULL /* flags */);
+		if (err)
+			return err == -ENODATA ? -EFSCORRUPTED : err;
+		if (next >= xid)
+			break;
+		curr = next;
+	}
+	if (next != xid)
+		return -EFSCORRUPTED;
+	*older = curr;
+
+	err = apfs_omap_snap_next(root, xid, younger, NULL /* flags */);
+	if (err == -ENODATA) {
+		*younger = 0;
+		err = 0;
+	}
+	return err;
+}
+
+/**
+ * apfs_update_latest_snap - Recompute the latest snapshot that is not deleted
+ * @sb:		superblock structure
+ * @root:	root of the omap snapshot tree
+ * @omap_raw:	the volume's omap object, already in the transaction
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_update_latest_snap(struct super_block *sb, struct apfs_node *root,
+				   struct apfs_omap_phys *omap_raw)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	u64 curr = 0, next, latest = 0;
+	u32 flags;
+	int err;
+
+	while (1) {
+		err = apfs_omap_snap_next(root, curr, &next, &flags);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			return err;
+		if (!(flags & APFS_OMAP_SNAPSHOT_DELETED))
+			latest = next;
+		curr = next;
+	}
+
+	apfs_assert_in_transaction(sb, &omap_raw->om_o);
+	omap_raw->om_most_recent_snap = cpu_to_le64(latest);
+	sbi->s_latest_snap = latest;
+	return 0;
+}
+
+/**
+ * apfs_snap_meta_insert - Insert a new record in the snapshot metadata tree
+ * @root:	root of the snapshot metadata tree
+ * @key:	in-memory key for the record
+ * @raw_key:	on-disk key for the record
+ * @key_len:	length of @raw_key
+ * @raw_val:	on-disk value for the record
+ * @val_len:	length of @raw_val
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snap_meta_insert(struct apfs_node *root, struct apfs_key *key,
+				 void *raw_key, int key_len, void *raw_val, int val_len)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = key;
+	query->flags = APFS_QUERY_SNAP_META;
+
+	err = apfs_btree_query(sb, &query);
+	if (!err) {
+		struct apfs_key found;
+
+		/* The non-exact query may have found a different record */
+		err = apfs_read_cat_key((void *)query->node->object.bh->b_data + query->key_off,
+					query->key_len, &found, false /* hashed */);
+		if (!err && !apfs_keycmp(sb, &found, key))
+			err = -EEXIST;
+		if (err)
+			goto fail;
+	} else if (err != -ENODATA) {
+		goto fail;
+	}
+	err = apfs_btree_insert(query, raw_key, key_len, raw_val, val_len);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_snap_meta_lookup - Find an exact record in the snapshot metadata tree
+ * @root:	root of the snapshot metadata tree
+ * @key:	in-memory key for the record
+ * @query_p:	on return, query that found the record; the caller must free it
+ *
+ * Returns 0 on success, -ENODATA if the record doesn't exist, or another
+ * negative error code in case of failure.
+ */
+static int apfs_snap_meta_lookup(struct apfs_node *root, struct apfs_key *key, struct apfs_query **query_p)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = key;
+	query->flags = APFS_QUERY_SNAP_META | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_free_query(sb, query);
+		return err;
+	}
+	*query_p = query;
+	return 0;
+}
+
+/**
+ * apfs_snap_name_lookup - Find the transaction id for a named snapshot
+ * @root:	root of the snapshot metadata tree
+ * @name:	name of the snapshot
+ * @xid:	on return, the transaction id for the snapshot
+ * @remove:	also remove the name record?
+ *
+ * Returns 0 on success, -ENODATA if there is no such snapshot, or another
+ * negative error code in case of failure.
+ */
+static int apfs_snap_name_lookup(struct apfs_node *root, const char *name, u64 *xid, bool remove)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query = NULL;
+	struct apfs_snap_name_val *val;
+	struct apfs_key key;
+	int err;
+
+	apfs_init_snap_name_key(name, &key);
+	err = apfs_snap_meta_lookup(root, &key, &query);
+	if (err)
+		return err;
+
+	if (query->len != sizeof(*val)) {
+		apfs_alert(sb, "bad snapshot name record for %s", name);
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	*xid = le64_to_cpu(val->snap_xid);
+
+	if (remove)
+		err = apfs_btree_remove(query);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_snap_extentref_root - Get write access to a snapshot's extentref tree
+ * @meta_root:	root of the snapshot metadata tree, already in the transaction
+ * @xid:	transaction id for the snapshot
+ *
+ * On success returns the root node, and the metadata record is updated with
+ * its new location. On failure returns an error pointer.
+ */
+static struct apfs_node *apfs_snap_extentref_root(struct apfs_node *meta_root, u64 xid)
+{
+	struct super_block *sb = meta_root->object.sb;
+	struct apfs_query *query = NULL;
+	struct apfs_snap_metadata_val *val;
+	struct apfs_node *root;
+	struct apfs_key key;
+	u64 oid;
+	int err;
+
+	apfs_init_snap_metadata_key(xid, &key);
+	err = apfs_snap_meta_lookup(meta_root, &key, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (err)
+		return ERR_PTR(err);
+
+	if (query->len < sizeof(*val)) {
+		root = ERR_PTR(-EFSCORRUPTED);
+		goto out;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	oid = le64_to_cpu(val->extentref_tree_oid);
+
+	root = apfs_read_node(sb, oid, APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(root) || root->object.oid == oid)
+		goto out;
+
+	err = apfs_query_join_transaction(query);
+	if (err) {
+		apfs_node_put(root);
+		root = ERR_PTR(err);
+		goto out;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	val->extentref_tree_oid = cpu_to_le64(root->object.oid);
+
+out:
+	apfs_free_query(sb, query);
+	return root;
+}
+
+/**
+ * apfs_volume_extentref_root - Get write access to the live extentref tree
+ * @sb: superblock structure
+ *
+ * On success returns the root node, on failure returns an error pointer.
+ */
+static struct apfs_node *apfs_volume_extentref_root(struct super_block *sb)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *root;
+
+	root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_extentref_tree_oid),
+			      APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(root))
+		return root;
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(root->object.oid);
+	return root;
+}
+
+/**
+ * apfs_snap_extentref_read - Read a snapshot's extentref tree root, read-only
+ * @meta_root:	root of the snapshot metadata tree
+ * @xid:	transaction id for the snapshot
+ *
+ * On success returns the root node, on failure returns an error pointer.
+ */
+static struct apfs_node *apfs_snap_extentref_read(struct apfs_node *meta_root, u64 xid)
+{
+	struct super_block *sb = meta_root->object.sb;
+	struct apfs_query *query = NULL;
+	struct apfs_snap_metadata_val *val;
+	struct apfs_node *root;
+	struct apfs_key key;
+	int err;
+
+	apfs_init_snap_metadata_key(xid, &key);
+	err = apfs_snap_meta_lookup(meta_root, &key, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (err)
+		return ERR_PTR(err);
+
+	if (query->len < sizeof(*val)) {
+		root = ERR_PTR(-EFSCORRUPTED);
+		goto out;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	root = apfs_read_node(sb, le64_to_cpu(val->extentref_tree_oid),
+			      APFS_OBJ_PHYSICAL, false /* write */);
+
+out:
+	apfs_free_query(sb, query);
+	return root;
+}
+
+/**
+ * apfs_snap_extentref_find - Find the snapshot record for a block that has none
+ *			      in the live extentref tree
+ * @sb:		superblock structure
+ * @bno:	the block number
+ * @pext:	on return, the record from the youngest snapshot that has one,
+ *		trimmed so that no younger snapshot has records for its blocks
+ * @val:	on return, a copy of the raw record value
+ *
+ * Snapshots deleted but not yet reaped still own their records, so they are
+ * searched as well.  Returns 0 on success, -ENODATA if no snapshot has a record
+ * for the block, or another negative error code in case of failure.
+ */
+int apfs_snap_extentref_find(struct super_block *sb, u64 bno, struct apfs_phys_extent *pext,
+			     struct apfs_phys_ext_val *val)
+{
+	struct buffer_head *omap_bh;
+	struct apfs_node *omap_snap_root = NULL, *meta_root = NULL, *ext_root;
+	struct apfs_phys_extent curr;
+	struct apfs_phys_ext_val curr_val;
+	u64 xid = 0, start = 0, end;
+	bool found = false;
+	int err;
+
+	omap_bh = apfs_read_omap_phys(sb);
+	if (IS_ERR(omap_bh))
+		return PTR_ERR(omap_bh);
+	omap_snap_root = apfs_read_omap_snap_root(sb, (struct apfs_omap_phys *)omap_bh->b_data,
+						  false /* write */);
+	if (IS_ERR(omap_snap_root)) {
+		err = PTR_ERR(omap_snap_root);
+		omap_snap_root = NULL;
+		goto out;
+	}
+	meta_root = apfs_read_snap_meta_root(sb, false /* write */);
+	if (IS_ERR(meta_root)) {
+		err = PTR_ERR(meta_root);
+		meta_root = NULL;
+		goto out;
+	}
+
+	/* Go from the oldest snapshot to the youngest, the last record wins */
+	while (1) {
+		err = apfs_omap_snap_next(omap_snap_root, xid, &xid, NULL /* flags */);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			goto out;
+
+		ext_root = apfs_snap_extentref_read(meta_root, xid);
+		if (IS_ERR(ext_root)) {
+			err = PTR_ERR(ext_root);
+			goto out;
+		}
+		err = apfs_extentref_lookup(ext_root, bno, &curr, &curr_val);
+		apfs_node_put(ext_root);
+		if (err == -ENODATA)
+			continue;
+		if (err)
+			goto out;
+
+		end = curr.bno + curr.blkcount;
+		if (end > bno) {
+			*pext = curr;
+			*val = curr_val;
+			start = curr.bno;
+			found = true;
+		} else if (found && end > start) {
+			/* A younger record for the lower blocks takes precedence */
+			start = end;
+		}
+	}
+
+	if (!found) {
+		err = -ENODATA;
+		goto out;
+	}
+	err = 0;
+	pext->blkcount -= start - pext->bno;
+	pext->len = pext->blkcount << sb->s_blocksize_bits;
+	pext->bno = start;
+
+out:
+	if (meta_root)
+		apfs_node_put(meta_root);
+	if (omap_snap_root)
+		apfs_node_put(omap_snap_root);
+	brelse(omap_bh);
+	return err;
+}
+
+/**
+ * apfs_free_snap_block - Free a block that belonged to a snapshot
+ * @sb:		superblock structure
+ * @bno:	block number
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_free_snap_block(struct super_block *sb, u64 bno)
+{
+	apfs_vol_alloc_add(sb, -1);
+	return apfs_free_queue_insert(sb, bno, 1);
+}
+
+/**
+ * apfs_snapshot_take - Take a snapshot of the volume in the current transaction
+ * @sb:		superblock structure
+ * @name:	name for the snapshot
+ *
+ * The current extentref tree is handed over to the snapshot, and the volume
+ * starts over with an empty one.  Returns 0 on success or a negative error
+ * code in case of failure.
+ */
+static int apfs_snapshot_take(struct super_block *sb, const char *name)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+	struct apfs_superblock *snap_vsb;
+	struct apfs_omap_phys *omap_raw = NULL;
+	struct apfs_node *meta_root = NULL, *ext_root = NULL, *new_ext_root = NULL;
+	struct apfs_node *omap_snap_root = NULL;
+	struct apfs_btree_info *info;
+	struct buffer_head *omap_bh = NULL, *sblock_bh = NULL;
+	struct apfs_snap_metadata_key meta_key;
+	struct apfs_snap_metadata_val *meta_val = NULL;
+	struct apfs_snap_name_key *name_key = NULL;
+	struct apfs_snap_name_val name_val;
+	struct apfs_omap_snapshot omap_snap = {0};
+	struct apfs_key key;
+	__le64 omap_snap_key;
+	u64 xid = nxi->nx_xid;
+	u64 old_ext_oid, sblock, dup_xid, now;
+	int namelen = strlen(name) + 1;
+	int err;
+
+	meta_root = apfs_create_snap_meta_root(sb);
+	if (IS_ERR(meta_root)) {
+		err = PTR_ERR(meta_root);
+		meta_root = NULL;
+		goto out;
+	}
+
+	err = apfs_snap_name_lookup(meta_root, name, &dup_xid, false /* remove */);
+	if (!err)
+		err = -EEXIST;
+	if (err != -ENODATA)
+		goto out;
+
+	/* The snapshot keeps the extentref tree, the volume gets a new one */
+	err = apfs_extref_delta_apply(sb);
+	if (err)
+		goto out;
+	old_ext_oid = le64_to_cpu(vsb_raw->apfs_extentref_tree_oid);
+	ext_root = apfs_read_node(sb, old_ext_oid, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(ext_root)) {
+		err = PTR_ERR(ext_root);
+		ext_root = NULL;
+		goto out;
+	}
+	info = (void *)ext_root->object.bh->b_data + sb->s_blocksize - sizeof(*info);
+	new_ext_root = apfs_create_root_node(sb, ext_root->tree_type, &info->bt_fixed);
+	if (IS_ERR(new_ext_root)) {
+		err = PTR_ERR(new_ext_root);
+		new_ext_root = NULL;
+		goto out;
+	}
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(new_ext_root->object.oid);
+
+	/* Allocate the block for the snapshot's copy of the volume superblock */
+	err = apfs_spaceman_allocate_block(sb, &sblock, true /* backwards */);
+	if (err)
+		goto out;
+	apfs_vol_alloc_add(sb, 1);
+	sblock_bh = apfs_sb_bread(sb, sblock);
+	if (!sblock_bh) {
+		err = -EIO;
+		goto out;
+	}
+	err = apfs_transaction_join(sb, sblock_bh);
+	if (err)
+		goto out;
+	set_buffer_csum(sblock_bh);
+
+	/* Now the metadata and name records */
+	meta_val = kzalloc(sizeof(*meta_val) + namelen, GFP_KERNEL);
+	name_key = kzalloc(sizeof(*name_key) + namelen, GFP_KERNEL);
+	if (!meta_val || !name_key) {
+		err = -ENOMEM;
+		goto out;
+	}
+	now = ktime_get_real_ns();
+	meta_val->extentref_tree_oid = cpu_to_le64(old_ext_oid);
+	meta_val->sblock_oid = cpu_to_le64(sblock);
+	meta_val->create_time = cpu_to_le64(now);
+	meta_val->change_time = cpu_to_le64(now);
+	meta_val->extentref_tree_type = vsb_raw->apfs_extentref_tree_type;
+	meta_val->name_len = cpu_to_le16(namelen);
+	memcpy(meta_val->name, name, namelen);
+	apfs_key_set_hdr(APFS_TYPE_SNAP_METADATA, xid, &meta_key);
+	apfs_init_snap_metadata_key(xid, &key);
+	err = apfs_snap_meta_insert(meta_root, &key, &meta_key, sizeof(meta_key),
+				    meta_val, sizeof(*meta_val) + namelen);
+	if (err)
+		goto out;
+
+	apfs_key_set_hdr(APFS_TYPE_SNAP_NAME, APFS_SNAP_NAME_OBJ_ID, name_key);
+	name_key->name_len = cpu_to_le16(namelen);
+	memcpy(name_key->name, name, namelen);
+	name_val.snap_xid = cpu_to_le64(xid);
+	apfs_init_snap_name_key(name, &key);
+	err = apfs_snap_meta_insert(meta_root, &key, name_key, sizeof(*name_key) + namelen,
+				    &name_val, sizeof(name_val));
+	if (err)
+		goto out;
+
+	/* Register the snapshot in the omap, so that older objects are kept */
+	omap_bh = apfs_read_omap_phys(sb);
+	if (IS_ERR(omap_bh)) {
+		err = PTR_ERR(omap_bh);
+		omap_bh = NULL;
+		goto out;
+	}
+	omap_raw = (void *)omap_bh->b_data;
+	omap_snap_root = apfs_read_omap_snap_root(sb, omap_raw, true /* write */);
+	if (IS_ERR(omap_snap_root) && PTR_ERR(omap_snap_root) == -ENODATA) {
+		struct apfs_btree_info_fixed fixed = {0};
+
+		fixed.bt_flags = cpu_to_le32(APFS_BTREE_UINT64_KEYS | APFS_BTREE_PHYSICAL);
+		fixed.bt_node_size = cpu_to_le32(sb->s_blocksize);
+		fixed.bt_key_size = cpu_to_le32(sizeof(omap_snap_key));
+		fixed.bt_val_size = cpu_to_le32(sizeof(omap_snap));
+		omap_snap_root = apfs_create_root_node(sb, APFS_OBJECT_TYPE_OMAP_SNAPSHOT, &fixed);
+		if (!IS_ERR(omap_snap_root)) {
+			apfs_assert_in_transaction(sb, &omap_raw->om_o);
+			omap_raw->om_snapshot_tree_type = cpu_to_le32(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE);
+			omap_raw->om_snapshot_tree_oid = cpu_to_le64(omap_snap_root->object.oid);
+		}
+	}
+	if (IS_ERR(omap_snap_root)) {
+		err = PTR_ERR(omap_snap_root);
+		omap_snap_root = NULL;
+		goto out;
+	}
+	{
+		struct apfs_query *query;
+
+		query = apfs_alloc_query(omap_snap_root, NULL /* parent */);
+		if (!query) {
+			err = -ENOMEM;
+			goto out;
+		}
+		apfs_init_omap_snap_key(xid, &key);
+		query->key = &key;
+		query->flags = APFS_QUERY_OMAP_SNAP;
+		err = apfs_btree_query(sb, &query);
+		if (!err)
+			err = -EFSCORRUPTED; /* Snapshot xids are unique */
+		if (err == -ENODATA) {
+			omap_snap_key = cpu_to_le64(xid);
+			err = apfs_btree_insert(query, &omap_snap_key, sizeof(omap_snap_key),
+						&omap_snap, sizeof(omap_snap));
+		}
+		apfs_free_query(sb, query);
+		if (err)
+			goto out;
+	}
+	apfs_assert_in_transaction(sb, &omap_raw->om_o);
+	le32_add_cpu(&omap_raw->om_snap_count, 1);
+	omap_raw->om_most_recent_snap = cpu_to_le64(xid);
+	sbi->s_snap_count = le32_to_cpu(omap_raw->om_snap_count);
+	sbi->s_latest_snap = xid;
+
+	le64_add_cpu(&vsb_raw->apfs_num_snapshots, 1);
+
+	/* Finally, the superblock copy; it keeps the old extentref tree */
+	apfs_vol_alloc_fold(sb);
+	memcpy(sblock_bh->b_data, vsb_raw, sb->s_blocksize);
+	snap_vsb = (void *)sblock_bh->b_data;
+	snap_vsb->apfs_o.o_oid = cpu_to_le64(sblock);
+	snap_vsb->apfs_o.o_xid = cpu_to_le64(xid);
+	snap_vsb->apfs_o.o_type = cpu_to_le32(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_FS);
+	snap_vsb->apfs_extentref_tree_oid = cpu_to_le64(old_ext_oid);
+
+out:
+	kfree(name_key);
+	kfree(meta_val);
+	brelse(sblock_bh);
+	brelse(omap_bh);
+	if (omap_snap_root)
+		apfs_node_put(omap_snap_root);
+	if (new_ext_root)
+		apfs_node_put(new_ext_root);
+	if (ext_root)
+		apfs_node_put(ext_root);
+	if (meta_root)
+		apfs_node_put(meta_root);
+	return err;
+}
+
+/**
+ * apfs_snapshot_create - Create a new snapshot of a mounted volume
+ * @sb:		superblock structure
+ * @name:	name for the snapshot
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_snapshot_create(struct super_block *sb, const char *name)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	struct apfs_max_ops maxops;
+	int err;
+
+	if (strlen(name) > APFS_SNAP_MAX_NAMELEN)
+		return -ENAMETOOLONG;
+
+	maxops.cat = APFS_SNAPSHOT_MAXOPS;
+	maxops.blks = 0;
+
+	/* Get all dirty file data into the snapshot */
+	down_read(&sb->s_umount);
+	err = sync_filesystem(sb);
+	up_read(&sb->s_umount);
+	if (err)
+		return err;
+
+	/*
+	 * The snapshot is identified by the xid of its transaction, so that
+	 * transaction must not include any other changes.
+	 */
+	while (1) {
+		err = apfs_transaction_start(sb, maxops);
+		if (err)
+			return err;
+		if (nx_trans->t_starts_count == 1)
+			break;
+		nx_trans->t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+	}
+
+	err = apfs_snapshot_take(sb, name);
+	if (err)
+		goto fail;
+
+	/* Later changes must not go into the snapshot's transaction */
+	nx_trans->t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_snapshot_mark_deleted - Mark a snapshot as deleted in the current
+ *				transaction
+ * @sb:		superblock structure
+ * @name:	name of the snapshot
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_snapshot_mark_deleted(struct super_block *sb, const char *name)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *meta_root = NULL, *omap_snap_root = NULL;
+	struct buffer_head *omap_bh = NULL;
+	struct apfs_omap_phys *omap_raw;
+	struct apfs_omap_snapshot *val;
+	struct apfs_query *query = NULL;
+	struct apfs_key key;
+	u64 xid;
+	int err;
+
+	meta_root = apfs_read_snap_meta_root(sb, true /* write */);
+	if (IS_ERR(meta_root)) {
+		err = PTR_ERR(meta_root);
+		meta_root = NULL;
+		goto out;
+	}
+	err = apfs_snap_name_lookup(meta_root, name, &xid, true /* remove */);
+	if (err)
+		goto out;
+
+	omap_bh = apfs_read_omap_phys(sb);
+	if (IS_ERR(omap_bh)) {
+		err = PTR_ERR(omap_bh);
+		omap_bh = NULL;
+		goto out;
+	}
+	omap_raw = (void *)omap_bh->b_data;
+	omap_snap_root = apfs_read_omap_snap_root(sb, omap_raw, true /* write */);
+	if (IS_ERR(omap_snap_root)) {
+		err = PTR_ERR(omap_snap_root);
+		omap_snap_root = NULL;
+		goto out;
+	}
+
+	query = apfs_alloc_query(omap_snap_root, NULL /* parent */);
+	if (!query) {
+		err = -ENOMEM;
+		goto out;
+	}
+	apfs_init_omap_snap_key(xid, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_OMAP_SNAP | APFS_QUERY_EXACT;
+	err = apfs_btree_query(sb, &query);
+	if (!err && query->len != sizeof(*val))
+		err = -EFSCORRUPTED;
+	if (!err)
+		err = apfs_query_join_transaction(query);
+	if (err) {
+		apfs_alert(sb, "no omap record for snapshot %s", name);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	val->oms_flags |= cpu_to_le32(APFS_OMAP_SNAPSHOT_DELETED);
+
+	err = apfs_update_latest_snap(sb, omap_snap_root, omap_raw);
+	if (err)
+		goto out;
+
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	le64_add_cpu(&vsb_raw->apfs_num_snapshots, -1);
+
+out:
+	apfs_free_query(sb, query);
+	brelse(omap_bh);
+	if (omap_snap_root)
+		apfs_node_put(omap_snap_root);
+	if (meta_root)
+		apfs_node_put(meta_root);
+	return err;
+}
+
+/**
+ * apfs_snapshot_destroy - Delete a snapshot of a mounted volume
+ * @sb:		superblock structure
+ * @name:	name of the snapshot
+ *
+ * The snapshot disappears right away, but its blocks are only released later
+ * by the reaper thread.  Returns 0 on success or a negative error code in case
+ * of failure.
+ */
+int apfs_snapshot_destroy(struct super_block *sb, const char *name)
+{
+	struct apfs_max_ops maxops;
+	int err;
+
+	maxops.cat = APFS_SNAPSHOT_MAXOPS;
+	maxops.blks = 0;
+
+	err = apfs_transaction_start(sb, maxops);
+	if (err)
+		return err;
+
+	err = apfs_snapshot_mark_deleted(sb, name);
+	if (err == -ENODATA)
+		err = -ENOENT;
+	if (err)
+		goto fail;
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+
+	return apfs_reaper_start(sb);
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/*
+ * State of the reaper for a single deleted snapshot
+ */
+struct apfs_reaper_ctx {
+	struct super_block *sb;
+	u64 xid;		/* Transaction id for the deleted snapshot */
+	u64 older;		/* Previous snapshot, or 0 if none */
+	u64 younger;		/* Next snapshot, or 0 for the live volume */
+	u64 cursor;		/* Last object id checked in the omap */
+	bool omap_done;		/* Have all omap records been checked? */
+};
+
+/**
+ * apfs_reaper_omap_rec - Read the omap record found by a query
+ * @query:	the query that found the record
+ * @key:	on return, the in-memory key
+ * @val:	on return, a copy of the value
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_reaper_omap_rec(struct apfs_query *query, struct apfs_key *key, struct apfs_omap_val *val)
+{
+	char *raw = query->node->object.bh->b_data;
+	int err;
+
+	err = apfs_read_omap_key(raw + query->key_off, query->key_len, key);
+	if (err)
+		return err;
+	if (query->len != sizeof(*val))
+		return -EFSCORRUPTED;
+	*val = *(struct apfs_omap_val *)(raw + query->off);
+	return 0;
+}
+
+/**
+ * apfs_reaper_omap_query - Run a query on the volume omap
+ * @sb:		superblock structure
+ * @key:	key to search for, must outlive the query
+ * @exact:	must the record match the xid in @key?
+ * @query_p:	on return, the query; the caller must free it even on failure
+ *
+ * Returns 0 if a record for the object was found, -ENODATA if not, or another
+ * negative error code in case of failure.
+ */
+static int apfs_reaper_omap_query(struct super_block *sb, struct apfs_key *key, bool exact,
+				  struct apfs_query **query_p)
+{
+	struct apfs_query *query;
+	struct apfs_key found;
+	int err;
+
+	*query_p = query = apfs_alloc_query(APFS_SB(sb)->s_omap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = key;
+	query->flags = APFS_QUERY_OMAP;
+	if (exact)
+		query->flags |= APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, query_p);
+	if (err)
+		return err;
+	query = *query_p;
+	err = apfs_read_omap_key(query->node->object.bh->b_data + query->key_off,
+				 query->key_len, &found);
+	if (err)
+		return err;
+	return found.id == key->id ? 0 : -ENODATA;
+}
+
+/**
+ * apfs_reap_omap_oid - Remove the version of an object only used by a deleted
+ *			snapshot
+ * @ctx:	reaper context
+ * @oid:	the object id
+ *
+ * The version seen by the deleted snapshot is needed by nobody else if it was
+ * created after the previous snapshot, and replaced before the next one.
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_reap_omap_oid(struct apfs_reaper_ctx *ctx, u64 oid)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_query *query = NULL;
+	struct apfs_key qkey, key, next;
+	struct apfs_omap_val val;
+	u32 flags;
+	int err;
+
+	apfs_init_omap_key(oid, ctx->xid, &qkey);
+	err = apfs_reaper_omap_query(sb, &qkey, false /* exact */, &query);
+	if (err)
+		goto out;
+	err = apfs_reaper_omap_rec(query, &key, &val);
+	if (err)
+		goto out;
+	if (key.number <= ctx->older)
+		goto out;
+
+	err = apfs_query_next_key(query, &next);
+	if (err || next.id != oid)
+		goto out;
+	if (ctx->younger && next.number > ctx->younger)
+		goto out;
+
+	err = apfs_btree_remove(query);
+	if (err)
+		goto out;
+	flags = le32_to_cpu(val.ov_flags);
+	if (!(flags & APFS_OMAP_VAL_DELETED)) {
+		err = apfs_free_snap_block(sb, le64_to_cpu(val.ov_paddr));
+		if (err)
+			goto out;
+	}
+
+	/* A deletion record with nothing older to hide is no longer needed */
+	apfs_free_query(sb, query);
+	apfs_init_omap_key(oid, next.number - 1, &qkey);
+	err = apfs_reaper_omap_query(sb, &qkey, false /* exact */, &query);
+	if (err != -ENODATA)
+		goto out;
+	apfs_free_query(sb, query);
+	apfs_init_omap_key(oid, next.number, &qkey);
+	err = apfs_reaper_omap_query(sb, &qkey, true /* exact */, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (!err)
+		err = apfs_reaper_omap_rec(query, &key, &val);
+	if (err)
+		goto out;
+	if (le32_to_cpu(val.ov_flags) & APFS_OMAP_VAL_DELETED)
+		err = apfs_btree_remove(query);
+
+out:
+	apfs_free_query(sb, query);
+	return err == -ENODATA ? 0 : err;
+}
+
+/**
+ * apfs_reaper_next_oid - Find the next object id in the volume omap
+ * @ctx:	reaper context
+ * @oid:	on return, the object id
+ *
+ * Returns 0 on success, -ENODATA if @ctx->cursor was the last object id, or
+ * another negative error code in case of failure.
+ */
+static int apfs_reaper_next_oid(struct apfs_reaper_ctx *ctx, u64 *oid)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_query *query = NULL;
+	struct apfs_key qkey, key;
+	int err;
+
+	/* Skip all the records for the last object id */
+	apfs_init_omap_key(ctx->cursor, ~0ULL, &qkey);
+	err = apfs_reaper_omap_query(sb, &qkey, false /* exact */, &query);
+	if (err && err != -ENODATA)
+		goto out;
+	err = apfs_query_next_key(query, &key);
+	if (!err)
+		*oid = key.id;
+out:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_reap_omap_batch - Reap the omap records for a batch of objects
+ * @ctx: reaper context
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_reap_omap_batch(struct apfs_reaper_ctx *ctx)
+{
+	u64 oid;
+	int i, err;
+
+	for (i = 0; i < APFS_REAPER_BATCH; ++i) {
+		err = apfs_reaper_next_oid(ctx, &oid);
+		if (err == -ENODATA) {
+			ctx->omap_done = true;
+			return 0;
+		}
+		if (err)
+			return err;
+		err = apfs_reap_omap_oid(ctx, oid);
+		if (err)
+			return err;
+		ctx->cursor = oid;
+	}
+	return 0;
+}
+
+/**
+ * apfs_reap_extentref_batch - Merge a batch of extentref records
+ * @ctx:	reaper context
+ * @meta_root:	root of the snapshot metadata tree, already in the transaction
+ *
+ * Returns 0 on success, -ENODATA if the snapshot has no records left, or
+ * another negative error code in case of failure.
+ */
+static int apfs_reap_extentref_batch(struct apfs_reaper_ctx *ctx, struct apfs_node *meta_root)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_node *src_root = NULL, *dst_root = NULL;
+	int i, err;
+
+	/* The merge needs the real reference counts in the live tree */
+	err = apfs_extref_delta_apply(sb);
+	if (err)
+		return err;
+
+	src_root = apfs_snap_extentref_root(meta_root, ctx->xid);
+	if (IS_ERR(src_root))
+		return PTR_ERR(src_root);
+	if (ctx->younger)
+		dst_root = apfs_snap_extentref_root(meta_root, ctx->younger);
+	else
+		dst_root = apfs_volume_extentref_root(sb);
+	if (IS_ERR(dst_root)) {
+		err = PTR_ERR(dst_root);
+		dst_root = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < APFS_REAPER_BATCH; ++i) {
+		err = apfs_extentref_merge_step(src_root, dst_root);
+		if (err)
+			break;
+	}
+
+out:
+	if (dst_root)
+		apfs_node_put(dst_root);
+	apfs_node_put(src_root);
+	return err;
+}
+
+/**
+ * apfs_reap_finish - Remove the last traces of a deleted snapshot
+ * @ctx:	reaper context
+ * @meta_root:	root of the snapshot metadata tree, already in the transaction
+ * @omap_snap_root: root of the omap snapshot tree, already in the transaction
+ * @omap_raw:	the volume's omap object, already in the transaction
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_reap_finish(struct apfs_reaper_ctx *ctx, struct apfs_node *meta_root,
+			    struct apfs_node *omap_snap_root, struct apfs_omap_phys *omap_raw)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct apfs_snap_metadata_val *val;
+	struct apfs_node *ext_root;
+	struct apfs_key key;
+	u64 sblock;
+	int err;
+
+	apfs_init_snap_metadata_key(ctx->xid, &key);
+	err = apfs_snap_meta_lookup(meta_root, &key, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (err)
+		return err;
+	if (query->len < sizeof(*val)) {
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	val = (void *)query->node->object.bh->b_data + query->off;
+	sblock = le64_to_cpu(val->sblock_oid);
+
+	ext_root = apfs_read_node(sb, le64_to_cpu(val->extentref_tree_oid),
+				  APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(ext_root)) {
+		err = PTR_ERR(ext_root);
+		goto out;
+	}
+	if (ext_root->records) {
+		apfs_node_put(ext_root);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	err = apfs_free_snap_block(sb, ext_root->object.block_nr);
+	apfs_node_put(ext_root);
+	if (err)
+		goto out;
+	err = apfs_free_snap_block(sb, sblock);
+	if (err)
+		goto out;
+	err = apfs_btree_remove(query);
+	if (err)
+		goto out;
+	apfs_free_query(sb, query);
+
+	query = apfs_alloc_query(omap_snap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_omap_snap_key(ctx->xid, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_OMAP_SNAP | APFS_QUERY_EXACT;
+	err = apfs_btree_query(sb, &query);
+	if (err == -ENODATA)
+		err = -EFSCORRUPTED;
+	if (!err)
+		err = apfs_btree_remove(query);
+	if (err)
+		goto out;
+
+	apfs_assert_in_transaction(sb, &omap_raw->om_o);
+	le32_add_cpu(&omap_raw->om_snap_count, -1);
+	sbi->s_snap_count = le32_to_cpu(omap_raw->om_snap_count);
+
+out:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_reap_step - Do one transaction worth of work on a deleted snapshot
+ * @ctx:	reaper context
+ * @done:	on return, is the snapshot gone?
+ *
+ * Must be called inside a transaction.  Returns 0 on success or a negative
+ * error code in case of failure.
+ */
+static int apfs_reap_step(struct apfs_reaper_ctx *ctx, bool *done)
+{
+	struct super_block *sb = ctx->sb;
+	struct apfs_node *meta_root = NULL, *omap_snap_root = NULL;
+	struct buffer_head *omap_bh = NULL;
+	struct apfs_omap_phys *omap_raw;
+	int err;
+
+	omap_bh = apfs_read_omap_phys(sb);
+	if (IS_ERR(omap_bh))
+		return PTR_ERR(omap_bh);
+	omap_raw = (void *)omap_bh->b_data;
+	omap_snap_root = apfs_read_omap_snap_root(sb, omap_raw, true /* write */);
+	if (IS_ERR(omap_snap_root)) {
+		err = PTR_ERR(omap_snap_root);
+		omap_snap_root = NULL;
+		goto out;
+	}
+
+	/* New snapshots may have been taken since the last step */
+	err = apfs_omap_snap_neighbours(omap_snap_root, ctx->xid, &ctx->older, &ctx->younger);
+	if (err)
+		goto out;
+
+	if (!ctx->omap_done) {
+		err = apfs_reap_omap_batch(ctx);
+		goto out;
+	}
+
+	meta_root = apfs_read_snap_meta_root(sb, true /* write */);
+	if (IS_ERR(meta_root)) {
+		err = PTR_ERR(meta_root);
+		meta_root = NULL;
+		goto out;
+	}
+	err = apfs_reap_extentref_batch(ctx, meta_root);
+	if (err != -ENODATA)
+		goto out;
+	err = apfs_reap_finish(ctx, meta_root, omap_snap_root, omap_raw);
+	if (!err)
+		*done = true;
+
+out:
+	if (meta_root)
+		apfs_node_put(meta_root);
+	if (omap_snap_root)
+		apfs_node_put(omap_snap_root);
+	brelse(omap_bh);
+	return err;
+}
+
+/**
+ * apfs_reaper_find - Find a deleted snapshot that still needs reaping
+ * @sb:		superblock structure
+ * @xid:	on return, the transaction id for the snapshot
+ *
+ * Returns 0 on success, -ENODATA if there is nothing to reap, or another
+ * negative error code in case of failure.
+ */
+static int apfs_reaper_find(struct super_block *sb, u64 *xid)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_superblock *vsb_raw;
+	struct apfs_omap_phys *omap_raw;
+	struct apfs_node *root = NULL;
+	struct buffer_head *bh;
+	u64 curr = 0;
+	u32 flags;
+	int err;
+
+	down_read(&nxi->nx_big_sem);
+	vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	bh = apfs_read_object_block(sb, le64_to_cpu(vsb_raw->apfs_omap_oid), false /* write */);
+	if (IS_ERR(bh)) {
+		err = PTR_ERR(bh);
+		goto out;
+	}
+	omap_raw = (void *)bh->b_data;
+	root = apfs_read_omap_snap_root(sb, omap_raw, false /* write */);
+	brelse(bh);
+	if (IS_ERR(root)) {
+		err = PTR_ERR(root);
+		root = NULL;
+		goto out;
+	}
+
+	do {
+		err = apfs_omap_snap_next(root, curr, &curr, &flags);
+	} while (!err && !(flags & APFS_OMAP_SNAPSHOT_DELETED));
+	if (!err)
+		*xid = curr;
+
+out:
+	if (root)
+		apfs_node_put(root);
+	up_read(&nxi->nx_big_sem);
+	return err;
+}
+
+/**
+ * apfs_reap_snapshot - Reap the first deleted snapshot in the volume
+ * @sb: superblock structure
+ *
+ * Returns 0 on success, -ENODATA if there was nothing to reap, -EINTR if the
+ * reaper was stopped, or another negative error code in case of failure.
+ */
+static int apfs_reap_snapshot(struct super_block *sb)
+{
+	struct apfs_reaper_ctx ctx = {0};
+	struct apfs_max_ops maxops;
+	bool done = false;
+	int err;
+
+	maxops.cat = APFS_REAPER_BATCH;
+	maxops.blks = APFS_REAPER_BATCH;
+
+	ctx.sb = sb;
+	err = apfs_reaper_find(sb, &ctx.xid);
+	if (err)
+		return err;
+
+	while (!done) {
+		if (kthread_should_stop())
+			return -EINTR;
+
+		err = apfs_transaction_start(sb, maxops);
+		if (err)
+			return err;
+		err = apfs_reap_step(&ctx, &done);
+		if (err)
+			goto fail;
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+		cond_resched();
+	}
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+static int apfs_reaper_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct apfs_reaper *rp = &APFS_SB(sb)->s_reaper;
+	bool again;
+	int err;
+
+	while (1) {
+		err = apfs_reap_snapshot(sb);
+		if (!err)
+			continue;
+		if (err != -ENODATA)
+			break;
+
+		/* Don't miss snapshots deleted after the search */
+		mutex_lock(&rp->rp_lock);
+		again = rp->rp_kick;
+		rp->rp_kick = false;
+		if (!again)
+			WRITE_ONCE(rp->rp_done, true);
+		mutex_unlock(&rp->rp_lock);
+		if (!again)
+			break;
+	}
+
+	if (err != -ENODATA) {
+		if (err != -EINTR && err != -EROFS)
+			apfs_err(sb, "snapshot reaper failed (%d)", err);
+		WRITE_ONCE(rp->rp_done, true);
+	}
+
+	/* Wait to be reaped by apfs_reaper_stop() or by the next deletion */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return err;
+}
+
+/**
+ * apfs_reaper_start - Start releasing the blocks of deleted snapshots
+ * @sb: superblock structure
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_reaper_start(struct super_block *sb)
+{
+	struct apfs_reaper *rp = &APFS_SB(sb)->s_reaper;
+	struct task_struct *task;
+	int err = 0;
+
+	mutex_lock(&rp->rp_lock);
+	if (rp->rp_task) {
+		if (!READ_ONCE(rp->rp_done)) {
+			/* The running thread will rescan before it's done */
+			rp->rp_kick = true;
+			goto out;
+		}
+		kthread_stop(rp->rp_task);
+		rp->rp_task = NULL;
+	}
+
+	WRITE_ONCE(rp->rp_done, false);
+	rp->rp_kick = false;
+	task = kthread_run(apfs_reaper_thread, sb, "apfs_reaper/%s", sb->s_id);
+	if (IS_ERR(task)) {
+		err = PTR_ERR(task);
+		goto out;
+	}
+	rp->rp_task = task;
+out:
+	mutex_unlock(&rp->rp_lock);
+	return err;
+}
+
+/**
+ * apfs_reaper_stop - Stop the reaper thread for a volume, if any
+ * @sb: superblock structure
+ *
+ * Must not be called with the big semaphore held.  Snapshots that are not
+ * fully reaped will be resumed on the next mount.
+ */
+void apfs_reaper_stop(struct super_block *sb)
+{
+	struct apfs_reaper *rp = &APFS_SB(sb)->s_reaper;
+	struct task_struct *task;
+
+	/* The thread may need the mutex to finish */
+	mutex_lock(&rp->rp_lock);
+	task = rp->rp_task;
+	rp->rp_task = NULL;
+	mutex_unlock(&rp->rp_lock);
+
+	if (task)
+		kthread_stop(task);
+}
@@ -414,8 +414,6 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned qid)
 	}
 	fq->sfq_oldest_xid = cpu_to_le64(apfs_free_queue_oldest_xid(fq_root));
 
-	apfs_obj_set_csum(sb, &sm_raw->sm_o);
-
 fail:
 	apfs_node_put(fq_root);
 	return err;
@@ -449,7 +447,7 @@ int apfs_read_spaceman(struct super_block *sb)
 	sm_raw = (struct apfs_spaceman_phys *)sm_bh->b_data;
 
 	if (nxi->nx_flags & APFS_CHECK_NODES &&
-	    !apfs_obj_verify_csum(sb, &sm_raw->sm_o)) {
+	    !apfs_obj_verify_bh_csum(sb, sm_bh)) {
 		apfs_err(sb, "bad checksum for the space manager");
 		err = -EFSBADCRC;
 		goto fail;
@@ -493,19 +491,20 @@ fail:
 
 /**
  * apfs_write_spaceman - Write the in-memory spaceman fields to the disk buffer
- * @sm: in-memory spaceman structure
+ * @sb: superblock structure
  *
  * Copies the updated in-memory fields of the space manager into the on-disk
- * structure; the buffer is not dirtied.
+ * structure.  This is only done once, when the transaction is committed; the
+ * checksum gets updated after that, along with the other ephemeral objects.
  */
-static void apfs_write_spaceman(struct apfs_spaceman *sm)
+void apfs_write_spaceman(struct super_block *sb)
 {
+	struct apfs_spaceman *sm = APFS_SM(sb);
 	struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
 	struct apfs_spaceman_device *dev_raw = &sm_raw->sm_dev[APFS_SD_MAIN];
-	struct apfs_nxsb_info *nxi;
 
-	nxi = container_of(sm, struct apfs_nxsb_info, nx_spaceman);
-	ASSERT(le64_to_cpu(sm_raw->sm_o.o_xid) == nxi->nx_xid);
+	apfs_assert_in_transaction(sb, &sm_raw->sm_o);
+	ASSERT(buffer_csum(sm->sm_bh));
 
 	dev_raw->sm_free_count = cpu_to_le64(sm->sm_free_count);
 }
@@ -582,6 +581,20 @@ static inline void apfs_chunk_mark_used(struct super_block *sb, char *bitmap,
 	__set_bit_le(bno & (bitcount - 1), bitmap);
 }
 
+/**
+ * apfs_chunk_test_used - Check if a block inside a chunk is in use
+ * @sb:		superblock structure
+ * @bitmap:	allocation bitmap for the chunk
+ * @bno:	block number (must belong to the chunk)
+ */
+static inline bool apfs_chunk_test_used(struct super_block *sb, char *bitmap,
+					u64 bno)
+{
+	int bitcount = sb->s_blocksize * 8;
+
+	return test_bit_le(bno & (bitcount - 1), bitmap);
+}
+
 /**
  * apfs_chunk_mark_free - Mark a block inside a chunk as free
  * @sb:		superblock structure
@@ -656,7 +669,6 @@ int apfs_free_queue_insert(struct super_block *sb, u64 bno, u64 count)
 	if (!fq->sfq_oldest_xid)
 		fq->sfq_oldest_xid = cpu_to_le64(nxi->nx_xid);
 	le64_add_cpu(&fq->sfq_count, count);
-	apfs_obj_set_csum(sb, &sm_raw->sm_o);
 
 fail:
 	apfs_free_query(sb, query);
@@ -671,10 +683,13 @@ fail:
  * @index:	index of this chunk's info structure inside @cib
  * @bno:	block number
  * @is_alloc:	true to allocate, false to free
+ * @exact:	allocate the block at @bno instead of searching for a free one
+ *
+ * Returns -EEXIST if an exact allocation finds the block already in use.
  */
 static int apfs_chunk_alloc_free(struct super_block *sb,
 				 struct buffer_head **cib_bh,
-				 int index, u64 *bno, bool is_alloc)
+				 int index, u64 *bno, bool is_alloc, bool exact)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_spaceman *sm = APFS_SM(sb);
@@ -695,7 +710,7 @@ static int apfs_chunk_alloc_free(struct super_block *sb,
 	if (le64_to_cpu(ci->ci_xid) < nxi->nx_xid)
 		old_bmap = true;
 	if (is_alloc && le32_to_cpu(ci->ci_free_count) < 1)
-		return -ENOSPC;
+		return exact ? -EEXIST : -ENOSPC;
 
 	/* Read the current bitmap, or allocate it if necessary */
 	if (!ci->ci_bitmap_addr) {
@@ -788,11 +803,19 @@ static int apfs_chunk_alloc_free(struct super_block *sb,
 
 	/* Finally, allocate / free the actual block that was requested */
 	if(is_alloc) {
-		*bno = apfs_chunk_find_free(sb, bmap, le64_to_cpu(ci->ci_addr));
+		if (!exact)
+			*bno = apfs_chunk_find_free(sb, bmap, le64_to_cpu(ci->ci_addr));
 		if (!*bno) {
 			err = -EFSCORRUPTED;
 			goto fail;
 		}
+		if (exact && apfs_chunk_test_used(sb, bmap, *bno)) {
+			le32_add_cpu(&ci->ci_free_count, 1);
+			apfs_obj_set_csum(sb, &cib->cib_o);
+			mark_buffer_dirty(*cib_bh);
+			err = -EEXIST;
+			goto fail;
+		}
 		apfs_chunk_mark_used(sb, bmap, *bno);
 		sm->sm_free_count -= 1;
 	} else {
@@ -826,7 +849,7 @@ static int apfs_chunk_allocate_block(struct super_block *sb,
 				     struct buffer_head **cib_bh,
 				     int index, u64 *bno)
 {
-	return apfs_chunk_alloc_free(sb, cib_bh, index, bno, true);
+	return apfs_chunk_alloc_free(sb, cib_bh, index, bno, true, false);
 }
 
 /**
@@ -851,7 +874,7 @@ static int apfs_cib_allocate_block(struct super_block *sb,
 
 	cib = (struct apfs_chunk_info_block *)(*cib_bh)->b_data;
 	if (nxi->nx_flags & APFS_CHECK_NODES &&
-	    !apfs_obj_verify_csum(sb, &cib->cib_o)) {
+	    !apfs_obj_verify_bh_csum(sb, *cib_bh)) {
 		apfs_err(sb, "bad checksum for chunk-info block");
 		return -EFSBADCRC;
 	}
@@ -887,7 +910,6 @@ static int apfs_cib_allocate_block(struct super_block *sb,
 int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backwards)
 {
 	struct apfs_spaceman *sm = APFS_SM(sb);
-	struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
 	int i;
 
 	for (i = 0; i < sm->sm_cib_count; ++i) {
@@ -908,9 +930,6 @@ int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backward
 		if (!err) {
 			/* The cib may have been moved */
 			apfs_spaceman_write_cib_addr(sb, index, cib_bh->b_blocknr);
-			/* The free block count has changed */
-			apfs_write_spaceman(sm);
-			apfs_obj_set_csum(sb, &sm_raw->sm_o);
 		}
 		brelse(cib_bh);
 		if (err == -ENOSPC) /* This cib is full */
@@ -931,15 +950,16 @@ static int apfs_chunk_free(struct super_block *sb,
 				struct buffer_head **cib_bh,
 				int index, u64 bno)
 {
-	return apfs_chunk_alloc_free(sb, cib_bh, index, &bno, false);
+	return apfs_chunk_alloc_free(sb, cib_bh, index, &bno, false, false);
 }
 
 /**
- * apfs_main_free - Mark a regular block as free
+ * apfs_main_alloc_free - Allocate or free a given regular block
  * @sb:		superblock structure
  * @bno:	block number (must not belong to the ip)
+ * @is_alloc:	true to allocate, false to free
  */
-static int apfs_main_free(struct super_block *sb, u64 bno)
+static int apfs_main_alloc_free(struct super_block *sb, u64 bno, bool is_alloc)
 {
 	struct apfs_spaceman *sm = APFS_SM(sb);
 	struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
@@ -959,15 +979,123 @@ static int apfs_main_free(struct super_block *sb, u64 bno)
 	if (!cib_bh)
 		return -EIO;
 
-	err = apfs_chunk_free(sb, &cib_bh, chunk_idx, bno);
+	if (is_alloc)
+		err = apfs_chunk_alloc_free(sb, &cib_bh, chunk_idx, &bno,
+					    true /* is_alloc */, true /* exact */);
+	else
+		err = apfs_chunk_free(sb, &cib_bh, chunk_idx, bno);
 	if (!err) {
 		/* The cib may have been moved */
 		apfs_spaceman_write_cib_addr(sb, cib_idx, cib_bh->b_blocknr);
-		/* The free block count has changed */
-		apfs_write_spaceman(sm);
-		apfs_obj_set_csum(sb, &sm_raw->sm_o);
 	}
 	brelse(cib_bh);
 
 	return err;
 }
+
+/**
+ * apfs_main_free - Mark a regular block as free
+ * @sb:		superblock structure
+ * @bno:	block number (must not belong to the ip)
+ */
+static int apfs_main_free(struct super_block *sb, u64 bno)
+{
+	return apfs_main_alloc_free(sb, bno, false /* is_alloc */);
+}
+
+/**
+ * apfs_spaceman_claim_block - Allocate a specific on-disk block
+ * @sb:		superblock structure
+ * @bno:	block number to allocate
+ *
+ * Used to take back the blocks referenced by the fsync log, which were never
+ * marked as used in a committed transaction. Returns 0 on success, -EEXIST if
+ * the block was already in use, or another negative error code in case of
+ * failure.
+ */
+int apfs_spaceman_claim_block(struct super_block *sb, u64 bno)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+
+	if (apfs_block_in_ip(sm, bno) || bno >= sm->sm_block_count)
+		return -EFSCORRUPTED;
+	return apfs_main_alloc_free(sb, bno, true /* is_alloc */);
+}
+
+/**
+ * apfs_spaceman_free_blocks - Get the current count of free container blocks
+ * @sb:		superblock structure
+ * @count:	on return, the free block count
+ *
+ * The caller must hold the big semaphore.  If no transaction has read the space
+ * manager since mount, the count is taken from the on-disk structure.  Returns
+ * 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_spaceman_free_blocks(struct super_block *sb, u64 *count)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_spaceman_phys *sm_raw;
+	struct buffer_head *sm_bh;
+
+	if (sm->sm_block_count) {
+		*count = sm->sm_free_count;
+		return 0;
+	}
+
+	sm_bh = apfs_read_ephemeral_object(sb, le64_to_cpu(nxi->nx_raw->nx_spaceman_oid));
+	if (IS_ERR(sm_bh))
+		return PTR_ERR(sm_bh);
+	sm_raw = (struct apfs_spaceman_phys *)sm_bh->b_data;
+	*count = le64_to_cpu(sm_raw->sm_dev[APFS_SD_MAIN].sm_free_count);
+	brelse(sm_bh);
+	return 0;
+}
+
+/**
+ * apfs_reserve_blocks - Reserve free blocks for a later allocation
+ * @sb:		superblock structure
+ * @count:	number of blocks to reserve
+ *
+ * Used for allocations that are delayed until writeback, so that they can't
+ * fail for lack of space by then.  Must not be called with a page locked, or
+ * inside a transaction.  Returns 0 on success, or a negative error code in case
+ * of failure.
+ */
+int apfs_reserve_blocks(struct super_block *sb, u64 count)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	u64 free;
+	int err;
+
+	down_read(&nxi->nx_big_sem);
+	err = apfs_spaceman_free_blocks(sb, &free);
+	if (err)
+		goto out;
+
+	spin_lock(&sm->sm_reserve_lock);
+	if (sm->sm_reserved + count > free)
+		err = -ENOSPC;
+	else
+		sm->sm_reserved += count;
+	spin_unlock(&sm->sm_reserve_lock);
+out:
+	up_read(&nxi->nx_big_sem);
+	return err;
+}
+
+/**
+ * apfs_release_blocks - Give back blocks reserved by apfs_reserve_blocks()
+ * @sb:		superblock structure
+ * @count:	number of blocks to release
+ */
+void apfs_release_blocks(struct super_block *sb, u64 count)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+
+	spin_lock(&sm->sm_reserve_lock);
+	ASSERT(sm->sm_reserved >= count);
+	sm->sm_reserved -= count;
+	spin_unlock(&sm->sm_reserve_lock);
+}
@@ -12,6 +12,7 @@
 #include <linux/parser.h>
 #include <linux/buffer_head.h>
 #include <linux/statfs.h>
+#include <linux/vmalloc.h>
 #include <linux/seq_file.h>
 #include "apfs.h"
 
@@ -136,7 +137,7 @@ static void apfs_make_super_copy(struct super_block *sb)
 		return;
 
 	/* Only update the backup once all volumes are unmounted */
-	mutex_lock(&nxs_mutex);
+	apfs_nxs_lock(nxi, APFS_LOCK_SITE_UNMOUNT);
 	if (nxi->nx_refcnt > 1)
 		goto out_unlock;
 
@@ -149,7 +150,172 @@ static void apfs_make_super_copy(struct super_block *sb)
 	mark_buffer_dirty(bh);
 	brelse(bh);
 out_unlock:
-	mutex_unlock(&nxs_mutex);
+	apfs_nxs_unlock(nxi);
+}
+
+/* Maximum depth for the tree of a non-contiguous checkpoint descriptor area */
+#define APFS_DESC_TREE_MAX_DEPTH	4
+
+/**
+ * apfs_read_desc_tree_node - Map the descriptor blocks listed under a node
+ * @sb:		superblock structure
+ * @bno:	block number for the node
+ * @map:	array of block numbers for the descriptor area, to be filled
+ * @blocks:	length of @map
+ * @level:	expected level for the node, or -1 for the root
+ *
+ * The keys of the tree are block offsets into the descriptor area, and the
+ * values are the physical ranges for each fragment.  Returns 0 on success or
+ * a negative error code in case of failure.
+ */
+static int apfs_read_desc_tree_node(struct super_block *sb, u64 bno, u64 *map,
+				    u32 blocks, int level)
+{
+	struct buffer_head *bh;
+	struct apfs_btree_node_phys *raw;
+	struct apfs_kvoff *toc;
+	int key_start, val_end, val_len;
+	u32 nkeys, i;
+	u16 flags;
+	int err = -EFSCORRUPTED;
+
+	bh = apfs_sb_bread(sb, bno);
+	if (!bh) {
+		apfs_err(sb, "unable to read descriptor tree node 0x%llx", bno);
+		return -EIO;
+	}
+	raw = (struct apfs_btree_node_phys *)bh->b_data;
+	if (!apfs_obj_verify_csum(sb, &raw->btn_o)) {
+		apfs_err(sb, "bad checksum for descriptor tree node 0x%llx", bno);
+		err = -EFSBADCRC;
+		goto out;
+	}
+
+	flags = le16_to_cpu(raw->btn_flags);
+	if (level < 0) {
+		level = le16_to_cpu(raw->btn_level);
+		if (!(flags & APFS_BTNODE_ROOT) || level > APFS_DESC_TREE_MAX_DEPTH)
+			goto corrupted;
+	} else if (le16_to_cpu(raw->btn_level) != level) {
+		goto corrupted;
+	}
+	if (!(flags & APFS_BTNODE_FIXED_KV_SIZE))
+		goto corrupted;
+	if (!(flags & APFS_BTNODE_LEAF) != !!level)
+		goto corrupted;
+
+	nkeys = le32_to_cpu(raw->btn_nkeys);
+	if (nkeys * sizeof(*toc) > le16_to_cpu(raw->btn_table_space.len))
+		goto corrupted;
+	toc = (struct apfs_kvoff *)raw->btn_data;
+	key_start = sizeof(*raw) + le16_to_cpu(raw->btn_table_space.off) +
+		    le16_to_cpu(raw->btn_table_space.len);
+	val_end = sb->s_blocksize;
+	if (flags & APFS_BTNODE_ROOT)
+		val_end -= sizeof(struct apfs_btree_info);
+	val_len = level ? sizeof(__le64) : sizeof(struct apfs_prange);
+
+	for (i = 0; i < nkeys; ++i) {
+		int k_off = key_start + le16_to_cpu(toc[i].k);
+		int v_off = val_end - le16_to_cpu(toc[i].v);
+		void *val = bh->b_data + v_off;
+		u64 offset, start, count, j;
+
+		if (k_off + sizeof(__le64) > val_end || v_off < key_start ||
+		    v_off + val_len > val_end)
+			goto corrupted;
+
+		if (level) {
+			err = apfs_read_desc_tree_node(sb, le64_to_cpup(val), map,
+						       blocks, level - 1);
+			if (err)
+				goto out;
+			continue;
+		}
+
+		offset = le64_to_cpup((__le64 *)(bh->b_data + k_off));
+		start = le64_to_cpu(((struct apfs_prange *)val)->pr_start_paddr);
+		count = le64_to_cpu(((struct apfs_prange *)val)->pr_block_count);
+		if (offset >= blocks || count > blocks - offset)
+			goto corrupted;
+		for (j = 0; j < count; ++j)
+			map[offset + j] = start + j;
+	}
+	err = 0;
+	goto out;
+
+corrupted:
+	apfs_err(sb, "bad descriptor tree node 0x%llx", bno);
+	err = -EFSCORRUPTED;
+out:
+	brelse(bh);
+	return err;
+}
+
+/**
+ * apfs_read_desc_map - Map a non-contiguous checkpoint descriptor area
+ * @sb:		superblock structure
+ * @oid:	physical object id for the root of the descriptor tree
+ * @blocks:	number of blocks in the descriptor area
+ *
+ * On success, sets the nx_desc_map array for the container and returns 0;
+ * returns a negative error code in case of failure.
+ */
+static int apfs_read_desc_map(struct super_block *sb, u64 oid, u32 blocks)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	u64 *map;
+	u32 i;
+	int err;
+
+	map = vzalloc(blocks * sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+
+	err = apfs_read_desc_tree_node(sb, oid, map, blocks, -1 /* level */);
+	if (err)
+		goto fail;
+
+	/* Block zero is always the superblock copy, so it marks a hole */
+	for (i = 0; i < blocks; ++i) {
+		if (map[i] == APFS_NX_BLOCK_NUM) {
+			apfs_err(sb, "hole in checkpoint descriptor area");
+			err = -EFSCORRUPTED;
+			goto fail;
+		}
+	}
+	nxi->nx_desc_map = map;
+	return 0;
+
+fail:
+	vfree(map);
+	return err;
+}
+
+/* Number of descriptor blocks to keep in flight while searching the area */
+#define APFS_DESC_READAHEAD	256
+
+/**
+ * apfs_desc_readahead - Start the reads for a window of the descriptor area
+ * @sb:		superblock structure
+ * @desc_base:	first block of the area, if it's contiguous
+ * @start:	first index to read
+ * @end:	index after the last to read
+ *
+ * The reads are plugged together so that contiguous ranges get merged into a
+ * few large bios, which matters a lot for devices with high latency.
+ */
+static void apfs_desc_readahead(struct super_block *sb, u64 desc_base,
+				u32 start, u32 end)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct blk_plug plug;
+	u32 i;
+
+	blk_start_plug(&plug);
+	for (i = start; i < end; ++i)
+		apfs_sb_breadahead(sb, __apfs_cpoint_desc_bno(nxi, desc_base, i));
+	blk_finish_plug(&plug);
 }
 
 /**
@@ -188,25 +354,46 @@ static int apfs_map_main_super(struct super_block *sb)
 
 	/* We want to mount the latest valid checkpoint among the descriptors */
 	desc_base = le64_to_cpu(msb_raw->nx_xp_desc_base);
-	if (desc_base >> 63 != 0) {
-		/* The highest bit is set when checkpoints are not contiguous */
-		apfs_err(sb, "checkpoint descriptor tree not yet supported");
-		goto fail;
-	}
-	desc_blocks = le32_to_cpu(msb_raw->nx_xp_desc_blocks);
+	desc_blocks = apfs_cpoint_desc_blocks(msb_raw);
 	if (desc_blocks > 10000) { /* Arbitrary loop limit, is it enough? */
 		apfs_err(sb, "too many checkpoint descriptors?");
 		err = -EFSCORRUPTED;
 		goto fail;
 	}
+	if (le32_to_cpu(msb_raw->nx_xp_data_blocks) & APFS_NX_XP_NONCONTIGUOUS) {
+		apfs_err(sb, "checkpoint data tree not yet supported");
+		goto fail;
+	}
+	if (le32_to_cpu(msb_raw->nx_xp_desc_blocks) & APFS_NX_XP_NONCONTIGUOUS) {
+		/* The base is the root of a tree that maps the fragments */
+		err = apfs_read_desc_map(sb, desc_base, desc_blocks);
+		if (err)
+			goto fail;
+		err = -EINVAL;
+	}
 
-	/* Now we go through the checkpoints one by one */
+	/*
+	 * Now we go through the checkpoints one by one, but keep a window of
+	 * reads in flight ahead of the scan. Only the magic and xid get checked
+	 * for most blocks; the checksum is verified for newer candidates alone.
+	 */
 	xid = le64_to_cpu(msb_raw->nx_o.o_xid);
 	for (i = 0; i < desc_blocks; ++i) {
 		struct apfs_nx_superblock *desc_raw;
+		u64 desc_bno;
 
+		if (i % APFS_DESC_READAHEAD == 0) {
+			u32 ra_start = i ? i + APFS_DESC_READAHEAD : 0;
+			u32 ra_end = min_t(u32, i + 2 * APFS_DESC_READAHEAD,
+					   desc_blocks);
+
+			if (ra_start < ra_end)
+				apfs_desc_readahead(sb, desc_base, ra_start, ra_end);
+		}
+
+		desc_bno = __apfs_cpoint_desc_bno(nxi, desc_base, i);
 		brelse(desc_bh);
-		desc_bh = apfs_sb_bread(sb, desc_base + i);
+		desc_bh = apfs_sb_bread(sb, desc_bno);
 		if (!desc_bh) {
 			apfs_err(sb, "unable to read checkpoint descriptor");
 			goto fail;
@@ -222,11 +409,12 @@ static int apfs_map_main_super(struct super_block *sb)
 
 		xid = le64_to_cpu(desc_raw->nx_o.o_xid);
 		msb_raw = desc_raw;
-		bno = desc_base + i;
+		bno = desc_bno;
 		brelse(bh);
 		bh = desc_bh;
 		desc_bh = NULL;
 	}
+	brelse(desc_bh);
 
 	nxi->nx_xid = xid;
 	nxi->nx_raw = msb_raw;
@@ -242,7 +430,10 @@ static int apfs_map_main_super(struct super_block *sb)
 	return 0;
 
 fail:
+	brelse(desc_bh);
 	brelse(bh);
+	vfree(nxi->nx_desc_map);
+	nxi->nx_desc_map = NULL;
 	return err;
 }
 
@@ -297,6 +488,9 @@ static inline void apfs_unmap_main_super(struct apfs_sb_info *sbi)
 		goto out;
 
 	brelse(nxi->nx_object.bh);
+	vfree(nxi->nx_desc_map);
+	apfs_metabuf_free(nxi);
+	apfs_lockstat_free(nxi);
 	blkdev_put(nxi->nx_bdev, mode);
 	list_del(&nxi->nx_list);
 	kfree(nxi);
@@ -472,6 +666,8 @@ int apfs_read_omap(struct super_block *sb, bool write)
 		ASSERT(buffer_trans(bh));
 		omap_raw->om_tree_oid = cpu_to_le64(omap_root->object.block_nr);
 	}
+	sbi->s_latest_snap = le64_to_cpu(omap_raw->om_most_recent_snap);
+	sbi->s_snap_count = le32_to_cpu(omap_raw->om_snap_count);
 	omap_raw = NULL;
 	brelse(bh);
 
@@ -502,7 +698,7 @@ int apfs_read_catalog(struct super_block *sb, bool write)
 	ASSERT(sbi->s_omap_root);
 
 	root_node = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_root_tree_oid),
-				   APFS_OBJ_VIRTUAL, write);
+				   apfs_cat_storage(sb), write);
 	if (IS_ERR(root_node)) {
 		apfs_err(sb, "unable to read catalog root node");
 		return PTR_ERR(root_node);
@@ -518,6 +714,11 @@ static void apfs_put_super(struct super_block *sb)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 
+	/* The scrubber and reaper take the big semaphore, so they go first */
+	apfs_scrub_stop(sb);
+	apfs_reaper_stop(sb);
+	apfs_shrink_stop(sb);
+
 	/* Update the volume's unmount time */
 	if (!(sb->s_flags & SB_RDONLY)) {
 		struct apfs_superblock *vsb_raw;
@@ -545,16 +746,23 @@ static void apfs_put_super(struct super_block *sb)
 	}
 
 fail:
+	apfs_fsync_log_put(sb);
 	iput(sbi->s_private_dir);
 	sbi->s_private_dir = NULL;
 
+	apfs_sysfs_unregister(sb);
+
+	apfs_seal_free(sb);
 	apfs_node_put(sbi->s_cat_root);
+	apfs_crypt_free(sb);
+	apfs_omap_index_free(sb);
 	apfs_node_put(sbi->s_omap_root);
 	apfs_unmap_volume_super(sb);
 
-	mutex_lock(&nxs_mutex);
+	/* The container may go away, so charge the global lock statistics */
+	apfs_nxs_lock(NULL, APFS_LOCK_SITE_UNMOUNT);
 	apfs_unmap_main_super(sbi);
-	mutex_unlock(&nxs_mutex);
+	apfs_nxs_unlock(NULL);
 
 	sb->s_fs_info = NULL;
 
@@ -582,8 +790,12 @@ static struct inode *apfs_alloc_inode(struct super_block *sb)
 	dstream->ds_sb = sb;
 	dstream->ds_cached_ext.len = 0;
 	dstream->ds_ext_dirty = false;
+	dstream->ds_seal_len = 0;
 	ai->i_nchildren = 0;
+	ai->i_cmpf.ci_algo = 0;
 	INIT_LIST_HEAD(&ai->i_list);
+	ai->i_nolog_xid = 0;
+	atomic_set(&ai->i_delayed_blks, 0);
 	return &ai->vfs_inode;
 }
 
@@ -664,11 +876,13 @@ static void destroy_inodecache(void)
  * @count:	on return it will store the block count
  *
  * This function probably belongs in a separate file, but for now it is
- * only called by statfs.
+ * only called by statfs. The caller must hold the big lock.
  */
 static int apfs_count_used_blocks(struct super_block *sb, u64 *count)
 {
-	struct apfs_nx_superblock *msb_raw = APFS_NXI(sb)->nx_raw;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
+	struct apfs_sb_info *sbi;
 	struct apfs_node *vnode;
 	struct apfs_omap_phys *msb_omap_raw;
 	struct buffer_head *bh;
@@ -722,6 +936,10 @@ static int apfs_count_used_blocks(struct super_block *sb, u64 *count)
 		brelse(bh);
 	}
 
+	/* The mounted volumes may have changes not yet folded into the count */
+	list_for_each_entry(sbi, &nxi->vol_list, list)
+		*count += sbi->s_transaction.t_alloc_delta;
+
 	apfs_node_put(vnode);
 	return err;
 }
@@ -733,10 +951,10 @@ static int apfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_superblock *msb_raw;
 	struct apfs_superblock *vol;
-	u64 fsid, used_blocks = 0;
+	u64 fsid, used_blocks = 0, locked;
 	int err;
 
-	down_read(&nxi->nx_big_sem);
+	locked = apfs_big_down_read(nxi, APFS_LOCK_SITE_STATFS);
 	msb_raw = nxi->nx_raw;
 	vol = sbi->s_vsb_raw;
 
@@ -772,7 +990,7 @@ static int apfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_fsid.val[1] = (fsid >> 32) & 0xFFFFFFFFUL;
 
 fail:
-	up_read(&nxi->nx_big_sem);
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_STATFS, locked);
 	return err;
 }
 
@@ -791,6 +1009,10 @@ static int apfs_show_options(struct seq_file *seq, struct dentry *root)
 						     sbi->s_gid));
 	if (nxi->nx_flags & APFS_CHECK_NODES)
 		seq_puts(seq, ",cknodes");
+	if (nxi->nx_flags & APFS_DATA_WRITEBACK)
+		seq_puts(seq, ",data=writeback");
+	if (nxi->nx_flags & APFS_FLAT_OMAP)
+		seq_puts(seq, ",flatomap");
 
 	return 0;
 }
@@ -801,7 +1023,7 @@ int apfs_sync_fs(struct super_block *sb, int wait)
 	struct apfs_max_ops maxops = {0};
 	int err;
 
-	err = apfs_transaction_start(sb, maxops);
+	err = __apfs_transaction_start(sb, maxops, APFS_LOCK_SITE_COMMIT);
 	if (err)
 		return err;
 	APFS_SB(sb)->s_nxi->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
@@ -814,15 +1036,34 @@ int apfs_sync_fs(struct super_block *sb, int wait)
 /* Only supports read-only remounts, everything else is silently ignored */
 static int apfs_remount(struct super_block *sb, int *flags, char *data)
 {
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	bool scrub = false;
 	int err = 0;
 
+	if ((*flags & SB_RDONLY) && !sb_rdonly(sb)) {
+		/*
+		 * The background writers go first, so that their changes get
+		 * synced below; the reaper resumes on the next read-write
+		 * mount. The scrub only reads, but it gets parked while we
+		 * switch.
+		 */
+		scrub = READ_ONCE(APFS_SB(sb)->s_scrub.sc_state) == APFS_SCRUB_RUNNING;
+		apfs_scrub_stop(sb);
+		apfs_reaper_stop(sb);
+		apfs_shrink_stop(sb);
+	}
+
 	err = sync_filesystem(sb);
 	if (err)
-		return err;
+		goto out;
 
 	/* TODO: race? Could a new transaction have started already? */
+	apfs_big_down_write(nxi, APFS_LOCK_SITE_OTHER);
 	if (*flags & SB_RDONLY)
 		sb->s_flags |= SB_RDONLY;
+	else /* The flat omap must not outlive a read-write remount */
+		apfs_omap_index_free(sb);
+	apfs_big_up_write(nxi);
 
 	/*
 	 * TODO: readwrite remounts seem simple enough, but I worry about
@@ -830,7 +1071,11 @@ static int apfs_remount(struct super_block *sb, int *flags, char *data)
 	 * dry-run version of parse_options().
 	 */
 	apfs_notice(sb, "all remounts can do is turn a volume read-only");
-	return 0;
+
+out:
+	if (scrub)
+		apfs_scrub_start(sb);
+	return err;
 }
 
 static const struct super_operations apfs_sops = {
@@ -843,10 +1088,13 @@ static const struct super_operations apfs_sops = {
 	.statfs		= apfs_statfs,
 	.remount_fs	= apfs_remount,
 	.show_options	= apfs_show_options,
+	.nr_cached_objects = apfs_nr_cached_objects,
+	.free_cached_objects = apfs_free_cached_objects,
 };
 
 enum {
-	Opt_readwrite, Opt_cknodes, Opt_uid, Opt_gid, Opt_vol, Opt_err,
+	Opt_readwrite, Opt_cknodes, Opt_uid, Opt_gid, Opt_vol,
+	Opt_data_ordered, Opt_data_writeback, Opt_flatomap, Opt_err,
 };
 
 static const match_table_t tokens = {
@@ -855,6 +1103,9 @@ static const match_table_t tokens = {
 	{Opt_uid, "uid=%u"},
 	{Opt_gid, "gid=%u"},
 	{Opt_vol, "vol=%u"},
+	{Opt_data_ordered, "data=ordered"},
+	{Opt_data_writeback, "data=writeback"},
+	{Opt_flatomap, "flatomap"},
 	{Opt_err, NULL}
 };
 
@@ -870,10 +1121,14 @@ static void apfs_set_nx_flags(struct super_block *sb, unsigned int flags)
 	lockdep_assert_held(&nxs_mutex);
 
 	/* The mount flags can only be set when the container is first mounted */
-	if (nxi->nx_refcnt == 1)
+	if (nxi->nx_refcnt == 1) {
 		nxi->nx_flags = flags;
-	else if (flags != nxi->nx_flags)
+		/* Unlike APFS_READWRITE, this one is never cleared */
+		if (!(flags & APFS_READWRITE))
+			nxi->nx_flags |= APFS_NEVER_WRITABLE;
+	} else if (flags != (nxi->nx_flags & ~APFS_NEVER_WRITABLE)) {
 		apfs_warn(sb, "ignoring mount flags - container already mounted");
+	}
 }
 
 /**
@@ -972,6 +1227,20 @@ static int parse_options(struct super_block *sb, char *options)
 			if (err)
 				return err;
 			break;
+		case Opt_data_ordered:
+			nx_flags &= ~APFS_DATA_WRITEBACK;
+			break;
+		case Opt_data_writeback:
+			/*
+			 * Commits won't wait for the new file data, so a crash
+			 * may expose stale blocks. Only for scratch volumes.
+			 */
+			nx_flags |= APFS_DATA_WRITEBACK;
+			break;
+		case Opt_flatomap:
+			/* Only used for read-only mounts, ignored otherwise */
+			nx_flags |= APFS_FLAT_OMAP;
+			break;
 		default:
 			return -EINVAL;
 		}
@@ -1028,6 +1297,10 @@ static int apfs_check_features(struct super_block *sb)
 		apfs_warn(sb, "encrypted volumes are not supported");
 		return -EINVAL;
 	}
+	if ((features & APFS_INCOMPAT_SEALED_VOLUME) && !sb_rdonly(sb)) {
+		apfs_warn(sb, "sealed volumes can't be mounted read-write");
+		return -EINVAL;
+	}
 
 	features = le64_to_cpu(msb_raw->nx_readonly_compatible_features);
 	if (features & ~APFS_NX_SUPPORTED_ROCOMPAT_MASK) {
@@ -1114,6 +1387,11 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi->s_uid = INVALID_UID;
 	sbi->s_gid = INVALID_GID;
+	mutex_init(&sbi->s_scrub.sc_lock);
+	sbi->s_scrub.sc_rate = APFS_SCRUB_DEFAULT_RATE;
+	mutex_init(&sbi->s_reaper.rp_lock);
+	mutex_init(&sbi->s_fsync_log.fl_lock);
+	apfs_shrink_init(sb);
 	err = parse_options(sb, data);
 	if (err)
 		return err;
@@ -1131,16 +1409,37 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (err)
 		goto failed_omap;
 
+	/* The omap never changes on read-only mounts */
+	if ((sb->s_flags & SB_RDONLY) && (sbi->s_nxi->nx_flags & APFS_FLAT_OMAP)) {
+		err = apfs_omap_index_build(sb);
+		if (err)
+			apfs_warn(sb, "failed to build the flat omap index (%d)", err);
+	}
+
+	/* Encrypted catalog nodes can't be read without the volume key */
+	err = apfs_crypt_init(sb);
+	if (err)
+		goto failed_crypt;
+
 	err = apfs_read_catalog(sb, false /* write */);
 	if (err)
 		goto failed_cat;
 
+	err = apfs_seal_init(sb);
+	if (err)
+		goto failed_seal;
+
 	sb->s_op = &apfs_sops;
 	sb->s_d_op = &apfs_dentry_operations;
 	sb->s_xattr = apfs_xattr_handlers;
+	sb->s_export_op = &apfs_export_ops;
 	sb->s_maxbytes = MAX_LFS_FILESIZE;
 	sb->s_time_gran = 1; /* Nanosecond granularity */
 
+	err = apfs_sysfs_register(sb);
+	if (err)
+		goto failed_sysfs;
+
 	sbi->s_private_dir = apfs_iget(sb, APFS_PRIV_DIR_INO_NUM);
 	if (IS_ERR(sbi->s_private_dir)) {
 		apfs_err(sb, "unable to get private-dir inode");
@@ -1160,14 +1459,28 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 		err = -ENOMEM;
 		goto failed_mount;
 	}
+
+	/* Resume the deletion of snapshots from previous mounts */
+	if (!(sb->s_flags & SB_RDONLY) && sbi->s_snap_count) {
+		err = apfs_reaper_start(sb);
+		if (err)
+			apfs_warn(sb, "failed to start the snapshot reaper (%d)", err);
+	}
 	return 0;
 
 failed_mount:
 	iput(sbi->s_private_dir);
 failed_private_dir:
 	sbi->s_private_dir = NULL;
+	apfs_sysfs_unregister(sb);
+failed_sysfs:
+	apfs_seal_free(sb);
+failed_seal:
 	apfs_node_put(sbi->s_cat_root);
 failed_cat:
+	apfs_crypt_free(sb);
+failed_crypt:
+	apfs_omap_index_free(sb);
 	apfs_node_put(sbi->s_omap_root);
 failed_omap:
 	apfs_unmap_volume_super(sb);
@@ -1253,15 +1566,26 @@ static int apfs_attach_nxi(struct apfs_sb_info *sbi, const char *dev_name, fmode
 		nxi = kzalloc(sizeof(*nxi), GFP_KERNEL);
 		if (!nxi)
 			return -ENOMEM;
+		ret = apfs_lockstat_init(nxi);
+		if (ret) {
+			kfree(nxi);
+			return ret;
+		}
 
 		bdev = blkdev_get_by_path(dev_name, mode, &apfs_fs_type);
 		if (IS_ERR(bdev)) {
+			apfs_lockstat_free(nxi);
 			kfree(nxi);
 			return PTR_ERR(bdev);
 		}
 
 		nxi->nx_bdev = bdev;
 		init_rwsem(&nxi->nx_big_sem);
+		mutex_init(&nxi->nx_transaction.t_flush_mutex);
+		spin_lock_init(&nxi->nx_spaceman.sm_reserve_lock);
+		mutex_init(&nxi->nx_replay_mutex);
+		init_waitqueue_head(&nxi->nx_replay_wait);
+		apfs_metabuf_init(nxi);
 		list_add(&nxi->nx_list, &nxs);
 		INIT_LIST_HEAD(&nxi->vol_list);
 	}
@@ -1282,12 +1606,14 @@ static struct dentry *apfs_mount(struct file_system_type *fs_type, int flags,
 	struct super_block *sb;
 	struct apfs_sb_info *sbi;
 	fmode_t mode = FMODE_READ | FMODE_EXCL;
+	bool fresh = false;
 	int error = 0;
 
 	if (!(flags & SB_RDONLY))
 		mode |= FMODE_WRITE;
 
-	mutex_lock(&nxs_mutex);
+	/* There is no container yet, so charge the global lock statistics */
+	apfs_nxs_lock(NULL, APFS_LOCK_SITE_MOUNT);
 
 	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
 	if (!sbi) {
@@ -1324,9 +1650,17 @@ static struct dentry *apfs_mount(struct file_system_type *fs_type, int flags,
 		if (error)
 			goto out_deactivate_super;
 		sb->s_flags |= SB_ACTIVE;
+		fresh = !(sb->s_flags & SB_RDONLY);
+		/* Hold back all writers in the container until the replay */
+		if (fresh)
+			atomic_inc(&APFS_NXI(sb)->nx_replay_count);
 	}
 
-	mutex_unlock(&nxs_mutex);
+	apfs_nxs_unlock(NULL);
+
+	/* The log lookups take the big lock, so they can't go in fill_super */
+	if (fresh)
+		apfs_fsync_log_mount(sb);
 	return dget(sb->s_root);
 
 out_deactivate_super:
@@ -1336,7 +1670,7 @@ out_unmap_super:
 out_free_sbi:
 	kfree(sbi);
 out_unlock:
-	mutex_unlock(&nxs_mutex);
+	apfs_nxs_unlock(NULL);
 	return ERR_PTR(error);
 }
 
@@ -1356,15 +1690,25 @@ static int __init init_apfs_fs(void)
 	err = init_inodecache();
 	if (err)
 		return err;
+	err = apfs_sysfs_init();
+	if (err)
+		goto fail_sysfs;
 	err = register_filesystem(&apfs_fs_type);
 	if (err)
-		destroy_inodecache();
+		goto fail_register;
+	return 0;
+
+fail_register:
+	apfs_sysfs_exit();
+fail_sysfs:
+	destroy_inodecache();
 	return err;
 }
 
 static void __exit exit_apfs_fs(void)
 {
 	unregister_filesystem(&apfs_fs_type);
+	apfs_sysfs_exit();
 	destroy_inodecache();
 }
 
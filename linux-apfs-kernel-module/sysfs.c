@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include "apfs.h"
+
+/* Directory for all mounted volumes, at /sys/fs/apfs */
+static struct kset *apfs_kset;
+
+/*
+ * Sysfs attribute for a mounted volume
+ */
+struct apfs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct apfs_sb_info *sbi, char *buf);
+	ssize_t (*store)(struct apfs_sb_info *sbi, const char *buf, size_t len);
+};
+
+#define APFS_ATTR_RO(_name) \
+static struct apfs_attr apfs_attr_##_name = __ATTR(_name, 0444, _name##_show, NULL)
+#define APFS_ATTR_RW(_name) \
+static struct apfs_attr apfs_attr_##_name = __ATTR(_name, 0644, _name##_show, _name##_store)
+
+static const char * const apfs_scrub_states[] = {
+	[APFS_SCRUB_IDLE]	= "idle",
+	[APFS_SCRUB_RUNNING]	= "running",
+	[APFS_SCRUB_DONE]	= "done",
+	[APFS_SCRUB_CANCELLED]	= "cancelled",
+	[APFS_SCRUB_FAILED]	= "failed",
+};
+
+static ssize_t scrub_state_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%s\n", apfs_scrub_states[READ_ONCE(sbi->s_scrub.sc_state)]);
+}
+APFS_ATTR_RO(scrub_state);
+
+static ssize_t scrub_objects_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%llu\n", READ_ONCE(sbi->s_scrub.sc_objects));
+}
+APFS_ATTR_RO(scrub_objects);
+
+static ssize_t scrub_errors_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%llu\n", READ_ONCE(sbi->s_scrub.sc_errors));
+}
+APFS_ATTR_RO(scrub_errors);
+
+static ssize_t scrub_restarts_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%llu\n", READ_ONCE(sbi->s_scrub.sc_restarts));
+}
+APFS_ATTR_RO(scrub_restarts);
+
+static ssize_t scrub_rate_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(sbi->s_scrub.sc_rate));
+}
+
+static ssize_t scrub_rate_store(struct apfs_sb_info *sbi, const char *buf, size_t len)
+{
+	unsigned int rate;
+	int err;
+
+	err = kstrtouint(buf, 0, &rate);
+	if (err)
+		return err;
+	WRITE_ONCE(sbi->s_scrub.sc_rate, rate);
+	return len;
+}
+APFS_ATTR_RW(scrub_rate);
+
+static ssize_t pinned_bytes_show(struct apfs_sb_info *sbi, char *buf)
+{
+	struct super_block *sb = sbi->s_vobject.sb;
+
+	/* This volume's share of the buffers pinned for the container */
+	return sprintf(buf, "%llu\n", (u64)apfs_pinned_buffers(sb) << sb->s_blocksize_bits);
+}
+APFS_ATTR_RO(pinned_bytes);
+
+static ssize_t shrink_scans_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%llu\n", READ_ONCE(sbi->s_shrink.sh_scans));
+}
+APFS_ATTR_RO(shrink_scans);
+
+static ssize_t shrink_commits_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%llu\n", READ_ONCE(sbi->s_shrink.sh_commits));
+}
+APFS_ATTR_RO(shrink_commits);
+
+/* The lock statistics are shared by all volumes in the container */
+static ssize_t lock_stats_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return apfs_lockstat_show(sbi->s_nxi, buf);
+}
+
+static ssize_t lock_stats_store(struct apfs_sb_info *sbi, const char *buf, size_t len)
+{
+	unsigned int val;
+	int err;
+
+	/* Writing a zero resets the statistics, nothing else is accepted */
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	if (val)
+		return -EINVAL;
+	apfs_lockstat_reset(sbi->s_nxi);
+	return len;
+}
+APFS_ATTR_RW(lock_stats);
+
+static ssize_t lock_wait_hist_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return apfs_lockstat_show_hist(sbi->s_nxi, buf, false /* hold */);
+}
+APFS_ATTR_RO(lock_wait_hist);
+
+static ssize_t lock_hold_hist_show(struct apfs_sb_info *sbi, char *buf)
+{
+	return apfs_lockstat_show_hist(sbi->s_nxi, buf, true /* hold */);
+}
+APFS_ATTR_RO(lock_hold_hist);
+
+static struct attribute *apfs_attrs[] = {
+	&apfs_attr_scrub_state.attr,
+	&apfs_attr_scrub_objects.attr,
+	&apfs_attr_scrub_errors.attr,
+	&apfs_attr_scrub_restarts.attr,
+	&apfs_attr_scrub_rate.attr,
+	&apfs_attr_pinned_bytes.attr,
+	&apfs_attr_shrink_scans.attr,
+	&apfs_attr_shrink_commits.attr,
+	&apfs_attr_lock_stats.attr,
+	&apfs_attr_lock_wait_hist.attr,
+	&apfs_attr_lock_hold_hist.attr,
+	NULL,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0) /* default_groups came in 5.2 */
+ATTRIBUTE_GROUPS(apfs);
+#endif
+
+static ssize_t apfs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info, s_kobj);
+	struct apfs_attr *apfs_attr = container_of(attr, struct apfs_attr, attr);
+
+	return apfs_attr->show(sbi, buf);
+}
+
+static ssize_t apfs_attr_store(struct kobject *kobj, struct attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info, s_kobj);
+	struct apfs_attr *apfs_attr = container_of(attr, struct apfs_attr, attr);
+
+	if (!apfs_attr->store)
+		return -EIO;
+	return apfs_attr->store(sbi, buf, len);
+}
+
+static void apfs_sb_release(struct kobject *kobj)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info, s_kobj);
+
+	complete(&sbi->s_kobj_unregister);
+}
+
+static const struct sysfs_ops apfs_attr_ops = {
+	.show	= apfs_attr_show,
+	.store	= apfs_attr_store,
+};
+
+static struct kobj_type apfs_sb_ktype = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	.default_groups	= apfs_groups,
+#else
+	.default_attrs	= apfs_attrs,
+#endif
+	.sysfs_ops	= &apfs_attr_ops,
+	.release	= apfs_sb_release,
+};
+
+/**
+ * apfs_sysfs_register - Create the sysfs directory for a mounted volume
+ * @sb: superblock structure
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_sysfs_register(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	int err;
+
+	init_completion(&sbi->s_kobj_unregister);
+	sbi->s_kobj.kset = apfs_kset;
+	err = kobject_init_and_add(&sbi->s_kobj, &apfs_sb_ktype, NULL, "%s", sb->s_id);
+	if (err) {
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+	}
+	return err;
+}
+
+/**
+ * apfs_sysfs_unregister - Remove the sysfs directory for a volume
+ * @sb: superblock structure
+ */
+void apfs_sysfs_unregister(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	kobject_del(&sbi->s_kobj);
+	kobject_put(&sbi->s_kobj);
+	wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+int __init apfs_sysfs_init(void)
+{
+	apfs_kset = kset_create_and_add("apfs", NULL, fs_kobj);
+	if (!apfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void apfs_sysfs_exit(void)
+{
+	kset_unregister(apfs_kset);
+}
@@ -5,16 +5,21 @@
 
 #include <linux/blkdev.h>
 #include <linux/rmap.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 #include "apfs.h"
 
 #define TRANSACTION_MAIN_QUEUE_MAX	4096
 #define TRANSACTION_BUFFERS_MAX		1024
 #define TRANSACTION_STARTS_MAX		1024
+/* Transactions with fewer buffers are not worth an early commit */
+#define TRANSACTION_SHRINK_MIN		64
 
 /**
  * apfs_cpoint_init_area - Initialize the new blocks of a checkpoint area
  * @sb:		superblock structure
  * @base:	first block of the area
+ * @map:	block numbers for a non-contiguous area, or NULL
  * @blks:	block count for the area
  * @next:	first block for the new checkpoint
  * @len:	block count for the new checkpoint
@@ -23,8 +28,8 @@
  * the new one, updating their xids, oids and checksums.  Returns 0 on success,
  * or a negative error code in case of failure.
  */
-static int apfs_cpoint_init_area(struct super_block *sb, u64 base, u32 blks,
-				 u32 next, u32 len)
+static int apfs_cpoint_init_area(struct super_block *sb, u64 base,
+				 const u64 *map, u32 blks, u32 next, u32 len)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	u32 i;
@@ -34,11 +39,14 @@ static int apfs_cpoint_init_area(struct super_block *sb, u64 base, u32 blks,
 		struct apfs_obj_phys *new_obj;
 		u32 new_index = (next + i) % blks;
 		u32 old_index = (blks + new_index - len) % blks;
+		u64 new_bno, old_bno;
 		u32 type;
 		int err;
 
-		new_bh = apfs_sb_bread(sb, base + new_index);
-		old_bh = apfs_sb_bread(sb, base + old_index);
+		new_bno = map ? map[new_index] : base + new_index;
+		old_bno = map ? map[old_index] : base + old_index;
+		new_bh = apfs_sb_bread(sb, new_bno);
+		old_bh = apfs_sb_bread(sb, old_bno);
 		if (!new_bh || !old_bh) {
 			apfs_err(sb, "unable to read the checkpoint areas");
 			brelse(new_bh);
@@ -88,7 +96,7 @@ static int apfs_cpoint_init_desc(struct super_block *sb)
 	struct buffer_head *new_sb_bh = NULL;
 	u64 desc_base = le64_to_cpu(raw_sb->nx_xp_desc_base);
 	u32 desc_next = le32_to_cpu(raw_sb->nx_xp_desc_next);
-	u32 desc_blks = le32_to_cpu(raw_sb->nx_xp_desc_blocks);
+	u32 desc_blks = apfs_cpoint_desc_blocks(raw_sb);
 	u32 desc_len = le32_to_cpu(raw_sb->nx_xp_desc_len);
 	u32 new_sb_index;
 	int err;
@@ -96,7 +104,7 @@ static int apfs_cpoint_init_desc(struct super_block *sb)
 	if (!desc_blks || !desc_len)
 		return -EFSCORRUPTED;
 
-	err = apfs_cpoint_init_area(sb, desc_base, desc_blks,
+	err = apfs_cpoint_init_area(sb, desc_base, nxi->nx_desc_map, desc_blks,
 				    desc_next, desc_len);
 	if (err)
 		return err;
@@ -104,7 +112,7 @@ static int apfs_cpoint_init_desc(struct super_block *sb)
 	/* Now update the superblock with the new checkpoint */
 
 	new_sb_index = (desc_next + desc_len - 1) % desc_blks;
-	new_sb_bh = apfs_sb_bread(sb, desc_base + new_sb_index);
+	new_sb_bh = apfs_sb_bread(sb, apfs_cpoint_desc_bno(nxi, new_sb_index));
 	if (!new_sb_bh) {
 		apfs_err(sb, "unable to read the new checkpoint superblock");
 		brelse(new_sb_bh);
@@ -149,7 +157,7 @@ static int apfs_cpoint_init_data(struct super_block *sb)
 	if (!data_blks || !data_len)
 		return -EFSCORRUPTED;
 
-	err = apfs_cpoint_init_area(sb, data_base, data_blks,
+	err = apfs_cpoint_init_area(sb, data_base, NULL /* map */, data_blks,
 				    data_next, data_len);
 	if (err)
 		return err;
@@ -201,9 +209,8 @@ static int apfs_update_mapping_blocks(struct super_block *sb)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_superblock *raw_sb = nxi->nx_raw;
-	u64 desc_base = le64_to_cpu(raw_sb->nx_xp_desc_base);
 	u32 desc_index = le32_to_cpu(raw_sb->nx_xp_desc_index);
-	u32 desc_blks = le32_to_cpu(raw_sb->nx_xp_desc_blocks);
+	u32 desc_blks = apfs_cpoint_desc_blocks(raw_sb);
 	u32 desc_len = le32_to_cpu(raw_sb->nx_xp_desc_len);
 	u32 i;
 
@@ -215,7 +222,7 @@ static int apfs_update_mapping_blocks(struct super_block *sb)
 		u32 map_count;
 		int j;
 
-		bh = apfs_sb_bread(sb, desc_base + desc_curr);
+		bh = apfs_sb_bread(sb, apfs_cpoint_desc_bno(nxi, desc_curr));
 		if (!bh)
 			return -EINVAL;
 		ASSERT(buffer_trans(bh));
@@ -337,36 +344,121 @@ static int apfs_checkpoint_start(struct super_block *sb)
 	return err;
 }
 
+/**
+ * apfs_wait_inflight - Wait for the writes of a sealed transaction
+ * @inflight: list of buffers submitted by apfs_transaction_commit_nx()
+ *
+ * Also releases the buffers and empties the list.  Returns 0 on success, or
+ * -EIO if any of the writes failed.
+ */
+static int apfs_wait_inflight(struct list_head *inflight)
+{
+	struct apfs_bh_info *bhi, *tmp;
+	int err = 0;
+
+	list_for_each_entry_safe(bhi, tmp, inflight, list) {
+		struct buffer_head *bh = bhi->bh;
+
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			err = -EIO;
+		brelse(bh);
+		bhi->bh = NULL;
+
+		list_del(&bhi->list);
+		kfree(bhi);
+	}
+	return err;
+}
+
+/**
+ * apfs_wait_inflight_data - Wait for file data written after its checkpoint
+ * @inflight: list of data buffers submitted by apfs_transaction_commit_nx()
+ *
+ * Only used for data=writeback mounts. The checkpoint is already on disk, so
+ * write errors are not fatal to the container, but they get reported to the
+ * next fsync() call on the file. Releases the buffers and empties the list.
+ */
+static void apfs_wait_inflight_data(struct list_head *inflight)
+{
+	struct apfs_bh_info *bhi, *tmp;
+
+	list_for_each_entry_safe(bhi, tmp, inflight, list) {
+		struct buffer_head *bh = bhi->bh;
+		struct address_space *mapping;
+
+		wait_on_buffer(bh);
+		mapping = READ_ONCE(bh->b_page->mapping);
+		if (!buffer_uptodate(bh) && mapping)
+			mapping_set_error(mapping, -EIO);
+		brelse(bh);
+		bhi->bh = NULL;
+
+		list_del(&bhi->list);
+		kfree(bhi);
+	}
+}
+
 /**
  * apfs_checkpoint_end - End the new checkpoint
- * @sb:	filesystem superblock
+ * @sb:		filesystem superblock
+ * @sb_bh:	buffer head for the superblock of the sealed checkpoint
+ * @inflight:	list of buffers still being written for the checkpoint
+ * @data:	list of data buffers that the checkpoint doesn't wait for
  *
- * Flushes all changes to disk, and commits the new checkpoint by setting the
- * fletcher checksum on its superblock.  Returns 0 on success, or a negative
- * error code in case of failure.
+ * Waits for all changes to reach the disk, and then commits the checkpoint by
+ * writing its superblock.  This runs without the big filesystem lock, so the
+ * next transaction may already be in progress; the flush mutex must be held to
+ * keep the superblocks in order.  The buffers in @data are only waited on after
+ * the superblock is written.  Releases @sb_bh and the buffers in both lists.
+ * Returns 0 on success, or a negative error code in case of failure.
  */
-static int apfs_checkpoint_end(struct super_block *sb)
+static int apfs_checkpoint_end(struct super_block *sb, struct buffer_head *sb_bh,
+			       struct list_head *inflight, struct list_head *data)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
-	struct apfs_obj_phys *obj = &nxi->nx_raw->nx_o;
-	struct buffer_head *bh = nxi->nx_object.bh;
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
 	struct inode *bdev_inode = nxi->nx_bdev->bd_inode;
 	struct address_space *bdev_map = bdev_inode->i_mapping;
-	int err;
+	int err, curr_err;
 
-	ASSERT(!(sb->s_flags & SB_RDONLY));
+	lockdep_assert_held(&nx_trans->t_flush_mutex);
 
-	err = filemap_write_and_wait(bdev_map);
-	if (err)
-		return err;
+	err = apfs_wait_inflight(inflight);
+	curr_err = filemap_fdatawait(bdev_map);
+	if (!err)
+		err = curr_err;
 
-	apfs_obj_set_csum(sb, obj);
-	mark_buffer_dirty(bh);
-	err = sync_dirty_buffer(bh);
-	if (err)
-		return err;
+	/* Never commit a checkpoint that builds on top of a failed one */
+	if (!err && nx_trans->t_flush_err)
+		err = -EIO;
+	if (!err) {
+		mark_buffer_dirty(sb_bh);
+		err = sync_dirty_buffer(sb_bh);
+	}
+	brelse(sb_bh);
+	apfs_wait_inflight_data(data);
+	return err;
+}
+
+/**
+ * apfs_wait_page_inflight - Wait for checkpoint writes of the buffers in a page
+ * @page: the page, with buffers
+ *
+ * The big lock is released before the checkpoint I/O completes, so the next
+ * transaction may get to a data page whose buffers are still being written.
+ * They must not be remapped or modified until then; the write keeps them
+ * locked.
+ */
+void apfs_wait_page_inflight(struct page *page)
+{
+	struct buffer_head *bh, *head;
 
-	return filemap_write_and_wait(bdev_map);
+	bh = head = page_buffers(page);
+	do {
+		wait_on_buffer(bh);
+		bh = bh->b_this_page;
+	} while (bh != head);
 }
 
 /**
@@ -376,6 +468,7 @@ static int apfs_checkpoint_end(struct super_block *sb)
  */
 static bool apfs_transaction_has_room(struct super_block *sb, struct apfs_max_ops maxops)
 {
+	struct apfs_spaceman *sm = APFS_SM(sb);
 	u64 max_cat_blks, max_omap_blks, max_extref_blks, max_blks;
 	/* I don't know the actual maximum heights, just guessing */
 	const u64 max_cat_height = 8, max_omap_height = 3, max_extref_height = 3;
@@ -402,18 +495,37 @@ static bool apfs_transaction_has_room(struct super_block *sb, struct apfs_max_op
 	 */
 	max_blks = max_cat_blks + max_omap_blks + max_extref_blks + maxops.blks;
 
-	return max_blks < APFS_SM(sb)->sm_free_count;
+	/* Blocks reserved for delayed allocation are off limits */
+	return max_blks + sm->sm_reserved < sm->sm_free_count;
 }
 
 /**
- * apfs_transaction_start - Begin a new transaction
+ * apfs_force_readonly - Set the whole container as read-only
+ * @nxi: container superblock info
+ */
+static void apfs_force_readonly(struct apfs_nxsb_info *nxi)
+{
+	struct apfs_sb_info *sbi = NULL;
+	struct super_block *sb = NULL;
+
+	list_for_each_entry(sbi, &nxi->vol_list, list) {
+		sb = sbi->s_vobject.sb;
+		sb->s_flags |= SB_RDONLY;
+	}
+	nxi->nx_flags &= ~APFS_READWRITE;
+}
+
+/**
+ * __apfs_transaction_start - Begin a new transaction
  * @sb:		superblock structure
  * @maxops:	maximum operations expected
+ * @site:	entry point, for the lock statistics
  *
  * Also locks the filesystem for writing; returns 0 on success or a negative
  * error code in case of failure.
  */
-int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
+int __apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops,
+			     enum apfs_lock_site site)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
@@ -421,13 +533,18 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
 	int err;
 
-	down_write(&nxi->nx_big_sem);
-	mutex_lock(&nxs_mutex); /* Don't mount during a transaction */
+	apfs_fsync_log_wait_replay(nxi);
+	apfs_big_down_write(nxi, site);
+	apfs_nxs_lock(nxi, site); /* Don't mount during a transaction */
+
+	/* Nothing can be committed on top of a failed checkpoint flush */
+	if (!nx_trans->t_old_msb && READ_ONCE(nx_trans->t_flush_err))
+		apfs_force_readonly(nxi);
 
 	if (sb->s_flags & SB_RDONLY) {
 		/* A previous transaction has failed; this should be rare */
-		mutex_unlock(&nxs_mutex);
-		up_write(&nxi->nx_big_sem);
+		apfs_nxs_unlock(nxi);
+		apfs_big_up_write(nxi);
 		return -EROFS;
 	}
 
@@ -452,6 +569,13 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 			goto fail;
 	}
 
+	/*
+	 * A big extentref delta gets flushed before the new operation, and the
+	 * flush needs room too: each pending range may split two records.
+	 */
+	if (vol_trans->t_extref_count > APFS_EXTREF_DELTA_MAX)
+		maxops.blks += 2 * vol_trans->t_extref_count;
+
 	/* Don't start transactions unless we are sure they fit in disk */
 	if (!apfs_transaction_has_room(sb, maxops)) {
 		/* Commit what we have so far to flush the queues */
@@ -466,21 +590,15 @@ int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
 		vol_trans->t_old_vsb = sbi->s_vobject.bh;
 		get_bh(vol_trans->t_old_vsb);
 
-		/* Backup the old tree roots; the node struct issues make this ugly */
-		vol_trans->t_old_cat_root = *sbi->s_cat_root;
-		get_bh(vol_trans->t_old_cat_root.object.bh);
-		vol_trans->t_old_omap_root = *sbi->s_omap_root;
-		get_bh(vol_trans->t_old_omap_root.object.bh);
-
 		err = apfs_map_volume_super(sb, true /* write */);
 		if (err)
 			goto fail;
 
-		/* TODO: don't copy these nodes for transactions that don't use them */
-		err = apfs_read_omap(sb, true /* write */);
-		if (err)
-			goto fail;
-		err = apfs_read_catalog(sb, true /* write */);
+		/* The tree roots get copied later, by apfs_transaction_join_root() */
+	}
+
+	if (vol_trans->t_extref_count > APFS_EXTREF_DELTA_MAX) {
+		err = apfs_extref_delta_apply(sb);
 		if (err)
 			goto fail;
 	}
@@ -493,6 +611,50 @@ fail:
 	return err;
 }
 
+/**
+ * apfs_transaction_start - Begin a new transaction
+ * @sb:		superblock structure
+ * @maxops:	maximum operations expected
+ *
+ * Same as __apfs_transaction_start(), for entry points that don't get their
+ * own lock statistics.
+ */
+int apfs_transaction_start(struct super_block *sb, struct apfs_max_ops maxops)
+{
+	return __apfs_transaction_start(sb, maxops, APFS_LOCK_SITE_OTHER);
+}
+
+/**
+ * apfs_transaction_join_root - Add a volume tree root to the current transaction
+ * @sb:		superblock structure
+ * @cat:	the catalog root? Otherwise, the object map root.
+ *
+ * The omap and catalog roots are only copied the first time a transaction
+ * needs to modify them, so that small transactions write fewer blocks. Returns
+ * 0 on success or a negative error code in case of failure.
+ */
+int apfs_transaction_join_root(struct super_block *sb, bool cat)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_vol_transaction *vol_trans = &sbi->s_transaction;
+	struct apfs_node *root = cat ? sbi->s_cat_root : sbi->s_omap_root;
+	struct apfs_node *old_root;
+
+	ASSERT(vol_trans->t_old_vsb);
+	if (buffer_trans(root->object.bh))
+		return 0;
+
+	/* Backup the old tree root; the node struct issues make this ugly */
+	old_root = cat ? &vol_trans->t_old_cat_root : &vol_trans->t_old_omap_root;
+	ASSERT(!old_root->object.bh);
+	*old_root = *root;
+	get_bh(old_root->object.bh);
+
+	if (cat)
+		return apfs_read_catalog(sb, true /* write */);
+	return apfs_read_omap(sb, true /* write */);
+}
+
 /**
  * apfs_end_buffer_write_sync - Clean up a buffer head just synced to disk
  * @bh:		the buffer head to clean
@@ -506,6 +668,9 @@ static void apfs_end_buffer_write_sync(struct buffer_head *bh, int uptodate)
 	page = bh->b_page;
 	get_page(page);
 
+	/* The block will be read again from disk, so it must be checked again */
+	if (!uptodate)
+		clear_buffer_csum_ok(bh);
 	end_buffer_write_sync(bh, uptodate);
 	bh = NULL;
 
@@ -518,14 +683,33 @@ static void apfs_end_buffer_write_sync(struct buffer_head *bh, int uptodate)
 }
 
 /**
- * apfs_transaction_commit_nx - Definitely commit the current transaction
- * @sb: superblock structure
+ * apfs_transaction_commit_nx - Seal the current transaction and start its I/O
+ * @sb:		superblock structure
+ * @inflight:	on return, the list of buffers submitted for writing
+ * @data:	on return, the list of data buffers submitted for writing that
+ *		the checkpoint doesn't need to wait for
+ * @sb_bh:	on return, the checkpoint superblock, still to be written
+ *
+ * This is the first stage of a commit, and it needs the big filesystem lock.
+ * The checkpoint only becomes valid once apfs_checkpoint_end() writes its
+ * superblock, but the next transaction may start before that.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ *
+ * With data=ordered, the new file data blocks go on @inflight along with the
+ * metadata, so they are always on disk before the checkpoint that references
+ * them.  With data=writeback they go on @data instead, and a crash may leave
+ * stale contents in them.
  */
-static int apfs_transaction_commit_nx(struct super_block *sb)
+static int apfs_transaction_commit_nx(struct super_block *sb,
+				      struct list_head *inflight,
+				      struct list_head *data,
+				      struct buffer_head **sb_bh)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_sb_info *sbi;
 	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	struct address_space *bdev_map = nxi->nx_bdev->bd_inode->i_mapping;
+	bool writeback = nxi->nx_flags & APFS_DATA_WRITEBACK;
 	struct apfs_bh_info *bhi, *tmp;
 	int err = 0, curr_err;
 
@@ -552,14 +736,14 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 		list_del_init(&ai->i_list);
 
 		nx_trans->t_state |= APFS_NX_TRANS_COMMITTING;
-		mutex_unlock(&nxs_mutex);
-		up_write(&nxi->nx_big_sem);
+		apfs_nxs_unlock(nxi);
+		apfs_big_up_write(nxi);
 
 		/* Unlocked, so it may call ->evict_inode() */
 		iput(inode);
 
-		down_write(&nxi->nx_big_sem);
-		mutex_lock(&nxs_mutex);
+		apfs_big_down_write(nxi, APFS_LOCK_SITE_COMMIT);
+		apfs_nxs_lock(nxi, APFS_LOCK_SITE_COMMIT);
 		nx_trans->t_state = 0;
 
 		/* Transaction aborted by ->evict_inode(), error code is lost */
@@ -569,32 +753,69 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 	if (err)
 		return err;
 
+	/* Pending extentref drops may free blocks, so they go first */
+	list_for_each_entry(sbi, &nxi->vol_list, list) {
+		err = apfs_extref_delta_apply(sbi->s_vobject.sb);
+		if (err)
+			return err;
+	}
+
+	/* Fold the deferred counters before the checksums are computed */
+	if (APFS_SM(sb)->sm_bh)
+		apfs_write_spaceman(sb);
+	list_for_each_entry(sbi, &nxi->vol_list, list)
+		apfs_vol_alloc_fold(sbi->s_vobject.sb);
+
 	list_for_each_entry_safe(bhi, tmp, &nx_trans->t_buffers, list) {
 		struct buffer_head *bh = bhi->bh;
 
 		ASSERT(buffer_trans(bh));
 
-		if (buffer_csum(bh))
+		/* The checksum we just computed is good, no need to check it */
+		if (buffer_csum(bh)) {
 			apfs_obj_set_csum(sb, (void *)bh->b_data);
+			set_buffer_csum_ok(bh);
+		}
 		clear_buffer_csum(bh);
 
 		list_del(&bhi->list);
 		clear_buffer_trans(bh);
 		nx_trans->t_buffers_count--;
-
 		bh->b_private = NULL;
-		bhi->bh = NULL;
-		kfree(bhi);
-		bhi = NULL;
-
 		clear_buffer_dirty(bh);
+
+		/* The superblock must only be written once all else is on disk */
+		if (bh == nxi->nx_object.bh) {
+			*sb_bh = bh; /* Keep the reference from the transaction */
+			bhi->bh = NULL;
+			kfree(bhi);
+			bhi = NULL;
+			continue;
+		}
+
+		/* Keep a reference for apfs_checkpoint_end() to wait on */
+		get_bh(bh);
+		if (writeback && bh->b_page->mapping != bdev_map)
+			list_add_tail(&bhi->list, data);
+		else
+			list_add_tail(&bhi->list, inflight);
+
 		lock_buffer(bh);
 		bh->b_end_io = apfs_end_buffer_write_sync;
 		submit_bh(REQ_OP_WRITE, REQ_SYNC, bh);
 	}
-	err = apfs_checkpoint_end(sb);
-	if (err)
+	ASSERT(*sb_bh);
+
+	/* Seal the checkpoint; the new transaction will copy this superblock */
+	apfs_obj_set_csum(sb, &nxi->nx_raw->nx_o);
+	err = filemap_fdatawrite(bdev_map);
+	if (err) {
+		apfs_wait_inflight(inflight);
+		apfs_wait_inflight_data(data);
+		brelse(*sb_bh);
+		*sb_bh = NULL;
 		return err;
+	}
 
 	/* Success: forget the old container and volume superblocks */
 	brelse(nx_trans->t_old_msb);
@@ -679,31 +900,78 @@ static bool apfs_transaction_need_commit(struct super_block *sb)
  * On success returns 0 and releases the big filesystem lock. On failure,
  * returns a negative error code, and the caller is responsibly for aborting
  * the transaction.
+ *
+ * The big lock is actually released as soon as the transaction is sealed, and
+ * this function only returns once its checkpoint is on disk. If that fails,
+ * the lock is taken again and the error is returned as usual.  By then another
+ * transaction may be open, but it doesn't belong to the caller, so the abort
+ * will leave it alone.
  */
 int apfs_transaction_commit(struct super_block *sb)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
+	struct buffer_head *sb_bh = NULL;
+	LIST_HEAD(inflight);
+	LIST_HEAD(data);
 	int err = 0;
 
-	if (apfs_transaction_need_commit(sb)) {
-		err = apfs_transaction_commit_nx(sb);
-		if (err) {
-			apfs_warn(sb, "transaction commit failed");
-			return err;
-		}
+	if (!apfs_transaction_need_commit(sb)) {
+		apfs_nxs_unlock(nxi);
+		apfs_big_up_write(nxi);
+		return 0;
 	}
 
-	mutex_unlock(&nxs_mutex);
-	up_write(&nxi->nx_big_sem);
-	return 0;
+	apfs_big_write_site(nxi, APFS_LOCK_SITE_COMMIT);
+	err = apfs_transaction_commit_nx(sb, &inflight, &data, &sb_bh);
+	if (err) {
+		apfs_warn(sb, "transaction commit failed");
+		return err;
+	}
+
+	/*
+	 * Take the flush mutex before unlocking, so that the checkpoints reach
+	 * the disk in order. Other writers can go ahead with a new transaction
+	 * while we wait for the I/O.
+	 */
+	mutex_lock(&nx_trans->t_flush_mutex);
+	apfs_nxs_unlock(nxi);
+	apfs_big_up_write(nxi);
+
+	err = apfs_checkpoint_end(sb, sb_bh, &inflight, &data);
+	if (err && !nx_trans->t_flush_err)
+		nx_trans->t_flush_err = err;
+	mutex_unlock(&nx_trans->t_flush_mutex);
+	if (!err)
+		return 0;
+
+	apfs_warn(sb, "checkpoint flush failed");
+	apfs_big_down_write(nxi, APFS_LOCK_SITE_COMMIT);
+	apfs_nxs_lock(nxi, APFS_LOCK_SITE_COMMIT);
+	if (!nx_trans->t_old_msb) {
+		/* The callers expect to abort with the lock held */
+		apfs_force_readonly(nxi);
+		return err;
+	}
+
+	/*
+	 * A new transaction is open by now, and it's not ours to abort. It will
+	 * fail on its own commit, and no other will start, so the container
+	 * still ends up read-only.
+	 */
+	nx_trans->t_state |= APFS_NX_TRANS_FLUSH_FAILED;
+	return err;
 }
 
 /**
- * apfs_inode_join_transaction - Add an inode to the current transaction
+ * apfs_inode_join_transaction_data - Add an inode to the transaction for I/O
  * @sb:		superblock structure
  * @inode:	vfs inode to add
+ *
+ * Like apfs_inode_join_transaction(), but the fsync log can still cover the
+ * inode. Only meant for changes to the data blocks, the size or the times.
  */
-void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode)
+void apfs_inode_join_transaction_data(struct super_block *sb, struct inode *inode)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
@@ -720,6 +988,21 @@ void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode)
 	list_add(&ai->i_list, &nx_trans->t_inodes);
 }
 
+/**
+ * apfs_inode_join_transaction - Add an inode to the current transaction
+ * @sb:		superblock structure
+ * @inode:	vfs inode to add
+ *
+ * The fsync log only knows how to replay data changes, so from now on and
+ * until the transaction commits, fsync() calls for @inode will need a full
+ * checkpoint.
+ */
+void apfs_inode_join_transaction(struct super_block *sb, struct inode *inode)
+{
+	apfs_inode_join_transaction_data(sb, inode);
+	APFS_I(inode)->i_nolog_xid = APFS_NXI(sb)->nx_xid;
+}
+
 /**
  * apfs_transaction_join - Add a buffer head to the current transaction
  * @sb:	superblock structure
@@ -738,6 +1021,9 @@ int apfs_transaction_join(struct super_block *sb, struct buffer_head *bh)
 	if (buffer_trans(bh)) /* Already part of the only transaction */
 		return 0;
 
+	/* The previous checkpoint may still be writing the block */
+	wait_on_buffer(bh);
+
 	/* TODO: use a slab cache */
 	bhi = kzalloc(sizeof(*bhi), GFP_NOFS);
 	if (!bhi)
@@ -748,26 +1034,11 @@ int apfs_transaction_join(struct super_block *sb, struct buffer_head *bh)
 	nx_trans->t_buffers_count ++;
 
 	set_buffer_trans(bh);
+	clear_buffer_csum_ok(bh); /* The block is about to be modified */
 	bh->b_private = bhi;
 	return 0;
 }
 
-/**
- * apfs_force_readonly - Set the whole container as read-only
- * @nxi: container superblock info
- */
-static void apfs_force_readonly(struct apfs_nxsb_info *nxi)
-{
-	struct apfs_sb_info *sbi = NULL;
-	struct super_block *sb = NULL;
-
-	list_for_each_entry(sbi, &nxi->vol_list, list) {
-		sb = sbi->s_vobject.sb;
-		sb->s_flags |= SB_RDONLY;
-	}
-	nxi->nx_flags &= ~APFS_READWRITE;
-}
-
 /**
  * apfs_transaction_abort - Abort the current transaction
  * @sb: superblock structure
@@ -784,13 +1055,21 @@ void apfs_transaction_abort(struct super_block *sb)
 	struct apfs_bh_info *bhi, *tmp;
 	struct apfs_inode_info *ai, *ai_tmp;
 
+	if (nx_trans->t_state & APFS_NX_TRANS_FLUSH_FAILED) {
+		/* Our checkpoint failed, the open transaction belongs to others */
+		nx_trans->t_state &= ~APFS_NX_TRANS_FLUSH_FAILED;
+		apfs_nxs_unlock(nxi);
+		apfs_big_up_write(nxi);
+		return;
+	}
+
 	if (sb->s_flags & SB_RDONLY) {
 		/* Transaction already aborted, do nothing */
 		ASSERT(!nx_trans->t_old_msb);
 		ASSERT(list_empty(&nx_trans->t_inodes));
 		ASSERT(list_empty(&nx_trans->t_buffers));
-		mutex_unlock(&nxs_mutex);
-		up_write(&nxi->nx_big_sem);
+		apfs_nxs_unlock(nxi);
+		apfs_big_up_write(nxi);
 		return;
 	}
 
@@ -822,6 +1101,9 @@ void apfs_transaction_abort(struct super_block *sb)
 
 	list_for_each_entry(sbi, &nxi->vol_list, list) {
 		struct apfs_vol_transaction *vol_trans = &sbi->s_transaction;
+
+		vol_trans->t_alloc_delta = 0;
+		apfs_extref_delta_free(sbi->s_vobject.sb);
 		if (!vol_trans->t_old_vsb)
 			continue;
 
@@ -832,13 +1114,17 @@ void apfs_transaction_abort(struct super_block *sb)
 		sbi->s_vsb_raw = (void *)vol_trans->t_old_vsb->b_data;
 		vol_trans->t_old_vsb = NULL;
 
-		/* XXX: restore the old b-tree root nodes */
-		brelse(sbi->s_omap_root->object.bh);
-		*(sbi->s_omap_root) = vol_trans->t_old_omap_root;
-		vol_trans->t_old_omap_root.object.bh = NULL;
-		brelse(sbi->s_cat_root->object.bh);
-		*(sbi->s_cat_root) = vol_trans->t_old_cat_root;
-		vol_trans->t_old_cat_root.object.bh = NULL;
+		/* XXX: restore the old b-tree root nodes, if they were copied */
+		if (vol_trans->t_old_omap_root.object.bh) {
+			brelse(sbi->s_omap_root->object.bh);
+			*(sbi->s_omap_root) = vol_trans->t_old_omap_root;
+			vol_trans->t_old_omap_root.object.bh = NULL;
+		}
+		if (vol_trans->t_old_cat_root.object.bh) {
+			brelse(sbi->s_cat_root->object.bh);
+			*(sbi->s_cat_root) = vol_trans->t_old_cat_root;
+			vol_trans->t_old_cat_root.object.bh = NULL;
+		}
 	}
 
 	brelse(APFS_SM(sb)->sm_ip);
@@ -852,8 +1138,8 @@ void apfs_transaction_abort(struct super_block *sb)
 	 */
 	apfs_force_readonly(nxi);
 
-	mutex_unlock(&nxs_mutex);
-	up_write(&nxi->nx_big_sem);
+	apfs_nxs_unlock(nxi);
+	apfs_big_up_write(nxi);
 
 	/* ->evict_inode() will just fail if it starts a new transaction */
 	list_for_each_entry_safe(ai, ai_tmp, &nx_trans->t_inodes, i_list) {
@@ -861,3 +1147,123 @@ void apfs_transaction_abort(struct super_block *sb)
 		iput(&ai->vfs_inode);
 	}
 }
+
+/**
+ * apfs_shrink_work - Commit the current transaction to release its buffers
+ * @work: the shrink work for a volume
+ */
+static void apfs_shrink_work(struct work_struct *work)
+{
+	struct apfs_shrink *shrink = container_of(work, struct apfs_shrink, sh_work);
+	struct apfs_sb_info *sbi = container_of(shrink, struct apfs_sb_info, s_shrink);
+	struct super_block *sb = sbi->s_vobject.sb;
+	struct apfs_nx_transaction *nx_trans = &sbi->s_nxi->nx_transaction;
+	struct apfs_max_ops maxops = {0};
+	int err;
+
+	err = __apfs_transaction_start(sb, maxops, APFS_LOCK_SITE_COMMIT);
+	if (err)
+		return;
+	/* Someone else may have committed since the request */
+	if (nx_trans->t_buffers_count >= TRANSACTION_SHRINK_MIN) {
+		nx_trans->t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+		WRITE_ONCE(shrink->sh_commits, shrink->sh_commits + 1);
+	}
+	err = apfs_transaction_commit(sb);
+	if (err)
+		apfs_transaction_abort(sb);
+}
+
+/**
+ * apfs_shrink_init - Set up the early commits for a volume
+ * @sb: filesystem superblock
+ */
+void apfs_shrink_init(struct super_block *sb)
+{
+	INIT_WORK(&APFS_SB(sb)->s_shrink.sh_work, apfs_shrink_work);
+}
+
+/**
+ * apfs_shrink_stop - Wait for a pending early commit
+ * @sb: filesystem superblock
+ *
+ * Called on unmount, when the superblock shrinker is already gone, and on
+ * read-only remounts. In the latter case a new commit may still get queued
+ * before the volume is read-only; that's harmless, it just commits like sync.
+ */
+void apfs_shrink_stop(struct super_block *sb)
+{
+	cancel_work_sync(&APFS_SB(sb)->s_shrink.sh_work);
+}
+
+/**
+ * apfs_pinned_buffers - Count the buffers pinned by the current transaction
+ * @sb: filesystem superblock
+ *
+ * Those buffers can't be released until the transaction is committed. The
+ * transaction is shared by the whole container, so each volume only reports
+ * its share; otherwise the shrinkers would count the buffers once per volume.
+ * This is racy, so only good for reporting and for the shrinker.
+ */
+unsigned long apfs_pinned_buffers(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	unsigned long count = READ_ONCE(nxi->nx_transaction.t_buffers_count);
+	unsigned int vols = max_t(unsigned int, READ_ONCE(nxi->nx_refcnt), 1);
+
+	return DIV_ROUND_UP(count, vols);
+}
+
+/**
+ * apfs_shrink_wanted - Check if the shrinker should ask for an early commit
+ * @sb: filesystem superblock
+ */
+static bool apfs_shrink_wanted(struct super_block *sb)
+{
+	struct apfs_nx_transaction *nx_trans = &APFS_NXI(sb)->nx_transaction;
+
+	/* Read-only remounts cancel the work, it must not come back */
+	if (sb->s_flags & SB_RDONLY)
+		return false;
+	return READ_ONCE(nx_trans->t_buffers_count) >= TRANSACTION_SHRINK_MIN;
+}
+
+/**
+ * apfs_nr_cached_objects - Report our buffers to the sb shrinker
+ * @sb: filesystem superblock
+ * @sc: shrink control
+ *
+ * That's the blocks in the metadata cache, plus the buffers pinned by the
+ * current transaction if there are enough of them.
+ */
+long apfs_nr_cached_objects(struct super_block *sb, struct shrink_control *sc)
+{
+	long count = apfs_metabuf_count(sb);
+
+	if (apfs_shrink_wanted(sb))
+		count += apfs_pinned_buffers(sb);
+	return count;
+}
+
+/**
+ * apfs_free_cached_objects - Release buffers under memory pressure
+ * @sb: filesystem superblock
+ * @sc: shrink control
+ *
+ * The metadata cache gets trimmed right away. The reclaiming task may be
+ * holding the big lock itself, so the early commit is left to a work item;
+ * the pinned buffers become reclaimable once the checkpoint is on disk, and
+ * they are not counted as freed. Returns the number of cached blocks evicted.
+ */
+long apfs_free_cached_objects(struct super_block *sb, struct shrink_control *sc)
+{
+	struct apfs_shrink *shrink = &APFS_SB(sb)->s_shrink;
+	long freed;
+
+	freed = apfs_metabuf_shrink(sb, sc->nr_to_scan);
+	if (apfs_shrink_wanted(sb)) {
+		WRITE_ONCE(shrink->sh_scans, shrink->sh_scans + 1);
+		queue_work(system_unbound_wq, &shrink->sh_work);
+	}
+	return freed;
+}
@@ -73,6 +73,7 @@ static void apfs_dstream_from_xattr(struct super_block *sb, struct apfs_xattr *x
 
 	dstream->ds_cached_ext.len = 0;
 	dstream->ds_ext_dirty = false;
+	dstream->ds_seal_len = 0;
 	spin_lock_init(&dstream->ds_ext_lock);
 }
 
@@ -96,6 +97,7 @@ static int apfs_xattr_extents_read(struct inode *parent,
 {
 	struct super_block *sb = parent->i_sb;
 	struct apfs_dstream_info *dstream;
+	struct page *page = NULL; /* Bounce page for decryption */
 	int length, blkcnt, i;
 	int ret;
 
@@ -127,6 +129,14 @@ static int apfs_xattr_extents_read(struct inode *parent,
 			length = size;
 	}
 
+	if (apfs_vol_is_soft_encrypted(sb)) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
 	blkcnt = (length + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
 	for (i = 0; i < blkcnt; i++) {
 		struct buffer_head tmp; /* XXX */
@@ -143,10 +153,33 @@ static int apfs_xattr_extents_read(struct inode *parent,
 			goto out;
 		}
 
-		bh = apfs_sb_bread(sb, tmp.b_blocknr);
-		if (!bh) {
-			ret = -EIO;
-			goto out;
+		if (page) {
+			u64 bno, tweak;
+
+			ret = apfs_dstream_map_tweak(dstream, i, &bno, &tweak);
+			if (!ret)
+				ret = apfs_crypt_read_data(sb, bno, tweak, page, 0);
+			if (ret)
+				goto out;
+			off = i << sb->s_blocksize_bits;
+			tocopy = min(sb->s_blocksize, (unsigned long)(length - off));
+			memcpy(buffer + off, page_address(page), tocopy);
+			continue;
+		}
+
+		if (apfs_vol_is_sealed(sb)) {
+			/* Resource forks of compressed files are hashed too */
+			bh = apfs_seal_bread(dstream, i, tmp.b_blocknr);
+			if (IS_ERR(bh)) {
+				ret = PTR_ERR(bh);
+				goto out;
+			}
+		} else {
+			bh = apfs_sb_bread(sb, tmp.b_blocknr);
+			if (!bh) {
+				ret = -EIO;
+				goto out;
+			}
 		}
 
 		off = i << sb->s_blocksize_bits;
@@ -157,6 +190,8 @@ static int apfs_xattr_extents_read(struct inode *parent,
 	ret = length;
 
 out:
+	if (page)
+		__free_page(page);
 	kfree(dstream);
 	return ret;
 }
@@ -210,15 +245,19 @@ int __apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
 }
 
 /**
- * ____apfs_xattr_get - Find and read a named attribute, optionally header only
+ * apfs_xattr_read - Find and read a named attribute, reporting its length
  * @inode:	inode the attribute belongs to
  * @name:	name of the attribute
  * @buffer:	where to copy the attribute value
  * @size:	size of @buffer
  * @only_whole:	must read complete (no partial header read allowed)
+ * @total:	if not NULL, on return the full length of the attribute
+ *
+ * Returns the number of bytes used/required, or a negative error code in case
+ * of failure.
  */
-int ____apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
-		       size_t size, bool only_whole)
+static int apfs_xattr_read(struct inode *inode, const char *name, void *buffer,
+			   size_t size, bool only_whole, int *total)
 {
 	struct super_block *sb = inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
@@ -250,12 +289,53 @@ int ____apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
 		ret = apfs_xattr_extents_read(inode, &xattr, buffer, size, only_whole);
 	else
 		ret = apfs_xattr_inline_read(inode, &xattr, buffer, size, only_whole);
+	if (ret >= 0 && total) {
+		/* With a NULL buffer, the reads just return the length */
+		if (xattr.has_dstream)
+			*total = apfs_xattr_extents_read(inode, &xattr, NULL, 0, false);
+		else
+			*total = apfs_xattr_inline_read(inode, &xattr, NULL, 0, false);
+		if (*total < 0)
+			ret = *total;
+	}
 
 done:
 	apfs_free_query(sb, query);
 	return ret;
 }
 
+/**
+ * ____apfs_xattr_get - Find and read a named attribute, optionally header only
+ * @inode:	inode the attribute belongs to
+ * @name:	name of the attribute
+ * @buffer:	where to copy the attribute value
+ * @size:	size of @buffer
+ * @only_whole:	must read complete (no partial header read allowed)
+ */
+int ____apfs_xattr_get(struct inode *inode, const char *name, void *buffer,
+		       size_t size, bool only_whole)
+{
+	return apfs_xattr_read(inode, name, buffer, size, only_whole, NULL /* total */);
+}
+
+/**
+ * apfs_xattr_get_head - Read the start of a named attribute and its length
+ * @inode:	inode the attribute belongs to
+ * @name:	name of the attribute
+ * @buffer:	where to copy the start of the attribute value
+ * @size:	size of @buffer
+ * @total:	on return, the full length of the attribute
+ *
+ * Same as a partial ____apfs_xattr_get() followed by a length query, but with
+ * a single catalog lookup.  Returns the number of bytes copied, or a negative
+ * error code in case of failure.
+ */
+int apfs_xattr_get_head(struct inode *inode, const char *name, void *buffer,
+			size_t size, int *total)
+{
+	return apfs_xattr_read(inode, name, buffer, size, false /* only_whole */, total);
+}
+
 /**
  * apfs_xattr_get - Find and read a named attribute
  * @inode:	inode the attribute belongs to
@@ -272,11 +352,12 @@ done:
 static int apfs_xattr_get(struct inode *inode, const char *name, void *buffer, size_t size)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(inode->i_sb);
+	u64 locked;
 	int ret;
 
-	down_read(&nxi->nx_big_sem);
+	locked = apfs_big_down_read(nxi, APFS_LOCK_SITE_XATTR);
 	ret = __apfs_xattr_get(inode, name, buffer, size);
-	up_read(&nxi->nx_big_sem);
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_XATTR, locked);
 	if (ret > XATTR_SIZE_MAX)
 		return -E2BIG;
 	return ret;
@@ -596,6 +677,9 @@ int apfs_xattr_set(struct inode *inode, const char *name, const void *value,
 	struct apfs_dstream_info *old_dstream = NULL;
 	int ret;
 
+	/* The fsync log doesn't cover xattrs */
+	APFS_I(inode)->i_nolog_xid = APFS_NXI(sb)->nx_xid;
+
 	if (size > APFS_XATTR_MAX_EMBEDDED_SIZE) {
 		dstream = apfs_create_xattr_dstream(sb, value, size);
 		if (IS_ERR(dstream))
@@ -691,7 +775,7 @@ static int apfs_xattr_osx_set(const struct xattr_handler *handler,
 	maxops.cat = APFS_XATTR_SET_MAXOPS();
 	maxops.blks = 0;
 
-	err = apfs_transaction_start(sb, maxops);
+	err = __apfs_transaction_start(sb, maxops, APFS_LOCK_SITE_XATTR);
 	if (err)
 		return err;
 
@@ -732,8 +816,9 @@ ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 	u64 cnid = apfs_ino(inode);
 	size_t free = size;
 	ssize_t ret;
+	u64 locked;
 
-	down_read(&nxi->nx_big_sem);
+	locked = apfs_big_down_read(nxi, APFS_LOCK_SITE_XATTR);
 
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query) {
@@ -781,6 +866,6 @@ ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 
 fail:
 	apfs_free_query(sb, query);
-	up_read(&nxi->nx_big_sem);
+	apfs_big_up_read(nxi, APFS_LOCK_SITE_XATTR, locked);
 	return ret;
 }